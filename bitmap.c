@@ -0,0 +1,450 @@
+#include <linux/bio.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "meta.h"
+#include "rebuild.h"
+#include "bitmap.h"
+
+/*
+ * 写意图位图。数据和校验分两步更新，崩溃后只有位图中置位的区域可能不一致，
+ * 重新创建阵列时只同步这些区域的校验。
+ *
+ * 写入落在位图已落盘的区域时直接下发；否则在内存中置位后挂到 deferred 上，由 flush_work
+ * 把这段时间内所有脏的位图页一次写回，再下发等待的写，位图的写回按批进行。
+ * daemon 每 PRAID_BITMAP_DAEMON_SLEEP 检查一次，连续两轮没有写入的区域在校验更新完成后清除。
+ */
+
+#define PRAID_BITMAP_BITS_PER_PAGE (PAGE_SIZE * BITS_PER_BYTE)
+
+static unsigned long *praid_bitmap_page_bits(struct praid_bitmap *bm, unsigned long region) {
+    return page_address(bm->pages[region / PRAID_BITMAP_BITS_PER_PAGE]);
+}
+
+static sector_t praid_bitmap_page_offset(unsigned int p) {
+    return PRAID_META_BITMAP_OFFSET + (sector_t)(p + 1) * PRAID_META_PAGE_SECTORS;
+}
+
+// 调用者持有 lock
+static void praid_bitmap_set(struct praid_bitmap *bm, unsigned long region) {
+    __set_bit(region % PRAID_BITMAP_BITS_PER_PAGE, praid_bitmap_page_bits(bm, region));
+    __set_bit(region / PRAID_BITMAP_BITS_PER_PAGE, bm->dirty_pages);
+}
+
+static void praid_bitmap_clear(struct praid_bitmap *bm, unsigned long region) {
+    __clear_bit(region % PRAID_BITMAP_BITS_PER_PAGE, praid_bitmap_page_bits(bm, region));
+    __set_bit(region / PRAID_BITMAP_BITS_PER_PAGE, bm->dirty_pages);
+    __clear_bit(region, bm->disk_bits);
+}
+
+// 写回所有脏的位图页，调用者持有 io_lock。写失败的页保持为脏，不更新 disk_bits
+static void praid_bitmap_write_dirty(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    struct praid_member *parity = praid_parity_member(dev);
+    unsigned long base, n;
+    unsigned int p, next = 0;
+    int ret;
+
+    for(;;) {
+        spin_lock_irq(&bm->lock);
+        p = find_next_bit(bm->dirty_pages, bm->nr_pages, next);
+        if(p >= bm->nr_pages) {
+            spin_unlock_irq(&bm->lock);
+            break;
+        }
+        __clear_bit(p, bm->dirty_pages);
+        memcpy(page_address(bm->bounce), page_address(bm->pages[p]), PAGE_SIZE);
+        spin_unlock_irq(&bm->lock);
+        next = p + 1;
+
+        // 校验盘失效时校验不再更新，位图也没有意义
+        if(!praid_member_faulty(parity)) {
+            ret = praid_meta_io(dev, READ_ONCE(parity->bdev), praid_bitmap_page_offset(p), bm->bounce, REQ_OP_WRITE);
+            if(ret) {
+                PRAID_ERROR("%s%d: write bitmap page %u failed, error %d.\n", VPCIEDISK_NAME, dev->id, p, ret);
+                spin_lock_irq(&bm->lock);
+                __set_bit(p, bm->dirty_pages);
+                spin_unlock_irq(&bm->lock);
+                continue;
+            }
+        }
+
+        base = (unsigned long)p * PRAID_BITMAP_BITS_PER_PAGE;
+        n = min_t(unsigned long, PRAID_BITMAP_BITS_PER_PAGE, bm->nr_regions - base);
+        spin_lock_irq(&bm->lock);
+        bitmap_copy(bm->disk_bits + BIT_WORD(base), page_address(bm->bounce), n);
+        spin_unlock_irq(&bm->lock);
+    }
+}
+
+// 挂起的写所在区域的位是否已经落盘
+static bool praid_bitmap_written(struct praid_bitmap *bm, struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    bool written;
+
+    spin_lock_irq(&bm->lock);
+    written = test_bit(pbio->iter.bi_sector >> bm->region_shift, bm->disk_bits);
+    spin_unlock_irq(&bm->lock);
+
+    return written;
+}
+
+static void praid_bitmap_flush_work(struct work_struct *work) {
+    struct praid_dev *dev = container_of(work, struct praid_dev, bitmap.flush_work);
+    struct praid_bitmap *bm = &dev->bitmap;
+    struct bio_list list;
+    struct bio *bio;
+
+    mutex_lock(&bm->io_lock);
+    spin_lock_irq(&bm->lock);
+    bio_list_init(&list);
+    bio_list_merge(&list, &bm->deferred);
+    bio_list_init(&bm->deferred);
+    spin_unlock_irq(&bm->lock);
+
+    praid_bitmap_write_dirty(dev);
+    mutex_unlock(&bm->io_lock);
+
+    // 位图未落盘的写以错误结束，否则崩溃后不会被同步。错误来自校验盘，不进入降级路径
+    while((bio = bio_list_pop(&list))) {
+        if(!praid_bitmap_written(bm, bio)) {
+            container_of(bio, struct praid_bio, bio)->degraded = true;
+            bio_io_error(bio);
+            continue;
+        }
+        praid_member_submit(bio);
+    }
+}
+
+/*
+ * 选出可以清除的区域：没有未完成的写，并且上一轮已经空闲，force 时不要求上一轮空闲。
+ * 返回是否有区域被清除
+ */
+static bool praid_bitmap_select_idle(struct praid_bitmap *bm, bool force) {
+    unsigned long region;
+    bool found = false;
+
+    spin_lock_irq(&bm->lock);
+    for_each_set_bit(region, bm->disk_bits, bm->nr_regions) {
+        if(bm->counters[region]) {
+            continue;
+        }
+        if(force || test_bit(region, bm->clear_bits)) {
+            __clear_bit(region, bm->clear_bits);
+            praid_bitmap_clear(bm, region);
+            found = true;
+        } else {
+            __set_bit(region, bm->clear_bits);
+        }
+    }
+    spin_unlock_irq(&bm->lock);
+
+    return found;
+}
+
+static void praid_bitmap_clear_idle(struct praid_dev *dev, bool force) {
+    struct praid_bitmap *bm = &dev->bitmap;
+
+    mutex_lock(&bm->io_lock);
+    if(praid_bitmap_select_idle(bm, force)) {
+        // 已完成的写的校验更新可能还在队列中，最后一个在设备完成后才释放 sem
+        flush_workqueue(dev->workqueue);
+        down(&dev->sem);
+        up(&dev->sem);
+
+        praid_bitmap_write_dirty(dev);
+    }
+    mutex_unlock(&bm->io_lock);
+}
+
+static void praid_bitmap_daemon(struct work_struct *work) {
+    struct praid_dev *dev = container_of(to_delayed_work(work), struct praid_dev, bitmap.daemon_work);
+
+    praid_bitmap_clear_idle(dev, false);
+    queue_delayed_work(dev->bitmap.wq, &dev->bitmap.daemon_work, PRAID_BITMAP_DAEMON_SLEEP);
+}
+
+/*
+ * 成员盘的写 bio 下发前调用。区域的位已落盘时返回 true，由调用者下发；
+ * 否则 bio 被挂起，位图落盘后由 praid_member_submit 下发
+ */
+bool praid_bitmap_start_write(struct praid_dev *dev, struct bio *bio) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    unsigned long region;
+
+    if(!bm->enabled) {
+        return true;
+    }
+
+    region = pbio->iter.bi_sector >> bm->region_shift;
+
+    spin_lock_irq(&bm->lock);
+    pbio->bitmap = true;
+    bm->counters[region] ++;
+    __clear_bit(region, bm->clear_bits);
+    if(likely(test_bit(region, bm->disk_bits))) {
+        spin_unlock_irq(&bm->lock);
+        return true;
+    }
+
+    praid_bitmap_set(bm, region);
+    bio_list_add(&bm->deferred, bio);
+    spin_unlock_irq(&bm->lock);
+
+    queue_work(bm->wq, &bm->flush_work);
+
+    return false;
+}
+
+void praid_bitmap_end_write(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_bitmap *bm;
+    unsigned long flags;
+
+    if(!pbio->bitmap) {
+        return;
+    }
+    pbio->bitmap = false;
+
+    bm = &pbio->member->dev->bitmap;
+    spin_lock_irqsave(&bm->lock, flags);
+    bm->counters[pbio->iter.bi_sector >> bm->region_shift] --;
+    spin_unlock_irqrestore(&bm->lock, flags);
+}
+
+unsigned long praid_bitmap_dirty_regions(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    unsigned long weight;
+
+    spin_lock_irq(&bm->lock);
+    weight = bitmap_weight(bm->disk_bits, bm->nr_regions);
+    spin_unlock_irq(&bm->lock);
+
+    return weight;
+}
+
+static void praid_bitmap_free(struct praid_bitmap *bm) {
+    unsigned int p;
+
+    if(bm->wq) {
+        destroy_workqueue(bm->wq);
+    }
+    if(bm->pages) {
+        for(p = 0; p < bm->nr_pages; p ++) {
+            if(bm->pages[p]) {
+                __free_page(bm->pages[p]);
+            }
+        }
+    }
+    if(bm->bounce) {
+        __free_page(bm->bounce);
+    }
+    kfree(bm->pages);
+    bitmap_free(bm->disk_bits);
+    bitmap_free(bm->clear_bits);
+    bitmap_free(bm->dirty_pages);
+    kfree(bm->counters);
+}
+
+static int praid_bitmap_alloc(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    int node = dev->config.node;
+    unsigned int p;
+
+    bm->pages = kcalloc_node(bm->nr_pages, sizeof(*bm->pages), GFP_KERNEL, node);
+    bm->disk_bits = bitmap_zalloc(bm->nr_regions, GFP_KERNEL);
+    bm->clear_bits = bitmap_zalloc(bm->nr_regions, GFP_KERNEL);
+    bm->dirty_pages = bitmap_zalloc(bm->nr_pages, GFP_KERNEL);
+    bm->counters = kcalloc_node(bm->nr_regions, sizeof(*bm->counters), GFP_KERNEL, node);
+    bm->bounce = alloc_pages_node(node, GFP_KERNEL, 0);
+    bm->wq = alloc_workqueue("praid%d_bitmap", WQ_UNBOUND | WQ_MEM_RECLAIM, 0, dev->id);
+    if(!bm->pages || !bm->disk_bits || !bm->clear_bits || !bm->dirty_pages || !bm->counters || !bm->bounce || !bm->wq) {
+        return -ENOMEM;
+    }
+
+    for(p = 0; p < bm->nr_pages; p ++) {
+        bm->pages[p] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+        if(!bm->pages[p]) {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+// 读取上次的位图，几何参数一致时返回 true
+static bool praid_bitmap_load(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    struct block_device *bdev = praid_parity_member(dev)->bdev;
+    struct praid_bitmap_sb *sb = page_address(bm->bounce);
+    unsigned int p;
+
+    if(praid_meta_io(dev, bdev, PRAID_META_BITMAP_OFFSET, bm->bounce, REQ_OP_READ)) {
+        return false;
+    }
+
+    if(le32_to_cpu(sb->magic) != PRAID_BITMAP_MAGIC ||
+       le32_to_cpu(sb->disk_cnt) != dev->disk_cnt ||
+       le32_to_cpu(sb->chunk_size) != dev->geo.chunk_size ||
+       le32_to_cpu(sb->region_shift) != bm->region_shift ||
+       le64_to_cpu(sb->size) != dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT ||
+       le64_to_cpu(sb->nr_regions) != bm->nr_regions) {
+        return false;
+    }
+
+    for(p = 0; p < bm->nr_pages; p ++) {
+        if(praid_meta_io(dev, bdev, praid_bitmap_page_offset(p), bm->pages[p], REQ_OP_READ)) {
+            return false;
+        }
+        bitmap_copy(bm->disk_bits + BIT_WORD((unsigned long)p * PRAID_BITMAP_BITS_PER_PAGE), page_address(bm->pages[p]),
+                    min_t(unsigned long, PRAID_BITMAP_BITS_PER_PAGE, bm->nr_regions - (unsigned long)p * PRAID_BITMAP_BITS_PER_PAGE));
+    }
+
+    return true;
+}
+
+// 同步位图中置位的区域的校验，此时块设备还没有创建
+static void praid_bitmap_resync(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    sector_t end = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    unsigned long region, nr = bitmap_weight(bm->disk_bits, bm->nr_regions);
+    sector_t sta;
+    int ret;
+
+    if(!nr) {
+        return;
+    }
+
+    if(praid_degraded(dev)) {
+        PRAID_ERROR("%s%d: array degraded, %lu dirty regions can not be resynced.\n", VPCIEDISK_NAME, dev->id, nr);
+        return;
+    }
+
+    PRAID_INFO("%s%d: unclean shutdown, resync %lu dirty regions.\n", VPCIEDISK_NAME, dev->id, nr);
+    for_each_set_bit(region, bm->disk_bits, bm->nr_regions) {
+        sta = (sector_t)region << bm->region_shift;
+        ret = praid_rebuild_sync(dev, praid_parity_member(dev), sta, min_t(sector_t, end, sta + ((sector_t)1 << bm->region_shift)));
+        if(ret) {
+            PRAID_ERROR("%s%d: resync region %lu failed, error %d.\n", VPCIEDISK_NAME, dev->id, region, ret);
+        }
+    }
+}
+
+// 写入头部，调用者持有 io_lock
+static int praid_bitmap_write_sb(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    struct praid_bitmap_sb *sb = page_address(bm->bounce);
+
+    clear_page(sb);
+    sb->magic = cpu_to_le32(PRAID_BITMAP_MAGIC);
+    sb->disk_cnt = cpu_to_le32(dev->disk_cnt);
+    sb->chunk_size = cpu_to_le32(dev->geo.chunk_size);
+    sb->region_shift = cpu_to_le32(bm->region_shift);
+    sb->size = cpu_to_le64(dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+    sb->nr_regions = cpu_to_le64(bm->nr_regions);
+
+    return praid_meta_io(dev, praid_parity_member(dev)->bdev, PRAID_META_BITMAP_OFFSET, bm->bounce, REQ_OP_WRITE);
+}
+
+// 写入头部和清空的位图
+static int praid_bitmap_format(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    unsigned int p;
+
+    for(p = 0; p < bm->nr_pages; p ++) {
+        clear_page(page_address(bm->pages[p]));
+        __set_bit(p, bm->dirty_pages);
+    }
+    praid_bitmap_write_dirty(dev);
+
+    return praid_bitmap_write_sb(dev);
+}
+
+// 扩容后数据盘数量变化，位图按成员盘区域记录，只需重写头部
+int praid_bitmap_regrow(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    int ret;
+
+    if(!bm->enabled) {
+        return 0;
+    }
+
+    mutex_lock(&bm->io_lock);
+    ret = praid_bitmap_write_sb(dev);
+    mutex_unlock(&bm->io_lock);
+
+    return ret;
+}
+
+/*
+ * 在 praid_rebuild_init 之后、块设备创建之前调用。校验盘上没有空间或者校验盘失效时不使用位图
+ */
+int praid_bitmap_init(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+    struct praid_member *parity = praid_parity_member(dev);
+    sector_t size = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    int ret;
+
+    spin_lock_init(&bm->lock);
+    mutex_init(&bm->io_lock);
+    bio_list_init(&bm->deferred);
+    INIT_WORK(&bm->flush_work, praid_bitmap_flush_work);
+    INIT_DELAYED_WORK(&bm->daemon_work, praid_bitmap_daemon);
+
+    bm->region_shift = max_t(unsigned int, ilog2(PRAID_BITMAP_REGION >> KERNEL_SECTOR_SHIFT), dev->rebuild.window_shift);
+    bm->nr_regions = DIV_ROUND_UP_SECTOR_T(size, (sector_t)1 << bm->region_shift);
+    bm->nr_pages = DIV_ROUND_UP(bm->nr_regions, PRAID_BITMAP_BITS_PER_PAGE);
+
+    if(praid_member_faulty(parity) ||
+       !praid_meta_fits(dev, parity->bdev, PRAID_META_BITMAP_OFFSET, (sector_t)(bm->nr_pages + 1) * PRAID_META_PAGE_SECTORS)) {
+        PRAID_INFO("%s%d: no space for write-intent bitmap on parity member, disabled.\n", VPCIEDISK_NAME, dev->id);
+        return 0;
+    }
+
+    ret = praid_bitmap_alloc(dev);
+    if(ret) {
+        goto out_free;
+    }
+
+    mutex_lock(&bm->io_lock);
+    if(praid_bitmap_load(dev)) {
+        praid_bitmap_resync(dev);
+    }
+    bitmap_zero(bm->disk_bits, bm->nr_regions);
+    ret = praid_bitmap_format(dev);
+    mutex_unlock(&bm->io_lock);
+    if(ret) {
+        PRAID_ERROR("%s%d: write bitmap failed, error %d.\n", VPCIEDISK_NAME, dev->id, ret);
+        goto out_free;
+    }
+
+    bm->enabled = true;
+    queue_delayed_work(bm->wq, &bm->daemon_work, PRAID_BITMAP_DAEMON_SLEEP);
+
+    return 0;
+
+out_free:
+    praid_bitmap_free(bm);
+    memset(bm, 0, sizeof(*bm));
+    return ret;
+}
+
+// 块设备删除之后调用，清除所有空闲区域的位，正常关闭后下次创建时不需要同步
+void praid_bitmap_exit(struct praid_dev *dev) {
+    struct praid_bitmap *bm = &dev->bitmap;
+
+    if(!bm->enabled) {
+        return;
+    }
+
+    cancel_delayed_work_sync(&bm->daemon_work);
+    flush_work(&bm->flush_work);
+    praid_bitmap_clear_idle(dev, true);
+
+    bm->enabled = false;
+    praid_bitmap_free(bm);
+}
@@ -0,0 +1,30 @@
+#ifndef __PRAID_BITMAP_H__
+#define __PRAID_BITMAP_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_BITMAP_MAGIC 0x50524249 // "PRBI"
+#define PRAID_BITMAP_REGION MB(16) // 每一位对应的成员盘区域的最小字节数
+#define PRAID_BITMAP_DAEMON_SLEEP (5 * HZ)
+
+// 位图头部，位置见 meta.h，位图页紧随其后
+struct praid_bitmap_sb {
+    __le32 magic;
+    __le32 disk_cnt;
+    __le32 chunk_size;
+    __le32 region_shift;
+    __le64 size;        // 成员盘数据区扇区数
+    __le64 nr_regions;
+};
+
+bool praid_bitmap_start_write(struct praid_dev *dev, struct bio *bio);
+void praid_bitmap_end_write(struct bio *bio);
+unsigned long praid_bitmap_dirty_regions(struct praid_dev *dev);
+int praid_bitmap_regrow(struct praid_dev *dev);
+
+int praid_bitmap_init(struct praid_dev *dev);
+void praid_bitmap_exit(struct praid_dev *dev);
+
+#endif
@@ -1,63 +1,361 @@
 #include <linux/version.h>
+#include <linux/mm.h>
 
 #include "block.h"
+#include "degraded.h"
+#include "rebuild.h"
+#include "reshape.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "zeromap.h"
+#include "cache.h"
+#include "pcache.h"
+#include "discard.h"
+#include "flush.h"
+#include "iosched.h"
+#include "readahead.h"
+#include "hedge.h"
+
+static int vpciedisk_major;
+
+// 成员盘 bio 的完成回调，降级路径处理完后也直接调用
+void praid_member_endio(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_member *member = pbio->member;
+    struct bio *parent = bio->bi_private;
+    int dir = op_is_write(bio_op(bio)) ? WRITE : READ;
+    u64 ns;
+
+    if(dir == WRITE) {
+        praid_ra_end_write(bio);
+    }
 
-static blk_qc_t vpciedisk_submit_bio(struct bio *bio) {
-    struct praid_dev *dev = bio->bi_bdev->bd_disk->private_data;
-    struct bio *child_bio, *tar_bio, *ex_bio;
-    unsigned int devi;
-    sector_t sta_sector, end_sector, cnt_sectors;
-    bool flag;
+    // 降级路径重新处理的 bio 不再经过调度，先释放
+    if(pbio->ioq) {
+        pbio->ioq = false;
+        praid_ioq_done(member);
+    }
 
-bio_split:
+    // 数据盘出错时由其余成员盘重建，统计在重建完成后进行
+    if(unlikely(bio->bi_status) && praid_degraded_retry(bio)) {
+        atomic64_inc(&member->errors);
+        return;
+    }
+    praid_rebuild_end_write(bio);
+    praid_bitmap_end_write(bio);
+    praid_reshape_end_io(bio);
+    praid_hedge_end_write(bio);
+    praid_stripe_end_write(bio);
+
+    ns = ktime_get_ns() - pbio->start_ns;
+    atomic64_inc(&member->ios[dir]);
+    atomic64_add(pbio->sectors, &member->sectors[dir]);
+    atomic64_add(ns, &member->ticks_ns[dir]);
+    if(dir == READ) {
+        praid_hedge_update_latency(member, ns);
+    }
+    if(bio->bi_status) {
+        atomic64_inc(&member->errors);
+    }
+    atomic_dec(&member->inflight);
 
-    sta_sector = bio->bi_iter.bi_sector;
-    end_sector = chunk_end_sector(sta_sector);
+    if(bio->bi_status && !parent->bi_status) {
+        parent->bi_status = bio->bi_status;
+    }
+    bio_put(bio);
+    bio_endio(parent);
+}
 
-    if(end_sector + 1 >= bio_end_sector(bio)) {
-        end_sector = bio_end_sector(bio) - 1;
-        tar_bio = bio;
-        flag = false;
-        goto bio_submit;
+// 将带 praid_bio 前置数据的 bio 绑定到成员盘，完成时统计并结束 parent
+void praid_member_bio_init(struct bio *bio, struct bio *parent, struct praid_member *member) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    pbio->member = member;
+    pbio->start_ns = ktime_get_ns();
+    pbio->sectors = bio_sectors(bio);
+    pbio->iter = bio->bi_iter;
+    pbio->degraded = false;
+    pbio->bucket = -1;
+    pbio->bitmap = false;
+    pbio->zeromap = false;
+    pbio->zero = false;
+    pbio->full = false;
+    pbio->reshape = -1;
+    pbio->background = false;
+    pbio->ioq = false;
+    pbio->hedge = -1;
+    pbio->stripe = -1;
+
+    bio_set_dev(bio, member->bdev);
+    bio->bi_private = parent;
+    bio->bi_end_io = praid_member_endio;
+    bio_inc_remaining(parent);
+    atomic_inc(&member->inflight);
+}
+
+// 加入 bio 需要的段数，kmalloc 的缓冲区物理连续，整体作为一个多页的段
+unsigned int praid_bio_buffer_segs(void *buf, unsigned int len) {
+    return is_vmalloc_addr(buf) ? DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE) : 1;
+}
+
+// 把连续的缓冲区加入 bio，来自 vmalloc 时逐页加入
+bool praid_bio_add_buffer(struct bio *bio, void *buf, unsigned int len) {
+    unsigned int done, size;
+
+    if(!is_vmalloc_addr(buf)) {
+        return bio_add_page(bio, virt_to_page(buf), len, offset_in_page(buf)) == len;
     }
 
-    cnt_sectors = end_sector - sta_sector + 1;
+    for(done = 0; done < len; done += size) {
+        size = min_t(unsigned int, len - done, PAGE_SIZE - offset_in_page(buf + done));
+        if(bio_add_page(bio, vmalloc_to_page(buf + done), size, offset_in_page(buf + done)) != size) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
-    child_bio = bio_split(bio, cnt_sectors, GFP_NOIO, &dev->queue->bio_split);
-    if(!child_bio) {
-        PRAID_ERROR("split bio failed.\n");
-        bio_io_error(bio);
-        goto vp_submit_bio_out;
+static unsigned int praid_member_ioq_class(struct praid_bio *pbio, bool write) {
+    if(pbio->background) {
+        return PRAID_IOQ_BG;
     }
+    return write ? PRAID_IOQ_WRITE : PRAID_IOQ_READ;
+}
 
-    child_bio->bi_private = NULL;
-    child_bio->bi_end_io = NULL;
-    
-    tar_bio = child_bio;
-    flag = true;
+// 经 io 调度把 bio 下发到成员盘，可以在完成回调中调用
+void praid_member_dispatch(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
 
-bio_submit:
-    devi = device_num(chunk_num(sta_sector), dev->disk_cnt);
+    pbio->ioq = true;
+    praid_ioq_submit(pbio->member, bio, praid_member_ioq_class(pbio, op_is_write(bio_op(bio))));
+}
 
-    tar_bio->bi_iter.bi_sector = sector_whole_to_i(sta_sector, dev->disk_cnt);
-    bio_set_dev(tar_bio, dev->bdev[devi]);
+/*
+ * 下发已映射到成员盘的 bio，写入时先提交读旧数据的 bio 用于更新校验。
+ * 从未写过的范围：读取直接返回零，写入不读旧数据；旧数据在旧数据缓存中时也不读
+ */
+void praid_member_submit(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_dev *dev = pbio->member->dev;
+    bool write = op_is_write(bio_op(bio));
+
+    // 对冲读在条带上有写入时不使用重建的结果，见 hedge.c
+    if(write) {
+        praid_hedge_start_write(bio);
+    }
+
+    // 整条带清零的 bio 没有数据，不更新校验和零区域表，见 discard.c
+    if(unlikely(bio_op(bio) == REQ_OP_WRITE_ZEROES)) {
+        praid_pcache_invalidate(dev, bio);
+        if(unlikely(praid_degraded(dev)) && praid_degraded_submit(dev, bio)) {
+            return;
+        }
+        submit_bio(bio);
+        return;
+    }
+
+    // 水位未落盘时 bio 由零区域表的 flush_work 重新下发
+    if(write ? !praid_zeromap_start_write(dev, bio) : praid_zeromap_read(dev, bio)) {
+        return;
+    }
 
-    if(flag) {
-        bio_chain(tar_bio, bio);
+    if(unlikely(praid_degraded(dev))) {
+        if(write) {
+            praid_pcache_invalidate(dev, bio);
+        }
+        if(praid_degraded_submit(dev, bio)) {
+            return;
+        }
     }
-    
-    if(bio_data_dir(tar_bio) == WRITE) {
-        tar_bio = pcievdrv_submit_verify(tar_bio, devi, dev);
+
+    // 校验盘失效时不再更新校验，重建中的校验盘只更新已重建的部分
+    if(write && !pbio->full && praid_member_in_sync(praid_parity_member(dev), bio->bi_iter.bi_sector, bio_sectors(bio))) {
+        struct bio *old;
+
+        // 条带被降级读写锁定时挂起，解锁后重新下发
+        if(!praid_stripe_start_write(dev, bio)) {
+            return;
+        }
+
+        if(pbio->zero) {
+            if(!pcievdrv_submit_verify_zero(bio, dev)) {
+                return;
+            }
+            praid_pcache_write(dev, bio, NULL);
+            praid_member_dispatch(bio);
+            return;
+        }
+
+        old = pcievdrv_submit_verify(bio, pbio->member->index, dev);
+        if(IS_ERR(old)) {
+            return;
+        }
+
+        // 旧数据全部在旧数据缓存中时不读成员盘，旧数据的读和写入同样调度
+        if(praid_pcache_write(dev, bio, pcievdrv_verify_old_data(old))) {
+            pcievdrv_submit_verify_old(old);
+        } else {
+            praid_ioq_submit(pbio->member, old, praid_member_ioq_class(pbio, true));
+        }
+        return;
+    }
+
+    if(write) {
+        praid_pcache_write(dev, bio, NULL);
+    } else if(praid_hedge_read(bio)) {
+        return;
+    }
+    praid_member_dispatch(bio);
+}
+
+static void praid_member_write_bio(struct bio *bio, struct bio *parent, struct praid_member *member, bool full, bool background) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    praid_member_bio_init(bio, parent, member);
+    pbio->full = full;
+    pbio->background = background;
+    praid_rebuild_start_write(member->dev, bio);
+    if(praid_bitmap_start_write(member->dev, bio)) {
+        praid_member_submit(bio);
     }
+}
+
+/*
+ * 在块设备的提交路径之外写入已映射到成员盘的 bio，用于日志的写回和缓存的刷写。
+ * 和 vpciedisk_submit_bio 一样阻止重建进入 bio 所在的窗口并记录写意图。
+ * full 为整条带写入，校验由调用者一起写入，bio 不更新校验
+ */
+void praid_member_write(struct bio *bio, struct bio *parent, struct praid_member *member, bool full) {
+    struct praid_dev *dev = member->dev;
+    // 校验盘按同一条带第一个数据盘的位置计算
+    sector_t sector = praid_geo_unmap(&dev->geo, bio->bi_iter.bi_sector, member->index < dev->disk_cnt ? member->index : 0);
+    unsigned long w0, w1;
+
+    praid_rebuild_hold_range(dev, sector, sector + bio_sectors(bio), &w0, &w1);
+    praid_member_write_bio(bio, parent, member, full, true);
+    praid_rebuild_release_range(dev, w0, w1);
+}
 
-    PRAID_INFO("sta_sector=%llu, end_sector=%llu, devi=%u, %c\n", sta_sector, end_sector, devi, bio_data_dir(bio) == WRITE ? 'w' : 'r');
-    submit_bio(tar_bio);
+// 同 praid_member_write，调用者已经持有覆盖 bio 的重建屏障范围，按前台写入调度
+void __praid_member_write(struct bio *bio, struct bio *parent, struct praid_member *member, bool full) {
+    praid_member_write_bio(bio, parent, member, full, false);
+}
 
-    if(flag) {
-        goto bio_split;
+static blk_qc_t vpciedisk_submit_bio(struct bio *bio) {
+    struct praid_dev *dev = bio->bi_bdev->bd_disk->private_data;
+    struct bio *tar_bio;
+    unsigned int devi;
+    sector_t sta_sector, end_sector, cnt_sectors;
+    unsigned long w0, w1;
+    int epoch;
+    bool write = op_is_write(bio_op(bio)) && bio_sectors(bio);
+    bool journal = write && dev->journal.enabled;
+    bool cache = write && dev->cache.enabled;
+    bool flush = dev->cache.enabled && op_is_flush(bio->bi_opf);
+    bool last;
+
+    // 没有写回缓存时 flush 和 FUA 合并后刷新所有成员盘，见 flush.c
+    if(!dev->cache.enabled && op_is_flush(bio->bi_opf) && praid_flush_submit(dev, bio)) {
+        return BLK_QC_T_NONE;
     }
 
-vp_submit_bio_out:
+    if(op_is_write(bio_op(bio)) && bio_sectors(bio)) {
+        praid_ra_invalidate(dev, bio->bi_iter.bi_sector, bio_end_sector(bio));
+    } else if(bio_op(bio) == REQ_OP_READ && praid_ra_read(dev, bio)) {
+        // 已预读的数据直接返回，见 readahead.c
+        return BLK_QC_T_NONE;
+    }
+
+    // 丢弃和清零按条带直接在成员盘上处理，不经过日志和缓存
+    if(praid_is_discard(bio)) {
+        praid_discard(dev, bio);
+        return BLK_QC_T_NONE;
+    }
+
+    // 日志和缓存中的写入在写回、刷写时才进入成员盘，见 journal.c、cache.c
+    if(journal || cache) {
+        write = false;
+    }
+
+    // 缓存开启时声明了易失的写缓存，flush 由刷写线程在脏数据落盘后结束
+    if(flush && !bio_sectors(bio)) {
+        praid_cache_flush(dev, bio);
+        return BLK_QC_T_NONE;
+    }
+
+    // 扩容中等待 bio 覆盖的范围搬移完成，见 reshape.c
+    epoch = praid_reshape_hold(dev, bio);
+
+    // 拆分前阻止重建进入 bio 覆盖的窗口，见 rebuild.c
+    if(write) {
+        praid_rebuild_hold_range(dev, bio->bi_iter.bi_sector, bio_end_sector(bio), &w0, &w1);
+    }
+
+    do {
+        sta_sector = bio->bi_iter.bi_sector;
+        end_sector = praid_geo_chunk_end(&dev->geo, sta_sector);
+
+        if(end_sector + 1 >= bio_end_sector(bio)) {
+            end_sector = bio_end_sector(bio) - 1;
+            tar_bio = bio_clone_fast(bio, GFP_NOIO, &dev->bio_set);
+            last = true;
+        } else {
+            cnt_sectors = end_sector - sta_sector + 1;
+            tar_bio = bio_split(bio, cnt_sectors, GFP_NOIO, &dev->bio_set);
+            last = false;
+        }
+
+        if(!tar_bio) {
+            PRAID_ERROR("split bio failed.\n");
+            bio->bi_status = BLK_STS_RESOURCE;
+            break;
+        }
+
+        tar_bio->bi_iter.bi_sector = praid_geo_map(praid_reshape_geo(dev, sta_sector), sta_sector, &devi);
+        praid_member_bio_init(tar_bio, bio, &dev->members[devi]);
+        praid_reshape_start_io(dev, tar_bio, epoch);
+        PRAID_INFO("sta_sector=%llu, end_sector=%llu, devi=%u, %c\n", sta_sector, end_sector, devi, bio_data_dir(bio) == WRITE ? 'w' : 'r');
+
+        if(journal) {
+            praid_journal_write(dev, tar_bio);
+            continue;
+        }
+
+        if(cache) {
+            praid_cache_write(dev, tar_bio);
+            continue;
+        }
+
+        if(write) {
+            praid_rebuild_start_write(dev, tar_bio);
+            // 位图未落盘时 bio 由位图的 flush_work 下发
+            if(!praid_bitmap_start_write(dev, tar_bio)) {
+                continue;
+            }
+        } else if(dev->journal.enabled && !op_is_write(bio_op(bio))) {
+            praid_journal_wait_read(dev, tar_bio);
+        } else if(dev->cache.enabled && !op_is_write(bio_op(bio)) && praid_cache_read(dev, tar_bio)) {
+            continue;
+        }
+
+        praid_member_submit(tar_bio);
+    } while(!last);
+
+    if(write) {
+        praid_rebuild_release_range(dev, w0, w1);
+    }
+    praid_reshape_release(dev, epoch);
+
+    // FUA 的数据已进入缓存，和 flush 一样等待刷写
+    if(flush) {
+        bio_inc_remaining(bio);
+        praid_cache_flush(dev, bio);
+    }
+
+    // 释放提交时持有的引用，所有成员盘的 bio 完成后 bio 结束
+    bio_endio(bio);
+
     return BLK_QC_T_NONE;
 }
 
@@ -99,29 +397,43 @@ static int create_block_device(struct praid_dev *dev) {
     int err;
     uint64_t nr_sectors;
 
-    dev->size = dev->config.size_nvme_disk * (uint64_t)dev->disk_cnt;
+    // 扩容未完成时按扩容前的数据盘数计算容量，完成后更新
+    dev->size = dev->config.size_nvme_disk * (uint64_t)(dev->reshape.active ? dev->reshape.old_geo.data_disks : dev->disk_cnt);
 
     nr_sectors = dev->size >> KERNEL_SECTOR_SHIFT;
 
     // spin_lock_init(&dev->blk_lock);
 
-    dev->gd = blk_alloc_disk(NUMA_NO_NODE);
+    err = bioset_init(&dev->bio_set, BIO_POOL_SIZE, offsetof(struct praid_bio, bio), BIOSET_NEED_BVECS);
+    if(err) {
+        PRAID_ERROR("init bio set failure\n");
+        goto out_err;
+    }
+
+    dev->gd = blk_alloc_disk(dev->config.node);
     if(!dev->gd || IS_ERR(dev->gd->queue)) {
         PRAID_INFO("alloc disk failure\n");
-        goto out_err;
+        goto out_bioset;
     }
 
-    dev->gd->major = VPCIEDISK_MAJOR;
-    dev->gd->first_minor = 0;
-    dev->gd->minors = 1;
+    dev->gd->major = vpciedisk_major;
+    dev->gd->first_minor = dev->id * VPCIEDISK_MINORS;
+    dev->gd->minors = VPCIEDISK_MINORS;
     dev->gd->fops = &vpciedisk_dev_ops;
     dev->queue = dev->gd->queue;
     dev->gd->private_data = dev;
-    snprintf(dev->gd->disk_name, 32, VPCIEDISK_NAME);
+    snprintf(dev->gd->disk_name, DISK_NAME_LEN, VPCIEDISK_NAME "%d", dev->id);
     set_capacity(dev->gd, nr_sectors * (HARDSECT_SIZE / KERNEL_SECTOR_SIZE));
     blk_queue_logical_block_size(dev->queue, KERNEL_SECTOR_SIZE);
+    blk_queue_io_min(dev->queue, dev->geo.chunk_size);
+    blk_queue_io_opt(dev->queue, dev->geo.chunk_size * dev->disk_cnt);
+    // 写回缓存的内容在崩溃后丢失，上层需要通过 flush/FUA 保证持久
+    if(dev->cache.enabled) {
+        blk_queue_write_cache(dev->queue, true, true);
+    }
+    praid_discard_limits(dev);
 
-    if((err = add_disk(dev->gd)) < 0) {
+    if((err = device_add_disk(NULL, dev->gd, praid_attr_groups)) < 0) {
         PRAID_ERROR("add disk failure, error code %d \n", err);
         goto out_disk_init;
     }
@@ -132,10 +444,12 @@ static int create_block_device(struct praid_dev *dev) {
 
 out_disk_init:
     if(dev->gd) {
-        del_gendisk(dev->gd);
         blk_cleanup_disk(dev->gd);
     }
 
+out_bioset:
+    bioset_exit(&dev->bio_set);
+
 out_err:
     return -ENOMEM;
 }
@@ -145,6 +459,7 @@ static void delete_block_device(struct praid_dev *dev) {
         del_gendisk(dev->gd);
         blk_cleanup_disk(dev->gd);
     }
+    bioset_exit(&dev->bio_set);
 
     PRAID_INFO("deleted vpciedisk device.");
 }
@@ -152,26 +467,30 @@ static void delete_block_device(struct praid_dev *dev) {
 int vpciedisk_init(struct praid_dev *praid_dev) {
     int status;
 
-    status = register_blkdev(VPCIEDISK_MAJOR, VPCIEDISK_NAME);
-    if(status < 0) {
-        PRAID_ERROR("unable to register vpciedisk device.\n");
-        return -EBUSY;
-    }
-
     status = create_block_device(praid_dev);
     if(status < 0) {
         PRAID_ERROR("unable to create vpciedisk device.\n");
-        goto out_register;
+        return status;
     }
 
     return 0;
-
-out_register:
-    unregister_blkdev(VPCIEDISK_MAJOR, VPCIEDISK_NAME);
-    return -ENOMEM;
 }
 
 void vpciedisk_exit(struct praid_dev *praid_dev) {
     delete_block_device(praid_dev);
-    unregister_blkdev(VPCIEDISK_MAJOR, VPCIEDISK_NAME);
-}
\ No newline at end of file
+}
+
+// 所有阵列共用一个动态分配的主设备号，次设备号为阵列编号
+int vpciedisk_register(void) {
+    vpciedisk_major = register_blkdev(0, VPCIEDISK_NAME);
+    if(vpciedisk_major < 0) {
+        PRAID_ERROR("unable to register vpciedisk device.\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+void vpciedisk_unregister(void) {
+    unregister_blkdev(vpciedisk_major, VPCIEDISK_NAME);
+}
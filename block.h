@@ -8,50 +8,45 @@
 
 #include "praid.h"
 
-#define VPCIEDISK_MAJOR 400
 #define VPCIEDISK_MINORS 1
 #define VPCIEDISK_NAME "praiddisk"
 
 #define SECTOR_TO_BYTE(sector) ((sector) << KERNEL_SECTOR_SHIFT)
 
-#define chunk_num(sector_num) ((sector_num) >> SECTORS_IN_CHUNK_SHIFT)
-#define stripe_num(sector_num, cnt_dev) (chunk_num(sector_num) / cnt_dev)
-#define device_num(chunk, cnt_dev) ((chunk) % (cnt_dev))
-#define chunk_sta_sector(sector_num) (chunk_num(sector_num) << SECTORS_IN_CHUNK_SHIFT)
-#define chunk_end_sector(sector_num) (chunk_sta_sector(sector_num) + SECTORS_IN_CHUNK - 1)
-#define sector_whole_to_i(sector_sta, cnt_dev) (((sector_sta) & 0x7) + ((chunk_num(sector_sta) / (cnt_dev)) << SECTORS_IN_CHUNK_SHIFT))
-#define i_chunk_sta_sector(sector_num, cnt_dev) sector_whole_to_i(chunk_sta_sector(sector_num), cnt_dev)
-#define i_chunk_end_sector(sector_num, cnt_dev) sector_whole_to_i(chunk_end_sector(sector_num), cnt_dev)
+/*
+ * 遍历 bio 的数据并用 bvec_kmap_local 映射。多页的段内的页物理连续，没有高端内存时在线性映射中
+ * 也连续，整段一次处理；有高端内存时退回到逐页遍历。循环体要能处理超过一页的 bv_len
+ */
+#ifdef CONFIG_HIGHMEM
+#define praid_bio_for_each_data(bvec, bio, iter) bio_for_each_segment(bvec, bio, iter)
+#else
+#define praid_bio_for_each_data(bvec, bio, iter) bio_for_each_bvec(bvec, bio, iter)
+#endif
+
+// 扇区到 chunk、条带、数据盘的映射见 geometry.h
 // 为方便计算扇区归属的条带，本设备中采用两侧都闭的区间
 
 #define DISK_INFO(string, args...) printk(KERN_INFO "%s: " string, VPCIEDISK_NAME, ##args)
 #define DISK_DEBUG(string, args...) printk(KERN_DEBUG "%s: " string, VPCIEDISK_NAME, ##args)
 #define DISK_ERROR(string, args...) printk(KERN_ERR "%s: " string, VPCIEDISK_NAME, ##args)
 
-struct blkdev_config {
-    unsigned int nr_nvme_disks;
-    uint64_t size_nvme_disk;
-    unsigned int nvme_major;
-    unsigned int nvme_minor_verify;
-    unsigned int nvme_minor[32];
-};
-
-// tackle signle bio instead of using blk-mq technique, which needs tag_set
-struct praidblk_dev {
-    struct blkdev_config config;
-
-    uint64_t size;
-    unsigned int disk_cnt;
-    struct block_device *bdev[32];
-    struct block_device *bdev_verify;
-
-    spinlock_t lock;
-    struct request_queue *queue;
-    struct gendisk *gd;
-};
-
+void praid_member_endio(struct bio *bio);
+void praid_member_bio_init(struct bio *bio, struct bio *parent, struct praid_member *member);
+void praid_member_submit(struct bio *bio);
+void praid_member_dispatch(struct bio *bio);
+void praid_member_write(struct bio *bio, struct bio *parent, struct praid_member *member, bool full);
+void __praid_member_write(struct bio *bio, struct bio *parent, struct praid_member *member, bool full);
+unsigned int praid_bio_buffer_segs(void *buf, unsigned int len);
+bool praid_bio_add_buffer(struct bio *bio, void *buf, unsigned int len);
 struct bio*  pcievdrv_submit_verify(struct bio *bio, unsigned int devi, struct praid_dev *dev);
+bool pcievdrv_submit_verify_zero(struct bio *bio, struct praid_dev *dev);
+void pcievdrv_submit_verify_old(struct bio *bio_old);
+void *pcievdrv_verify_old_data(struct bio *bio_old);
+
+extern const struct attribute_group *praid_attr_groups[];
 
+int vpciedisk_register(void);
+void vpciedisk_unregister(void);
 int vpciedisk_init(struct praid_dev *praid_dev);
 void vpciedisk_exit(struct praid_dev *praid_dev);
 
@@ -0,0 +1,806 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/hash.h>
+#include <linux/io.h>
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "praid.h"
+#include "block.h"
+#include "engine.h"
+#include "journal.h"
+#include "plog.h"
+#include "flush.h"
+#include "cache.h"
+
+/*
+ * 写回缓存。开启后保留内存中计算槽位之后的空间按条带分成若干行，写入的数据拷贝到所在条带的行中
+ * 即向上层返回，读取的范围全部在缓存中时直接从缓存返回。
+ *
+ * 后台刷写线程在脏行超过高水位时刷写到低水位以下，空闲时刷写所有脏行，一批中的行按条带号
+ * 从上次的位置循环排序。整条带都是脏数据时由设备计算校验，数据和校验直接写入成员盘，没有读改写；
+ * 其余的行按连续的脏扇区经正常的写路径写入。降级时都经正常的写路径。
+ *
+ * 缓存的内容不在崩溃后恢复，块设备声明易失的写缓存，flush 和 FUA 在所有脏行刷写、校验更新完成
+ * 并且成员盘自身的缓存刷新之后才结束。
+ */
+
+struct praid_cache_line {
+    struct hlist_node node;
+    struct list_head list;
+    u64 stripe;
+    u64 key; // 排序时距上次刷写位置的距离
+    unsigned long *valid, *dirty;
+    unsigned int refs; // 正在拷贝数据的读写，不能被替换
+    bool destaging; // 刷写的 io 未完成，写入和未命中的读取等待
+};
+
+static void *praid_cache_line_addr(struct praid_cache *c, struct praid_cache_line *line) {
+    return c->addr + (line - c->lines) * ((size_t)c->line_sectors << KERNEL_SECTOR_SHIFT);
+}
+
+static struct praid_cache_line *praid_cache_lookup(struct praid_cache *c, u64 stripe) {
+    struct praid_cache_line *line;
+
+    hlist_for_each_entry(line, &c->hash[hash_64(stripe, c->hash_bits)], node) {
+        if(line->stripe == stripe) {
+            return line;
+        }
+    }
+    return NULL;
+}
+
+static bool praid_cache_over_high(struct praid_cache *c) {
+    return c->nr_dirty * 100 > c->nr_lines * READ_ONCE(c->dirty_high);
+}
+
+// 取一个空闲的行，没有时替换最久未使用的干净行
+static struct praid_cache_line *praid_cache_get_line(struct praid_cache *c, u64 stripe) {
+    struct praid_cache_line *line = list_first_entry_or_null(&c->free, struct praid_cache_line, list), *l;
+
+    if(!line) {
+        list_for_each_entry(l, &c->clean, list) {
+            if(!l->refs && !l->destaging) {
+                line = l;
+                break;
+            }
+        }
+        if(!line) {
+            return NULL;
+        }
+        hlist_del(&line->node);
+        bitmap_zero(line->valid, c->line_sectors);
+    }
+
+    line->stripe = stripe;
+    hlist_add_head(&line->node, &c->hash[hash_64(stripe, c->hash_bits)]);
+    list_move_tail(&line->list, &c->clean);
+
+    return line;
+}
+
+static bool praid_cache_has_free(struct praid_cache *c) {
+    struct praid_cache_line *line;
+    bool ret;
+
+    spin_lock(&c->lock);
+    ret = !list_empty(&c->free);
+    list_for_each_entry(line, &c->clean, list) {
+        if(ret) {
+            break;
+        }
+        ret = !line->refs && !line->destaging;
+    }
+    spin_unlock(&c->lock);
+
+    return ret;
+}
+
+static bool praid_cache_line_destaging(struct praid_cache *c, u64 stripe) {
+    struct praid_cache_line *line;
+    bool ret;
+
+    spin_lock(&c->lock);
+    line = praid_cache_lookup(c, stripe);
+    ret = line && line->destaging;
+    spin_unlock(&c->lock);
+
+    return ret;
+}
+
+// 行中 [pos, pos + n) 没有脏数据，并且行不在刷写中
+static bool praid_cache_range_clean(struct praid_cache *c, u64 stripe, unsigned int pos, unsigned int n) {
+    struct praid_cache_line *line;
+    bool ret;
+
+    spin_lock(&c->lock);
+    line = praid_cache_lookup(c, stripe);
+    ret = !line || (!line->destaging && find_next_bit(line->dirty, pos + n, pos) >= pos + n);
+    spin_unlock(&c->lock);
+
+    return ret;
+}
+
+static void praid_cache_urgent(struct praid_cache *c) {
+    c->urgent = true;
+    wake_up(&c->destage_wait);
+}
+
+// 成员盘上的 bio 在行中的扇区位置
+static unsigned int praid_cache_pos(struct praid_dev *dev, struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    return (pbio->member->index << dev->geo.chunk_sectors_shift) + (bio->bi_iter.bi_sector & dev->geo.chunk_mask);
+}
+
+static void praid_cache_copy(struct bio *bio, void *addr, bool to_bio) {
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    uint8_t *data;
+
+    praid_bio_for_each_data(bvec, bio, iter) {
+        data = bvec_kmap_local(&bvec);
+        if(to_bio) {
+            memcpy(data, addr, bvec.bv_len);
+        } else {
+            memcpy(addr, data, bvec.bv_len);
+        }
+        kunmap_local(data);
+        addr += bvec.bv_len;
+    }
+}
+
+/*
+ * 读取的 bio 已映射到成员盘。范围全部在缓存中时从缓存返回并结束 bio；范围中有未刷写的数据
+ * 但不完整时等待其刷写。返回 false 时由调用者读成员盘
+ */
+bool praid_cache_read(struct praid_dev *dev, struct bio *bio) {
+    struct praid_cache *c = &dev->cache;
+    u64 stripe = bio->bi_iter.bi_sector >> dev->geo.chunk_sectors_shift;
+    unsigned int pos = praid_cache_pos(dev, bio), n = bio_sectors(bio);
+    struct praid_cache_line *line;
+
+    spin_lock(&c->lock);
+    for(;;) {
+        line = praid_cache_lookup(c, stripe);
+        if(!line) {
+            spin_unlock(&c->lock);
+            return false;
+        }
+        if(find_next_zero_bit(line->valid, pos + n, pos) >= pos + n) {
+            break;
+        }
+        if(!line->destaging && find_next_bit(line->dirty, pos + n, pos) >= pos + n) {
+            spin_unlock(&c->lock);
+            return false;
+        }
+
+        praid_cache_urgent(c);
+        spin_unlock(&c->lock);
+        wait_event(c->wait, praid_cache_range_clean(c, stripe, pos, n));
+        spin_lock(&c->lock);
+    }
+
+    line->refs ++;
+    if(!line->destaging && bitmap_empty(line->dirty, c->line_sectors)) {
+        list_move_tail(&line->list, &c->clean);
+    }
+    spin_unlock(&c->lock);
+
+    praid_cache_copy(bio, praid_cache_line_addr(c, line) + ((size_t)pos << KERNEL_SECTOR_SHIFT), true);
+
+    spin_lock(&c->lock);
+    line->refs --;
+    spin_unlock(&c->lock);
+    wake_up_all(&c->wait);
+
+    atomic64_inc(&c->read_hits);
+    bio_endio(bio);
+
+    return true;
+}
+
+/*
+ * 写入的 bio 已映射到成员盘，将其数据拷贝到所在条带的行中并结束 bio。
+ * 行正在刷写时等待刷写完成，没有可用的行时等待刷写线程腾出
+ */
+void praid_cache_write(struct praid_dev *dev, struct bio *bio) {
+    struct praid_cache *c = &dev->cache;
+    u64 stripe = bio->bi_iter.bi_sector >> dev->geo.chunk_sectors_shift;
+    unsigned int pos = praid_cache_pos(dev, bio), n = bio_sectors(bio);
+    struct praid_cache_line *line;
+    bool kick;
+
+    spin_lock(&c->lock);
+    for(;;) {
+        line = praid_cache_lookup(c, stripe);
+        if(line && line->destaging) {
+            spin_unlock(&c->lock);
+            wait_event(c->wait, !praid_cache_line_destaging(c, stripe));
+            spin_lock(&c->lock);
+            continue;
+        }
+        if(!line) {
+            line = praid_cache_get_line(c, stripe);
+        }
+        if(line) {
+            break;
+        }
+
+        praid_cache_urgent(c);
+        spin_unlock(&c->lock);
+        wait_event(c->wait, praid_cache_has_free(c));
+        spin_lock(&c->lock);
+    }
+    line->refs ++;
+    spin_unlock(&c->lock);
+
+    praid_cache_copy(bio, praid_cache_line_addr(c, line) + ((size_t)pos << KERNEL_SECTOR_SHIFT), false);
+
+    spin_lock(&c->lock);
+    if(bitmap_empty(line->dirty, c->line_sectors)) {
+        list_move_tail(&line->list, &c->dirty);
+        c->nr_dirty ++;
+    }
+    bitmap_set(line->valid, pos, n);
+    bitmap_set(line->dirty, pos, n);
+    line->refs --;
+    kick = praid_cache_over_high(c);
+    spin_unlock(&c->lock);
+    wake_up_all(&c->wait);
+
+    if(kick) {
+        wake_up(&c->destage_wait);
+    }
+
+    bio_endio(bio);
+}
+
+/*
+ * flush 或 FUA 的 bio 在之前的写入都进入缓存后调用，所有脏行刷写之后由刷写线程结束 bio
+ */
+void praid_cache_flush(struct praid_dev *dev, struct bio *bio) {
+    struct praid_cache *c = &dev->cache;
+
+    atomic64_inc(&dev->flush.requests);
+    spin_lock(&c->lock);
+    bio_list_add(&c->flushes, bio);
+    spin_unlock(&c->lock);
+
+    wake_up(&c->destage_wait);
+}
+
+// 条带 [s0, s1) 中有正在拷贝数据或刷写的行，调用者持有 lock
+static bool __praid_cache_range_busy(struct praid_cache *c, u64 s0, u64 s1) {
+    struct praid_cache_line *line;
+
+    list_for_each_entry(line, &c->dirty, list) {
+        if(line->stripe >= s0 && line->stripe < s1 && line->refs) {
+            return true;
+        }
+    }
+    list_for_each_entry(line, &c->clean, list) {
+        if(line->stripe >= s0 && line->stripe < s1 && (line->refs || line->destaging)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool praid_cache_range_busy(struct praid_cache *c, u64 s0, u64 s1) {
+    bool ret;
+
+    spin_lock(&c->lock);
+    ret = __praid_cache_range_busy(c, s0, s1);
+    spin_unlock(&c->lock);
+
+    return ret;
+}
+
+static void praid_cache_drop_line(struct praid_cache *c, struct praid_cache_line *line) {
+    hlist_del(&line->node);
+    bitmap_zero(line->valid, c->line_sectors);
+    bitmap_zero(line->dirty, c->line_sectors);
+    list_move_tail(&line->list, &c->free);
+}
+
+/*
+ * 条带 [s0, s1) 直接在成员盘上清零之前调用，等待这些条带的行结束拷贝和刷写后丢弃，脏数据不再刷写
+ */
+void praid_cache_discard(struct praid_dev *dev, u64 s0, u64 s1) {
+    struct praid_cache *c = &dev->cache;
+    struct praid_cache_line *line, *tmp;
+
+    if(!c->enabled) {
+        return;
+    }
+
+    spin_lock(&c->lock);
+    while(__praid_cache_range_busy(c, s0, s1)) {
+        spin_unlock(&c->lock);
+        wait_event(c->wait, !praid_cache_range_busy(c, s0, s1));
+        spin_lock(&c->lock);
+    }
+
+    list_for_each_entry_safe(line, tmp, &c->dirty, list) {
+        if(line->stripe >= s0 && line->stripe < s1) {
+            praid_cache_drop_line(c, line);
+            c->nr_dirty --;
+        }
+    }
+    list_for_each_entry_safe(line, tmp, &c->clean, list) {
+        if(line->stripe >= s0 && line->stripe < s1) {
+            praid_cache_drop_line(c, line);
+        }
+    }
+    spin_unlock(&c->lock);
+
+    wake_up_all(&c->wait);
+}
+
+unsigned long praid_cache_dirty_lines(struct praid_dev *dev) {
+    return READ_ONCE(dev->cache.nr_dirty);
+}
+
+// 调整水位之后唤醒刷写线程重新检查
+void praid_cache_kick(struct praid_dev *dev) {
+    wake_up(&dev->cache.destage_wait);
+}
+
+static int praid_cache_cmp(const void *a, const void *b) {
+    const struct praid_cache_line *la = *(const struct praid_cache_line **)a;
+    const struct praid_cache_line *lb = *(const struct praid_cache_line **)b;
+
+    if(la->key == lb->key) {
+        return 0;
+    }
+    return la->key < lb->key ? -1 : 1;
+}
+
+/*
+ * 选出最多 max 个脏行，按条带号从上次刷写的位置开始循环排序，记录其脏位图后清除，行转入刷写状态
+ */
+static unsigned int praid_cache_select(struct praid_dev *dev, unsigned long max) {
+    struct praid_cache *c = &dev->cache;
+    struct praid_cache_line *line;
+    unsigned long longs = BITS_TO_LONGS(c->line_sectors);
+    unsigned int i, k, n = 0;
+
+    // 除了丢弃，只有刷写线程清除脏行，释放锁之后选出的行仍然是脏的
+    spin_lock(&c->lock);
+    list_for_each_entry(line, &c->dirty, list) {
+        line->key = line->stripe - c->cursor;
+        c->batch[n ++] = line;
+    }
+    spin_unlock(&c->lock);
+
+    sort(c->batch, n, sizeof(*c->batch), praid_cache_cmp, NULL);
+    n = min3(n, c->batch_lines, (unsigned int)min_t(unsigned long, max, UINT_MAX));
+    if(!n) {
+        return 0;
+    }
+
+    spin_lock(&c->lock);
+    for(i = 0, k = 0; i < n; i ++) {
+        line = c->batch[i];
+        // 选出之后被 praid_cache_discard 丢弃的行
+        if(bitmap_empty(line->dirty, c->line_sectors)) {
+            continue;
+        }
+        c->batch[k] = line;
+        bitmap_copy(c->snap + k * longs, line->dirty, c->line_sectors);
+        bitmap_zero(line->dirty, c->line_sectors);
+        line->destaging = true;
+        list_move_tail(&line->list, &c->clean);
+        c->nr_dirty --;
+        k ++;
+    }
+    spin_unlock(&c->lock);
+
+    if(k) {
+        c->cursor = c->batch[k - 1]->stripe + 1;
+    }
+
+    return k;
+}
+
+static struct bio *praid_cache_page_bio(struct praid_cache *c, sector_t sector, struct page **pages, unsigned int len) {
+    struct bio *bio = bio_alloc_bioset(GFP_NOIO, DIV_ROUND_UP(len, PAGE_SIZE), &c->bio_set);
+    unsigned int i;
+
+    bio->bi_iter.bi_sector = sector;
+    bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+    for(i = 0; i * PAGE_SIZE < len; i ++) {
+        bio_add_page(bio, pages[i], min_t(unsigned int, PAGE_SIZE, len - i * PAGE_SIZE), 0);
+    }
+
+    return bio;
+}
+
+// 从缓存拷贝 len 字节到缓冲区的 *off 处，构造写入 sector 的 bio
+static struct bio *praid_cache_copy_bio(struct praid_cache *c, sector_t sector, void *src, unsigned int len, unsigned long *off) {
+    struct bio *bio;
+    unsigned int size, done = 0;
+
+    // 不小于一页的连续脏数据按页对齐，bio 的段数不超过 chunk 的页数
+    if(len >= PAGE_SIZE) {
+        *off = PAGE_ALIGN(*off);
+    }
+
+    bio = bio_alloc_bioset(GFP_NOIO, DIV_ROUND_UP(offset_in_page(*off) + len, PAGE_SIZE), &c->bio_set);
+    bio->bi_iter.bi_sector = sector;
+    bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+
+    while(done < len) {
+        size = min_t(unsigned int, PAGE_SIZE - offset_in_page(*off), len - done);
+        memcpy(page_address(c->buf[*off >> PAGE_SHIFT]) + offset_in_page(*off), src + done, size);
+        bio_add_page(bio, c->buf[*off >> PAGE_SHIFT], size, offset_in_page(*off));
+        done += size;
+        *off += size;
+    }
+
+    return bio;
+}
+
+/*
+ * 整条带写入：由校验引擎计算所有数据 chunk 的异或作为校验，数据和校验都不经读改写直接写入。
+ * 计算出错时返回错误，由调用者按部分写处理
+ */
+static int praid_cache_destage_full(struct praid_dev *dev, struct praid_cache_line *line, struct bio *parent, unsigned long *off) {
+    struct praid_cache *c = &dev->cache;
+    unsigned int chunk_size = dev->geo.chunk_size, nr_pages = chunk_size >> PAGE_SHIFT, i, k;
+    sector_t sector = line->stripe << dev->geo.chunk_sectors_shift;
+    void *addr = praid_cache_line_addr(c, line);
+    struct page **pages;
+    int ret;
+
+    pages = c->buf + (PAGE_ALIGN(*off) >> PAGE_SHIFT);
+    for(i = 0; i < dev->disk_cnt; i ++) {
+        for(k = 0; k < nr_pages; k ++) {
+            memcpy(page_address(pages[i * nr_pages + k]), addr + i * chunk_size + k * PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+
+    ret = dev->config.engine->stripe(dev, pages, dev->disk_cnt, nr_pages, 0, chunk_size);
+    if(ret) {
+        return ret;
+    }
+    *off = PAGE_ALIGN(*off) + (size_t)(dev->disk_cnt + 1) * chunk_size;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        praid_member_write(praid_cache_page_bio(c, sector, pages + i * nr_pages, chunk_size), parent, &dev->members[i], true);
+    }
+
+    return 0;
+}
+
+// 部分写入：每段连续的脏扇区经正常的写路径写入，由校验更新任务读改写校验
+static void praid_cache_destage_partial(struct praid_dev *dev, struct praid_cache_line *line, unsigned long *snap, struct bio *parent, unsigned long *off) {
+    struct praid_cache *c = &dev->cache;
+    unsigned int css = dev->geo.chunk_sectors_shift, i, s, e, base, end;
+    void *addr = praid_cache_line_addr(c, line);
+    struct bio *bio;
+
+    for(i = 0; i < dev->disk_cnt; i ++) {
+        base = i << css;
+        end = base + (1 << css);
+        for(s = find_next_bit(snap, end, base); s < end; s = find_next_bit(snap, end, e)) {
+            e = find_next_zero_bit(snap, end, s);
+            bio = praid_cache_copy_bio(c, (line->stripe << css) + (s - base), addr + ((size_t)s << KERNEL_SECTOR_SHIFT),
+                                       (e - s) << KERNEL_SECTOR_SHIFT, off);
+            praid_member_write(bio, parent, &dev->members[i], false);
+        }
+    }
+}
+
+static void praid_cache_batch_endio(struct bio *bio) {
+    complete(bio->bi_private);
+}
+
+/*
+ * 刷写选出的 n 个行，bytes 为写入的数据字节数。失败时恢复这些行开始刷写时的脏位，
+ * 数据留在缓存中等待下次刷写，返回错误
+ */
+static int praid_cache_destage_batch(struct praid_dev *dev, unsigned int n, unsigned long *bytes) {
+    struct praid_cache *c = &dev->cache;
+    unsigned long longs = BITS_TO_LONGS(c->line_sectors), off = 0, *snap;
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct praid_cache_line *line;
+    struct blk_plug plug;
+    struct bio *parent;
+    bool drained = false;
+    unsigned int i;
+    int ret;
+
+    parent = bio_alloc(GFP_NOIO, 0);
+    parent->bi_private = &done;
+    parent->bi_end_io = praid_cache_batch_endio;
+
+    blk_start_plug(&plug);
+    for(i = 0; i < n; i ++) {
+        line = c->batch[i];
+        snap = c->snap + i * longs;
+        *bytes += (unsigned long)bitmap_weight(snap, c->line_sectors) << KERNEL_SECTOR_SHIFT;
+
+        if(bitmap_full(snap, c->line_sectors) && !praid_degraded(dev)) {
+            // 直接写入的校验会被之前排队的校验更新和未合并的校验日志覆盖，先等待它们完成
+            if(!drained) {
+                flush_workqueue(dev->workqueue);
+                down(&dev->sem);
+                up(&dev->sem);
+                praid_plog_drain(dev);
+                drained = true;
+            }
+            if(!praid_cache_destage_full(dev, line, parent, &off)) {
+                atomic64_inc(&c->full_stripes);
+                continue;
+            }
+        }
+
+        praid_cache_destage_partial(dev, line, snap, parent, &off);
+        atomic64_inc(&c->partial_stripes);
+    }
+    blk_finish_plug(&plug);
+
+    bio_endio(parent);
+    wait_for_completion_io(&done);
+    ret = blk_status_to_errno(parent->bi_status);
+    if(ret) {
+        PRAID_ERROR("%s%d: cache destage failed, error %d.\n", VPCIEDISK_NAME, dev->id, ret);
+    }
+    bio_put(parent);
+
+    // 刷写中的行不会被写入或丢弃，失败时脏位原样恢复
+    spin_lock(&c->lock);
+    for(i = 0; i < n; i ++) {
+        line = c->batch[i];
+        line->destaging = false;
+        if(!ret) {
+            continue;
+        }
+        if(bitmap_empty(line->dirty, c->line_sectors)) {
+            list_move_tail(&line->list, &c->dirty);
+            c->nr_dirty ++;
+        }
+        bitmap_or(line->dirty, line->dirty, c->snap + i * longs, c->line_sectors);
+    }
+    spin_unlock(&c->lock);
+    wake_up_all(&c->wait);
+
+    return ret;
+}
+
+// 后台刷写按 destage_rate 限速，有读写等待刷写时不再等待
+static void praid_cache_throttle(struct praid_dev *dev, unsigned long bytes) {
+    struct praid_cache *c = &dev->cache;
+    unsigned int rate = READ_ONCE(c->destage_rate);
+
+    if(!rate) {
+        return;
+    }
+
+    wait_event_interruptible_timeout(c->destage_wait, READ_ONCE(c->urgent) || kthread_should_stop(),
+                                     msecs_to_jiffies(bytes / rate));
+}
+
+// 刷写脏行直到脏行数不超过 target，一批失败时停止并返回错误
+static int praid_cache_destage(struct praid_dev *dev, unsigned long target, bool throttle) {
+    unsigned long nr, bytes;
+    unsigned int n;
+    int ret;
+
+    while((nr = praid_cache_dirty_lines(dev)) > target) {
+        n = praid_cache_select(dev, nr - target);
+        if(!n) {
+            break;
+        }
+
+        bytes = 0;
+        ret = praid_cache_destage_batch(dev, n, &bytes);
+        if(ret) {
+            return ret;
+        }
+        if(throttle) {
+            praid_cache_throttle(dev, bytes);
+        }
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/*
+ * 脏行刷写之后，等待校验更新完成并刷新成员盘的缓存，然后结束 flush 和 FUA 的 bio。
+ * err 为刷写脏行的错误，刷写失败时 bio 同样以错误结束
+ */
+static void praid_cache_end_flushes(struct praid_dev *dev, struct bio_list *flushes, int err) {
+    struct bio *bio;
+
+    if(!err) {
+        err = praid_flush_members(dev);
+    }
+
+    while((bio = bio_list_pop(flushes))) {
+        if(err) {
+            bio->bi_status = errno_to_blk_status(err);
+        }
+        bio_endio(bio);
+    }
+}
+
+static bool praid_cache_need_destage(struct praid_cache *c) {
+    bool ret;
+
+    spin_lock(&c->lock);
+    ret = c->urgent || !bio_list_empty(&c->flushes) || praid_cache_over_high(c);
+    spin_unlock(&c->lock);
+
+    return ret;
+}
+
+static int praid_cache_thread(void *data) {
+    struct praid_dev *dev = data;
+    struct praid_cache *c = &dev->cache;
+    struct bio_list flushes;
+    unsigned long target;
+    bool idle, urgent, stop;
+    int err;
+
+    // 停止时再刷写一轮，结束所有等待的 flush 后退出
+    do {
+        idle = !wait_event_interruptible_timeout(c->destage_wait, praid_cache_need_destage(c) || kthread_should_stop(),
+                                                 PRAID_CACHE_DESTAGE_INTERVAL);
+        stop = kthread_should_stop();
+
+        bio_list_init(&flushes);
+        spin_lock(&c->lock);
+        bio_list_merge(&flushes, &c->flushes);
+        bio_list_init(&c->flushes);
+        urgent = stop || c->urgent || !bio_list_empty(&flushes);
+        c->urgent = false;
+        target = urgent || idle ? 0 : div_u64((u64)c->nr_lines * READ_ONCE(c->dirty_low), 100);
+        spin_unlock(&c->lock);
+
+        err = praid_cache_destage(dev, target, !urgent);
+
+        if(!bio_list_empty(&flushes)) {
+            praid_cache_end_flushes(dev, &flushes, err);
+        }
+        wake_up_all(&c->wait);
+
+        // 刷写失败的行仍然是脏的，间隔一段时间再重试
+        if(err && !stop) {
+            schedule_timeout_interruptible(PRAID_CACHE_DESTAGE_INTERVAL);
+        }
+    } while(!stop);
+
+    if(err) {
+        PRAID_ERROR("%s%d: %lu dirty cache lines lost.\n", VPCIEDISK_NAME, dev->id, praid_cache_dirty_lines(dev));
+    }
+
+    return 0;
+}
+
+static void praid_cache_free_all(struct praid_cache *c) {
+    unsigned int i;
+
+    bioset_exit(&c->bio_set);
+    if(c->buf) {
+        for(i = 0; i < c->nr_buf_pages; i ++) {
+            if(c->buf[i]) {
+                __free_page(c->buf[i]);
+            }
+        }
+    }
+    kvfree(c->buf);
+    kvfree(c->snap);
+    kvfree(c->batch);
+    kvfree(c->hash);
+    kvfree(c->bits);
+    kvfree(c->lines);
+    if(c->addr) {
+        memunmap(c->addr);
+    }
+}
+
+int praid_cache_init(struct praid_dev *dev) {
+    struct praid_cache *c = &dev->cache;
+    unsigned long offset = praid_journal_offset(dev->disk_cnt, dev->geo.chunk_size), longs, i;
+    size_t line_bytes = (size_t)dev->disk_cnt * dev->geo.chunk_size;
+    unsigned int per_line;
+    int ret = -ENOMEM;
+
+    if(!dev->config.cache_size) {
+        return 0;
+    }
+
+    spin_lock_init(&c->lock);
+    INIT_LIST_HEAD(&c->free);
+    INIT_LIST_HEAD(&c->clean);
+    INIT_LIST_HEAD(&c->dirty);
+    bio_list_init(&c->flushes);
+    init_waitqueue_head(&c->wait);
+    init_waitqueue_head(&c->destage_wait);
+    c->dirty_high = PRAID_CACHE_DIRTY_HIGH;
+    c->dirty_low = PRAID_CACHE_DIRTY_LOW;
+
+    c->nr_lines = div64_u64(dev->config.cache_size, line_bytes);
+    c->line_sectors = line_bytes >> KERNEL_SECTOR_SHIFT;
+    c->hash_bits = ilog2(roundup_pow_of_two(c->nr_lines));
+    longs = BITS_TO_LONGS(c->line_sectors);
+
+    // 整条带写入占用数据和校验的页，部分写入时每个 chunk 最多占用两倍的页
+    per_line = (dev->disk_cnt + 1) * (2 * (dev->geo.chunk_size >> PAGE_SHIFT) + 1);
+    c->nr_buf_pages = max_t(unsigned int, PRAID_CACHE_DESTAGE_BUF >> PAGE_SHIFT, per_line);
+    c->batch_lines = c->nr_buf_pages / per_line;
+
+    // 缓存的内容不在崩溃后恢复，使用回写的映射
+    c->addr = memremap(dev->config.memmap_start + offset, c->nr_lines * line_bytes, MEMREMAP_WB);
+    if(!c->addr) {
+        PRAID_ERROR("%s%d: cache memremap err.\n", VPCIEDISK_NAME, dev->id);
+        goto out_free;
+    }
+
+    c->lines = kvcalloc(c->nr_lines, sizeof(*c->lines), GFP_KERNEL);
+    c->bits = kvcalloc(2 * c->nr_lines * longs, sizeof(*c->bits), GFP_KERNEL);
+    c->hash = kvcalloc(1UL << c->hash_bits, sizeof(*c->hash), GFP_KERNEL);
+    c->batch = kvcalloc(c->nr_lines, sizeof(*c->batch), GFP_KERNEL);
+    c->snap = kvcalloc((size_t)c->batch_lines * longs, sizeof(*c->snap), GFP_KERNEL);
+    c->buf = kvcalloc(c->nr_buf_pages, sizeof(*c->buf), GFP_KERNEL);
+    if(!c->lines || !c->bits || !c->hash || !c->batch || !c->snap || !c->buf) {
+        goto out_free;
+    }
+
+    for(i = 0; i < c->nr_buf_pages; i ++) {
+        c->buf[i] = alloc_pages_node(dev->config.node, GFP_KERNEL, 0);
+        if(!c->buf[i]) {
+            goto out_free;
+        }
+    }
+
+    ret = bioset_init(&c->bio_set, BIO_POOL_SIZE, offsetof(struct praid_bio, bio), 0);
+    if(ret) {
+        goto out_free;
+    }
+
+    for(i = 0; i < c->nr_lines; i ++) {
+        c->lines[i].valid = c->bits + 2 * i * longs;
+        c->lines[i].dirty = c->bits + (2 * i + 1) * longs;
+        list_add_tail(&c->lines[i].list, &c->free);
+    }
+
+    c->thread = kthread_create_on_node(praid_cache_thread, dev, dev->config.node, "praid%d_destage", dev->id);
+    if(IS_ERR(c->thread)) {
+        ret = PTR_ERR(c->thread);
+        c->thread = NULL;
+        goto out_free;
+    }
+    wake_up_process(c->thread);
+
+    c->enabled = true;
+
+    PRAID_INFO("%s%d: cache %lu stripes, %llu MiB.\n", VPCIEDISK_NAME, dev->id, c->nr_lines, BYTE_TO_MB((u64)c->nr_lines * line_bytes));
+
+    return 0;
+
+out_free:
+    praid_cache_free_all(c);
+    memset(c, 0, sizeof(*c));
+    return ret;
+}
+
+// 块设备删除之后调用，刷写线程退出前刷写所有脏行并结束等待的 flush
+void praid_cache_exit(struct praid_dev *dev) {
+    struct praid_cache *c = &dev->cache;
+
+    if(!c->enabled) {
+        return;
+    }
+
+    kthread_stop(c->thread);
+    c->thread = NULL;
+
+    c->enabled = false;
+    praid_cache_free_all(c);
+}
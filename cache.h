@@ -0,0 +1,24 @@
+#ifndef __PRAID_CACHE_H__
+#define __PRAID_CACHE_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_CACHE_DIRTY_HIGH 75               // %
+#define PRAID_CACHE_DIRTY_LOW 50                // %
+#define PRAID_CACHE_MIN_LINES 16                // 缓存至少容纳的条带数
+#define PRAID_CACHE_DESTAGE_BUF MB(16)          // 一批刷写的缓冲区上限
+#define PRAID_CACHE_DESTAGE_INTERVAL (5 * HZ)   // 空闲时刷写所有脏行的间隔
+
+bool praid_cache_read(struct praid_dev *dev, struct bio *bio);
+void praid_cache_write(struct praid_dev *dev, struct bio *bio);
+void praid_cache_flush(struct praid_dev *dev, struct bio *bio);
+void praid_cache_discard(struct praid_dev *dev, u64 s0, u64 s1);
+unsigned long praid_cache_dirty_lines(struct praid_dev *dev);
+void praid_cache_kick(struct praid_dev *dev);
+
+int praid_cache_init(struct praid_dev *dev);
+void praid_cache_exit(struct praid_dev *dev);
+
+#endif
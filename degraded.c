@@ -0,0 +1,486 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/overflow.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "engine.h"
+#include "degraded.h"
+#include "plog.h"
+#include "iosched.h"
+
+/*
+ * 降级模式：某个成员盘失效后，读取该盘的 chunk 时读出其余所有成员盘(包括校验盘)同一位置的数据，
+ * 由设备异或重建；写入该盘的 chunk 时读出其余数据盘的数据，和新数据一起由设备异或得到新的校验数据
+ * 并写入校验盘。校验盘失效时写入不再更新校验。两者都由条带锁和同一条带上的读改写互斥。
+ */
+
+struct praid_xor_req *praid_xor_req_alloc(struct praid_dev *dev, sector_t sector, unsigned int len, unsigned int nr_src) {
+    struct praid_xor_req *req;
+    unsigned int i, nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+
+    req = kzalloc(struct_size(req, pages, (nr_src + 1) * nr_pages), GFP_NOIO);
+    if(!req) {
+        return NULL;
+    }
+
+    req->srcs = kcalloc(nr_src + 1, sizeof(*req->srcs), GFP_NOIO);
+    if(!req->srcs) {
+        kfree(req);
+        return NULL;
+    }
+
+    req->dev = dev;
+    req->sector = sector;
+    req->offset = (sector & dev->geo.chunk_mask) << KERNEL_SECTOR_SHIFT;
+    req->len = len;
+    req->nr_src = nr_src;
+    req->nr_pages = nr_pages;
+    req->ioq = PRAID_IOQ_BG;
+    atomic_set(&req->pending, 1);
+    init_completion(&req->done);
+
+    for(i = 0; i <= nr_src; i ++) {
+        req->srcs[i].req = req;
+    }
+
+    for(i = 0; i < (nr_src + 1) * nr_pages; i ++) {
+        req->pages[i] = alloc_page(GFP_NOIO);
+        if(!req->pages[i]) {
+            praid_xor_req_free(req);
+            return NULL;
+        }
+    }
+
+    return req;
+}
+
+void praid_xor_req_free(struct praid_xor_req *req) {
+    unsigned int i;
+
+    for(i = 0; i < (req->nr_src + 1) * req->nr_pages; i ++) {
+        if(req->pages[i]) {
+            __free_page(req->pages[i]);
+        }
+    }
+    kfree(req->srcs);
+    kfree(req);
+}
+
+static void praid_xor_req_put(struct praid_xor_req *req) {
+    if(atomic_dec_and_test(&req->pending)) {
+        complete(&req->done);
+    }
+}
+
+static void praid_xor_req_endio(struct bio *bio) {
+    struct praid_xor_src *src = bio->bi_private;
+    struct praid_xor_req *req = src->req;
+
+    if(bio->bi_status) {
+        req->status = bio->bi_status;
+        src->failed = true;
+    }
+    praid_ioq_done(src->member);
+    bio_put(bio);
+    praid_xor_req_put(req);
+}
+
+static struct bio *praid_xor_req_bio(struct praid_xor_req *req, unsigned int idx, struct praid_member *member, sector_t sector, unsigned int op) {
+    struct page **pages = praid_xor_req_group(req, idx);
+    struct bio *bio;
+    unsigned int i, size;
+
+    bio = bio_alloc(GFP_NOIO, req->nr_pages);
+    bio_set_dev(bio, member->bdev);
+    bio->bi_iter.bi_sector = sector;
+    bio_set_op_attrs(bio, op, 0);
+
+    for(i = 0; i < req->nr_pages; i ++) {
+        size = min_t(unsigned int, PAGE_SIZE, req->len - i * PAGE_SIZE);
+        bio_add_page(bio, pages[i], size, 0);
+    }
+
+    return bio;
+}
+
+// 异步读取成员盘的数据到第 idx 组中，或将第 idx 组写入成员盘，用 praid_xor_req_wait 等待
+void praid_xor_req_submit(struct praid_xor_req *req, unsigned int idx, struct praid_member *member, unsigned int op) {
+    praid_xor_req_submit_at(req, idx, member, req->sector, op);
+}
+
+// 同 praid_xor_req_submit，第 idx 组在成员盘上的位置为 sector 而不是 req->sector，用于扩容时搬移数据
+void praid_xor_req_submit_at(struct praid_xor_req *req, unsigned int idx, struct praid_member *member, sector_t sector, unsigned int op) {
+    struct bio *bio = praid_xor_req_bio(req, idx, member, sector, op);
+
+    req->srcs[idx].member = member;
+    bio->bi_private = &req->srcs[idx];
+    bio->bi_end_io = praid_xor_req_endio;
+    atomic_inc(&req->pending);
+    praid_ioq_submit(member, bio, req->ioq);
+}
+
+/*
+ * bio 的数据和第 idx 组之间拷贝，to_bio 为真时从组中拷贝到 bio。
+ * bio 的段长度不一定是整页，组内的位置需要逐段累计
+ */
+void praid_xor_req_copy_bio(struct praid_xor_req *req, unsigned int idx, struct bio *bio, bool to_bio) {
+    struct page **pages = praid_xor_req_group(req, idx);
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    size_t done = 0, bv_done, pos, size;
+    uint8_t *data, *buf;
+
+    praid_bio_for_each_data(bvec, bio, iter) {
+        data = bvec_kmap_local(&bvec);
+        for(bv_done = 0; bv_done < bvec.bv_len; bv_done += size, done += size) {
+            pos = offset_in_page(done);
+            size = min_t(size_t, bvec.bv_len - bv_done, PAGE_SIZE - pos);
+            buf = kmap_local_page(pages[done >> PAGE_SHIFT]);
+            if(to_bio) {
+                memcpy(data + bv_done, buf + pos, size);
+            } else {
+                memcpy(buf + pos, data + bv_done, size);
+            }
+            kunmap_local(buf);
+        }
+        kunmap_local(data);
+    }
+}
+
+// 等待已提交的 io 全部完成，出错的成员盘标记为失效。返回后可以继续提交下一批 io
+int praid_xor_req_wait(struct praid_xor_req *req) {
+    unsigned int i;
+
+    praid_xor_req_put(req);
+    wait_for_completion_io(&req->done);
+
+    atomic_set(&req->pending, 1);
+    reinit_completion(&req->done);
+
+    if(req->status) {
+        for(i = 0; i <= req->nr_src; i ++) {
+            if(req->srcs[i].failed) {
+                praid_member_set_faulty(req->srcs[i].member);
+            }
+        }
+        return blk_status_to_errno(req->status);
+    }
+
+    return 0;
+}
+
+int praid_xor_req_compute(struct praid_xor_req *req) {
+    return req->dev->config.engine->reconstruct(req->dev, req->pages, req->nr_src, req->nr_pages, req->offset, req->len);
+}
+
+// 将异或结果同步写入成员盘
+int praid_xor_req_write_result(struct praid_xor_req *req, struct praid_member *member) {
+    struct bio *bio = praid_xor_req_bio(req, req->nr_src, member, req->sector, REQ_OP_WRITE);
+    int ret;
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    if(ret) {
+        praid_member_set_faulty(member);
+    }
+
+    return ret;
+}
+
+void praid_member_set_faulty(struct praid_member *member) {
+    struct praid_dev *dev = member->dev;
+    int nr_faulty;
+
+    if(test_and_set_bit(PRAID_MEMBER_FAULTY, &member->flags)) {
+        // 重建中的替换盘出错，停止重建
+        if(test_and_clear_bit(PRAID_MEMBER_REBUILDING, &member->flags)) {
+            PRAID_ERROR("%s%d: replacement member %u failed, rebuild aborted.\n", VPCIEDISK_NAME, dev->id, member->index);
+        }
+        return;
+    }
+
+    nr_faulty = atomic_inc_return(&dev->nr_faulty);
+    PRAID_ERROR("%s%d: %s member %u (minor %u) is faulty, %s.\n", VPCIEDISK_NAME, dev->id,
+                member->index == dev->disk_cnt ? "parity" : "data", member->index, member->minor,
+                nr_faulty > 1 ? "array failed" : "running degraded");
+}
+
+/*
+ * 条带锁。读改写从下发写入到校验更新完成之间计入条带所在的桶，写入和校验更新各计一次，
+ * 校验更新在写入下发前排队，计数不会中途归零。降级读写由其余成员盘直接计算，开始前锁定桶并等待
+ * 桶中的读改写全部完成，锁定期间新的读改写挂起，解锁后重新下发
+ */
+static void praid_stripe_put(struct praid_dev *dev, unsigned int b) {
+    struct praid_stripe *s = &dev->stripe;
+
+    if(atomic_dec_and_test(&s->pending[b]) && wq_has_sleeper(&s->wait)) {
+        wake_up_all(&s->wait);
+    }
+}
+
+// 读改写的写入下发前调用，桶被锁定时挂起 bio 并返回 false
+bool praid_stripe_start_write(struct praid_dev *dev, struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_stripe *s = &dev->stripe;
+    unsigned int b = praid_stripe_bucket(dev, bio->bi_iter.bi_sector);
+    unsigned long flags;
+
+    atomic_inc(&s->pending[b]);
+    smp_mb__after_atomic();
+    if(unlikely(atomic_read(&s->locked[b]))) {
+        spin_lock_irqsave(&s->lock, flags);
+        if(atomic_read(&s->locked[b])) {
+            bio_list_add(&s->deferred, bio);
+            spin_unlock_irqrestore(&s->lock, flags);
+            praid_stripe_put(dev, b);
+            return false;
+        }
+        spin_unlock_irqrestore(&s->lock, flags);
+    }
+
+    pbio->stripe = b;
+    return true;
+}
+
+void praid_stripe_end_write(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    if(pbio->stripe < 0) {
+        return;
+    }
+    praid_stripe_put(pbio->member->dev, pbio->stripe);
+    pbio->stripe = -1;
+}
+
+// 校验更新排队前调用，此时写入的计数还未释放，不会有新的锁定者完成等待
+void praid_stripe_start_update(struct praid_dev *dev, sector_t sector) {
+    atomic_inc(&dev->stripe.pending[praid_stripe_bucket(dev, sector)]);
+}
+
+void praid_stripe_end_update(struct praid_dev *dev, sector_t sector) {
+    praid_stripe_put(dev, praid_stripe_bucket(dev, sector));
+}
+
+// sector 所在条带的桶中是否有未完成的读改写或校验更新
+bool praid_stripe_pending(struct praid_dev *dev, sector_t sector) {
+    return atomic_read(&dev->stripe.pending[praid_stripe_bucket(dev, sector)]);
+}
+
+static void praid_stripe_lock(struct praid_dev *dev, sector_t sector) {
+    struct praid_stripe *s = &dev->stripe;
+    unsigned int b = praid_stripe_bucket(dev, sector);
+
+    atomic_inc(&s->locked[b]);
+    smp_mb__after_atomic();
+    wait_event(s->wait, !atomic_read(&s->pending[b]));
+}
+
+static void praid_stripe_unlock(struct praid_dev *dev, sector_t sector) {
+    struct praid_stripe *s = &dev->stripe;
+    struct bio_list list;
+    struct bio *bio;
+
+    bio_list_init(&list);
+    spin_lock_irq(&s->lock);
+    if(atomic_dec_and_test(&s->locked[praid_stripe_bucket(dev, sector)])) {
+        bio_list_merge(&list, &s->deferred);
+        bio_list_init(&s->deferred);
+    }
+    spin_unlock_irq(&s->lock);
+
+    // 其他仍被锁定的桶中的 bio 会再次挂起
+    while((bio = bio_list_pop(&list))) {
+        praid_member_submit(bio);
+    }
+}
+
+// 读出失效盘以外的所有成员盘，重建失效盘上 bio 范围内的数据
+static void praid_degraded_read_work(struct work_struct *work) {
+    struct praid_bio *pbio = container_of(work, struct praid_bio, work);
+    struct bio *bio = &pbio->bio;
+    struct praid_dev *dev = pbio->member->dev;
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct praid_xor_req *req;
+    struct blk_plug plug;
+    unsigned int i, idx = 0;
+    int ret;
+
+    // 等待条带上的校验更新完成，未合并的校验日志先写入校验
+    praid_stripe_lock(dev, sector);
+    praid_plog_drain(dev);
+
+    req = praid_xor_req_alloc(dev, bio->bi_iter.bi_sector, bio->bi_iter.bi_size, dev->disk_cnt);
+    if(!req) {
+        bio->bi_status = BLK_STS_RESOURCE;
+        goto out;
+    }
+    req->ioq = PRAID_IOQ_READ;
+
+    blk_start_plug(&plug);
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        if(i != pbio->member->index) {
+            praid_xor_req_submit(req, idx ++, &dev->members[i], REQ_OP_READ);
+        }
+    }
+    blk_finish_plug(&plug);
+
+    ret = praid_xor_req_wait(req);
+    if(!ret) {
+        ret = praid_xor_req_compute(req);
+    }
+
+    if(!ret) {
+        praid_xor_req_copy_bio(req, req->nr_src, bio, true);
+        atomic64_inc(&dev->degraded_reads);
+    } else {
+        bio->bi_status = errno_to_blk_status(ret);
+    }
+
+    praid_xor_req_free(req);
+
+out:
+    praid_stripe_unlock(dev, sector);
+    praid_member_endio(bio);
+}
+
+// 失效盘上的 chunk 不再写入，用其余数据盘的数据和新数据重新计算校验
+static void praid_degraded_write_work(struct work_struct *work) {
+    struct praid_bio *pbio = container_of(work, struct praid_bio, work);
+    struct bio *bio = &pbio->bio;
+    struct praid_dev *dev = pbio->member->dev;
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct praid_xor_req *req;
+    struct blk_plug plug;
+    unsigned int i, idx = 0;
+    int ret;
+
+    // 锁定期间条带上没有读改写和校验更新，未合并的校验日志先写入校验
+    praid_stripe_lock(dev, sector);
+    praid_plog_drain(dev);
+
+    req = praid_xor_req_alloc(dev, bio->bi_iter.bi_sector, bio->bi_iter.bi_size, dev->disk_cnt);
+    if(!req) {
+        bio->bi_status = BLK_STS_RESOURCE;
+        goto out;
+    }
+    req->ioq = PRAID_IOQ_WRITE;
+
+    blk_start_plug(&plug);
+    for(i = 0; i < dev->disk_cnt; i ++) {
+        if(i != pbio->member->index) {
+            praid_xor_req_submit(req, idx ++, &dev->members[i], REQ_OP_READ);
+        }
+    }
+    blk_finish_plug(&plug);
+
+    praid_xor_req_copy_bio(req, idx, bio, false);
+
+    ret = praid_xor_req_wait(req);
+    if(!ret) {
+        ret = praid_xor_req_compute(req);
+    }
+    if(!ret) {
+        ret = praid_xor_req_write_result(req, praid_parity_member(dev));
+    }
+
+    if(!ret) {
+        atomic64_inc(&dev->degraded_writes);
+    } else {
+        bio->bi_status = errno_to_blk_status(ret);
+    }
+
+    praid_xor_req_free(req);
+
+out:
+    praid_stripe_unlock(dev, sector);
+    praid_member_endio(bio);
+}
+
+static void praid_degraded_queue(struct praid_dev *dev, struct praid_bio *pbio) {
+    pbio->degraded = true;
+
+    if(op_is_write(bio_op(&pbio->bio))) {
+        // 出错后重新处理的读改写已计入条带，在锁定前释放
+        praid_stripe_end_write(&pbio->bio);
+        INIT_WORK(&pbio->work, praid_degraded_write_work);
+    } else {
+        INIT_WORK(&pbio->work, praid_degraded_read_work);
+    }
+    // 锁定条带时等待校验更新完成，不能放在校验更新的队列中
+    queue_work_node(dev->config.node, dev->recovery_wq, &pbio->work);
+}
+
+/*
+ * 提交到成员盘之前调用，目标成员盘失效时接管 bio 并返回 true
+ */
+bool praid_degraded_submit(struct praid_dev *dev, struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    if(unlikely(praid_failed(dev))) {
+        pbio->degraded = true;
+        bio_io_error(bio);
+        return true;
+    }
+
+    if(praid_member_in_sync(pbio->member, bio->bi_iter.bi_sector, bio_sectors(bio))) {
+        // 替换盘上已重建的区域直接读写，bdev 在替换时可能已经改变
+        bio_set_dev(bio, READ_ONCE(pbio->member->bdev));
+        return false;
+    }
+
+    // 整条带清零时失效盘上的数据由其余成员盘异或得到，同样为零
+    if(bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+        pbio->degraded = true;
+        praid_member_endio(bio);
+        return true;
+    }
+
+    praid_degraded_queue(dev, pbio);
+    return true;
+}
+
+/*
+ * 成员盘 bio 出错时在完成回调中调用。数据盘标记为失效，阵列仍可用时改由降级路径重新处理 bio
+ */
+bool praid_degraded_retry(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_member *member = pbio->member;
+    struct praid_dev *dev = member->dev;
+
+    // 资源不足不是成员盘的错误；清零的 bio 没有数据可以重建，错误直接返回
+    if(pbio->degraded || member->index == dev->disk_cnt || bio->bi_status == BLK_STS_RESOURCE ||
+       bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+        return false;
+    }
+
+    praid_member_set_faulty(member);
+    if(praid_failed(dev)) {
+        return false;
+    }
+
+    bio->bi_iter = pbio->iter;
+    bio->bi_status = BLK_STS_OK;
+    praid_degraded_queue(dev, pbio);
+
+    return true;
+}
+
+int praid_degraded_init(struct praid_dev *dev) {
+    spin_lock_init(&dev->stripe.lock);
+    bio_list_init(&dev->stripe.deferred);
+    init_waitqueue_head(&dev->stripe.wait);
+
+    dev->recovery_wq = alloc_workqueue("praid%d_recovery", WQ_UNBOUND | WQ_MEM_RECLAIM, 0, dev->id);
+    if(!dev->recovery_wq) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void praid_degraded_exit(struct praid_dev *dev) {
+    destroy_workqueue(dev->recovery_wq);
+}
@@ -0,0 +1,62 @@
+#ifndef __PRAID_DEGRADED_H__
+#define __PRAID_DEGRADED_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+/*
+ * 成员盘范围 [sector, sector + len) 内的异或请求。nr_src 组源数据由成员盘读出或从 bio 拷贝，
+ * 交给设备异或后结果放在第 nr_src 组中。范围不能跨越 chunk
+ */
+struct praid_xor_src {
+    struct praid_xor_req *req;
+    struct praid_member *member; // 和成员盘之间有 io 时有效
+    bool failed;
+};
+
+struct praid_xor_req {
+    struct praid_dev *dev;
+    sector_t sector;        // 盘内起始扇区
+    unsigned int offset;    // chunk 内的字节偏移
+    unsigned int len;       // 字节数
+    unsigned int nr_src;
+    unsigned int nr_pages;  // 每组页数
+    unsigned int ioq;       // 成员盘读写的调度类别，默认为后台
+
+    atomic_t pending;
+    blk_status_t status;
+    struct completion done;
+
+    struct praid_xor_src *srcs; // nr_src + 1 个，最后一个对应结果组
+
+    struct page *pages[];   // (nr_src + 1) * nr_pages
+};
+
+static inline struct page **praid_xor_req_group(struct praid_xor_req *req, unsigned int idx) {
+    return req->pages + idx * req->nr_pages;
+}
+
+struct praid_xor_req *praid_xor_req_alloc(struct praid_dev *dev, sector_t sector, unsigned int len, unsigned int nr_src);
+void praid_xor_req_free(struct praid_xor_req *req);
+void praid_xor_req_submit(struct praid_xor_req *req, unsigned int idx, struct praid_member *member, unsigned int op);
+void praid_xor_req_submit_at(struct praid_xor_req *req, unsigned int idx, struct praid_member *member, sector_t sector, unsigned int op);
+void praid_xor_req_copy_bio(struct praid_xor_req *req, unsigned int idx, struct bio *bio, bool to_bio);
+int praid_xor_req_wait(struct praid_xor_req *req);
+int praid_xor_req_compute(struct praid_xor_req *req);
+int praid_xor_req_write_result(struct praid_xor_req *req, struct praid_member *member);
+
+void praid_member_set_faulty(struct praid_member *member);
+bool praid_degraded_submit(struct praid_dev *dev, struct bio *bio);
+bool praid_degraded_retry(struct bio *bio);
+
+bool praid_stripe_start_write(struct praid_dev *dev, struct bio *bio);
+void praid_stripe_end_write(struct bio *bio);
+void praid_stripe_start_update(struct praid_dev *dev, sector_t sector);
+void praid_stripe_end_update(struct praid_dev *dev, sector_t sector);
+bool praid_stripe_pending(struct praid_dev *dev, sector_t sector);
+
+int praid_degraded_init(struct praid_dev *dev);
+void praid_degraded_exit(struct praid_dev *dev);
+
+#endif
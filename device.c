@@ -12,42 +12,39 @@
 #include "device.h"
 #include "praid.h"
 
-struct pciev_dev *pciev_vdev = NULL;
-
 static int pciev_dispatcher(void *data) {
+	struct pciev_dev *pciev_vdev = data;
+
 	PCIEV_INFO("pciev_dispatcher started on cpu %d (node %d)\n",
 			   pciev_vdev->config.cpu_nr_dispatcher,
 			   cpu_to_node(pciev_vdev->config.cpu_nr_dispatcher));
 	
 	while (!kthread_should_stop()) {
-		pciev_proc_bars();
-		pciev_dispatcher_clac_xor_single();
+		pciev_proc_bars(pciev_vdev);
+		pciev_dispatcher_proc_io(pciev_vdev);
 		cond_resched();
 	}
 
 	return 0;
 }
 
-static bool __load_configs(struct pciev_config *config) {
-	config->memmap_start = memmap_start;
-	config->memmap_size = memmap_size;
-
-	config->storage_start = memmap_start + BAR_CHUNK_OFFSET;
-	config->storage_size = memmap_size - BAR_CHUNK_OFFSET;
+static bool __load_configs(struct pciev_config *config, const struct pciev_config *init) {
+	*config = *init;
 
-	config->cpu_nr_dispatcher = cpu;
+	config->storage_start = config->memmap_start + BAR_CHUNK_OFFSET;
+	config->storage_size = config->memmap_size - BAR_CHUNK_OFFSET;
 
 	return true;
 }
 
 static void PCIEV_DISPATCHER_INIT(struct pciev_dev *pciev_vdev)
 {
-	pciev_vdev->verify_page = alloc_page(GFP_KERNEL);
-	pciev_vdev->pciev_dispatcher = kthread_create(pciev_dispatcher, NULL, "pciev_dispatcher");
+	pciev_vdev->verify_page = alloc_pages_node(pciev_vdev->config.node, GFP_KERNEL, 0);
+	pciev_vdev->pciev_dispatcher = kthread_create_on_node(pciev_dispatcher, pciev_vdev, pciev_vdev->config.node,
+														  "pciev_dispatcher/%d", pciev_vdev->config.bus_nr);
 	kthread_bind(pciev_vdev->pciev_dispatcher, pciev_vdev->config.cpu_nr_dispatcher);
 	wake_up_process(pciev_vdev->pciev_dispatcher);
 }
-
 static void PCIEV_DISPATCHER_FINAL(struct pciev_dev *pciev_vdev)
 {
 	if (!IS_ERR_OR_NULL(pciev_vdev->pciev_dispatcher)) {
@@ -75,17 +72,16 @@ static void PCIEV_STORAGE_FINAL(struct pciev_dev *pciev_vdev) {
 		memunmap(pciev_vdev->storage_mapped);
 }
 
-int PCIEV_init(struct block_device* bdev, unsigned int cnt_dev) {
-	pciev_vdev = VDEV_INIT();
+struct pciev_dev *PCIEV_init(const struct pciev_config *config, struct block_device *bdev) {
+	struct pciev_dev *pciev_vdev = VDEV_INIT(config->node);
 	if (!pciev_vdev)
-		return -EINVAL;
+		return NULL;
 
-	if (!__load_configs(&pciev_vdev->config)) {
+	if (!__load_configs(&pciev_vdev->config, config)) {
 		goto ret_err;
 	}
 
 	pciev_vdev->verify_blk = bdev;
-	pciev_vdev->config.cnt_disk = cnt_dev;
 
 	PCIEV_STORAGE_INIT(pciev_vdev);
 
@@ -97,16 +93,17 @@ int PCIEV_init(struct block_device* bdev, unsigned int cnt_dev) {
 
 	pci_bus_add_devices(pciev_vdev->virt_bus);
 
-	PCIEV_INFO("Virtual PCIE device created\n");
+	PCIEV_INFO("Virtual PCIE device created on bus %#x\n", pciev_vdev->config.bus_nr);
 
-	return 0;
+	return pciev_vdev;
 
 ret_err:
+	PCIEV_STORAGE_FINAL(pciev_vdev);
 	VDEV_FINALIZE(pciev_vdev);
-	return -EIO;
+	return NULL;
 }
 
-void PCIEV_exit(void) {
+void PCIEV_exit(struct pciev_dev *pciev_vdev) {
 
 	if (pciev_vdev->virt_bus != NULL) {
 		pci_stop_root_bus(pciev_vdev->virt_bus);
@@ -119,4 +116,12 @@ void PCIEV_exit(void) {
 	VDEV_FINALIZE(pciev_vdev);
 
 	PCIEV_INFO("Virtual PCIE device closed\n");
-}
\ No newline at end of file
+}
+
+// 扩容后更新设备的成员数量，调用者保证设备空闲
+void PCIEV_set_disk_cnt(struct pciev_dev *pciev_vdev, unsigned int cnt_disk) {
+	pciev_vdev->config.cnt_disk = cnt_disk;
+	pciev_vdev->old_bar->dev_cnt = cnt_disk;
+	pciev_vdev->bar->dev_cnt = cnt_disk;
+	smp_mb();
+}
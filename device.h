@@ -46,11 +46,16 @@ struct pciev_config {
 	unsigned long storage_size; // byte
 
 	unsigned int cnt_disk;
+	unsigned int chunk_size; // byte
 
 	unsigned int cpu_nr_dispatcher;
+
+	int bus_nr; // 设备所在的虚拟 pci 总线
+	int node; // NUMA 节点
 };
 
 struct pciev_dev {
+	struct pci_sysdata sysdata; // 虚拟总线的 sysdata，pci 配置空间的读写由此找到设备
 	struct pci_bus *virt_bus;
 	void *virtDev;
 	struct pci_header *pcihdr;
@@ -78,18 +83,14 @@ struct pciev_dev {
 	struct page* verify_page;
 };
 
-extern struct pciev_dev *pciev_vdev;
-struct pciev_dev *VDEV_INIT(void);
+struct pciev_dev *VDEV_INIT(int node);
 void VDEV_FINALIZE(struct pciev_dev *pciev_vdev);
-void pciev_proc_bars(void);
-void pciev_dispatcher_clac_xor_single(void);
+void pciev_proc_bars(struct pciev_dev *pciev_vdev);
+void pciev_dispatcher_proc_io(struct pciev_dev *pciev_vdev);
 bool PCIEV_PCI_INIT(struct pciev_dev *dev);
 
-extern unsigned long memmap_start;
-extern unsigned long memmap_size;
-extern unsigned int cpu;
-
-int PCIEV_init(struct block_device*, unsigned int cnt_dev);
-void PCIEV_exit(void);
+struct pciev_dev *PCIEV_init(const struct pciev_config *config, struct block_device *bdev);
+void PCIEV_exit(struct pciev_dev *pciev_vdev);
+void PCIEV_set_disk_cnt(struct pciev_dev *pciev_vdev, unsigned int cnt_disk);
 
 #endif /* _LIB_DEVICE_H */
\ No newline at end of file
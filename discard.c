@@ -0,0 +1,153 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/math64.h>
+
+#include "praid.h"
+#include "block.h"
+#include "rebuild.h"
+#include "plog.h"
+#include "zeromap.h"
+#include "cache.h"
+#include "discard.h"
+
+/*
+ * 丢弃和清零。完整覆盖的条带在所有成员盘(包括校验盘)上清零，数据全为零时校验也为零，不需要读改写。
+ * 丢弃同样转为成员盘上的 WRITE_ZEROES：成员盘丢弃后读出的数据不确定，校验会和数据不一致；
+ * 不带 REQ_NOUNMAP 的 WRITE_ZEROES 允许成员盘释放这些块，SSD 同样得到 TRIM。
+ *
+ * 没有完整覆盖的条带：丢弃直接忽略，清零按写入零页的普通写处理，由校验更新任务读改写校验。
+ * 扩容中整个范围都按这种方式处理。
+ *
+ * 成员盘的 bio 按重建窗口拆分，和其他写入一样计入重建屏障和写意图位图。失效盘上的数据由其余成员盘
+ * 异或得到，条带清零后同样为零，所以不在同步状态的部分直接跳过，见 praid_degraded_submit
+ */
+
+static sector_t praid_discard_stripe_sectors(struct praid_dev *dev) {
+    return (sector_t)dev->disk_cnt << dev->geo.chunk_sectors_shift;
+}
+
+/*
+ * 创建块设备和扩容完成时调用。所有成员盘都支持 WRITE_ZEROES 时声明丢弃和清零，粒度为一个条带；
+ * 开启日志时不声明，日志中未写回的记录会在清零之后覆盖成员盘
+ */
+void praid_discard_limits(struct praid_dev *dev) {
+    struct request_queue *q = dev->queue;
+    sector_t stripe = praid_discard_stripe_sectors(dev), max;
+    bool supported = !dev->journal.enabled;
+    unsigned int i;
+
+    for(i = 0; i <= dev->disk_cnt && supported; i ++) {
+        if(!praid_member_faulty(&dev->members[i]) && !bdev_write_zeroes_sectors(dev->members[i].bdev)) {
+            supported = false;
+        }
+    }
+
+    if(!supported) {
+        blk_queue_flag_clear(QUEUE_FLAG_DISCARD, q);
+        blk_queue_max_discard_sectors(q, 0);
+        blk_queue_max_write_zeroes_sectors(q, 0);
+        return;
+    }
+
+    // 上层按条带对齐拆分，一个 bio 的成员盘 bio 数量有上限
+    max = min_t(sector_t, (sector_t)(PRAID_DISCARD_MAX >> KERNEL_SECTOR_SHIFT) * dev->disk_cnt,
+                rounddown((sector_t)(UINT_MAX >> KERNEL_SECTOR_SHIFT), stripe));
+
+    q->limits.discard_granularity = stripe << KERNEL_SECTOR_SHIFT;
+    q->limits.discard_alignment = 0;
+    blk_queue_max_discard_sectors(q, max);
+    blk_queue_max_write_zeroes_sectors(q, max);
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+}
+
+// 用零页的普通写入清零阵列扇区 [sector, end)，作为 parent 的子 bio 重新提交到块设备
+static void praid_discard_zero_pages(struct bio *parent, sector_t sector, sector_t end) {
+    struct bio *bio;
+    sector_t nr;
+    unsigned int len;
+
+    while(sector < end) {
+        nr = min_t(sector_t, end - sector, (sector_t)BIO_MAX_VECS << (PAGE_SHIFT - KERNEL_SECTOR_SHIFT));
+
+        bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(nr << KERNEL_SECTOR_SHIFT, PAGE_SIZE));
+        bio_set_dev(bio, parent->bi_bdev);
+        bio->bi_iter.bi_sector = sector;
+        bio->bi_opf = REQ_OP_WRITE | (parent->bi_opf & REQ_SYNC);
+
+        for(sector += nr; nr; nr -= len >> KERNEL_SECTOR_SHIFT) {
+            len = min_t(sector_t, nr << KERNEL_SECTOR_SHIFT, PAGE_SIZE);
+            bio_add_page(bio, ZERO_PAGE(0), len, 0);
+        }
+
+        bio_chain(bio, parent);
+        submit_bio(bio);
+    }
+}
+
+// 在所有成员盘上清零条带 [s0, s1)
+static void praid_discard_stripes(struct praid_dev *dev, struct bio *parent, u64 s0, u64 s1) {
+    unsigned int css = dev->geo.chunk_sectors_shift, shift = dev->rebuild.window_shift, i;
+    sector_t stripe = praid_discard_stripe_sectors(dev), sector = (sector_t)s0 << css, end = (sector_t)s1 << css, n;
+    unsigned int opf = REQ_OP_WRITE_ZEROES;
+    unsigned long w0, w1;
+    struct bio *bio;
+
+    if(bio_op(parent) == REQ_OP_WRITE_ZEROES) {
+        opf |= parent->bi_opf & REQ_NOUNMAP;
+    }
+
+    // 写回缓存中这些条带的数据不再刷写
+    praid_cache_discard(dev, s0, s1);
+
+    // 之前排队的校验更新和未合并的校验日志会覆盖清零后的校验，先等待它们完成
+    flush_workqueue(dev->workqueue);
+    down(&dev->sem);
+    up(&dev->sem);
+    praid_plog_drain(dev);
+
+    for(i = 0; i < dev->disk_cnt; i ++) {
+        praid_zeromap_discard(dev, i, sector, end - sector);
+    }
+
+    // 和 vpciedisk_submit_bio 一样先持有整个范围，拆分中途等待屏障会和已计数未下发的 bio 死锁
+    praid_rebuild_hold_range(dev, s0 * stripe, s1 * stripe, &w0, &w1);
+
+    for(; sector < end; sector += n) {
+        n = min_t(sector_t, end - sector, (((sector >> shift) + 1) << shift) - sector);
+        for(i = 0; i <= dev->disk_cnt; i ++) {
+            bio = bio_alloc_bioset(GFP_NOIO, 0, &dev->bio_set);
+            bio->bi_iter.bi_sector = sector;
+            bio->bi_iter.bi_size = n << KERNEL_SECTOR_SHIFT;
+            bio->bi_opf = opf;
+            __praid_member_write(bio, parent, &dev->members[i], true);
+        }
+    }
+
+    praid_rebuild_release_range(dev, w0, w1);
+}
+
+void praid_discard(struct praid_dev *dev, struct bio *bio) {
+    sector_t stripe = praid_discard_stripe_sectors(dev), sta = bio->bi_iter.bi_sector, end = bio_end_sector(bio), a, b;
+    u64 s0 = div64_u64(sta + stripe - 1, stripe), s1 = div64_u64(end, stripe);
+
+    // 扩容中条带的布局随位置变化，整个范围按没有完整覆盖的条带处理
+    if(unlikely(READ_ONCE(dev->reshape.active)) || s0 >= s1) {
+        s0 = s1 = 0;
+        a = b = end;
+    } else {
+        a = (sector_t)s0 * stripe;
+        b = (sector_t)s1 * stripe;
+    }
+
+    if(bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+        praid_discard_zero_pages(bio, sta, a);
+        praid_discard_zero_pages(bio, b, end);
+    }
+
+    if(s0 < s1) {
+        praid_discard_stripes(dev, bio, s0, s1);
+    }
+
+    // 所有成员盘的 bio 和零页的写入完成后 bio 结束
+    bio_endio(bio);
+}
@@ -0,0 +1,17 @@
+#ifndef __PRAID_DISCARD_H__
+#define __PRAID_DISCARD_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_DISCARD_MAX MB(64) // 一个 bio 在每个成员盘上清零的最大字节数
+
+static inline bool praid_is_discard(struct bio *bio) {
+    return bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES;
+}
+
+void praid_discard_limits(struct praid_dev *dev);
+void praid_discard(struct praid_dev *dev, struct bio *bio);
+
+#endif
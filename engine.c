@@ -0,0 +1,226 @@
+#include <linux/bio.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/raid/xor.h>
+#include <linux/async_tx.h>
+
+#include "praid.h"
+#include "pciedrv.h"
+#include "block.h"
+#include "engine.h"
+
+/*
+ * 校验计算引擎。校验更新、整条带的校验和降级重建都交给阵列加载时选择的引擎：
+ * pciev 由虚拟加速设备计算；async 使用内核的 async_tx 接口，有支持异或的 dma 通道时由通道计算，
+ * 否则在 cpu 上同步计算；cpu 在提交的线程中直接用内核的异或例程计算。
+ * async 和 cpu 的校验更新由主机读改写校验盘。校验日志由设备合并，只能和 pciev 一起使用
+ */
+
+// 读写校验盘上 sector 处 len 字节
+static int praid_engine_parity_io(struct praid_dev *dev, sector_t sector, void *buf, unsigned int len, unsigned int op) {
+    struct bio *bio = bio_alloc(GFP_NOIO, praid_bio_buffer_segs(buf, len));
+    int ret;
+
+    if(!bio) {
+        return -ENOMEM;
+    }
+    bio_set_dev(bio, praid_parity_member(dev)->bdev);
+    bio->bi_iter.bi_sector = sector;
+    bio_set_op_attrs(bio, op, 0);
+
+    ret = praid_bio_add_buffer(bio, buf, len) ? submit_bio_wait(bio) : -EIO;
+    bio_put(bio);
+    return ret;
+}
+
+// 读出 d 的校验范围，由 xor 异或上各任务的差值后写回
+static int praid_engine_rmw(struct praid_dev *dev, struct praid_engine_delta *d, void (*xor)(struct praid_engine_delta *d, uint8_t *parity)) {
+    unsigned int noio;
+    void *parity;
+    int ret;
+
+    // 大的更新可能退回到 vmalloc，kvmalloc 只接受 GFP_KERNEL，用作用域限制为 noio
+    noio = memalloc_noio_save();
+    parity = kvmalloc_node(d->size, GFP_KERNEL, dev->config.node);
+    memalloc_noio_restore(noio);
+    if(!parity) {
+        return -ENOMEM;
+    }
+
+    ret = praid_engine_parity_io(dev, d->sector, parity, d->size, REQ_OP_READ);
+    if(!ret) {
+        xor(d, parity);
+        ret = praid_engine_parity_io(dev, d->sector, parity, d->size, REQ_OP_WRITE);
+    }
+
+    kvfree(parity);
+    return ret;
+}
+
+static void praid_cpu_delta_xor(struct praid_engine_delta *d, uint8_t *parity) {
+    struct verify_task *t;
+    uint64_t sta, end;
+    unsigned int nr;
+    void *srcs[2];
+
+    list_for_each_entry(t, d->tasks, list) {
+        if(!verify_task_overlap(t, d->offset, d->size, &sta, &end)) {
+            continue;
+        }
+        nr = 0;
+        if(!t->zero) {
+            srcs[nr ++] = (uint8_t*)t->buf + (sta - t->offset);
+        }
+        srcs[nr ++] = verify_task_new(t) + (sta - t->offset);
+        xor_blocks(nr, end - sta, parity + (sta - d->offset), srcs);
+    }
+}
+
+// 主机读改写校验，cpu 引擎和混合计算中由主机进行的更新都使用
+int praid_engine_host_delta(struct praid_dev *dev, struct praid_engine_delta *d) {
+    return praid_engine_rmw(dev, d, praid_cpu_delta_xor);
+}
+
+static void praid_cpu_delta(struct praid_dev *dev, struct praid_engine_delta *d) {
+    d->done(d, praid_engine_host_delta(dev, d));
+}
+
+// 逐页计算，每次最多异或 MAX_XOR_BLOCKS 个源。页都来自 GFP_KERNEL 或 GFP_NOIO，在线性映射中
+static int praid_cpu_stripe(struct praid_dev *dev, struct page **pages, unsigned int nr_src, unsigned int nr_pages, unsigned int offset, unsigned int len) {
+    void *srcs[MAX_XOR_BLOCKS];
+    unsigned int i, j, k, nr, size;
+    void *dst;
+
+    for(k = 0; k * PAGE_SIZE < len; k ++) {
+        size = min_t(unsigned int, PAGE_SIZE, len - k * PAGE_SIZE);
+        dst = page_address(pages[nr_src * nr_pages + k]);
+        memcpy(dst, page_address(pages[k]), size);
+        for(i = 1; i < nr_src; i += nr) {
+            nr = min_t(unsigned int, nr_src - i, MAX_XOR_BLOCKS);
+            for(j = 0; j < nr; j ++) {
+                srcs[j] = page_address(pages[(i + j) * nr_pages + k]);
+            }
+            xor_blocks(nr, size, dst, srcs);
+        }
+    }
+
+    return 0;
+}
+
+static const struct praid_engine_ops praid_cpu_engine = {
+    .name = "cpu",
+    .delta = praid_cpu_delta,
+    .stripe = praid_cpu_stripe,
+    .reconstruct = praid_cpu_stripe,
+};
+
+#if IS_ENABLED(CONFIG_ASYNC_XOR)
+static struct page *praid_async_page(void *buf) {
+    return is_vmalloc_addr(buf) ? vmalloc_to_page(buf) : virt_to_page(buf);
+}
+
+/*
+ * 在 async_tx 上按段链接异或，每段不跨越任何一个缓冲区的页边界。校验页既是目的也是第一个源，
+ * 用 ASYNC_TX_XOR_DROP_DST。没有 dma 通道时 async_tx 同步计算并把源数组改写为地址，每段重新填写
+ */
+static void praid_async_delta_xor(struct praid_engine_delta *d, uint8_t *parity) {
+    struct dma_async_tx_descriptor *tx = NULL;
+    struct async_submit_ctl submit;
+    struct verify_task *t;
+    struct page *srcs[3];
+    unsigned int offs[3];
+    uint8_t *bufs[3];
+    uint64_t sta, end, pos, len;
+    unsigned int i, nr;
+
+    list_for_each_entry(t, d->tasks, list) {
+        if(!verify_task_overlap(t, d->offset, d->size, &sta, &end)) {
+            continue;
+        }
+        for(pos = sta; pos < end; pos += len) {
+            nr = 0;
+            bufs[nr ++] = parity + (pos - d->offset);
+            if(!t->zero) {
+                bufs[nr ++] = (uint8_t*)t->buf + (pos - t->offset);
+            }
+            bufs[nr ++] = verify_task_new(t) + (pos - t->offset);
+
+            len = end - pos;
+            for(i = 0; i < nr; i ++) {
+                len = min_t(uint64_t, len, PAGE_SIZE - offset_in_page(bufs[i]));
+                srcs[i] = praid_async_page(bufs[i]);
+                offs[i] = offset_in_page(bufs[i]);
+            }
+
+            init_async_submit(&submit, ASYNC_TX_XOR_DROP_DST, tx, NULL, NULL, NULL);
+            tx = async_xor_offs(srcs[0], offs[0], srcs, offs, nr, len, &submit);
+        }
+    }
+
+    async_tx_issue_pending(tx);
+    async_tx_quiesce(&tx);
+}
+
+static void praid_async_delta(struct praid_dev *dev, struct praid_engine_delta *d) {
+    d->done(d, praid_engine_rmw(dev, d, praid_async_delta_xor));
+}
+
+static int praid_async_stripe(struct praid_dev *dev, struct page **pages, unsigned int nr_src, unsigned int nr_pages, unsigned int offset, unsigned int len) {
+    struct dma_async_tx_descriptor *tx = NULL;
+    struct async_submit_ctl submit;
+    unsigned int i, k, size;
+    struct page **srcs;
+
+    srcs = kmalloc_array(nr_src, sizeof(*srcs), GFP_NOIO);
+    if(!srcs) {
+        return -ENOMEM;
+    }
+
+    for(k = 0; k * PAGE_SIZE < len; k ++) {
+        size = min_t(unsigned int, PAGE_SIZE, len - k * PAGE_SIZE);
+        for(i = 0; i < nr_src; i ++) {
+            srcs[i] = pages[i * nr_pages + k];
+        }
+        init_async_submit(&submit, ASYNC_TX_XOR_ZERO_DST, tx, NULL, NULL, NULL);
+        tx = async_xor(pages[nr_src * nr_pages + k], srcs, 0, nr_src, size, &submit);
+    }
+
+    async_tx_issue_pending(tx);
+    async_tx_quiesce(&tx);
+    kfree(srcs);
+
+    return 0;
+}
+
+static const struct praid_engine_ops praid_async_engine = {
+    .name = "async",
+    .delta = praid_async_delta,
+    .stripe = praid_async_stripe,
+    .reconstruct = praid_async_stripe,
+};
+#endif
+
+static const struct praid_engine_ops *praid_engines[] = {
+    &pcievdrv_engine,
+#if IS_ENABLED(CONFIG_ASYNC_XOR)
+    &praid_async_engine,
+#endif
+    &praid_cpu_engine,
+};
+
+// 按名字查找引擎，未指定时使用设备。没有该引擎时返回 NULL
+const struct praid_engine_ops *praid_engine_find(const char *name) {
+    unsigned int i;
+
+    if(!name || !*name) {
+        name = PRAID_ENGINE_DEFAULT;
+    }
+
+    for(i = 0; i < ARRAY_SIZE(praid_engines); i ++) {
+        if(sysfs_streq(name, praid_engines[i]->name)) {
+            return praid_engines[i];
+        }
+    }
+
+    return NULL;
+}
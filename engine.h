@@ -0,0 +1,43 @@
+#ifndef __PRAID_ENGINE_H__
+#define __PRAID_ENGINE_H__
+
+#include <linux/list.h>
+#include <linux/mm_types.h>
+
+#include "praid.h"
+
+#define PRAID_ENGINE_DEFAULT "pciev"
+
+/*
+ * 一次校验更新：把 tasks 中各 verify_task 和 chunk 内 [offset, offset + size) 重叠部分的差值
+ * 合并到校验盘 sector 处的校验中。tasks 在校验盘上首尾相接
+ */
+struct praid_engine_delta {
+    struct list_head *tasks;
+    sector_t sector;    // 校验盘扇区，对应 chunk 内的 offset
+    uint64_t offset;
+    uint64_t size;
+    void (*done)(struct praid_engine_delta *d, int err); // 完成回调，可能在中断上下文或 delta 返回前调用
+};
+
+/*
+ * 校验计算引擎，加载时按名字选择，同一个阵列的所有校验计算都交给它
+ */
+struct praid_engine_ops {
+    const char *name;
+    // 提交一次校验更新，在可睡眠的上下文中调用，同一时间只有一个
+    void (*delta)(struct praid_dev *dev, struct praid_engine_delta *d);
+    /*
+     * 整条带的校验和降级时的重建：计算 nr_src 组数据的异或，每组 nr_pages 个页，数据位于页内 [0, len)，
+     * 结果写入第 nr_src 组页中。offset 为数据在 chunk 内的偏移。同步完成，需要在可睡眠的上下文中调用
+     */
+    int (*stripe)(struct praid_dev *dev, struct page **pages, unsigned int nr_src, unsigned int nr_pages, unsigned int offset, unsigned int len);
+    int (*reconstruct)(struct praid_dev *dev, struct page **pages, unsigned int nr_src, unsigned int nr_pages, unsigned int offset, unsigned int len);
+};
+
+extern const struct praid_engine_ops pcievdrv_engine;
+
+const struct praid_engine_ops *praid_engine_find(const char *name);
+int praid_engine_host_delta(struct praid_dev *dev, struct praid_engine_delta *d);
+
+#endif
@@ -0,0 +1,185 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+
+#include "praid.h"
+#include "block.h"
+#include "flush.h"
+
+/*
+ * flush 和 FUA。写入在数据盘完成时即向上层返回，校验由之后的校验更新任务写入，所以刷新时
+ * 先等待已排队的校验更新完成，再并行刷新所有成员盘(包括校验盘)的缓存。
+ *
+ * REQ_PREFLUSH 的 bio 在刷新之后才下发数据；REQ_FUA 的 bio 去掉该标志正常写入，完成后再等待
+ * 一轮刷新才向上层返回。等待刷新的 bio 放入 pending，由 work 一轮刷新后一起处理，刷新中到达的
+ * bio 等待下一轮，并发的 fsync 只产生一轮成员盘的 flush。
+ *
+ * 开启写回缓存时由缓存的刷写线程在脏行刷写之后处理，见 cache.c
+ */
+
+static void praid_flush_endio(struct bio *bio) {
+    complete(bio->bi_private);
+}
+
+// 等待已排队的校验更新完成，然后并行刷新所有在用成员盘的缓存，需要在可睡眠的上下文中调用
+int praid_flush_members(struct praid_dev *dev) {
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct praid_member *member;
+    struct bio *parent, *bio;
+    unsigned int i;
+    int ret;
+
+    flush_workqueue(dev->workqueue);
+    // 最后一个校验更新在设备完成后才释放 sem
+    down(&dev->sem);
+    up(&dev->sem);
+
+    parent = bio_alloc(GFP_NOIO, 0);
+    parent->bi_private = &done;
+    parent->bi_end_io = praid_flush_endio;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        member = &dev->members[i];
+        if(praid_member_faulty(member) && !test_bit(PRAID_MEMBER_REBUILDING, &member->flags)) {
+            continue;
+        }
+
+        bio = bio_alloc(GFP_NOIO, 0);
+        bio_set_dev(bio, READ_ONCE(member->bdev));
+        bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+        bio_chain(bio, parent);
+        submit_bio(bio);
+    }
+
+    bio_endio(parent);
+    wait_for_completion_io(&done);
+    ret = blk_status_to_errno(parent->bi_status);
+    bio_put(parent);
+
+    atomic64_inc(&dev->flush.flushes);
+
+    return ret;
+}
+
+static void praid_flush_work(struct work_struct *work) {
+    struct praid_dev *dev = container_of(work, struct praid_dev, flush.work);
+    struct praid_flush *f = &dev->flush;
+    struct bio_list list;
+    struct bio *bio;
+    int ret;
+
+    spin_lock_irq(&f->lock);
+    bio_list_init(&list);
+    bio_list_merge(&list, &f->pending);
+    bio_list_init(&f->pending);
+    spin_unlock_irq(&f->lock);
+
+    if(bio_list_empty(&list)) {
+        return;
+    }
+
+    ret = praid_flush_members(dev);
+
+    while((bio = bio_list_pop(&list))) {
+        if(ret) {
+            bio->bi_status = errno_to_blk_status(ret);
+            bio_endio(bio);
+            continue;
+        }
+
+        // REQ_PREFLUSH 的数据在刷新之后下发，REQ_FUA 的数据已经写入
+        if(bio->bi_opf & REQ_PREFLUSH) {
+            bio->bi_opf &= ~REQ_PREFLUSH;
+            if(bio_sectors(bio)) {
+                submit_bio_noacct(bio);
+                continue;
+            }
+        }
+        bio_endio(bio);
+    }
+}
+
+// 也在完成回调中调用
+static void praid_flush_queue(struct praid_dev *dev, struct bio *bio) {
+    struct praid_flush *f = &dev->flush;
+    unsigned long flags;
+
+    spin_lock_irqsave(&f->lock, flags);
+    bio_list_add(&f->pending, bio);
+    spin_unlock_irqrestore(&f->lock, flags);
+
+    queue_work(f->wq, &f->work);
+}
+
+// FUA 的数据写入完成后等待一轮刷新，再结束原 bio
+static void praid_flush_fua_endio(struct bio *clone) {
+    struct bio *bio = clone->bi_private;
+
+    if(clone->bi_status) {
+        bio->bi_status = clone->bi_status;
+        bio_put(clone);
+        bio_endio(bio);
+        return;
+    }
+
+    bio_put(clone);
+    praid_flush_queue(bio->bi_bdev->bd_disk->private_data, bio);
+}
+
+/*
+ * 提交路径中调用，bio 带 REQ_PREFLUSH 或者是带 REQ_FUA 的写入时接管 bio 并返回 true
+ */
+bool praid_flush_submit(struct praid_dev *dev, struct bio *bio) {
+    struct bio *clone;
+
+    if(bio->bi_opf & REQ_PREFLUSH) {
+        atomic64_inc(&dev->flush.requests);
+        praid_flush_queue(dev, bio);
+        return true;
+    }
+
+    if(!(bio->bi_opf & REQ_FUA) || !bio_sectors(bio)) {
+        return false;
+    }
+
+    clone = bio_clone_fast(bio, GFP_NOIO, &dev->flush.bio_set);
+    if(!clone) {
+        return false;
+    }
+    clone->bi_opf &= ~REQ_FUA;
+    clone->bi_private = bio;
+    clone->bi_end_io = praid_flush_fua_endio;
+
+    atomic64_inc(&dev->flush.requests);
+    submit_bio_noacct(clone);
+
+    return true;
+}
+
+int praid_flush_init(struct praid_dev *dev) {
+    struct praid_flush *f = &dev->flush;
+    int ret;
+
+    spin_lock_init(&f->lock);
+    bio_list_init(&f->pending);
+    INIT_WORK(&f->work, praid_flush_work);
+
+    // 克隆随后在提交路径中从 dev->bio_set 拆分，从同一个 mempool 嵌套分配可能死锁
+    ret = bioset_init(&f->bio_set, BIO_POOL_SIZE, 0, 0);
+    if(ret) {
+        return ret;
+    }
+
+    f->wq = alloc_workqueue("praid%d_flush", WQ_MEM_RECLAIM, 1, dev->id);
+    if(!f->wq) {
+        bioset_exit(&f->bio_set);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// 块设备删除之后调用，等待中的刷新全部完成
+void praid_flush_exit(struct praid_dev *dev) {
+    destroy_workqueue(dev->flush.wq);
+    bioset_exit(&dev->flush.bio_set);
+}
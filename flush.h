@@ -0,0 +1,14 @@
+#ifndef __PRAID_FLUSH_H__
+#define __PRAID_FLUSH_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+int praid_flush_members(struct praid_dev *dev);
+bool praid_flush_submit(struct praid_dev *dev, struct bio *bio);
+
+int praid_flush_init(struct praid_dev *dev);
+void praid_flush_exit(struct praid_dev *dev);
+
+#endif
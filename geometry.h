@@ -0,0 +1,90 @@
+#ifndef __PRAID_GEOMETRY_H__
+#define __PRAID_GEOMETRY_H__
+
+#include <linux/types.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/reciprocal_div.h>
+
+/*
+ * 条带几何参数。chunk 大小在加载时确定，所有的移位、掩码和除数的倒数在
+ * 初始化时预先算好，映射路径上不再出现 '/' 和 '%'。
+ *
+ * 阵列扇区 -> chunk 号 -> (条带号, 数据盘号)，盘内扇区 = 条带号 * chunk 扇区数 + chunk 内偏移
+ */
+struct praid_geo {
+    unsigned int chunk_shift;           // log2(chunk 字节数)
+    unsigned int chunk_size;            // chunk 字节数
+    unsigned int chunk_sectors_shift;   // log2(chunk 扇区数)
+    sector_t chunk_sectors;
+    sector_t chunk_mask;                // chunk 内扇区偏移的掩码
+
+    unsigned int data_disks;
+    bool data_disks_pow2;
+    unsigned int data_disks_shift;      // data_disks 为 2 的幂时有效
+    struct reciprocal_value data_disks_recip;
+};
+
+static inline void praid_geo_init(struct praid_geo *geo, unsigned int chunk_size, unsigned int data_disks) {
+    geo->chunk_shift = ilog2(chunk_size);
+    geo->chunk_size = chunk_size;
+    geo->chunk_sectors_shift = geo->chunk_shift - SECTOR_SHIFT;
+    geo->chunk_sectors = (sector_t)1 << geo->chunk_sectors_shift;
+    geo->chunk_mask = geo->chunk_sectors - 1;
+
+    geo->data_disks = data_disks;
+    geo->data_disks_pow2 = is_power_of_2(data_disks);
+    geo->data_disks_shift = geo->data_disks_pow2 ? ilog2(data_disks) : 0;
+    geo->data_disks_recip = reciprocal_value(data_disks);
+}
+
+static inline uint64_t praid_geo_chunk(const struct praid_geo *geo, sector_t sector) {
+    return sector >> geo->chunk_sectors_shift;
+}
+
+static inline sector_t praid_geo_chunk_end(const struct praid_geo *geo, sector_t sector) {
+    return sector | geo->chunk_mask;
+}
+
+// chunk 号拆分为条带号和数据盘号，返回条带号
+static inline uint64_t praid_geo_split_chunk(const struct praid_geo *geo, uint64_t chunk, unsigned int *devi) {
+    uint64_t stripe;
+    uint32_t rem;
+
+    if (geo->data_disks_pow2) {
+        *devi = chunk & (geo->data_disks - 1);
+        return chunk >> geo->data_disks_shift;
+    }
+
+    if (likely(chunk <= U32_MAX)) {
+        stripe = reciprocal_divide((u32)chunk, geo->data_disks_recip);
+        *devi = (u32)chunk - (u32)stripe * geo->data_disks;
+        return stripe;
+    }
+
+    stripe = div_u64_rem(chunk, geo->data_disks, &rem);
+    *devi = rem;
+    return stripe;
+}
+
+static inline sector_t praid_geo_stripe_to_sector(const struct praid_geo *geo, uint64_t stripe) {
+    return (sector_t)stripe << geo->chunk_sectors_shift;
+}
+
+// 阵列扇区映射到数据盘号和盘内扇区
+static inline sector_t praid_geo_map(const struct praid_geo *geo, sector_t sector, unsigned int *devi) {
+    uint64_t stripe = praid_geo_split_chunk(geo, praid_geo_chunk(geo, sector), devi);
+
+    return praid_geo_stripe_to_sector(geo, stripe) | (sector & geo->chunk_mask);
+}
+
+// 盘内扇区和数据盘号映射回阵列扇区
+static inline sector_t praid_geo_unmap(const struct praid_geo *geo, sector_t member_sector, unsigned int devi) {
+    uint64_t stripe = member_sector >> geo->chunk_sectors_shift;
+    uint64_t chunk = stripe * geo->data_disks + devi;
+
+    return ((sector_t)chunk << geo->chunk_sectors_shift) | (member_sector & geo->chunk_mask);
+}
+
+#endif
@@ -0,0 +1,354 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "degraded.h"
+#include "iosched.h"
+#include "plog.h"
+#include "hedge.h"
+
+/*
+ * 对冲读。成员盘做垃圾回收时映射到它的读全部停顿，而同样的数据可以由其余成员盘和校验盘异或得到。
+ *
+ * 成员盘未完成的 io 不少于 PRAID_HEDGE_MIN_INFLIGHT 且超过其余成员盘最大值的 depth 倍时，读直接由
+ * 设备异或重建，不下发到该盘。开启 timeout_us 时成员盘的读先读到单独的页中，超时未完成就同时开始
+ * 重建，先完成的一方把数据拷贝到原 bio 并结束它，另一方的结果丢弃。
+ *
+ * 校验由校验更新任务异步写入，重建前等待所在条带上的校验更新完成，等待超时则放弃。
+ * 条带上还有未合并的校验日志时先合并。写入按条带号计入桶，重建开始时条带上有写入、
+ * 或者重建期间有新的写入开始，重建的结果不可信，放弃并等待成员盘的读取。
+ * 只在阵列没有降级、没有扩容时对冲，读取不能跨越 chunk
+ */
+
+/*
+ * 原 bio 结束后可能马上被释放，失败的一方不能再访问它，需要的字段预先保存
+ */
+struct praid_hedge_req {
+    struct bio *bio;        // 成员盘 bio，由先完成的一方结束
+    struct bio *read;       // 读到单独页中的成员盘 bio，直接重建时为 NULL
+    struct praid_member *member;
+    sector_t sector;
+    unsigned int size;
+    int bucket;
+    struct hrtimer timer;
+    struct work_struct work;
+    atomic_t done;
+    refcount_t ref;
+    unsigned int nr_pages;
+    struct page *pages[];
+};
+
+// 成员盘 bio 所在条带的桶，跨越多个条带的 bio 计入最后一个桶
+static int praid_hedge_bucket(struct praid_dev *dev, struct bio *bio) {
+    unsigned int shift = dev->geo.chunk_sectors_shift;
+    sector_t stripe = bio->bi_iter.bi_sector >> shift;
+
+    if(stripe != (bio_end_sector(bio) - 1) >> shift) {
+        return PRAID_HEDGE_BUCKETS;
+    }
+    return stripe & (PRAID_HEDGE_BUCKETS - 1);
+}
+
+// 成员盘的写 bio 下发前调用，零区域表和位图重新下发的 bio 已经计入
+void praid_hedge_start_write(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_hedge *h = &pbio->member->dev->hedge;
+
+    if(pbio->hedge >= 0) {
+        return;
+    }
+
+    pbio->hedge = praid_hedge_bucket(pbio->member->dev, bio);
+    atomic_inc(&h->writes[pbio->hedge]);
+    atomic_inc(&h->gen[pbio->hedge]);
+    smp_mb__after_atomic();
+}
+
+void praid_hedge_end_write(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    if(pbio->hedge < 0) {
+        return;
+    }
+    atomic_dec(&pbio->member->dev->hedge.writes[pbio->hedge]);
+    pbio->hedge = -1;
+}
+
+// 成员盘读时延的滑动平均，权重 1/8，在完成回调中调用
+void praid_hedge_update_latency(struct praid_member *member, u64 ns) {
+    u64 avg = READ_ONCE(member->read_lat_ns);
+
+    WRITE_ONCE(member->read_lat_ns, avg ? avg - (avg >> 3) + (ns >> 3) : ns);
+}
+
+static void praid_hedge_put(struct praid_hedge_req *req) {
+    unsigned int i;
+
+    if(!refcount_dec_and_test(&req->ref)) {
+        return;
+    }
+
+    for(i = 0; i < req->nr_pages; i ++) {
+        if(req->pages[i]) {
+            __free_page(req->pages[i]);
+        }
+    }
+    if(req->read) {
+        bio_put(req->read);
+    }
+    kfree(req);
+}
+
+// 先完成的一方返回 true，由它结束原 bio
+static bool praid_hedge_win(struct praid_hedge_req *req) {
+    return atomic_cmpxchg(&req->done, 0, 1) == 0;
+}
+
+// 单独页中的数据拷贝到原 bio
+static void praid_hedge_copy(struct praid_hedge_req *req, struct bio *bio) {
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    size_t done = 0, bv_done, pos, size;
+    uint8_t *data, *buf;
+
+    praid_bio_for_each_data(bvec, bio, iter) {
+        data = bvec_kmap_local(&bvec);
+        for(bv_done = 0; bv_done < bvec.bv_len; bv_done += size, done += size) {
+            pos = offset_in_page(done);
+            size = min_t(size_t, bvec.bv_len - bv_done, PAGE_SIZE - pos);
+            buf = kmap_local_page(req->pages[done >> PAGE_SHIFT]);
+            memcpy(data + bv_done, buf + pos, size);
+            kunmap_local(buf);
+        }
+        kunmap_local(data);
+    }
+}
+
+// 由其余成员盘和校验重建原 bio 的数据
+static void praid_hedge_work(struct work_struct *work) {
+    struct praid_hedge_req *req = container_of(work, struct praid_hedge_req, work);
+    struct bio *bio = req->bio;
+    struct praid_member *member = req->member;
+    struct praid_dev *dev = member->dev;
+    struct praid_hedge *h = &dev->hedge;
+    int b = req->bucket, ret = -EAGAIN;
+    struct praid_xor_req *xreq;
+    struct blk_plug plug;
+    unsigned int i, idx = 0, gen, wide;
+
+    // 成员盘已经先完成
+    if(atomic_read(&req->done)) {
+        goto out;
+    }
+
+    gen = atomic_read(&h->gen[b]);
+    wide = atomic_read(&h->gen[PRAID_HEDGE_BUCKETS]);
+    smp_rmb();
+    if(atomic_read(&h->writes[b]) || atomic_read(&h->writes[PRAID_HEDGE_BUCKETS])) {
+        goto abort;
+    }
+
+    // 已完成的写入对应的校验更新在结束前都计入条带，只等待本条带上的更新写入校验
+    if(praid_stripe_pending(dev, req->sector) &&
+       !wait_event_timeout(dev->stripe.wait, !praid_stripe_pending(dev, req->sector), msecs_to_jiffies(PRAID_HEDGE_WAIT_MS))) {
+        goto abort;
+    }
+    if(praid_plog_pending(dev, req->sector)) {
+        praid_plog_drain(dev);
+    }
+
+    xreq = praid_xor_req_alloc(dev, req->sector, req->size, dev->disk_cnt);
+    if(!xreq) {
+        goto abort;
+    }
+    xreq->ioq = PRAID_IOQ_READ;
+
+    blk_start_plug(&plug);
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        if(i != member->index) {
+            praid_xor_req_submit(xreq, idx ++, &dev->members[i], REQ_OP_READ);
+        }
+    }
+    blk_finish_plug(&plug);
+
+    ret = praid_xor_req_wait(xreq);
+    if(!ret) {
+        ret = praid_xor_req_compute(xreq);
+    }
+    smp_rmb();
+    if(!ret && (atomic_read(&h->gen[b]) != gen || atomic_read(&h->gen[PRAID_HEDGE_BUCKETS]) != wide)) {
+        ret = -EAGAIN;
+    }
+
+    if(!ret && praid_hedge_win(req)) {
+        praid_xor_req_copy_bio(xreq, xreq->nr_src, bio, true);
+        atomic64_inc(&h->wins);
+        praid_member_endio(bio);
+    }
+    praid_xor_req_free(xreq);
+
+    if(!ret) {
+        goto out;
+    }
+
+abort:
+    atomic64_inc(&h->aborts);
+    // 直接重建的读改为下发到成员盘，对冲的读等待成员盘完成
+    if(!req->read && praid_hedge_win(req)) {
+        praid_member_dispatch(bio);
+    }
+
+out:
+    praid_hedge_put(req);
+}
+
+static enum hrtimer_restart praid_hedge_timer(struct hrtimer *timer) {
+    struct praid_hedge_req *req = container_of(timer, struct praid_hedge_req, timer);
+    struct praid_dev *dev = req->member->dev;
+
+    atomic64_inc(&dev->hedge.timeouts);
+    queue_work(dev->recovery_wq, &req->work);
+
+    return HRTIMER_NORESTART;
+}
+
+static void praid_hedge_read_endio(struct bio *read) {
+    struct praid_hedge_req *req = read->bi_private;
+    struct bio *bio = req->bio;
+
+    praid_ioq_done(req->member);
+
+    // 定时器没有触发时由这里释放它的引用
+    if(hrtimer_try_to_cancel(&req->timer) == 1) {
+        praid_hedge_put(req);
+    }
+
+    // 出错时按普通读的错误处理，由降级路径重建
+    if(praid_hedge_win(req)) {
+        if(read->bi_status) {
+            bio->bi_status = read->bi_status;
+        } else {
+            praid_hedge_copy(req, bio);
+        }
+        praid_member_endio(bio);
+    }
+
+    praid_hedge_put(req);
+}
+
+// 其余成员盘(包括校验盘)中未完成 io 最多的不到 member 的 1/depth 时认为 member 繁忙
+static bool praid_hedge_busy(struct praid_dev *dev, struct praid_member *member, unsigned int depth) {
+    int inflight = atomic_read(&member->inflight), peak = 0;
+    unsigned int i;
+
+    if(!depth || inflight < PRAID_HEDGE_MIN_INFLIGHT) {
+        return false;
+    }
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        if(i != member->index) {
+            peak = max(peak, atomic_read(&dev->members[i].inflight));
+        }
+    }
+
+    return inflight > (int)depth * peak;
+}
+
+static struct praid_hedge_req *praid_hedge_req_alloc(struct bio *bio, unsigned int nr_pages, unsigned int ref) {
+    struct praid_hedge_req *req;
+
+    req = kzalloc(struct_size(req, pages, nr_pages), GFP_NOIO);
+    if(!req) {
+        return NULL;
+    }
+
+    req->bio = bio;
+    req->member = container_of(bio, struct praid_bio, bio)->member;
+    req->sector = bio->bi_iter.bi_sector;
+    req->size = bio->bi_iter.bi_size;
+    req->bucket = praid_hedge_bucket(req->member->dev, bio);
+    req->nr_pages = nr_pages;
+    atomic_set(&req->done, 0);
+    refcount_set(&req->ref, ref);
+    INIT_WORK(&req->work, praid_hedge_work);
+
+    return req;
+}
+
+/*
+ * 数据盘的读 bio 下发前调用。直接重建或者开始对冲时接管 bio 并返回 true，
+ * 之后 bio 由 praid_member_endio 结束
+ */
+bool praid_hedge_read(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_member *member = pbio->member;
+    struct praid_dev *dev = member->dev;
+    struct praid_hedge *h = &dev->hedge;
+    unsigned int timeout = READ_ONCE(h->timeout_us), nr_pages, i, size;
+    struct praid_hedge_req *req;
+    struct bio *read;
+
+    if((!timeout && !READ_ONCE(h->depth)) || member->index >= dev->disk_cnt ||
+       praid_degraded(dev) || READ_ONCE(dev->reshape.active)) {
+        return false;
+    }
+
+    // 设备按 chunk 异或
+    if((bio->bi_iter.bi_sector & dev->geo.chunk_mask) + bio_sectors(bio) > dev->geo.chunk_sectors) {
+        return false;
+    }
+
+    if(praid_hedge_busy(dev, member, READ_ONCE(h->depth))) {
+        req = praid_hedge_req_alloc(bio, 0, 1);
+        if(!req) {
+            return false;
+        }
+        atomic64_inc(&h->busy);
+        queue_work(dev->recovery_wq, &req->work);
+        return true;
+    }
+
+    if(!timeout) {
+        return false;
+    }
+
+    nr_pages = DIV_ROUND_UP(bio->bi_iter.bi_size, PAGE_SIZE);
+    req = praid_hedge_req_alloc(bio, nr_pages, 1);
+    if(!req) {
+        return false;
+    }
+
+    read = bio_alloc(GFP_NOIO, nr_pages);
+    bio_set_dev(read, member->bdev);
+    read->bi_iter.bi_sector = bio->bi_iter.bi_sector;
+    read->bi_opf = bio->bi_opf;
+    read->bi_ioprio = bio->bi_ioprio;
+    req->read = read;
+
+    for(i = 0; i < nr_pages; i ++) {
+        req->pages[i] = alloc_page(GFP_NOIO);
+        if(!req->pages[i]) {
+            praid_hedge_put(req);
+            return false;
+        }
+        size = min_t(unsigned int, PAGE_SIZE, bio->bi_iter.bi_size - i * PAGE_SIZE);
+        bio_add_page(read, req->pages[i], size, 0);
+    }
+    read->bi_private = req;
+    read->bi_end_io = praid_hedge_read_endio;
+
+    // 定时器和成员盘的读各持有一个引用
+    refcount_inc(&req->ref);
+    hrtimer_init(&req->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    req->timer.function = praid_hedge_timer;
+    hrtimer_start(&req->timer, us_to_ktime(timeout), HRTIMER_MODE_REL);
+
+    praid_ioq_submit(member, read, PRAID_IOQ_READ);
+
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef __PRAID_HEDGE_H__
+#define __PRAID_HEDGE_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_HEDGE_TIMEOUT_MAX 1000000 // us
+#define PRAID_HEDGE_DEPTH_MAX 64
+#define PRAID_HEDGE_MIN_INFLIGHT 8      // 未完成的 io 少于该值时不认为成员盘繁忙
+#define PRAID_HEDGE_WAIT_MS 10          // 等待条带上的校验更新完成的上限，超过时放弃重建
+
+void praid_hedge_start_write(struct bio *bio);
+void praid_hedge_end_write(struct bio *bio);
+void praid_hedge_update_latency(struct praid_member *member, u64 ns);
+bool praid_hedge_read(struct bio *bio);
+
+#endif
@@ -0,0 +1,97 @@
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "praid.h"
+#include "hybrid.h"
+
+/*
+ * 主机和设备混合计算校验更新。所有校验更新默认交给设备，设备按顺序逐个处理，写入多时更新在
+ * verify_list 上排队。交给设备还未完成的更新不少于 depth，或者设备从排队到完成的时延超过 lat_us 时，
+ * 新的更新改由主机在提交它的 cpu 上读改写校验，和设备并行进行。
+ *
+ * 差值的异或可以交换顺序，同一段校验只需要保证读改写不交错。更新按校验盘 chunk 计入桶：
+ * 桶中有交给设备的更新或者主机正在更新时，新的更新交给设备；设备处理一组更新前等待桶中主机的更新结束。
+ * 校验日志会在任意时刻由设备合并到校验中，开启时不由主机计算；降级时也不由主机计算
+ */
+
+static unsigned int praid_hybrid_bucket(struct praid_dev *dev, sector_t sector) {
+    return (sector >> dev->geo.chunk_sectors_shift) % PRAID_HYBRID_BUCKETS;
+}
+
+static bool praid_hybrid_busy(struct praid_hybrid *h) {
+    unsigned int depth = READ_ONCE(h->depth), lat_us = READ_ONCE(h->lat_us);
+
+    return h->queued && ((depth && h->queued >= depth) || (lat_us && h->lat_ns > (u64)lat_us * NSEC_PER_USEC));
+}
+
+/*
+ * 校验更新排队前调用，返回 true 时由主机计算，完成后调用 praid_hybrid_host_end；
+ * 否则交给设备，完成后调用 praid_hybrid_device_end
+ */
+bool praid_hybrid_start(struct praid_dev *dev, sector_t sector) {
+    struct praid_hybrid *h = &dev->hybrid;
+    unsigned int b = praid_hybrid_bucket(dev, sector);
+    bool host;
+
+    spin_lock(&h->lock);
+    host = praid_hybrid_busy(h) && !h->dev_pending[b] && !h->host_active[b] &&
+           !READ_ONCE(dev->plog.enabled) && !praid_degraded(dev);
+    if(host) {
+        h->host_active[b] ++;
+    } else {
+        h->dev_pending[b] ++;
+        h->queued ++;
+    }
+    spin_unlock(&h->lock);
+
+    return host;
+}
+
+void praid_hybrid_host_end(struct praid_dev *dev, sector_t sector, u64 ns) {
+    struct praid_hybrid *h = &dev->hybrid;
+    unsigned int b = praid_hybrid_bucket(dev, sector);
+
+    spin_lock(&h->lock);
+    h->host_active[b] --;
+    spin_unlock(&h->lock);
+
+    atomic64_inc(&h->host);
+    atomic64_add(ns, &h->host_ns);
+    wake_up_all(&h->wait);
+}
+
+// ns 为设备上的更新从排队到完成的时延
+void praid_hybrid_device_end(struct praid_dev *dev, sector_t sector, u64 ns) {
+    struct praid_hybrid *h = &dev->hybrid;
+    unsigned int b = praid_hybrid_bucket(dev, sector);
+
+    spin_lock(&h->lock);
+    h->dev_pending[b] --;
+    h->queued --;
+    h->lat_ns = h->lat_ns ? h->lat_ns - (h->lat_ns >> 3) + (ns >> 3) : ns;
+    spin_unlock(&h->lock);
+
+    atomic64_inc(&h->device);
+}
+
+static bool praid_hybrid_host_idle(struct praid_dev *dev, unsigned int b) {
+    bool idle;
+
+    spin_lock(&dev->hybrid.lock);
+    idle = !dev->hybrid.host_active[b];
+    spin_unlock(&dev->hybrid.lock);
+
+    return idle;
+}
+
+// 设备处理 sector 所在 chunk 的更新前调用，等待主机在该桶中的更新结束
+void praid_hybrid_wait(struct praid_dev *dev, sector_t sector) {
+    unsigned int b = praid_hybrid_bucket(dev, sector);
+
+    wait_event(dev->hybrid.wait, praid_hybrid_host_idle(dev, b));
+}
+
+void praid_hybrid_init(struct praid_dev *dev) {
+    spin_lock_init(&dev->hybrid.lock);
+    init_waitqueue_head(&dev->hybrid.wait);
+}
@@ -0,0 +1,16 @@
+#ifndef __PRAID_HYBRID_H__
+#define __PRAID_HYBRID_H__
+
+#include "praid.h"
+
+#define PRAID_HYBRID_DEPTH_MAX 4096
+#define PRAID_HYBRID_LAT_MAX 1000000 // us
+
+bool praid_hybrid_start(struct praid_dev *dev, sector_t sector);
+void praid_hybrid_host_end(struct praid_dev *dev, sector_t sector, u64 ns);
+void praid_hybrid_device_end(struct praid_dev *dev, sector_t sector, u64 ns);
+void praid_hybrid_wait(struct praid_dev *dev, sector_t sector);
+
+void praid_hybrid_init(struct praid_dev *dev);
+
+#endif
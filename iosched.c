@@ -0,0 +1,164 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/ioprio.h>
+
+#include "praid.h"
+#include "block.h"
+#include "iosched.h"
+
+/*
+ * 成员盘的 io 调度。发往成员盘的 io 按来源分为三个队列：前台读、前台写(包括读改写的旧数据读)、
+ * 后台(重建和扩容的读写、缓存和日志的写回)。bio 的 ioprio 为 RT 时按前台读处理，为 IDLE 时按后台处理。
+ *
+ * 每个成员盘同时下发的 io 不超过 depth，未满时直接下发，满了之后按类别排队，完成时由 work 按
+ * 权重轮询从各队列取出下发：有排队的队列按权重分配配额，都用完后重新分配。写入突发时读仍然
+ * 能按权重得到大部分的下发机会，不会排在所有写入和校验读改写之后。
+ *
+ * 校验盘上的校验更新由虚拟设备同步读写，不经过调度；降级写的校验写入和元数据的读写也直接下发
+ */
+
+static unsigned int praid_ioq_prio_class(struct bio *bio, unsigned int class) {
+    switch(IOPRIO_PRIO_CLASS(bio_prio(bio))) {
+    case IOPRIO_CLASS_RT:
+        return PRAID_IOQ_READ;
+    case IOPRIO_CLASS_IDLE:
+        return PRAID_IOQ_BG;
+    default:
+        return class;
+    }
+}
+
+// 调用者持有 ioq_lock
+static bool praid_ioq_has_room(struct praid_member *member) {
+    unsigned int depth = READ_ONCE(member->dev->iosched.depth);
+
+    return !depth || member->ioq_inflight < depth;
+}
+
+// 按权重轮询选出下一个下发的队列，调用者持有 ioq_lock
+static int praid_ioq_pick(struct praid_member *member) {
+    struct praid_iosched *s = &member->dev->iosched;
+    unsigned int pass, c;
+
+    for(pass = 0; pass < 2; pass ++) {
+        for(c = 0; c < PRAID_IOQ_NR; c ++) {
+            if(member->ioq_credit[c] && !bio_list_empty(&member->ioq[c])) {
+                member->ioq_credit[c] --;
+                return c;
+            }
+        }
+        // 有排队的队列配额都用完，重新分配
+        for(c = 0; c < PRAID_IOQ_NR; c ++) {
+            member->ioq_credit[c] = READ_ONCE(s->weights[c]);
+        }
+    }
+
+    return -1;
+}
+
+static void praid_ioq_work(struct work_struct *work) {
+    struct praid_member *member = container_of(work, struct praid_member, ioq_work);
+    struct blk_plug plug;
+    struct bio *bio;
+    int c;
+
+    blk_start_plug(&plug);
+    spin_lock_irq(&member->ioq_lock);
+    while(praid_ioq_has_room(member) && (c = praid_ioq_pick(member)) >= 0) {
+        bio = bio_list_pop(&member->ioq[c]);
+        member->ioq_inflight ++;
+        spin_unlock_irq(&member->ioq_lock);
+
+        submit_bio(bio);
+
+        spin_lock_irq(&member->ioq_lock);
+    }
+    spin_unlock_irq(&member->ioq_lock);
+    blk_finish_plug(&plug);
+}
+
+/*
+ * 下发成员盘的 bio，class 为 PRAID_IOQ_*。完成时调用者必须调用 praid_ioq_done。
+ * 可以在完成回调中调用，bio 排队时由 work 下发
+ */
+void praid_ioq_submit(struct praid_member *member, struct bio *bio, unsigned int class) {
+    unsigned long flags;
+
+    class = praid_ioq_prio_class(bio, class);
+
+    spin_lock_irqsave(&member->ioq_lock, flags);
+    // 同一队列中已有排队的 bio 时不能越过它们
+    if(bio_list_empty(&member->ioq[class]) && praid_ioq_has_room(member)) {
+        member->ioq_inflight ++;
+        spin_unlock_irqrestore(&member->ioq_lock, flags);
+        submit_bio(bio);
+        return;
+    }
+
+    bio_list_add(&member->ioq[class], bio);
+    spin_unlock_irqrestore(&member->ioq_lock, flags);
+
+    atomic64_inc(&member->dev->iosched.waits[class]);
+    queue_work(member->dev->iosched.wq, &member->ioq_work);
+}
+
+// 经 praid_ioq_submit 下发的 bio 完成时调用，在完成回调中调用
+void praid_ioq_done(struct praid_member *member) {
+    unsigned long flags;
+    bool kick = false;
+    unsigned int c;
+
+    spin_lock_irqsave(&member->ioq_lock, flags);
+    member->ioq_inflight --;
+    for(c = 0; c < PRAID_IOQ_NR; c ++) {
+        kick |= !bio_list_empty(&member->ioq[c]);
+    }
+    spin_unlock_irqrestore(&member->ioq_lock, flags);
+
+    if(kick) {
+        queue_work(member->dev->iosched.wq, &member->ioq_work);
+    }
+}
+
+// 调整 depth 或权重之后重新检查所有成员盘的队列
+void praid_ioq_kick(struct praid_dev *dev) {
+    unsigned int i;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        queue_work(dev->iosched.wq, &dev->members[i].ioq_work);
+    }
+}
+
+// 成员盘初始化和扩容移动成员盘时调用，此时成员盘上没有经调度的 io
+void praid_iosched_member_init(struct praid_member *member) {
+    unsigned int c;
+
+    spin_lock_init(&member->ioq_lock);
+    for(c = 0; c < PRAID_IOQ_NR; c ++) {
+        bio_list_init(&member->ioq[c]);
+        member->ioq_credit[c] = 0;
+    }
+    member->ioq_inflight = 0;
+    INIT_WORK(&member->ioq_work, praid_ioq_work);
+}
+
+int praid_iosched_init(struct praid_dev *dev) {
+    struct praid_iosched *s = &dev->iosched;
+
+    s->depth = PRAID_IOQ_DEPTH;
+    s->weights[PRAID_IOQ_READ] = PRAID_IOQ_WEIGHT_READ;
+    s->weights[PRAID_IOQ_WRITE] = PRAID_IOQ_WEIGHT_WRITE;
+    s->weights[PRAID_IOQ_BG] = PRAID_IOQ_WEIGHT_BG;
+
+    s->wq = alloc_workqueue("praid%d_ioq", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0, dev->id);
+    if(!s->wq) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// 所有成员盘的 io 结束之后调用
+void praid_iosched_exit(struct praid_dev *dev) {
+    destroy_workqueue(dev->iosched.wq);
+}
@@ -0,0 +1,23 @@
+#ifndef __PRAID_IOSCHED_H__
+#define __PRAID_IOSCHED_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_IOQ_DEPTH 64          // 每个成员盘同时下发的 io 上限的默认值
+#define PRAID_IOQ_DEPTH_MAX 4096
+#define PRAID_IOQ_WEIGHT_READ 8     // 各队列的默认轮询权重
+#define PRAID_IOQ_WEIGHT_WRITE 4
+#define PRAID_IOQ_WEIGHT_BG 1
+#define PRAID_IOQ_WEIGHT_MAX 64
+
+void praid_ioq_submit(struct praid_member *member, struct bio *bio, unsigned int class);
+void praid_ioq_done(struct praid_member *member);
+void praid_ioq_kick(struct praid_dev *dev);
+
+void praid_iosched_member_init(struct praid_member *member);
+int praid_iosched_init(struct praid_dev *dev);
+void praid_iosched_exit(struct praid_dev *dev);
+
+#endif
@@ -0,0 +1,602 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/crc32c.h>
+#include <linux/hash.h>
+#include <linux/io.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "praid.h"
+#include "block.h"
+#include "rebuild.h"
+#include "journal.h"
+
+/*
+ * 写日志，同 md 的 raid5-cache 写回模式。开启后写入的新数据先追加到保留内存中的记录环，
+ * 追加完成即向上层返回，写回线程按批把记录经正常的写路径(读旧数据、更新校验)写到成员盘，
+ * 写回和校验更新都完成后环尾前移。
+ *
+ * 崩溃后重新创建阵列时，从环尾按序号和 crc 扫描出未写回的记录并重新写回。记录对应的 chunk
+ * 可能只写了数据或只更新了校验，没有写意图位图时先由数据盘重新计算这些 chunk 的校验，
+ * 再写回记录，RAID4 的写洞由此消除。阵列降级时无法重新计算校验，和位图一样只能告警。
+ *
+ * 读取落在未写回的记录所在的 chunk 上时，先等待这些记录写回。
+ */
+
+#define PRAID_JOURNAL_HASH_BITS 10
+
+struct praid_journal_entry {
+    struct list_head list;
+    struct hlist_node node;
+    u64 key; // 成员盘和 chunk，见 praid_journal_key
+    u64 seq;
+    u64 pos, end; // 记录(含头部)在环中的逻辑位置
+    unsigned int member;
+    sector_t sector;
+    unsigned int len;
+
+    struct page **pages; // 写回时分配
+    unsigned int nr_pages;
+};
+
+static u64 praid_journal_key(struct praid_dev *dev, unsigned int member, sector_t sector) {
+    return ((u64)member << 56) | (sector >> dev->geo.chunk_sectors_shift);
+}
+
+static u64 praid_journal_ring_off(struct praid_journal *j, u64 pos) {
+    u64 off;
+
+    div64_u64_rem(pos, j->ring_size, &off);
+    return off;
+}
+
+static u64 praid_journal_free(struct praid_journal *j) {
+    return j->ring_size - (READ_ONCE(j->head) - READ_ONCE(j->tail));
+}
+
+static void praid_journal_kick(struct praid_journal *j, unsigned long delay) {
+    if(delay) {
+        queue_delayed_work(j->wq, &j->wb_work, delay);
+    } else {
+        mod_delayed_work(j->wq, &j->wb_work, 0);
+    }
+}
+
+static bool praid_journal_pending(struct praid_journal *j, u64 key) {
+    struct praid_journal_entry *e;
+    bool found = false;
+
+    spin_lock_irq(&j->lock);
+    hlist_for_each_entry(e, &j->hash[hash_64(key, PRAID_JOURNAL_HASH_BITS)], node) {
+        if(e->key == key) {
+            found = true;
+            break;
+        }
+    }
+    spin_unlock_irq(&j->lock);
+
+    return found;
+}
+
+static void praid_journal_add(struct praid_journal *j, struct praid_journal_entry *e) {
+    spin_lock_irq(&j->lock);
+    list_add_tail(&e->list, &j->entries);
+    hlist_add_head(&e->node, &j->hash[hash_64(e->key, PRAID_JOURNAL_HASH_BITS)]);
+    j->nr_entries ++;
+    spin_unlock_irq(&j->lock);
+}
+
+// 更新环尾的检查点，两份副本交替写入，gen 的写入是原子的
+static void praid_journal_commit_tail(struct praid_journal *j, u64 tail, u64 seq) {
+    u64 gen = le64_to_cpu(READ_ONCE(j->sb->gen)) + 1;
+
+    WRITE_ONCE(j->sb->tail[gen & 1].tail, cpu_to_le64(tail));
+    WRITE_ONCE(j->sb->tail[gen & 1].seq, cpu_to_le64(seq));
+    wmb();
+    WRITE_ONCE(j->sb->gen, cpu_to_le64(gen));
+    wmb();
+}
+
+/*
+ * 写入的 bio 已映射到成员盘，将其数据追加到日志中并结束 bio。环中空间不足时等待写回
+ */
+void praid_journal_write(struct praid_dev *dev, struct bio *bio) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_journal_entry *e;
+    struct praid_journal_rec *rec;
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    unsigned int len = bio->bi_iter.bi_size;
+    u64 need = PRAID_JOURNAL_HDR_SIZE + len, off, pad;
+    u32 crc = 0;
+    uint8_t *data, *dst;
+
+    e = mempool_alloc(j->entry_pool, GFP_NOIO);
+    memset(e, 0, sizeof(*e));
+    e->member = pbio->member->index;
+    e->sector = bio->bi_iter.bi_sector;
+    e->len = len;
+    e->key = praid_journal_key(dev, e->member, e->sector);
+
+    mutex_lock(&j->append_lock);
+    for(;;) {
+        off = praid_journal_ring_off(j, j->head);
+        pad = off + need > j->ring_size ? j->ring_size - off : 0;
+        if(praid_journal_free(j) >= pad + need) {
+            break;
+        }
+
+        mutex_unlock(&j->append_lock);
+        praid_journal_kick(j, 0);
+        wait_event(j->wait, praid_journal_free(j) >= pad + need);
+        mutex_lock(&j->append_lock);
+    }
+
+    if(pad) {
+        rec = j->ring + off;
+        rec->seq = cpu_to_le64(j->seq ++);
+        wmb();
+        WRITE_ONCE(rec->magic, cpu_to_le32(PRAID_JOURNAL_PAD_MAGIC));
+        WRITE_ONCE(j->head, j->head + pad);
+        off = 0;
+    }
+
+    dst = j->ring + off + PRAID_JOURNAL_HDR_SIZE;
+    praid_bio_for_each_data(bvec, bio, iter) {
+        data = bvec_kmap_local(&bvec);
+        memcpy(dst, data, bvec.bv_len);
+        crc = crc32c(crc, data, bvec.bv_len);
+        kunmap_local(data);
+        dst += bvec.bv_len;
+    }
+
+    e->seq = j->seq ++;
+    e->pos = j->head;
+    e->end = j->head + need;
+
+    // 头部最后写入 magic，记录在 magic 可见时完整
+    rec = j->ring + off;
+    rec->member = cpu_to_le32(e->member);
+    rec->seq = cpu_to_le64(e->seq);
+    rec->sector = cpu_to_le64(e->sector);
+    rec->len = cpu_to_le32(len);
+    rec->crc = cpu_to_le32(crc);
+    wmb();
+    WRITE_ONCE(rec->magic, cpu_to_le32(PRAID_JOURNAL_REC_MAGIC));
+    wmb();
+
+    WRITE_ONCE(j->head, e->end);
+    praid_journal_add(j, e);
+    mutex_unlock(&j->append_lock);
+
+    // 使用超过一半时立即写回，否则等待更多的记录合并成一批
+    praid_journal_kick(j, praid_journal_free(j) < j->ring_size / 2 ? 0 : PRAID_JOURNAL_WB_DELAY);
+
+    bio_endio(bio);
+}
+
+// 读取的 bio 落在未写回的 chunk 上时等待写回
+void praid_journal_wait_read(struct praid_dev *dev, struct bio *bio) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    u64 key = praid_journal_key(dev, pbio->member->index, bio->bi_iter.bi_sector);
+
+    if(likely(!praid_journal_pending(j, key))) {
+        return;
+    }
+
+    praid_journal_kick(j, 0);
+    wait_event(j->wait, !praid_journal_pending(j, key));
+}
+
+static void praid_journal_entry_free_pages(struct praid_journal_entry *e) {
+    unsigned int i;
+
+    if(!e->pages) {
+        return;
+    }
+    for(i = 0; i < e->nr_pages; i ++) {
+        if(e->pages[i]) {
+            __free_page(e->pages[i]);
+        }
+    }
+    kfree(e->pages);
+    e->pages = NULL;
+}
+
+// 从环中拷贝记录的数据构造写回的 bio
+static struct bio *praid_journal_entry_bio(struct praid_dev *dev, struct praid_journal_entry *e) {
+    struct praid_journal *j = &dev->journal;
+    void *src = j->ring + praid_journal_ring_off(j, e->pos) + PRAID_JOURNAL_HDR_SIZE;
+    struct bio *bio;
+    unsigned int i, size;
+
+    e->nr_pages = DIV_ROUND_UP(e->len, PAGE_SIZE);
+    e->pages = kcalloc(e->nr_pages, sizeof(*e->pages), GFP_NOIO);
+    if(!e->pages) {
+        return NULL;
+    }
+
+    bio = bio_alloc_bioset(GFP_NOIO, e->nr_pages, &j->bio_set);
+    bio->bi_iter.bi_sector = e->sector;
+    bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+
+    for(i = 0; i < e->nr_pages; i ++) {
+        e->pages[i] = alloc_page(GFP_NOIO);
+        if(!e->pages[i]) {
+            bio_put(bio);
+            praid_journal_entry_free_pages(e);
+            return NULL;
+        }
+
+        size = min_t(unsigned int, PAGE_SIZE, e->len - i * PAGE_SIZE);
+        memcpy(page_address(e->pages[i]), src + i * PAGE_SIZE, size);
+        bio_add_page(bio, e->pages[i], size, 0);
+    }
+
+    return bio;
+}
+
+static bool praid_journal_in_batch(struct praid_journal *j, unsigned int n, u64 key) {
+    unsigned int i;
+
+    for(i = 0; i < n; i ++) {
+        if(j->batch[i]->key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void praid_journal_batch_endio(struct bio *bio) {
+    complete(bio->bi_private);
+}
+
+// 丢弃已写回的前 n 个记录
+static void praid_journal_retire(struct praid_dev *dev, unsigned int n) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_entry *e;
+    unsigned int i;
+
+    if(!n) {
+        return;
+    }
+
+    spin_lock_irq(&j->lock);
+    for(i = 0; i < n; i ++) {
+        e = j->batch[i];
+        list_del(&e->list);
+        hlist_del(&e->node);
+        j->nr_entries --;
+    }
+    e = j->batch[n - 1];
+    j->tail_seq = e->seq + 1;
+    spin_unlock_irq(&j->lock);
+
+    praid_journal_commit_tail(j, e->end, e->seq + 1);
+    WRITE_ONCE(j->tail, e->end);
+
+    for(i = 0; i < n; i ++) {
+        praid_journal_entry_free_pages(j->batch[i]);
+        mempool_free(j->batch[i], j->entry_pool);
+    }
+
+    wake_up_all(&j->wait);
+}
+
+static void praid_journal_wb_work(struct work_struct *work) {
+    struct praid_dev *dev = container_of(to_delayed_work(work), struct praid_dev, journal.wb_work);
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_entry *e;
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct blk_plug plug;
+    struct bio *parent, *bio;
+    unsigned int i, n = 0;
+    int err;
+
+    // 同一个 chunk 的记录不在一批中并发写回，保证后写入的数据覆盖先写入的
+    spin_lock_irq(&j->lock);
+    list_for_each_entry(e, &j->entries, list) {
+        if(n == PRAID_JOURNAL_BATCH || praid_journal_in_batch(j, n, e->key)) {
+            break;
+        }
+        j->batch[n ++] = e;
+    }
+    spin_unlock_irq(&j->lock);
+
+    if(!n) {
+        return;
+    }
+
+    // 一批记录的写回共用一个 parent，所有成员盘的写完成后 parent 结束
+    parent = bio_alloc(GFP_NOIO, 0);
+    parent->bi_private = &done;
+    parent->bi_end_io = praid_journal_batch_endio;
+
+    blk_start_plug(&plug);
+    for(i = 0; i < n; i ++) {
+        e = j->batch[i];
+        bio = praid_journal_entry_bio(dev, e);
+        if(!bio) {
+            break;
+        }
+        praid_member_write(bio, parent, &dev->members[e->member], false);
+    }
+    blk_finish_plug(&plug);
+    n = i;
+
+    bio_endio(parent);
+    wait_for_completion_io(&done);
+    err = blk_status_to_errno(parent->bi_status);
+    bio_put(parent);
+
+    // 写入已经返回，记录是数据唯一完整的副本，失败时留在环中，间隔一段时间后整批重试
+    if(err) {
+        PRAID_ERROR("%s%d: journal write back failed, error %d.\n", VPCIEDISK_NAME, dev->id, err);
+        for(i = 0; i < n; i ++) {
+            praid_journal_entry_free_pages(j->batch[i]);
+        }
+        WRITE_ONCE(j->wb_err, err);
+        if(!READ_ONCE(j->stopping)) {
+            praid_journal_kick(j, PRAID_JOURNAL_RETRY_DELAY);
+        }
+        wake_up_all(&j->wait);
+        return;
+    }
+    WRITE_ONCE(j->wb_err, 0);
+
+    // 校验更新完成后记录才能丢弃，最后一个在设备完成后才释放 sem
+    flush_workqueue(dev->workqueue);
+    down(&dev->sem);
+    up(&dev->sem);
+
+    praid_journal_retire(dev, n);
+
+    if(READ_ONCE(j->nr_entries)) {
+        praid_journal_kick(j, n ? 0 : PRAID_JOURNAL_WB_DELAY);
+    }
+}
+
+// 检查环中 pos 处的记录，有效时返回记录头部
+static struct praid_journal_rec *praid_journal_check_rec(struct praid_dev *dev, u64 pos, u64 seq) {
+    struct praid_journal *j = &dev->journal;
+    u64 off = praid_journal_ring_off(j, pos);
+    struct praid_journal_rec *rec = j->ring + off;
+    sector_t size = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    sector_t sector = le64_to_cpu(rec->sector);
+    unsigned int len = le32_to_cpu(rec->len);
+
+    if(le64_to_cpu(rec->seq) != seq) {
+        return NULL;
+    }
+    if(le32_to_cpu(rec->magic) == PRAID_JOURNAL_PAD_MAGIC) {
+        return rec;
+    }
+
+    if(le32_to_cpu(rec->magic) != PRAID_JOURNAL_REC_MAGIC ||
+       le32_to_cpu(rec->member) >= dev->disk_cnt ||
+       !len || len & (KERNEL_SECTOR_SIZE - 1) || len > dev->geo.chunk_size ||
+       off + PRAID_JOURNAL_HDR_SIZE + len > j->ring_size ||
+       sector + (len >> KERNEL_SECTOR_SHIFT) > size ||
+       praid_geo_chunk(&dev->geo, sector) != praid_geo_chunk(&dev->geo, sector + (len >> KERNEL_SECTOR_SHIFT) - 1)) {
+        return NULL;
+    }
+
+    if(crc32c(0, (void *)rec + PRAID_JOURNAL_HDR_SIZE, len) != le32_to_cpu(rec->crc)) {
+        return NULL;
+    }
+
+    return rec;
+}
+
+// 从环尾扫描未写回的记录，返回记录数
+static unsigned int praid_journal_recover(struct praid_dev *dev) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_rec *rec;
+    struct praid_journal_entry *e;
+    u64 pos = j->tail, seq = j->tail_seq;
+    unsigned int nr = 0;
+
+    while(pos - j->tail < j->ring_size && (rec = praid_journal_check_rec(dev, pos, seq))) {
+        if(le32_to_cpu(rec->magic) == PRAID_JOURNAL_PAD_MAGIC) {
+            pos += j->ring_size - praid_journal_ring_off(j, pos);
+            seq ++;
+            continue;
+        }
+
+        e = mempool_alloc(j->entry_pool, GFP_KERNEL);
+        memset(e, 0, sizeof(*e));
+        e->member = le32_to_cpu(rec->member);
+        e->sector = le64_to_cpu(rec->sector);
+        e->len = le32_to_cpu(rec->len);
+        e->key = praid_journal_key(dev, e->member, e->sector);
+        e->seq = seq ++;
+        e->pos = pos;
+        e->end = pos + PRAID_JOURNAL_HDR_SIZE + e->len;
+        pos = e->end;
+
+        praid_journal_add(j, e);
+        nr ++;
+    }
+
+    j->head = pos;
+    j->seq = seq;
+
+    return nr;
+}
+
+// 没有写意图位图时，重新计算未写回的记录所在 chunk 的校验
+static void praid_journal_resync(struct praid_dev *dev) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_entry *e;
+    sector_t sta;
+    int ret;
+
+    if(dev->bitmap.enabled) {
+        return;
+    }
+
+    if(praid_degraded(dev)) {
+        PRAID_ERROR("%s%d: array degraded, parity of journaled chunks can not be resynced.\n", VPCIEDISK_NAME, dev->id);
+        return;
+    }
+
+    list_for_each_entry(e, &j->entries, list) {
+        sta = e->sector & ~dev->geo.chunk_mask;
+        ret = praid_rebuild_sync(dev, praid_parity_member(dev), sta, sta + dev->geo.chunk_sectors);
+        if(ret) {
+            PRAID_ERROR("%s%d: resync chunk at sector %llu failed, error %d.\n", VPCIEDISK_NAME, dev->id, (u64)sta, ret);
+        }
+    }
+}
+
+static bool praid_journal_load(struct praid_dev *dev) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_sb *sb = j->sb;
+    u64 gen;
+
+    if(le32_to_cpu(sb->magic) != PRAID_JOURNAL_MAGIC) {
+        return false;
+    }
+
+    if(le32_to_cpu(sb->disk_cnt) != dev->disk_cnt ||
+       le32_to_cpu(sb->chunk_size) != dev->geo.chunk_size ||
+       le64_to_cpu(sb->size) != dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT ||
+       le64_to_cpu(sb->ring_size) != j->ring_size) {
+        PRAID_ERROR("%s%d: journal belongs to another geometry, discarded.\n", VPCIEDISK_NAME, dev->id);
+        return false;
+    }
+
+    gen = le64_to_cpu(sb->gen);
+    j->tail = le64_to_cpu(sb->tail[gen & 1].tail);
+    j->tail_seq = le64_to_cpu(sb->tail[gen & 1].seq);
+
+    return true;
+}
+
+static void praid_journal_format(struct praid_dev *dev) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_sb *sb = j->sb;
+
+    // 序号从一个随机的位置开始，旧的记录不会被当作有效记录
+    j->head = j->tail = 0;
+    j->seq = j->tail_seq = ktime_get_real_ns();
+
+    memset(sb, 0, sizeof(*sb));
+    sb->disk_cnt = cpu_to_le32(dev->disk_cnt);
+    sb->chunk_size = cpu_to_le32(dev->geo.chunk_size);
+    sb->size = cpu_to_le64(dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+    sb->ring_size = cpu_to_le64(j->ring_size);
+    sb->tail[0].tail = cpu_to_le64(j->tail);
+    sb->tail[0].seq = cpu_to_le64(j->tail_seq);
+    wmb();
+    WRITE_ONCE(sb->magic, cpu_to_le32(PRAID_JOURNAL_MAGIC));
+    wmb();
+}
+
+static void praid_journal_free_all(struct praid_journal *j) {
+    if(j->wq) {
+        destroy_workqueue(j->wq);
+    }
+    bioset_exit(&j->bio_set);
+    mempool_destroy(j->entry_pool);
+    kfree(j->batch);
+    kfree(j->hash);
+    if(j->addr) {
+        memunmap(j->addr);
+    }
+}
+
+/*
+ * 在 praid_bitmap_init 之后调用。恢复出的记录立即开始写回，写回不依赖块设备
+ */
+int praid_journal_init(struct praid_dev *dev) {
+    struct praid_journal *j = &dev->journal;
+    unsigned long offset = praid_journal_offset(dev->disk_cnt, dev->geo.chunk_size);
+    unsigned int nr;
+    int ret = -ENOMEM;
+
+    if(!dev->config.journal) {
+        return 0;
+    }
+
+    mutex_init(&j->append_lock);
+    spin_lock_init(&j->lock);
+    INIT_LIST_HEAD(&j->entries);
+    init_waitqueue_head(&j->wait);
+    INIT_DELAYED_WORK(&j->wb_work, praid_journal_wb_work);
+
+    // 和 BAR 一样使用写通的映射，追加完成时数据已经在保留内存中
+    j->addr = memremap(dev->config.memmap_start + offset, dev->config.memmap_size - offset, MEMREMAP_WT);
+    if(!j->addr) {
+        PRAID_ERROR("%s%d: journal memremap err.\n", VPCIEDISK_NAME, dev->id);
+        goto out_free;
+    }
+    j->sb = j->addr;
+    j->ring = j->addr + PAGE_SIZE;
+    j->ring_size = round_down(dev->config.memmap_size - offset - PAGE_SIZE, PRAID_JOURNAL_HDR_SIZE);
+
+    j->hash = kcalloc_node(1 << PRAID_JOURNAL_HASH_BITS, sizeof(*j->hash), GFP_KERNEL, dev->config.node);
+    j->batch = kcalloc_node(PRAID_JOURNAL_BATCH, sizeof(*j->batch), GFP_KERNEL, dev->config.node);
+    j->entry_pool = mempool_create_kmalloc_pool(PRAID_JOURNAL_BATCH, sizeof(struct praid_journal_entry));
+    j->wq = alloc_workqueue("praid%d_journal", WQ_UNBOUND | WQ_MEM_RECLAIM, 1, dev->id);
+    if(!j->hash || !j->batch || !j->entry_pool || !j->wq) {
+        goto out_free;
+    }
+
+    ret = bioset_init(&j->bio_set, BIO_POOL_SIZE, offsetof(struct praid_bio, bio), 0);
+    if(ret) {
+        goto out_free;
+    }
+
+    if(praid_journal_load(dev) && (nr = praid_journal_recover(dev))) {
+        PRAID_INFO("%s%d: %u journal records to replay.\n", VPCIEDISK_NAME, dev->id, nr);
+        praid_journal_resync(dev);
+    } else {
+        praid_journal_format(dev);
+    }
+
+    j->enabled = true;
+    praid_journal_kick(j, 0);
+
+    PRAID_INFO("%s%d: journal %llu MiB.\n", VPCIEDISK_NAME, dev->id, BYTE_TO_MB(j->ring_size));
+
+    return 0;
+
+out_free:
+    praid_journal_free_all(j);
+    memset(j, 0, sizeof(*j));
+    return ret;
+}
+
+/*
+ * 块设备删除之后调用，写回所有记录。退出时写回仍然失败的记录不提交环尾，留在保留内存中，
+ * 下次创建阵列时重放
+ */
+void praid_journal_exit(struct praid_dev *dev) {
+    struct praid_journal *j = &dev->journal;
+    struct praid_journal_entry *e, *n;
+
+    if(!j->enabled) {
+        return;
+    }
+
+    WRITE_ONCE(j->wb_err, 0);
+    WRITE_ONCE(j->stopping, true);
+    praid_journal_kick(j, 0);
+    wait_event(j->wait, !READ_ONCE(j->nr_entries) || READ_ONCE(j->wb_err));
+    cancel_delayed_work_sync(&j->wb_work);
+
+    if(j->nr_entries) {
+        PRAID_ERROR("%s%d: %u journal records not written back, kept for replay.\n", VPCIEDISK_NAME, dev->id, j->nr_entries);
+    }
+    list_for_each_entry_safe(e, n, &j->entries, list) {
+        list_del(&e->list);
+        praid_journal_entry_free_pages(e);
+        mempool_free(e, j->entry_pool);
+    }
+
+    j->enabled = false;
+    praid_journal_free_all(j);
+}
@@ -0,0 +1,57 @@
+#ifndef __PRAID_JOURNAL_H__
+#define __PRAID_JOURNAL_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+#include "pciev.h"
+
+#define PRAID_JOURNAL_MAGIC 0x50524a53      // "PRJS"，头部
+#define PRAID_JOURNAL_REC_MAGIC 0x50524a52  // "PRJR"，数据记录
+#define PRAID_JOURNAL_PAD_MAGIC 0x50524a50  // "PRJP"，环尾的填充记录，下一个记录从环首开始
+
+#define PRAID_JOURNAL_MIN_SIZE MB(4)
+#define PRAID_JOURNAL_HDR_SIZE KERNEL_SECTOR_SIZE   // 记录头部的大小，记录按扇区对齐
+#define PRAID_JOURNAL_BATCH 128                     // 一次写回的记录数上限
+#define PRAID_JOURNAL_WB_DELAY (HZ / 10)            // 写回的最大延迟
+#define PRAID_JOURNAL_RETRY_DELAY (5 * HZ)          // 写回失败后重试的间隔
+
+// 日志区域位于保留内存中计算槽位之后，按 1MiB 对齐
+static inline unsigned long praid_journal_offset(unsigned int disk_cnt, unsigned int chunk_size) {
+    return BAR_CHUNK_OFFSET + ALIGN((unsigned long)PCIEV_BAR_SLOTS(disk_cnt) * chunk_size, MB(1));
+}
+
+// 日志区域的第一页，之后为记录环
+struct praid_journal_sb {
+    __le32 magic;
+    __le32 disk_cnt;
+    __le32 chunk_size;
+    __le32 reserved;
+    __le64 size;        // 成员盘数据区扇区数
+    __le64 ring_size;
+
+    // 环尾的两份副本，先写不活跃的一份再递增 gen，gen 的最低位指向活跃的副本
+    __le64 gen;
+    struct {
+        __le64 tail;    // 第一个未写回的记录在环中的逻辑位置
+        __le64 seq;     // 该记录的序号
+    } tail[2];
+};
+
+// 记录头部，之后是 len 字节的新数据
+struct praid_journal_rec {
+    __le32 magic;
+    __le32 member;
+    __le64 seq;
+    __le64 sector;      // 成员盘内扇区
+    __le32 len;
+    __le32 crc;         // 数据的 crc32c
+};
+
+void praid_journal_write(struct praid_dev *dev, struct bio *bio);
+void praid_journal_wait_read(struct praid_dev *dev, struct bio *bio);
+
+int praid_journal_init(struct praid_dev *dev);
+void praid_journal_exit(struct praid_dev *dev);
+
+#endif
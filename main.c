@@ -2,6 +2,8 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/kernel.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
 
 #ifdef CONFIG_X86
 #include <asm/e820/types.h>
@@ -13,6 +15,20 @@
 #include "block.h"
 #include "device.h"
 #include "pciev.h"
+#include "pci.h"
+#include "degraded.h"
+#include "rebuild.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "cache.h"
+#include "pcache.h"
+#include "zeromap.h"
+#include "plog.h"
+#include "reshape.h"
+#include "flush.h"
+#include "iosched.h"
+#include "readahead.h"
+#include "engine.h"
 
 #define MODULE_NAME "PCIEDRVBLK"
 
@@ -22,17 +38,49 @@
  * 1MiB area for metadata
  *  - BAR : 1 page
  * Storage area
+ *
+ * 每个阵列使用独立的保留内存区间，虚拟设备挂在各自的虚拟 pci 总线上
 */
 
-struct praid_dev *praid_dev = NULL;
-
-unsigned long memmap_start = 0;
-unsigned long memmap_size = 0;
-unsigned int cpu = 0;
-
+// 加载模块时创建的第一个阵列的参数，未指定 minors 时不创建
+static unsigned long memmap_start = 0;
+static unsigned long memmap_size = 0;
+static unsigned int cpu = 0;
 static unsigned int major = 0;
 static uint64_t per_size = 0;
+static uint64_t chunk_size = PRAID_CHUNK_SIZE_DEFAULT;
 static char *minors;
+static bool journal;
+static bool fresh;
+static uint64_t plog_size;
+static uint64_t cache_size;
+static uint64_t pcache_size;
+static bool readahead = true;
+static char *engine;
+static bool dmaengine;
+
+static LIST_HEAD(praid_devs);
+static DEFINE_MUTEX(praid_devs_lock);
+static DEFINE_IDA(praid_ida);
+
+// 创建一个阵列所需的参数
+struct praid_params {
+	unsigned long memmap_start;
+	unsigned long memmap_size;
+	unsigned int cpu;
+	unsigned int major;
+	uint64_t per_size;
+	uint64_t chunk_size;
+	char *minors;
+	bool journal;
+	bool fresh;
+	uint64_t plog_size;
+	uint64_t cache_size;
+	uint64_t pcache_size;
+	bool readahead;
+	char *engine;
+	bool dmaengine;
+};
 
 static int set_parse_mem_param(const char *val, const struct kernel_param *kp) {
 	uint64_t *arg = (uint64_t *)kp->arg;
@@ -53,18 +101,36 @@ module_param(cpu, uint, 0644);
 MODULE_PARM_DESC(cpu, "CPU core to do dispatcher jobs");
 module_param_cb(per_size, &ops_parse_mem_param, &per_size, 0444);
 MODULE_PARM_DESC(per_size, "Storage size for single nvme device");
+module_param_cb(chunk_size, &ops_parse_mem_param, &chunk_size, 0444);
+MODULE_PARM_DESC(chunk_size, "Chunk size of the array, power of 2 between 4K and 1M (default 4K)");
 module_param(major, uint, 0644);
 MODULE_PARM_DESC(major, "Major device number of nvme block device");
 module_param(minors, charp, 0644);
 MODULE_PARM_DESC(minors, "Minor device number of nvme block devices");
+module_param(journal, bool, 0444);
+MODULE_PARM_DESC(journal, "Log writes to the reserved memory after the BAR before writing them to the disks");
+module_param(fresh, bool, 0444);
+MODULE_PARM_DESC(fresh, "New array: zero the members and mark every region as never written");
+module_param_cb(plog_size, &ops_parse_mem_param, &plog_size, 0444);
+MODULE_PARM_DESC(plog_size, "Size of the parity log on the parity member, 0 to update parity in place (default 0)");
+module_param_cb(cache_size, &ops_parse_mem_param, &cache_size, 0444);
+MODULE_PARM_DESC(cache_size, "Size of the write-back cache in the reserved memory after the BAR, 0 to disable (default 0)");
+module_param_cb(pcache_size, &ops_parse_mem_param, &pcache_size, 0444);
+MODULE_PARM_DESC(pcache_size, "Size of the cache of recently written data used as old data by parity updates, 0 to disable (default 0)");
+module_param(readahead, bool, 0444);
+MODULE_PARM_DESC(readahead, "Stripe-aware sequential readahead, 8 windows of 1 MiB per array (default 1)");
+module_param(engine, charp, 0444);
+MODULE_PARM_DESC(engine, "Parity engine: pciev for the virtual device, async for the async_tx API, cpu for inline xor (default pciev)");
+module_param(dmaengine, bool, 0444);
+MODULE_PARM_DESC(dmaengine, "Register the virtual device as a dmaengine XOR channel for async_tx users such as md raid456");
 
 #ifdef CONFIG_X86
-static int __validate_configs_arch(void) {
+static int __validate_configs_arch(struct praid_params *params) {
 	unsigned long resv_start_bytes;
 	unsigned long resv_end_bytes;
 
-	resv_start_bytes = memmap_start;
-	resv_end_bytes = resv_start_bytes + memmap_size - 1;
+	resv_start_bytes = params->memmap_start;
+	resv_end_bytes = resv_start_bytes + params->memmap_size - 1;
 
 	if (e820__mapped_any(resv_start_bytes, resv_end_bytes, E820_TYPE_RAM) ||
 	    e820__mapped_any(resv_start_bytes, resv_end_bytes, E820_TYPE_RESERVED_KERN)) {
@@ -81,62 +147,157 @@ static int __validate_configs_arch(void) {
 	return 0;
 }
 #else
-static int __validate_configs_arch(void) {
+static int __validate_configs_arch(struct praid_params *params) {
 	return -EPERM;
 }
 #endif
 
-static int __validate_configs(void) {
-	if (!memmap_start) {
+// 调用者持有 praid_devs_lock
+static int __validate_configs(struct praid_params *params) {
+	const struct praid_engine_ops *ops;
+	struct praid_dev *dev;
+
+	if (!params->memmap_start) {
 		PRAID_ERROR("[memmap_start] should be specified\n");
 		return -EINVAL;
 	}
 
-	if (!memmap_size) {
+	if (!params->memmap_size) {
 		PRAID_ERROR("[memmap_size] should be specified\n");
 		return -EINVAL;
-	} else if (memmap_size <= MB(1)) {
+	} else if (params->memmap_size <= MB(1)) {
 		PRAID_ERROR("[memmap_size] should be bigger than 1 MiB\n");
 		return -EINVAL;
 	}
 
-	if (!cpu) {
+	if (!params->cpu) {
 		PRAID_ERROR("[cpu] shoud be spcified\n");
 		return -EINVAL;
 	}
 
-	if (__validate_configs_arch()) {
+	if (params->cpu >= nr_cpu_ids || !cpu_online(params->cpu)) {
+		PRAID_ERROR("[cpu] %u is not online\n", params->cpu);
+		return -EINVAL;
+	}
+
+	if (__validate_configs_arch(params)) {
 		return -EPERM;
 	}
 
-	if (!major) {
+	list_for_each_entry(dev, &praid_devs, list) {
+		if (params->memmap_start < dev->config.memmap_start + dev->config.memmap_size &&
+		    dev->config.memmap_start < params->memmap_start + params->memmap_size) {
+			PRAID_ERROR("[mem %#010lx-%#010lx] is used by %s%d\n", params->memmap_start,
+				    params->memmap_start + params->memmap_size - 1, VPCIEDISK_NAME, dev->id);
+			return -EBUSY;
+		}
+	}
+
+	if (!params->major) {
 		PRAID_ERROR("[major] should be specified\n");
 		return -EINVAL;
 	}
 
-	if (per_size < MB(512)) {
+	if (params->per_size < MB(512)) {
 		PRAID_ERROR("Disk size too small\n");
 		return -EINVAL;
 	}
 
+	if (!is_power_of_2(params->chunk_size) || params->chunk_size < PRAID_CHUNK_SIZE_MIN || params->chunk_size > PRAID_CHUNK_SIZE_MAX || params->chunk_size < PAGE_SIZE) {
+		PRAID_ERROR("[chunk_size] should be a power of 2 between 4 KiB and 1 MiB\n");
+		return -EINVAL;
+	}
+
+	if (params->per_size & (params->chunk_size - 1)) {
+		PRAID_ERROR("[per_size] should be a multiple of [chunk_size]\n");
+		return -EINVAL;
+	}
+
+	if (params->plog_size && params->plog_size < PRAID_PLOG_MIN_SIZE) {
+		PRAID_ERROR("[plog_size] should be at least %d MiB\n", BYTE_TO_MB(PRAID_PLOG_MIN_SIZE));
+		return -EINVAL;
+	}
+
+	if (params->pcache_size && params->pcache_size < PRAID_PCACHE_MIN_SIZE) {
+		PRAID_ERROR("[pcache_size] should be at least %d MiB\n", BYTE_TO_MB(PRAID_PCACHE_MIN_SIZE));
+		return -EINVAL;
+	}
+
+	ops = praid_engine_find(params->engine);
+	if (!ops) {
+		PRAID_ERROR("[engine] %s is not available\n", params->engine);
+		return -EINVAL;
+	}
+
+	if (params->dmaengine && !IS_ENABLED(CONFIG_DMA_ENGINE)) {
+		PRAID_ERROR("[dmaengine] needs CONFIG_DMA_ENGINE\n");
+		return -EINVAL;
+	}
+
+	// 校验日志由设备合并
+	if (params->plog_size && ops != &pcievdrv_engine) {
+		PRAID_ERROR("[plog_size] can only be used with the pciev engine\n");
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
-static bool __load_configs(struct praid_config *config) {
+static bool __load_configs(struct praid_config *config, struct praid_params *params) {
     bool first = true;
-	unsigned int minor_nr;
-	char *minor;
+	unsigned int minor_nr, cnt_minors;
+	char *minor, *minor_list, *minor_buf;
 
-	if (__validate_configs() < 0) {
+	if (__validate_configs(params) < 0) {
 		return false;
 	}
 
-    config->nvme_major = major;
-    config->size_nvme_disk = per_size;
+	if (!params->minors) {
+		PRAID_ERROR("[minors] should be specified\n");
+		return false;
+	}
+
+	config->memmap_start = params->memmap_start;
+	config->memmap_size = params->memmap_size;
+	config->cpu = params->cpu;
+	config->node = cpu_to_node(params->cpu);
+    config->nvme_major = params->major;
+    config->size_nvme_disk = params->per_size;
+    config->chunk_size = params->chunk_size;
+	config->journal = params->journal;
+	config->fresh = params->fresh;
+	config->plog_size = params->plog_size;
+	config->cache_size = params->cache_size;
+	config->pcache_size = params->pcache_size;
+	config->readahead = params->readahead;
+	config->engine = praid_engine_find(params->engine);
+	config->dmaengine = params->dmaengine;
 
 	config->nr_nvme_disks = 0;
 
-	while ((minor = strsep(&minors, ",")) != NULL) {
+	// 第一个为校验盘，其余为数据盘
+	cnt_minors = 1;
+	for (minor = params->minors; *minor; minor++) {
+		if (*minor == ',')
+			cnt_minors++;
+	}
+
+	if(cnt_minors - 1 > PRAID_MAX_DISKS) {
+		PRAID_ERROR("To many disks.\n");
+		return false;
+	}
+
+	config->nvme_minor = kcalloc_node(cnt_minors, sizeof(*config->nvme_minor), GFP_KERNEL, config->node);
+	if (!config->nvme_minor) {
+		return false;
+	}
+
+	minor_buf = minor_list = kstrdup(params->minors, GFP_KERNEL);
+	if (!minor_buf) {
+		goto out_minor;
+	}
+
+	while ((minor = strsep(&minor_list, ",")) != NULL) {
 		minor_nr = (unsigned int)simple_strtol(minor, NULL, 10);
 		if (first) {
 			config->nvme_minor_verify = minor_nr;
@@ -145,48 +306,89 @@ static bool __load_configs(struct praid_config *config) {
 			config->nr_nvme_disks++;
 		}
 		first = false;
+	}
+	kfree(minor_buf);
 
-		if(config->nr_nvme_disks > 31) {
-			PRAID_ERROR("To many disks.\n");
-			return false;
-		}
+	if(!config->nr_nvme_disks) {
+		PRAID_ERROR("No data disks.\n");
+		goto out_minor;
 	}
 
-	if((unsigned long)(config->nr_nvme_disks + 1) * CHUNK_SIZE + PAGE_SIZE > memmap_size) {
+	if((unsigned long)PCIEV_BAR_SLOTS(config->nr_nvme_disks) * config->chunk_size + BAR_CHUNK_OFFSET > config->memmap_size) {
 		PRAID_ERROR("Spcace proviced too small.\n");
-		return false;
+		goto out_minor;
+	}
+
+	// 日志使用计算槽位之后的保留内存，至少容纳一个 chunk 的记录
+	if(config->journal) {
+		unsigned long offset = praid_journal_offset(config->nr_nvme_disks, config->chunk_size);
+
+		if(offset + PRAID_JOURNAL_MIN_SIZE > config->memmap_size ||
+		   config->memmap_size - offset < PAGE_SIZE + 2 * (PRAID_JOURNAL_HDR_SIZE + config->chunk_size)) {
+			PRAID_ERROR("[journal] needs at least %d MiB after the BAR.\n", BYTE_TO_MB(PRAID_JOURNAL_MIN_SIZE));
+			goto out_minor;
+		}
+	}
+
+	// 缓存和日志使用同一块保留内存，至少容纳 PRAID_CACHE_MIN_LINES 个条带
+	if(config->cache_size) {
+		unsigned long offset = praid_journal_offset(config->nr_nvme_disks, config->chunk_size);
+
+		if(config->journal) {
+			PRAID_ERROR("[cache_size] and [journal] can not be used together.\n");
+			goto out_minor;
+		}
+		if(offset + config->cache_size > config->memmap_size ||
+		   config->cache_size < (uint64_t)PRAID_CACHE_MIN_LINES * config->nr_nvme_disks * config->chunk_size) {
+			PRAID_ERROR("[cache_size] should hold at least %d stripes and fit in the memory after the BAR.\n", PRAID_CACHE_MIN_LINES);
+			goto out_minor;
+		}
 	}
 
 	return true;
+
+out_minor:
+	kfree(config->nvme_minor);
+	config->nvme_minor = NULL;
+	return false;
 }
 
 static int nvme_blkdev_init(struct praid_dev *dev) {
     int i;
+    struct praid_member *member;
 
     dev->disk_cnt = dev->config.nr_nvme_disks;
-    
-    for(i = 0; i < dev->disk_cnt; i ++) {
-        if(IS_ERR((dev->bdev[i] = blkdev_get_by_dev(
-        MKDEV(dev->config.nvme_major, dev->config.nvme_minor[i]),
-        FMODE_READ | FMODE_WRITE,
-        NULL)))) {
-            goto ret_err;
-        }
+    praid_geo_init(&dev->geo, dev->config.chunk_size, dev->disk_cnt);
+
+    // 2 的幂大小的 kmalloc 保证按大小自然对齐，使每个成员都落在独立的 cache line 上。
+    // 按数据盘数量上限分配，扩容时不需要重新分配
+    dev->members = kzalloc_node(roundup_pow_of_two(sizeof(struct praid_member) * (PRAID_MAX_DISKS + 1)), GFP_KERNEL, dev->config.node);
+    if(!dev->members) {
+        return -ENOMEM;
     }
 
-    if(IS_ERR((dev->bdev_verify = blkdev_get_by_dev(
-    MKDEV(dev->config.nvme_major, dev->config.nvme_minor_verify),
-    FMODE_READ | FMODE_WRITE,
-    NULL)))) {
-        goto ret_err;
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        member = &dev->members[i];
+        member->dev = dev;
+        member->index = i;
+        member->minor = i < dev->disk_cnt ? dev->config.nvme_minor[i] : dev->config.nvme_minor_verify;
+        praid_iosched_member_init(member);
+        if(IS_ERR((member->bdev = blkdev_get_by_dev(
+        MKDEV(dev->config.nvme_major, member->minor),
+        FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+        dev)))) {
+            goto ret_err;
+        }
     }
 
     return 0;
 
 ret_err:
     for(i --; i >= 0; i --) {
-        blkdev_put(dev->bdev[i], FMODE_READ | FMODE_WRITE); 
+        blkdev_put(dev->members[i].bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL); 
     }
+    kfree(dev->members);
+    dev->members = NULL;
 
     return -EBUSY;
 }
@@ -194,86 +396,414 @@ ret_err:
 static void nvme_blkdev_final(struct praid_dev *dev) {
     int i;
 
-    
-    blkdev_put(dev->bdev_verify, FMODE_READ | FMODE_WRITE);
-    for(i = 0; i < dev->disk_cnt; i ++) {
-        blkdev_put(dev->bdev[i], FMODE_READ | FMODE_WRITE);
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        blkdev_put(dev->members[i].bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
     }
+    kfree(dev->members);
+    dev->members = NULL;
 }
 
-static void __print_praid_info(struct praid_dev *dev) {
-	PRAID_INFO("size_nvme_disk = %lld\n", dev->config.size_nvme_disk);
-	PRAID_INFO("disk size = %lld\n", dev->size);
-	PRAID_INFO("disk count = %d\n", dev->disk_cnt);
+static struct pciev_dev *__create_pciev(struct praid_dev *dev) {
+	struct pciev_config config = {
+		.memmap_start = dev->config.memmap_start,
+		.memmap_size = dev->config.memmap_size,
+		.cnt_disk = dev->disk_cnt,
+		.chunk_size = dev->geo.chunk_size,
+		.cpu_nr_dispatcher = dev->config.cpu,
+		.bus_nr = dev->pci_bus_nr,
+		.node = dev->config.node,
+	};
+
+	return PCIEV_init(&config, praid_parity_member(dev)->bdev);
 }
 
-static int vpcie_module_init(void) {
-    int ret = 0;
+static void __print_praid_info(struct praid_dev *dev) {
+	PRAID_INFO("%s%d: size_nvme_disk = %lld\n", VPCIEDISK_NAME, dev->id, dev->config.size_nvme_disk);
+	PRAID_INFO("%s%d: disk size = %lld\n", VPCIEDISK_NAME, dev->id, dev->size);
+	PRAID_INFO("%s%d: disk count = %d\n", VPCIEDISK_NAME, dev->id, dev->disk_cnt);
+	PRAID_INFO("%s%d: chunk size = %u\n", VPCIEDISK_NAME, dev->id, dev->geo.chunk_size);
+	PRAID_INFO("%s%d: cpu = %u, node = %d\n", VPCIEDISK_NAME, dev->id, dev->config.cpu, dev->config.node);
+	PRAID_INFO("%s%d: parity engine = %s\n", VPCIEDISK_NAME, dev->id, dev->config.engine->name);
+}
 
-	praid_dev = kzalloc(sizeof(struct praid_dev), GFP_KERNEL);
+// 调用者持有 praid_devs_lock
+static int praid_array_create(struct praid_params *params) {
+	struct praid_dev *dev;
+	int ret;
 
-	if(!praid_dev) {
-		ret = -EINVAL;
+	dev = kzalloc(sizeof(struct praid_dev), GFP_KERNEL);
+	if(!dev) {
+		ret = -ENOMEM;
 		goto out_err;
 	}
 
-    if (!__load_configs(&praid_dev->config)) {
+	ret = ida_alloc_max(&praid_ida, PRAID_MAX_ARRAYS - 1, GFP_KERNEL);
+	if(ret < 0) {
+		PRAID_ERROR("To many arrays.\n");
+		goto out_free;
+	}
+	dev->id = ret;
+	dev->pci_bus_nr = PCIEV_PCI_BUS_NUM + dev->id;
+
+    if (!__load_configs(&dev->config, params)) {
         ret = -EINVAL;
-		goto out_pcievdrv_err;
+		goto out_ida;
 	}
 
-	if(nvme_blkdev_init(praid_dev) < 0) {
+	if(nvme_blkdev_init(dev) < 0) {
 		ret = -EBUSY;
-		goto out_pcievdrv_err;
+		goto out_config;
 	}
 
-	if(PCIEV_init(praid_dev->bdev_verify, praid_dev->disk_cnt) < 0) {
+	// 虚拟设备加入总线时驱动的 probe 会同步执行，需要先登记阵列
+	pcievdrv_attach(dev);
+
+	dev->vdev = __create_pciev(dev);
+	if(!dev->vdev) {
 		ret = -EBUSY;
-		goto out_nvme_err;
+		goto out_attach;
 	}
 
-    ret = pcievdrv_init();
-    if(ret) {
-        goto out_device_err;
-    }
+	if(!dev->pdev) {
+		PRAID_ERROR("%s%d: pcie device not probed.\n", VPCIEDISK_NAME, dev->id);
+		ret = -ENODEV;
+		goto out_device_err;
+	}
+
+	ret = praid_iosched_init(dev);
+	if(ret) {
+		goto out_device_err;
+	}
+
+	ret = praid_degraded_init(dev);
+	if(ret) {
+		goto out_iosched;
+	}
+
+	ret = praid_rebuild_init(dev);
+	if(ret) {
+		goto out_degraded;
+	}
 
-    ret = vpciedisk_init(praid_dev);
+	ret = praid_bitmap_init(dev);
+	if(ret) {
+		goto out_rebuild;
+	}
+
+	ret = praid_zeromap_init(dev);
+	if(ret) {
+		goto out_bitmap;
+	}
+
+	ret = praid_reshape_init(dev);
+	if(ret) {
+		goto out_zeromap;
+	}
+
+	ret = praid_plog_init(dev);
+	if(ret) {
+		goto out_reshape;
+	}
+
+	ret = praid_pcache_init(dev);
+	if(ret) {
+		goto out_plog;
+	}
+
+	ret = praid_journal_init(dev);
+	if(ret) {
+		goto out_pcache;
+	}
+
+	ret = praid_cache_init(dev);
+	if(ret) {
+		goto out_journal;
+	}
+
+	ret = praid_flush_init(dev);
+	if(ret) {
+		goto out_cache;
+	}
+
+	ret = praid_ra_init(dev);
+	if(ret) {
+		goto out_flush;
+	}
+
+    ret = vpciedisk_init(dev);
     if(ret) {
-        goto out_vdisk_err;
+        goto out_ra;
     }
 
-	__print_praid_info(praid_dev);
+	praid_rebuild_run(dev);
+	praid_reshape_run(dev);
+
+	list_add_tail(&dev->list, &praid_devs);
+	__print_praid_info(dev);
 
     return 0;
 
-out_vdisk_err:
-    pcievdrv_exit();
+out_ra:
+	praid_ra_exit(dev);
+
+out_flush:
+	praid_flush_exit(dev);
+
+out_cache:
+	praid_cache_exit(dev);
+
+out_journal:
+	praid_journal_exit(dev);
+
+out_pcache:
+	praid_pcache_exit(dev);
+
+out_plog:
+	praid_plog_exit(dev);
+
+out_reshape:
+	praid_reshape_exit(dev);
+
+out_zeromap:
+	praid_zeromap_exit(dev);
+
+out_bitmap:
+	praid_bitmap_exit(dev);
+
+out_rebuild:
+	praid_rebuild_exit(dev);
+
+out_degraded:
+	praid_degraded_exit(dev);
+
+out_iosched:
+	praid_iosched_exit(dev);
 
 out_device_err:
-	PCIEV_exit();
+	PCIEV_exit(dev->vdev);
 
-out_nvme_err:
-	nvme_blkdev_final(praid_dev);
+out_attach:
+	pcievdrv_detach(dev);
+	nvme_blkdev_final(dev);
 
-out_pcievdrv_err:
-	if(praid_dev) {
-		kfree(praid_dev);
+out_config:
+	kfree(dev->config.nvme_minor);
+
+out_ida:
+	ida_free(&praid_ida, dev->id);
+
+out_free:
+	kfree(dev);
+
+out_err:
+    return ret;
+}
+
+// 调用者持有 praid_devs_lock
+static void praid_array_destroy(struct praid_dev *dev) {
+	list_del(&dev->list);
+
+	// 扩容线程退出时放行阻塞的 io，之后才能删除块设备
+	praid_reshape_exit(dev);
+    vpciedisk_exit(dev);
+	praid_ra_exit(dev);
+	praid_flush_exit(dev);
+	praid_cache_exit(dev);
+	praid_journal_exit(dev);
+	praid_pcache_exit(dev);
+	praid_plog_exit(dev);
+	praid_rebuild_exit(dev);
+	praid_zeromap_exit(dev);
+	praid_bitmap_exit(dev);
+	praid_degraded_exit(dev);
+	praid_iosched_exit(dev);
+	PCIEV_exit(dev->vdev);
+	pcievdrv_detach(dev);
+	nvme_blkdev_final(dev);
+
+	PRAID_INFO("%s%d: destroyed\n", VPCIEDISK_NAME, dev->id);
+
+	ida_free(&praid_ida, dev->id);
+	kfree(dev->config.nvme_minor);
+	kfree(dev);
+}
+
+/*
+ * 运行时创建阵列，参数格式和加载模块时相同，例如
+ * echo "memmap_start=6G memmap_size=1G cpu=20 per_size=512M major=259 minors=4,5,6,7" > /sys/module/praid/parameters/create
+ */
+static int set_create_param(const char *val, const struct kernel_param *kp) {
+	struct praid_params params = {
+		.chunk_size = PRAID_CHUNK_SIZE_DEFAULT,
+		.readahead = true,
+	};
+	char *buf, *args, *arg, *value;
+	int ret = 0;
+
+	buf = args = kstrdup(val, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while ((arg = strsep(&args, " \t\n")) != NULL) {
+		if (!*arg)
+			continue;
+
+		value = strchr(arg, '=');
+		if (!value) {
+			ret = -EINVAL;
+			goto out;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(arg, "memmap_start")) {
+			params.memmap_start = memparse(value, NULL);
+		} else if (!strcmp(arg, "memmap_size")) {
+			params.memmap_size = memparse(value, NULL);
+		} else if (!strcmp(arg, "per_size")) {
+			params.per_size = memparse(value, NULL);
+		} else if (!strcmp(arg, "chunk_size")) {
+			params.chunk_size = memparse(value, NULL);
+		} else if (!strcmp(arg, "cpu")) {
+			ret = kstrtouint(value, 0, &params.cpu);
+		} else if (!strcmp(arg, "major")) {
+			ret = kstrtouint(value, 0, &params.major);
+		} else if (!strcmp(arg, "minors")) {
+			params.minors = value;
+		} else if (!strcmp(arg, "journal")) {
+			ret = kstrtobool(value, &params.journal);
+		} else if (!strcmp(arg, "fresh")) {
+			ret = kstrtobool(value, &params.fresh);
+		} else if (!strcmp(arg, "plog_size")) {
+			params.plog_size = memparse(value, NULL);
+		} else if (!strcmp(arg, "cache_size")) {
+			params.cache_size = memparse(value, NULL);
+		} else if (!strcmp(arg, "pcache_size")) {
+			params.pcache_size = memparse(value, NULL);
+		} else if (!strcmp(arg, "readahead")) {
+			ret = kstrtobool(value, &params.readahead);
+		} else if (!strcmp(arg, "engine")) {
+			params.engine = value;
+		} else if (!strcmp(arg, "dmaengine")) {
+			ret = kstrtobool(value, &params.dmaengine);
+		} else {
+			PRAID_ERROR("unknown parameter %s\n", arg);
+			ret = -EINVAL;
+		}
+
+		if (ret)
+			goto out;
+	}
+
+	mutex_lock(&praid_devs_lock);
+	ret = praid_array_create(&params);
+	mutex_unlock(&praid_devs_lock);
+
+out:
+	kfree(buf);
+	return ret;
+}
+
+static struct kernel_param_ops ops_create_param = {
+	.set = set_create_param,
+};
+
+// 按编号删除阵列，echo 1 > /sys/module/praid/parameters/remove 删除 praiddisk1
+static int set_remove_param(const char *val, const struct kernel_param *kp) {
+	struct praid_dev *dev;
+	int id, ret;
+
+	ret = kstrtoint(val, 0, &id);
+	if (ret)
+		return ret;
+
+	ret = -ENODEV;
+	mutex_lock(&praid_devs_lock);
+	list_for_each_entry(dev, &praid_devs, list) {
+		if (dev->id == id) {
+			praid_array_destroy(dev);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&praid_devs_lock);
+
+	return ret;
+}
+
+static struct kernel_param_ops ops_remove_param = {
+	.set = set_remove_param,
+};
+
+module_param_cb(create, &ops_create_param, NULL, 0200);
+MODULE_PARM_DESC(create, "Create an array at runtime, e.g. \"memmap_start=6G memmap_size=1G cpu=20 per_size=512M major=259 minors=4,5,6,7\"");
+module_param_cb(remove, &ops_remove_param, NULL, 0200);
+MODULE_PARM_DESC(remove, "Remove the array praiddisk<N> at runtime");
+
+static int vpcie_module_init(void) {
+    int ret = 0;
+	struct praid_params params = {
+		.memmap_start = memmap_start,
+		.memmap_size = memmap_size,
+		.cpu = cpu,
+		.major = major,
+		.per_size = per_size,
+		.chunk_size = chunk_size,
+		.minors = minors,
+		.journal = journal,
+		.fresh = fresh,
+		.plog_size = plog_size,
+		.cache_size = cache_size,
+		.pcache_size = pcache_size,
+		.readahead = readahead,
+		.engine = engine,
+		.dmaengine = dmaengine,
+	};
+
+	ret = vpciedisk_register();
+	if(ret) {
+		goto out_err;
+	}
+
+    ret = pcievdrv_init();
+    if(ret) {
+        goto out_blk_err;
+    }
+
+	if(minors) {
+		mutex_lock(&praid_devs_lock);
+		ret = praid_array_create(&params);
+		mutex_unlock(&praid_devs_lock);
+		if(ret) {
+			goto out_pcievdrv_err;
+		}
 	}
 
+    return 0;
+
+out_pcievdrv_err:
+    pcievdrv_exit();
+
+out_blk_err:
+	vpciedisk_unregister();
+
 out_err:
     return ret;
 }
 
 static void vpcie_module_exit(void) {
-    vpciedisk_exit(praid_dev);
-    pcievdrv_exit();
-	PCIEV_exit();
-	nvme_blkdev_final(praid_dev);
-	if(praid_dev) {
-		kfree(praid_dev);
+	struct praid_dev *dev, *tmp;
+
+	mutex_lock(&praid_devs_lock);
+	list_for_each_entry_safe(dev, tmp, &praid_devs, list) {
+		praid_array_destroy(dev);
 	}
+	mutex_unlock(&praid_devs_lock);
+
+    pcievdrv_exit();
+	vpciedisk_unregister();
+	ida_destroy(&praid_ida);
 }
 
 MODULE_LICENSE("GPL v2");
 module_init(vpcie_module_init);
-module_exit(vpcie_module_exit);
\ No newline at end of file
+module_exit(vpcie_module_exit);
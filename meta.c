@@ -0,0 +1,32 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+
+#include "praid.h"
+#include "meta.h"
+
+bool praid_meta_fits(struct praid_dev *dev, struct block_device *bdev, sector_t offset, sector_t nr_sectors) {
+    sector_t sector = (dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT) + offset;
+
+    return bdev_nr_sectors(bdev) >= sector + nr_sectors;
+}
+
+// 同步读写一页元数据，写入时带 FUA，op 可以带 REQ_PREFLUSH 等标志
+int praid_meta_io(struct praid_dev *dev, struct block_device *bdev, sector_t offset, struct page *page, unsigned int op) {
+    struct bio *bio;
+    int ret;
+
+    if(!praid_meta_fits(dev, bdev, offset, PRAID_META_PAGE_SECTORS)) {
+        return -ENOSPC;
+    }
+
+    bio = bio_alloc(GFP_NOIO, 1);
+    bio_set_dev(bio, bdev);
+    bio->bi_iter.bi_sector = (dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT) + offset;
+    bio->bi_opf = op | REQ_SYNC | (op_is_write(op) ? REQ_FUA : 0);
+    bio_add_page(bio, page, PAGE_SIZE, 0);
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+
+    return ret;
+}
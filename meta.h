@@ -0,0 +1,31 @@
+#ifndef __PRAID_META_H__
+#define __PRAID_META_H__
+
+#include <linux/blkdev.h>
+
+#include "praid.h"
+
+/*
+ * 成员盘数据区(per_size)之后的元数据布局，偏移以扇区为单位，成员盘容量不足时不保存元数据
+ *  - 重建检查点 : 1 page
+ *  - 写意图位图 : 1 page 头部 + 位图页，只保存在校验盘上
+ *  - 零区域表   : 1 page 头部 + 水位页，只保存在校验盘上，紧随位图之后
+ *  - 校验日志   : 1 page 头部 + 记录环 + 1 page 余量，只保存在校验盘上，紧随零区域表之后
+ */
+#define PRAID_META_PAGE_SECTORS (PAGE_SIZE >> KERNEL_SECTOR_SHIFT)
+#define PRAID_META_CKPT_OFFSET 0
+#define PRAID_META_BITMAP_OFFSET (PRAID_META_CKPT_OFFSET + PRAID_META_PAGE_SECTORS)
+
+// 位图的大小在 praid_bitmap_init 中确定，位图未启用时同样预留
+static inline sector_t praid_meta_zeromap_offset(struct praid_dev *dev) {
+    return PRAID_META_BITMAP_OFFSET + (sector_t)(dev->bitmap.nr_pages + 1) * PRAID_META_PAGE_SECTORS;
+}
+
+static inline sector_t praid_meta_plog_offset(struct praid_dev *dev) {
+    return praid_meta_zeromap_offset(dev) + (sector_t)(dev->zeromap.nr_pages + 1) * PRAID_META_PAGE_SECTORS;
+}
+
+bool praid_meta_fits(struct praid_dev *dev, struct block_device *bdev, sector_t offset, sector_t nr_sectors);
+int praid_meta_io(struct praid_dev *dev, struct block_device *bdev, sector_t offset, struct page *page, unsigned int op);
+
+#endif
@@ -0,0 +1,230 @@
+#include <linux/bio.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "pcache.h"
+
+/*
+ * 旧数据缓存。写入数据盘的数据按 (成员盘, 盘内页) 保存在预先分配的页中，LRU 替换。
+ * 读改写需要的旧数据全部在缓存中时直接从缓存拷贝，不再读成员盘，同一 chunk 的反复覆盖写
+ * 只剩写入。
+ *
+ * 所有写入数据盘的 bio 在下发前更新缓存，需要旧数据的写入在更新前先取出旧数据，缓存的内容
+ * 和已提交的校验更新任务对应的数据一致。降级时写入经降级路径，只使对应的缓存失效。
+ */
+
+struct praid_pcache_entry {
+    struct hlist_node node;
+    struct list_head lru;
+    u64 key; // 成员盘和盘内页号，见 praid_pcache_key
+    bool used;
+    DECLARE_BITMAP(valid, PRAID_PCACHE_BLOCK_SECTORS); // 页中已缓存的扇区
+    struct page *page;
+};
+
+static u64 praid_pcache_key(unsigned int member, sector_t sector) {
+    return ((u64)member << 56) | (sector / PRAID_PCACHE_BLOCK_SECTORS);
+}
+
+static struct praid_pcache_entry *praid_pcache_lookup(struct praid_pcache *p, u64 key) {
+    struct praid_pcache_entry *e;
+
+    hlist_for_each_entry(e, &p->hash[hash_64(key, p->hash_bits)], node) {
+        if(e->key == key) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// 查找 key 对应的项，没有时替换最久未使用的项
+static struct praid_pcache_entry *praid_pcache_get(struct praid_pcache *p, u64 key) {
+    struct praid_pcache_entry *e = praid_pcache_lookup(p, key);
+
+    if(!e) {
+        e = list_last_entry(&p->lru, struct praid_pcache_entry, lru);
+        if(e->used) {
+            hlist_del(&e->node);
+        }
+        e->key = key;
+        e->used = true;
+        bitmap_zero(e->valid, PRAID_PCACHE_BLOCK_SECTORS);
+        hlist_add_head(&e->node, &p->hash[hash_64(key, p->hash_bits)]);
+    }
+    list_move(&e->lru, &p->lru);
+
+    return e;
+}
+
+/*
+ * 将 len 字节的新数据 src 写入缓存。dst 不为 NULL 时先把缓存中的旧数据拷贝到 dst，
+ * 旧数据不全在缓存中时返回 false
+ */
+static bool praid_pcache_copy(struct praid_pcache *p, unsigned int member, sector_t sector, void *src, void *dst, unsigned int len) {
+    struct praid_pcache_entry *e;
+    unsigned int idx, n;
+    unsigned long flags;
+    uint8_t *data;
+    bool hit = dst != NULL;
+
+    while(len) {
+        idx = sector % PRAID_PCACHE_BLOCK_SECTORS;
+        n = min_t(unsigned int, len >> KERNEL_SECTOR_SHIFT, PRAID_PCACHE_BLOCK_SECTORS - idx);
+
+        spin_lock_irqsave(&p->lock, flags);
+        e = praid_pcache_get(p, praid_pcache_key(member, sector));
+        data = page_address(e->page) + (idx << KERNEL_SECTOR_SHIFT);
+        if(hit && find_next_zero_bit(e->valid, idx + n, idx) < idx + n) {
+            hit = false;
+        }
+        if(hit) {
+            memcpy(dst, data, n << KERNEL_SECTOR_SHIFT);
+            dst += n << KERNEL_SECTOR_SHIFT;
+        }
+        memcpy(data, src, n << KERNEL_SECTOR_SHIFT);
+        bitmap_set(e->valid, idx, n);
+        spin_unlock_irqrestore(&p->lock, flags);
+
+        src += n << KERNEL_SECTOR_SHIFT;
+        sector += n;
+        len -= n << KERNEL_SECTOR_SHIFT;
+    }
+
+    return hit;
+}
+
+/*
+ * 写入数据盘的 bio 下发前调用，用 bio 的数据更新缓存。old 为 pcievdrv_submit_verify 中暂存
+ * 旧数据的缓冲区时，先从缓存拷贝旧数据到 old 中，全部命中时返回 true，不需要再读成员盘
+ */
+bool praid_pcache_write(struct praid_dev *dev, struct bio *bio, void *old) {
+    struct praid_pcache *p = &dev->pcache;
+    unsigned int member = container_of(bio, struct praid_bio, bio)->member->index;
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    uint8_t *src, *dst = old;
+    bool hit = old != NULL;
+
+    if(!p->enabled || member >= dev->disk_cnt) {
+        return false;
+    }
+
+    // old 中的旧数据和 bio 的数据按顺序一一对应
+    praid_bio_for_each_data(bvec, bio, iter) {
+        src = bvec_kmap_local(&bvec);
+
+        if(!praid_pcache_copy(p, member, sector, src, hit ? dst : NULL, bvec.bv_len)) {
+            hit = false;
+        }
+
+        kunmap_local(src);
+        sector += bvec.bv_len >> KERNEL_SECTOR_SHIFT;
+        if(dst) {
+            dst += bvec.bv_len;
+        }
+    }
+
+    if(old) {
+        atomic64_inc(hit ? &p->hits : &p->misses);
+    }
+
+    return hit;
+}
+
+// 使数据盘 member 上 [sector, sector + nr_sectors) 的缓存失效
+void praid_pcache_invalidate_range(struct praid_dev *dev, unsigned int member, sector_t sector, sector_t nr_sectors) {
+    struct praid_pcache *p = &dev->pcache;
+    sector_t end = sector + nr_sectors;
+    struct praid_pcache_entry *e;
+    unsigned long flags;
+    unsigned int idx, n;
+
+    if(!p->enabled || member >= dev->disk_cnt) {
+        return;
+    }
+
+    for(; sector < end; sector += n) {
+        idx = sector % PRAID_PCACHE_BLOCK_SECTORS;
+        n = min_t(sector_t, end - sector, PRAID_PCACHE_BLOCK_SECTORS - idx);
+
+        spin_lock_irqsave(&p->lock, flags);
+        e = praid_pcache_lookup(p, praid_pcache_key(member, sector));
+        if(e) {
+            bitmap_clear(e->valid, idx, n);
+        }
+        spin_unlock_irqrestore(&p->lock, flags);
+    }
+}
+
+// 降级路径处理的写入不经过缓存，使 bio 范围内的缓存失效
+void praid_pcache_invalidate(struct praid_dev *dev, struct bio *bio) {
+    praid_pcache_invalidate_range(dev, container_of(bio, struct praid_bio, bio)->member->index, bio->bi_iter.bi_sector, bio_sectors(bio));
+}
+
+static void praid_pcache_free_all(struct praid_pcache *p) {
+    unsigned long i;
+
+    if(p->entries) {
+        for(i = 0; i < p->nr_entries; i ++) {
+            if(p->entries[i].page) {
+                __free_page(p->entries[i].page);
+            }
+        }
+    }
+    kvfree(p->entries);
+    kvfree(p->hash);
+}
+
+int praid_pcache_init(struct praid_dev *dev) {
+    struct praid_pcache *p = &dev->pcache;
+    unsigned long i;
+
+    if(!dev->config.pcache_size) {
+        return 0;
+    }
+
+    spin_lock_init(&p->lock);
+    INIT_LIST_HEAD(&p->lru);
+    p->nr_entries = dev->config.pcache_size >> PAGE_SHIFT;
+    p->hash_bits = ilog2(roundup_pow_of_two(p->nr_entries));
+
+    p->entries = kvcalloc(p->nr_entries, sizeof(*p->entries), GFP_KERNEL);
+    p->hash = kvcalloc(1UL << p->hash_bits, sizeof(*p->hash), GFP_KERNEL);
+    if(!p->entries || !p->hash) {
+        goto out_free;
+    }
+
+    for(i = 0; i < p->nr_entries; i ++) {
+        p->entries[i].page = alloc_pages_node(dev->config.node, GFP_KERNEL, 0);
+        if(!p->entries[i].page) {
+            goto out_free;
+        }
+        list_add_tail(&p->entries[i].lru, &p->lru);
+    }
+
+    p->enabled = true;
+
+    PRAID_INFO("%s%d: old data cache %llu MiB.\n", VPCIEDISK_NAME, dev->id, BYTE_TO_MB((u64)p->nr_entries << PAGE_SHIFT));
+
+    return 0;
+
+out_free:
+    praid_pcache_free_all(p);
+    memset(p, 0, sizeof(*p));
+    return -ENOMEM;
+}
+
+// 所有写入结束之后调用
+void praid_pcache_exit(struct praid_dev *dev) {
+    struct praid_pcache *p = &dev->pcache;
+
+    if(!p->enabled) {
+        return;
+    }
+
+    p->enabled = false;
+    praid_pcache_free_all(p);
+}
@@ -0,0 +1,18 @@
+#ifndef __PRAID_PCACHE_H__
+#define __PRAID_PCACHE_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_PCACHE_MIN_SIZE MB(1)
+#define PRAID_PCACHE_BLOCK_SECTORS (PAGE_SIZE >> KERNEL_SECTOR_SHIFT) // 每项缓存一页
+
+bool praid_pcache_write(struct praid_dev *dev, struct bio *bio, void *old);
+void praid_pcache_invalidate(struct praid_dev *dev, struct bio *bio);
+void praid_pcache_invalidate_range(struct praid_dev *dev, unsigned int member, sector_t sector, sector_t nr_sectors);
+
+int praid_pcache_init(struct praid_dev *dev);
+void praid_pcache_exit(struct praid_dev *dev);
+
+#endif
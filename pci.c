@@ -24,7 +24,7 @@ static void __signal_irq(const char *type, unsigned int irq)
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
-static void __process_msi_irq(int msi_index)
+static void __process_msi_irq(struct pciev_dev *pciev_vdev, int msi_index)
 {
 	unsigned int virq = msi_get_virq(&pciev_vdev->pdev->dev, msi_index);
 
@@ -32,7 +32,7 @@ static void __process_msi_irq(int msi_index)
 	__signal_irq("msi", virq);
 }
 #else
-static void __process_msi_irq(int msi_index)
+static void __process_msi_irq(struct pciev_dev *pciev_vdev, int msi_index)
 {
 	struct msi_desc *msi_desc, *tmp;
 
@@ -47,10 +47,14 @@ static void __process_msi_irq(int msi_index)
 }
 #endif
 
-void pciev_signal_irq(int msi_index)
+void pciev_signal_irq(struct pciev_dev *pciev_vdev, int msi_index)
 {
+	// 共享中断线上由 isr 区分是哪个设备发出的中断
+	pciev_vdev->bar->isr = 1;
+	smp_wmb();
+
 	if (pciev_vdev->pdev->msix_enabled) {
-		__process_msi_irq(msi_index);
+		__process_msi_irq(pciev_vdev, msi_index);
 	} else {
 		pciev_vdev->pcihdr->sts.is = 1;
 
@@ -70,7 +74,7 @@ void pciev_signal_irq(int msi_index)
  * Also, memory barrier is not necessary here since BAR-related
  * operations are only processed by the dispatcher.
  */
-void pciev_proc_bars(void)
+void pciev_proc_bars(struct pciev_dev *pciev_vdev)
 {
 	volatile struct pciev_bar *old_bar = pciev_vdev->old_bar;
 	volatile struct pciev_bar *bar = pciev_vdev->bar;
@@ -80,6 +84,10 @@ void pciev_proc_bars(void)
 		bar->dev_cnt = old_bar->dev_cnt; // read only
 	}
 
+	if (old_bar->chunk_size != bar->chunk_size) {
+		bar->chunk_size = old_bar->chunk_size; // read only
+	}
+
 // out:
 	smp_mb();
 	return;
@@ -90,44 +98,66 @@ static enum pciev_io_t {
 	PCIEV_BIO_WRITE = 1,
 };
 
+// 读写缓冲区的 [offset, offset + size)，首页的页内偏移和 offset 相同，范围可以跨页
 static int pciev_submit_bio(void* buffer, size_t offset, size_t size, sector_t sector_num, struct block_device* blk_dev, enum pciev_io_t rw) {
 	struct bio *bio;
-	void *page_data;
-	struct page* page;
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
+	uint8_t *page_data;
+	struct page *page, *pages = NULL;
+	size_t done, len, pofs = offset & ~PAGE_MASK;
+	unsigned int i, nr_pages = DIV_ROUND_UP(pofs + size, PAGE_SIZE), order = get_order(nr_pages << PAGE_SHIFT);
 	int ret = 0;
 
-	bio = bio_alloc(GFP_KERNEL, 1);
+	bio = bio_alloc(GFP_KERNEL, nr_pages);
     if(!bio) {
 		PCIEV_ERROR("Failed to allocate bio\n");
 		ret = -EINVAL;
 		goto out;
     }
 
-	page = alloc_page(GFP_KERNEL);
-	if(!page) {
-		PCIEV_ERROR("Failed to allocate page\n");
-		ret = -EINVAL;
-		goto out_bio;
-	}
+	bio_set_dev(bio, blk_dev);
+	bio->bi_iter.bi_sector = sector_num;
 
-	page_data = kmap(page);
-	if(!page_data) {
-		PCIEV_ERROR("Page map error\n");
-		ret = -EINVAL;
-		goto out_page;
+	// 优先分配物理连续的页，在 bio 中合并为一个多页的段。拆成单页后可以和逐页分配的一样释放
+	if(order) {
+		pages = alloc_pages(GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN, order);
 	}
-
-	if(rw == PCIEV_BIO_WRITE) {
-		memcpy((uint8_t*)page_data + offset, (uint8_t*)buffer + offset, size);
+	if(pages) {
+		split_page(pages, order);
+		for(i = nr_pages; i < (1U << order); i ++) {
+			__free_page(pages + i);
+		}
 	}
 
-	bio_set_dev(bio, blk_dev);
-	bio->bi_iter.bi_sector = sector_num;
+	for(i = 0, done = 0; done < size; i ++, done += len, pofs = 0) {
+		len = min_t(size_t, PAGE_SIZE - pofs, size - done);
 
-	if(bio_add_page(bio, page, size, offset) != size) {
-		PCIEV_ERROR("Failed to add bio page\n");
-		ret = -EIO;
-		goto out_map;
+		page = pages ? pages + i : alloc_page(GFP_KERNEL);
+		if(!page) {
+			PCIEV_ERROR("Failed to allocate page\n");
+			ret = -EINVAL;
+			goto out_pages;
+		}
+
+		if(rw == PCIEV_BIO_WRITE) {
+			page_data = kmap_local_page(page);
+			memcpy(page_data + pofs, (uint8_t*)buffer + offset + done, len);
+			kunmap_local(page_data);
+		}
+
+		if(bio_add_page(bio, page, len, pofs) != len) {
+			PCIEV_ERROR("Failed to add bio page\n");
+			// 连续分配的页中还没有加入 bio 的部分在这里释放
+			for(; pages && i < nr_pages; i ++) {
+				__free_page(pages + i);
+			}
+			if(!pages) {
+				__free_page(page);
+			}
+			ret = -EIO;
+			goto out_pages;
+		}
 	}
 
 	PCIEV_INFO("sta_sector=%llu, size=%lu, offset=%lu", sector_num, size, offset);
@@ -136,94 +166,211 @@ static int pciev_submit_bio(void* buffer, size_t offset, size_t size, sector_t s
 	if(submit_bio_wait(bio) < 0) {
 		PCIEV_ERROR("Failed to submit bio\n");
 		ret = -EIO;
-		goto out_map;
+		goto out_pages;
 	}
 
 	if(rw == PCIEV_BIO_READ) {
-		memcpy((uint8_t*)buffer + offset, (uint8_t*)page_data + offset, size);
+		done = 0;
+		bio_for_each_segment_all(bvec, bio, iter_all) {
+			page_data = kmap_local_page(bvec->bv_page);
+			memcpy((uint8_t*)buffer + offset + done, page_data + bvec->bv_offset, bvec->bv_len);
+			kunmap_local(page_data);
+			done += bvec->bv_len;
+		}
 	}
 
-out_map:
-	kunmap(page);
-out_page:
-	__free_page(page);
-out_bio:
+out_pages:
+	bio_for_each_segment_all(bvec, bio, iter_all)
+		__free_page(bvec->bv_page);
 	bio_put(bio);
 out:
 	return ret;
 }
 
-void pciev_dispatcher_clac_xor_single(void) {
+static int pciev_dispatcher_clac_xor_single(struct pciev_dev *pciev_vdev) {
 	uint64_t value, toffset, tsize, nowofs, offset;
 	uint8_t *data, *res;
-
-	if(pciev_vdev->bar->io_property.io_num <= pciev_vdev->bar->io_property.io_done) {
-		return;
-	}
-
-	PCIEV_DEBUG("4\n");
-
-	pciev_vdev->bar->io_property.io_done ++;
+	uint32_t chunk_size = pciev_vdev->config.chunk_size;
 
 	toffset = pciev_vdev->bar->io_property.offset;
 	tsize = pciev_vdev->bar->io_property.size;
 
 	data = pciev_vdev->storage_mapped;
-	res = data + PAGE_SIZE * 2;
+	res = PTR_BAR_TO_CHUNK_V(data, chunk_size);
 
 	if(pciev_submit_bio(res, toffset, tsize, pciev_vdev->bar->io_property.sector_sta, pciev_vdev->verify_blk, PCIEV_BIO_READ) < 0) {
 		PCIEV_ERROR("Failed to read verify.\n");
-		return;
+		return -EIO;
 	}
 
 	for(offset = 0; offset < tsize; offset += sizeof(uint64_t)) {
 		nowofs = toffset + offset;
 		value = U64_DATA(res, nowofs);
-		value ^= U64_DATA(data, nowofs);
-		value ^= U64_DATA(data, nowofs + CHUNK_SIZE);
-		PCIEV_DEBUG("offset=%4lld, %8llu = %8llu xor %8llu xor %8llu\n", nowofs, value, U64_DATA(res, nowofs), U64_DATA(data, nowofs), U64_DATA(data, nowofs + CHUNK_SIZE));
+		value ^= U64_DATA(PTR_BAR_TO_CHUNK_O(data, chunk_size), nowofs);
+		value ^= U64_DATA(PTR_BAR_TO_CHUNK_N(data, chunk_size), nowofs);
+		PCIEV_DEBUG("offset=%4lld, %8llu = %8llu xor %8llu xor %8llu\n", nowofs, value, U64_DATA(res, nowofs), U64_DATA(PTR_BAR_TO_CHUNK_O(data, chunk_size), nowofs), U64_DATA(PTR_BAR_TO_CHUNK_N(data, chunk_size), nowofs));
 		U64_DATA(res, nowofs) = value;
 	}
 
 	if(pciev_submit_bio(res, toffset, tsize, pciev_vdev->bar->io_property.sector_sta, pciev_vdev->verify_blk, PCIEV_BIO_WRITE) < 0) {
 		PCIEV_ERROR("Failed to write verify.\n");
-		return;
+		return -EIO;
 	}
-	
-	pciev_signal_irq(0);
+
+	return 0;
 }
 
-// void pciev_disptcher_calc_xor_whole(void) {
-// 	int offset, idev;
-// 	uint64_t value;
-// 	uint8_t *data, *res;
+// 计算旧数据和新数据的差值，记录头部和差值顺序写入校验盘的日志区域，校验数据本身不读写
+static int pciev_dispatcher_delta_log(struct pciev_dev *pciev_vdev) {
+	uint64_t toffset, tsize, nowofs, offset;
+	uint8_t *data, *res;
+	uint32_t chunk_size = pciev_vdev->config.chunk_size;
+	struct pciev_plog_rec *rec;
+	sector_t log_sector = pciev_vdev->bar->io_property.log_sector;
+	int ret = 0;
+
+	toffset = pciev_vdev->bar->io_property.offset;
+	tsize = pciev_vdev->bar->io_property.size;
+
+	data = pciev_vdev->storage_mapped;
+	res = PTR_BAR_TO_CHUNK_V(data, chunk_size);
+
+	for(offset = 0; offset < tsize; offset += sizeof(uint64_t)) {
+		nowofs = toffset + offset;
+		U64_DATA(res, nowofs) = U64_DATA(PTR_BAR_TO_CHUNK_O(data, chunk_size), nowofs) ^ U64_DATA(PTR_BAR_TO_CHUNK_N(data, chunk_size), nowofs);
+	}
 
-// 	// no job, return and wait
-// 	if(pciev_vdev->bar->io_property.db != DB_FREE) {
-// 		return;
-// 	}
+	rec = kzalloc(PCIEV_PLOG_ALIGN_SECTORS << KERNEL_SECTOR_SHIFT, GFP_KERNEL);
+	if(!rec) {
+		return -ENOMEM;
+	}
+	rec->magic = cpu_to_le32(PCIEV_PLOG_MAGIC);
+	rec->size = cpu_to_le32(tsize);
+	rec->seq = cpu_to_le64(pciev_vdev->bar->io_property.log_seq);
+	rec->sector = cpu_to_le64(pciev_vdev->bar->io_property.sector_sta);
+
+	if(pciev_submit_bio(res, toffset, tsize, log_sector + PCIEV_PLOG_ALIGN_SECTORS, pciev_vdev->verify_blk, PCIEV_BIO_WRITE) < 0 ||
+	   pciev_submit_bio(rec, 0, PCIEV_PLOG_ALIGN_SECTORS << KERNEL_SECTOR_SHIFT, log_sector, pciev_vdev->verify_blk, PCIEV_BIO_WRITE) < 0) {
+		PCIEV_ERROR("Failed to write parity log.\n");
+		ret = -EIO;
+	}
 
-// 	pciev_vdev->bar->io_property.db = DB_BUSY;
+	kfree(rec);
+	return ret;
+}
 
-// 	// has job, now 0 to dev_cnt-1 chunks filled with data
-// 	// clac res to dec_cnt
+// 读出校验数据，异或上槽位 [0, nr_src) 后写回，用于合并校验日志中的差值
+static int pciev_dispatcher_fold(struct pciev_dev *pciev_vdev) {
+	uint64_t value, toffset, tsize, offset;
+	uint32_t idev, nr_src;
+	uint8_t *data, *res;
+	uint32_t chunk_size = pciev_vdev->config.chunk_size;
 
-// 	data = pciev_vdev->storage_mapped;
-// 	res = data + PAGE_SIZE * pciev_vdev->config.cnt_disk;
+	toffset = pciev_vdev->bar->io_property.offset;
+	tsize = pciev_vdev->bar->io_property.size;
+	nr_src = pciev_vdev->bar->io_property.nr_src;
 
-// 	for(offset = 0; offset < PAGE_SIZE; offset += sizeof(uint64_t)) {
-// 		value = 0;
-// 		for(idev = 0; idev < pciev_vdev->config.cnt_disk; idev ++) {
-// 			value ^= *(uint64_t*)(data + PAGE_SIZE * idev + offset);
-// 		}
-// 		*(uint64_t*)(res + offset) = value;
-// 	}
+	if(nr_src + 1 > PCIEV_BAR_SLOTS(pciev_vdev->config.cnt_disk) || toffset + tsize > PAGE_SIZE) {
+		PCIEV_ERROR("Invalid fold request, nr_src=%u, offset=%llu, size=%llu\n", nr_src, toffset, tsize);
+		return -EINVAL;
+	}
 
-// 	pciev_vdev->bar->io_property.db = DB_DONE;
-// }
+	data = pciev_vdev->storage_mapped;
+	res = PTR_BAR_TO_SLOT(data, nr_src, chunk_size);
+
+	if(pciev_submit_bio(res, toffset, tsize, pciev_vdev->bar->io_property.sector_sta, pciev_vdev->verify_blk, PCIEV_BIO_READ) < 0) {
+		PCIEV_ERROR("Failed to read verify.\n");
+		return -EIO;
+	}
+
+	for(offset = toffset; offset < toffset + tsize; offset += sizeof(uint64_t)) {
+		value = U64_DATA(res, offset);
+		for(idev = 0; idev < nr_src; idev ++) {
+			value ^= U64_DATA(PTR_BAR_TO_SLOT(data, idev, chunk_size), offset);
+		}
+		U64_DATA(res, offset) = value;
+	}
+
+	if(pciev_submit_bio(res, toffset, tsize, pciev_vdev->bar->io_property.sector_sta, pciev_vdev->verify_blk, PCIEV_BIO_WRITE) < 0) {
+		PCIEV_ERROR("Failed to write verify.\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+// 槽位 [0, nr_src) 异或后写入槽位 nr_src，用于整条带的校验计算和缺失 chunk 的重建
+static int pciev_dispatcher_calc_xor_whole(struct pciev_dev *pciev_vdev) {
+	uint64_t value, toffset, tsize, offset;
+	uint32_t idev, nr_src;
+	uint8_t *data, *res;
+	uint32_t chunk_size = pciev_vdev->config.chunk_size;
+
+	toffset = pciev_vdev->bar->io_property.offset;
+	tsize = pciev_vdev->bar->io_property.size;
+	nr_src = pciev_vdev->bar->io_property.nr_src;
+
+	if(nr_src + 1 > PCIEV_BAR_SLOTS(pciev_vdev->config.cnt_disk) || toffset + tsize > chunk_size) {
+		PCIEV_ERROR("Invalid xor request, nr_src=%u, offset=%llu, size=%llu\n", nr_src, toffset, tsize);
+		return -EINVAL;
+	}
+
+	data = pciev_vdev->storage_mapped;
+	res = PTR_BAR_TO_SLOT(data, nr_src, chunk_size);
+
+	for(offset = toffset; offset < toffset + tsize; offset += sizeof(uint64_t)) {
+		value = 0;
+		for(idev = 0; idev < nr_src; idev ++) {
+			value ^= U64_DATA(PTR_BAR_TO_SLOT(data, idev, chunk_size), offset);
+		}
+		U64_DATA(res, offset) = value;
+	}
+
+	return 0;
+}
+
+void pciev_dispatcher_proc_io(struct pciev_dev *pciev_vdev) {
+	int ret;
+
+	if(pciev_vdev->bar->io_property.io_num <= pciev_vdev->bar->io_property.io_done) {
+		return;
+	}
+
+	pciev_vdev->bar->io_property.io_done ++;
+
+	switch(pciev_vdev->bar->io_property.opcode) {
+	case PCIEV_OP_DELTA:
+		ret = pciev_dispatcher_clac_xor_single(pciev_vdev);
+		break;
+	case PCIEV_OP_XOR:
+		ret = pciev_dispatcher_calc_xor_whole(pciev_vdev);
+		break;
+	case PCIEV_OP_DELTA_LOG:
+		ret = pciev_dispatcher_delta_log(pciev_vdev);
+		break;
+	case PCIEV_OP_FOLD:
+		ret = pciev_dispatcher_fold(pciev_vdev);
+		break;
+	default:
+		PCIEV_ERROR("Unknown opcode %u\n", pciev_vdev->bar->io_property.opcode);
+		ret = -EINVAL;
+		break;
+	}
+
+	// 无论成功与否都要通知驱动，否则驱动会一直等待
+	pciev_vdev->bar->io_property.status = ret ? 1 : 0;
+	pciev_signal_irq(pciev_vdev, 0);
+}
+
+static inline struct pciev_dev *bus_to_pciev(struct pci_bus *bus)
+{
+	return container_of(bus->sysdata, struct pciev_dev, sysdata);
+}
 
 static int pciev_pci_read(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *val)
 {
+	struct pciev_dev *pciev_vdev = bus_to_pciev(bus);
+
 	if (devfn != 0)
 		return 1;
 
@@ -236,6 +383,7 @@ static int pciev_pci_read(struct pci_bus *bus, unsigned int devfn, int where, in
 
 static int pciev_pci_write(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 _val)
 {
+	struct pciev_dev *pciev_vdev = bus_to_pciev(bus);
 	u32 mask = ~(0U);
 	u32 val = 0x00;
 	int target = where;
@@ -299,11 +447,6 @@ static struct pci_ops pciev_pci_ops = {
 	.write = pciev_pci_write,
 }; // specify how to read and write PCIE configuration space
 
-static struct pci_sysdata pciev_pci_sysdata = {
-	.domain = PCIEV_PCI_DOMAIN_NUM, // PCI domain, identify host bridge number(?)
-	.node = 0, // NUMA node
-};
-
 static void __dump_pci_dev(struct pci_dev *dev)
 {
 	/*
@@ -318,7 +461,7 @@ static void __dump_pci_dev(struct pci_dev *dev)
 	*/
 }
 
-static void __init_pciev_bar(struct pci_dev *dev)
+static void __init_pciev_bar(struct pciev_dev *pciev_vdev, struct pci_dev *dev)
 {
 	struct pciev_bar *bar =
 		memremap(pci_resource_start(dev, 0), PAGE_SIZE, MEMREMAP_WT);
@@ -330,6 +473,7 @@ static void __init_pciev_bar(struct pci_dev *dev)
 	memset(bar, 0x0, PAGE_SIZE);
 
 	bar->dev_cnt = pciev_vdev->config.cnt_disk;
+	bar->chunk_size = pciev_vdev->config.chunk_size;
 
 	// PCIEV_INFO("in bar data: 0x%llx 0x%llx.\n", bar->io_cnt, bar->storage_start, bar->storage_size);
 
@@ -348,19 +492,19 @@ static void __init_pciev_bar(struct pci_dev *dev)
 	// };
 }
 
-static struct pci_bus *__create_pci_bus(void)
+static struct pci_bus *__create_pci_bus(struct pciev_dev *pciev_vdev)
 {
 	struct pci_bus *bus = NULL;
 	struct pci_dev *dev;
 
-	bus = pci_scan_bus(PCIEV_PCI_BUS_NUM, &pciev_pci_ops, &pciev_pci_sysdata); // Scans the complete bus and update into the pci access structure(?)
+	bus = pci_scan_bus(pciev_vdev->config.bus_nr, &pciev_pci_ops, &pciev_vdev->sysdata); // Scans the complete bus and update into the pci access structure(?)
 
 	if (!bus) {
 		PCIEV_ERROR("Unable to create PCI bus\n");
 		return NULL;
 	}
 
-	/* XXX Only support a singe NVMeVirt instance in the system for now */
+	/* 每个设备独占一条虚拟总线 */
 	list_for_each_entry(dev, &bus->devices, bus_list) {
 		struct resource *res = &dev->resource[0];
 		res->parent = &iomem_resource; // identify resource tree
@@ -369,7 +513,7 @@ static struct pci_bus *__create_pci_bus(void)
 		dev->irq = pciev_vdev->pcihdr->intr.iline; // Interrupt Line
 		// __dump_pci_dev(dev);
 
-		__init_pciev_bar(dev);
+		__init_pciev_bar(pciev_vdev, dev);
 
 		pciev_vdev->old_bar = kzalloc(PAGE_SIZE, GFP_KERNEL);
 		PCIEV_INFO("old_bar: %p, bar: %p\n", pciev_vdev->old_bar, pciev_vdev->bar);
@@ -383,17 +527,23 @@ static struct pci_bus *__create_pci_bus(void)
 		memset(pciev_vdev->msix_table, 0x00, NR_MAX_IO_QUEUE * PCI_MSIX_ENTRY_SIZE);
 	}
 
-	PCIEV_INFO("Virtual PCI bus created (node %d)\n", pciev_pci_sysdata.node);
+	PCIEV_INFO("Virtual PCI bus %#x created (node %d)\n", pciev_vdev->config.bus_nr, pciev_vdev->sysdata.node);
 
 	return bus;
 };
 
-struct pciev_dev *VDEV_INIT(void)
+struct pciev_dev *VDEV_INIT(int node)
 {
 	struct pciev_dev *pciev_vdev;
-	pciev_vdev = kzalloc(sizeof(*pciev_vdev), GFP_KERNEL);
+	pciev_vdev = kzalloc_node(sizeof(*pciev_vdev), GFP_KERNEL, node);
+	if (!pciev_vdev)
+		return NULL;
 
-	pciev_vdev->virtDev = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	pciev_vdev->virtDev = kzalloc_node(PAGE_SIZE, GFP_KERNEL, node);
+	if (!pciev_vdev->virtDev) {
+		kfree(pciev_vdev);
+		return NULL;
+	}
 
 	pciev_vdev->pcihdr = pciev_vdev->virtDev + OFFS_PCI_HDR;
 	pciev_vdev->pmcap = pciev_vdev->virtDev + OFFS_PCI_PM_CAP;
@@ -576,7 +726,10 @@ bool PCIEV_PCI_INIT(struct pciev_dev *pciev_vdev)
 
 	pciev_vdev->intx_disabled = false;
 
-	pciev_vdev->virt_bus = __create_pci_bus();
+	pciev_vdev->sysdata.domain = PCIEV_PCI_DOMAIN_NUM; // PCI domain, identify host bridge number(?)
+	pciev_vdev->sysdata.node = pciev_vdev->config.node; // NUMA node
+
+	pciev_vdev->virt_bus = __create_pci_bus(pciev_vdev);
 	if (!pciev_vdev->virt_bus)
 		return false;
 
@@ -0,0 +1,392 @@
+#include <linux/pci.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-direct.h>
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/iommu.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "praid.h"
+#include "pciev.h"
+#include "pciedrv.h"
+#include "pciedma.h"
+
+/*
+ * 把阵列的虚拟加速设备注册为 dmaengine 的提供者，一个通道，支持 DMA_XOR 和 DMA_XOR_VAL。
+ * 公共通道会被 async_tx 的使用者（例如 md 的 raid456）选中，也可以由 dma_request_channel 申请。
+ *
+ * 描述符按提交顺序在单独的有序工作队列上处理：源数据拷贝到 chunk 计算区域的槽位中，由设备异或后
+ * 把结果拷贝回目的地址，超过一个 chunk 的描述符分多次计算。和阵列自身的校验计算一样持有 sem，
+ * 两者在设备上交替进行。dma 地址按直接映射转换为物理地址，设备处于转换地址的 iommu 域中时不注册。
+ * 设备没有 Q 校验的计算，不支持 DMA_PQ
+ */
+
+struct pcievdrv_dma_desc {
+    struct dma_async_tx_descriptor txd;
+    struct list_head node;
+    dma_addr_t dst;
+    enum sum_check_flags *result; // DMA_XOR_VAL 的结果，DMA_XOR 时为 NULL
+    size_t len;
+    unsigned int nr_src;
+    dma_addr_t src[];
+};
+
+static inline struct pcievdrv_dma *to_pcievdrv_dma(struct dma_chan *chan) {
+    return container_of(chan, struct pcievdrv_dma, chan);
+}
+
+// 在 dma 地址和内核缓冲区之间拷贝，逐页映射，高端内存的页也可以使用
+static void pcievdrv_dma_copy(struct device *dev, dma_addr_t addr, void *buf, size_t len, bool to_buf) {
+    phys_addr_t phys = dma_to_phys(dev, addr);
+    size_t done, size;
+    uint8_t *p;
+
+    for(done = 0; done < len; done += size, phys += size) {
+        size = min_t(size_t, len - done, PAGE_SIZE - offset_in_page(phys));
+        p = kmap_local_page(pfn_to_page(PHYS_PFN(phys)));
+        if(to_buf) {
+            memcpy((uint8_t*)buf + done, p + offset_in_page(phys), size);
+        } else {
+            memcpy(p + offset_in_page(phys), (uint8_t*)buf + done, size);
+        }
+        kunmap_local(p);
+    }
+}
+
+// 由设备计算一个描述符，返回设备的结果
+static int pcievdrv_dma_run(struct pcievdrv_dma *dma, struct praid_dev *dev, struct pcievdrv_dma_desc *d) {
+    struct device *ddev = dma->dma.dev;
+    size_t off, len;
+    unsigned int i, chunk_size;
+    int ret = 0;
+
+    if(d->result) {
+        *d->result = 0;
+    }
+
+    for(off = 0; off < d->len && !ret; off += len) {
+        // 扩容时 chunk 计算区域重新映射，持有 sem 时读取
+        down(&dev->sem);
+        chunk_size = dev->geo.chunk_size;
+        len = min_t(size_t, d->len - off, chunk_size);
+
+        for(i = 0; i < d->nr_src; i ++) {
+            pcievdrv_dma_copy(ddev, d->src[i] + off, PTR_BAR_TO_SLOT(dev->chunk_addr, i, chunk_size), len, true);
+        }
+
+        ret = pcievdrv_submit_xor_slots(dev, d->nr_src, 0, len);
+        if(!ret) {
+            if(d->result) {
+                if(memchr_inv(PTR_BAR_TO_SLOT(dev->chunk_addr, d->nr_src, chunk_size), 0, len)) {
+                    *d->result |= SUM_CHECK_P_RESULT;
+                }
+            } else {
+                pcievdrv_dma_copy(ddev, d->dst + off, PTR_BAR_TO_SLOT(dev->chunk_addr, d->nr_src, chunk_size), len, false);
+            }
+        }
+
+        up(&dev->sem);
+    }
+
+    return ret;
+}
+
+// 释放使用者已确认的描述符，调用者持有 dma->lock
+static void pcievdrv_dma_cleanup(struct pcievdrv_dma *dma, struct list_head *free) {
+    struct pcievdrv_dma_desc *d, *n;
+
+    list_for_each_entry_safe(d, n, &dma->done, node) {
+        if(async_tx_test_ack(&d->txd)) {
+            list_move_tail(&d->node, free);
+        }
+    }
+}
+
+static void pcievdrv_dma_free_list(struct list_head *free) {
+    struct pcievdrv_dma_desc *d, *n;
+
+    list_for_each_entry_safe(d, n, free, node) {
+        list_del(&d->node);
+        kfree(d);
+    }
+}
+
+/*
+ * 按顺序处理已 issue 的描述符。完成后调用使用者的回调并启动依赖于它的操作，
+ * 描述符留到使用者确认后释放
+ */
+static void pcievdrv_dma_work(struct work_struct *work) {
+    struct pcievdrv_dma *dma = container_of(work, struct pcievdrv_dma, work);
+    struct dma_async_tx_descriptor *txd;
+    struct dmaengine_result res;
+    struct pcievdrv_dma_desc *d;
+    struct praid_dev *dev;
+    unsigned long flags;
+    LIST_HEAD(free);
+    int ret;
+
+    for(;;) {
+        spin_lock_irqsave(&dma->lock, flags);
+        d = list_first_entry_or_null(&dma->issued, struct pcievdrv_dma_desc, node);
+        if(d) {
+            list_del(&d->node);
+        }
+        dev = dma->dev;
+        spin_unlock_irqrestore(&dma->lock, flags);
+        if(!d) {
+            break;
+        }
+
+        // 阵列已移除而使用者还持有通道时，描述符以错误结束
+        txd = &d->txd;
+        ret = dev ? pcievdrv_dma_run(dma, dev, d) : -ENODEV;
+        if(ret) {
+            atomic64_inc(&dma->errors);
+        } else {
+            atomic64_inc(d->result ? &dma->vals : &dma->xors);
+        }
+
+        spin_lock_irqsave(&dma->lock, flags);
+        dma->chan.completed_cookie = txd->cookie;
+        txd->cookie = 0;
+        spin_unlock_irqrestore(&dma->lock, flags);
+
+        res.result = ret ? DMA_TRANS_ABORTED : DMA_TRANS_NOERROR;
+        res.residue = 0;
+        if(txd->callback_result) {
+            txd->callback_result(txd->callback_param, &res);
+        } else if(txd->callback) {
+            txd->callback(txd->callback_param);
+        }
+        dma_run_dependencies(txd);
+
+        spin_lock_irqsave(&dma->lock, flags);
+        list_add_tail(&d->node, &dma->done);
+        pcievdrv_dma_cleanup(dma, &free);
+        spin_unlock_irqrestore(&dma->lock, flags);
+
+        pcievdrv_dma_free_list(&free);
+        cond_resched();
+    }
+}
+
+static dma_cookie_t pcievdrv_dma_tx_submit(struct dma_async_tx_descriptor *txd) {
+    struct pcievdrv_dma *dma = to_pcievdrv_dma(txd->chan);
+    struct pcievdrv_dma_desc *d = container_of(txd, struct pcievdrv_dma_desc, txd);
+    struct dma_chan *chan = txd->chan;
+    unsigned long flags;
+    dma_cookie_t cookie;
+
+    spin_lock_irqsave(&dma->lock, flags);
+    cookie = chan->cookie + 1;
+    if(cookie < DMA_MIN_COOKIE) {
+        cookie = DMA_MIN_COOKIE;
+    }
+    chan->cookie = txd->cookie = cookie;
+    list_add_tail(&d->node, &dma->submitted);
+    spin_unlock_irqrestore(&dma->lock, flags);
+
+    return cookie;
+}
+
+// prep 可能在原子上下文中调用
+static struct pcievdrv_dma_desc *pcievdrv_dma_desc_alloc(struct dma_chan *chan, dma_addr_t *src, unsigned int src_cnt, size_t len, unsigned long flags) {
+    struct pcievdrv_dma_desc *d;
+
+    if(!src_cnt || src_cnt > chan->device->max_xor || !len) {
+        return NULL;
+    }
+
+    d = kzalloc(struct_size(d, src, src_cnt), GFP_NOWAIT);
+    if(!d) {
+        return NULL;
+    }
+
+    dma_async_tx_descriptor_init(&d->txd, chan);
+    d->txd.tx_submit = pcievdrv_dma_tx_submit;
+    d->txd.flags = flags;
+    INIT_LIST_HEAD(&d->node);
+    d->len = len;
+    d->nr_src = src_cnt;
+    memcpy(d->src, src, src_cnt * sizeof(*src));
+
+    return d;
+}
+
+static struct dma_async_tx_descriptor *pcievdrv_dma_prep_xor(struct dma_chan *chan, dma_addr_t dst, dma_addr_t *src, unsigned int src_cnt, size_t len, unsigned long flags) {
+    struct pcievdrv_dma_desc *d = pcievdrv_dma_desc_alloc(chan, src, src_cnt, len, flags);
+
+    if(!d) {
+        return NULL;
+    }
+    d->dst = dst;
+
+    return &d->txd;
+}
+
+static struct dma_async_tx_descriptor *pcievdrv_dma_prep_xor_val(struct dma_chan *chan, dma_addr_t *src, unsigned int src_cnt, size_t len, enum sum_check_flags *result, unsigned long flags) {
+    struct pcievdrv_dma_desc *d = pcievdrv_dma_desc_alloc(chan, src, src_cnt, len, flags);
+
+    if(!d) {
+        return NULL;
+    }
+    d->result = result;
+
+    return &d->txd;
+}
+
+static void pcievdrv_dma_issue_pending(struct dma_chan *chan) {
+    struct pcievdrv_dma *dma = to_pcievdrv_dma(chan);
+    unsigned long flags;
+    bool issue;
+
+    spin_lock_irqsave(&dma->lock, flags);
+    issue = !list_empty(&dma->submitted);
+    list_splice_tail_init(&dma->submitted, &dma->issued);
+    spin_unlock_irqrestore(&dma->lock, flags);
+
+    if(issue) {
+        queue_work(dma->wq, &dma->work);
+    }
+}
+
+static enum dma_status pcievdrv_dma_tx_status(struct dma_chan *chan, dma_cookie_t cookie, struct dma_tx_state *state) {
+    dma_cookie_t used = READ_ONCE(chan->cookie), complete = READ_ONCE(chan->completed_cookie);
+
+    dma_set_tx_state(state, complete, used, 0);
+    return dma_async_is_complete(cookie, complete, used);
+}
+
+static int pcievdrv_dma_alloc_chan_resources(struct dma_chan *chan) {
+    chan->cookie = DMA_MIN_COOKIE;
+    chan->completed_cookie = DMA_MIN_COOKIE;
+    return 0;
+}
+
+// 使用者释放通道时已不再提交，等待处理中的描述符后全部释放
+static void pcievdrv_dma_free_chan_resources(struct dma_chan *chan) {
+    struct pcievdrv_dma *dma = to_pcievdrv_dma(chan);
+    unsigned long flags;
+    LIST_HEAD(free);
+
+    flush_workqueue(dma->wq);
+
+    spin_lock_irqsave(&dma->lock, flags);
+    list_splice_tail_init(&dma->submitted, &free);
+    list_splice_tail_init(&dma->issued, &free);
+    list_splice_tail_init(&dma->done, &free);
+    spin_unlock_irqrestore(&dma->lock, flags);
+
+    pcievdrv_dma_free_list(&free);
+}
+
+// 最后一个使用者释放通道后调用
+static void pcievdrv_dma_release(struct dma_device *dd) {
+    struct pcievdrv_dma *dma = container_of(dd, struct pcievdrv_dma, dma);
+
+    destroy_workqueue(dma->wq);
+    kfree(dma);
+}
+
+/*
+ * 在 probe 中、中断申请之后调用，阵列未开启 dmaengine 时不注册
+ */
+int pcievdrv_dma_register(struct praid_dev *dev) {
+    struct iommu_domain *domain;
+    struct pcievdrv_dma *dma;
+    struct dma_device *dd;
+    int ret;
+
+    if(!dev->config.dmaengine) {
+        return 0;
+    }
+
+    // 使用者映射出的是 iova，dma_to_phys 无法还原为物理地址，不注册通道，阵列照常工作
+    domain = iommu_get_domain_for_dev(&dev->pdev->dev);
+    if(domain && domain->type != IOMMU_DOMAIN_IDENTITY) {
+        VP_ERROR("dma addresses are translated by iommu, dmaengine disabled.\n");
+        return 0;
+    }
+
+    // 描述符中的地址由使用者按本设备映射，不需要经过 swiotlb
+    ret = dma_set_mask_and_coherent(&dev->pdev->dev, DMA_BIT_MASK(64));
+    if(ret) {
+        VP_ERROR("set dma mask failed.\n");
+        return ret;
+    }
+
+    dma = kzalloc_node(sizeof(*dma), GFP_KERNEL, dev->config.node);
+    if(!dma) {
+        return -ENOMEM;
+    }
+
+    dma->dev = dev;
+    spin_lock_init(&dma->lock);
+    INIT_LIST_HEAD(&dma->submitted);
+    INIT_LIST_HEAD(&dma->issued);
+    INIT_LIST_HEAD(&dma->done);
+    INIT_WORK(&dma->work, pcievdrv_dma_work);
+    dma->wq = alloc_ordered_workqueue("pciev_dma%d", WQ_MEM_RECLAIM, dev->id);
+    if(!dma->wq) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    dd = &dma->dma;
+    dd->dev = &dev->pdev->dev;
+    dma_cap_set(DMA_XOR, dd->cap_mask);
+    dma_cap_set(DMA_XOR_VAL, dd->cap_mask);
+    // 槽位数在扩容时只增加，注册时的数量一直可用
+    dd->max_xor = PCIEV_BAR_SLOTS(dev->disk_cnt) - 1;
+    dd->xor_align = DMAENGINE_ALIGN_8_BYTES;
+    dd->device_alloc_chan_resources = pcievdrv_dma_alloc_chan_resources;
+    dd->device_free_chan_resources = pcievdrv_dma_free_chan_resources;
+    dd->device_prep_dma_xor = pcievdrv_dma_prep_xor;
+    dd->device_prep_dma_xor_val = pcievdrv_dma_prep_xor_val;
+    dd->device_issue_pending = pcievdrv_dma_issue_pending;
+    dd->device_tx_status = pcievdrv_dma_tx_status;
+    dd->device_release = pcievdrv_dma_release;
+    INIT_LIST_HEAD(&dd->channels);
+
+    dma->chan.device = dd;
+    list_add_tail(&dma->chan.device_node, &dd->channels);
+
+    ret = dma_async_device_register(dd);
+    if(ret) {
+        VP_ERROR("register dma device failed, ret=%d\n", ret);
+        goto out_wq;
+    }
+
+    dev->dma = dma;
+    VP_INFO("%s: xor channel, max_xor=%u\n", dma_chan_name(&dma->chan), dd->max_xor);
+
+    return 0;
+
+out_wq:
+    destroy_workqueue(dma->wq);
+out_free:
+    kfree(dma);
+    return ret;
+}
+
+/*
+ * 在 remove 中、释放中断之前调用。正在处理的描述符完成后不再使用设备，
+ * 通道的内存在最后一个使用者释放后由 pcievdrv_dma_release 释放
+ */
+void pcievdrv_dma_unregister(struct praid_dev *dev) {
+    struct pcievdrv_dma *dma = dev->dma;
+    unsigned long flags;
+
+    if(!dma) {
+        return;
+    }
+
+    spin_lock_irqsave(&dma->lock, flags);
+    dma->dev = NULL;
+    spin_unlock_irqrestore(&dma->lock, flags);
+    flush_workqueue(dma->wq);
+
+    dev->dma = NULL;
+    dma_async_device_unregister(&dma->dma);
+}
@@ -0,0 +1,38 @@
+#ifndef __PCIEVDMA_H__
+#define __PCIEVDMA_H__
+
+#include <linux/dmaengine.h>
+#include <linux/workqueue.h>
+
+#include "praid.h"
+
+#ifdef CONFIG_DMA_ENGINE
+/*
+ * 把阵列的虚拟加速设备注册为 dmaengine 的异或通道，见 pciedma.c
+ */
+struct pcievdrv_dma {
+    struct dma_device dma;
+    struct dma_chan chan;
+    struct praid_dev *dev;
+    spinlock_t lock;
+    struct list_head submitted; // 已提交，等待 issue_pending
+    struct list_head issued;    // 等待设备处理
+    struct list_head done;      // 已完成，使用者确认后释放
+    struct workqueue_struct *wq;
+    struct work_struct work;
+
+    atomic64_t xors, vals, errors; // 完成的异或和校验检查，设备出错的描述符
+};
+
+int pcievdrv_dma_register(struct praid_dev *dev);
+void pcievdrv_dma_unregister(struct praid_dev *dev);
+#else
+static inline int pcievdrv_dma_register(struct praid_dev *dev) {
+    return 0;
+}
+
+static inline void pcievdrv_dma_unregister(struct praid_dev *dev) {
+}
+#endif
+
+#endif
@@ -1,11 +1,21 @@
 #include <linux/pci.h>
 #include <linux/module.h>
 #include <linux/bio.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/percpu.h>
 
 #include "praid.h"
 #include "pciev.h"
 #include "pciedrv.h"
 #include "block.h"
+#include "degraded.h"
+#include "plog.h"
+#include "iosched.h"
+#include "hybrid.h"
+#include "engine.h"
+#include "pciedma.h"
+#include "pcieuser.h"
 
 /* 指明该驱动程序适用于哪一些PCI设备 */
 static struct pci_device_id pcievdrv_ids[] = {
@@ -28,178 +38,664 @@ static void pcievdrv_get_configs(struct pci_dev *dev) {
     VP_INFO("class: %x\n", val4);
 }
 
-static void do_verify_work(struct work_struct *work) {
-    struct verify_work* work_data = container_of(work, struct verify_work, work);
-    struct verify_work_param* param = &work_data->param;
+static void verify_task_free(struct verify_task *t) {
+    kvfree(t->buf);
+    kfree(t);
+}
 
-    VP_DEBUG("size=%llu, offset=%llu, num_sector=%llu\n", param->size, param->offset, param->num_sector);
+// 把 t 中和 chunk 内 [off, off + len) 重叠的部分放到旧数据和新数据槽位的对应位置
+static void verify_task_stage(struct verify_task *t, struct praid_dev *dev, uint64_t off, uint64_t len) {
+    uint64_t sta, end;
 
-    if(down_interruptible(&param->dev->sem) < 0) {
-        VP_ERROR("Semens wait interrupted.\n");
+    if(!verify_task_overlap(t, off, len, &sta, &end)) {
         return;
     }
 
-    if(!copy_page_to_buffer(param->page_old, PTR_BAR_TO_CHUNK_O(param->dev->chunk_addr), param->offset, param->size) || !copy_page_to_buffer(param->page_new, PTR_BAR_TO_CHUNK_N(param->dev->chunk_addr), param->offset, param->size)) {
-        up(&param->dev->sem);
+    if(t->zero) {
+        memset(PTR_BAR_TO_CHUNK_O(dev->chunk_addr, dev->geo.chunk_size) + sta, 0, end - sta);
+    } else {
+        memcpy(PTR_BAR_TO_CHUNK_O(dev->chunk_addr, dev->geo.chunk_size) + sta, (uint8_t*)t->buf + (sta - t->offset), end - sta);
+    }
+    memcpy(PTR_BAR_TO_CHUNK_N(dev->chunk_addr, dev->geo.chunk_size) + sta, verify_task_new(t) + (sta - t->offset), end - sta);
+}
+
+/*
+ * 一组校验更新已由引擎完成。等待校验的写入在这里结束，校验更新失败时写入返回错误，
+ * 错误记在原 bio 上，不使数据盘失效
+ */
+static void verify_pack_finish(struct list_head *pack, bool err, struct praid_dev *dev) {
+    struct verify_task *t, *n;
+    struct bio *parent;
+    u64 now = ktime_get_ns();
+
+    list_for_each_entry_safe(t, n, pack, list) {
+        list_del(&t->list);
+        atomic64_inc(&dev->verify_finished);
+        atomic64_add(now - t->queue_ns, &dev->verify_lat_ns);
+        praid_hybrid_device_end(dev, t->num_sector, now - t->queue_ns);
+        praid_stripe_end_update(dev, t->num_sector);
+        if(err) {
+            atomic64_inc(&dev->verify_errors);
+        }
+        if(t->ack) {
+            parent = t->bio->bi_private;
+            if(err && !parent->bi_status) {
+                parent->bi_status = BLK_STS_IOERR;
+            }
+            atomic64_inc(&dev->verify_acks);
+            bio_endio(t->bio);
+        }
+        verify_task_free(t);
+    }
+}
+
+// do_verify_work 交给引擎的一次更新
+struct verify_delta {
+    struct praid_engine_delta d;
+    struct completion done;
+    int err;
+};
+
+static void verify_delta_done(struct praid_engine_delta *d, int err) {
+    struct verify_delta *v = container_of(d, struct verify_delta, d);
+
+    v->err = err;
+    complete(&v->done);
+}
+
+/*
+ * 提交 dev->verify_list 中的校验更新。引擎忙时新的更新在链表中积累，空闲后把校验盘上
+ * 首尾相接的一组更新打包为一次更新，顺序的小写入不必每个都读写一次校验
+ */
+static void do_verify_work(struct work_struct *work) {
+    struct praid_dev *dev = container_of(work, struct praid_dev, verify_work);
+    const struct praid_engine_ops *engine = dev->config.engine;
+    struct verify_task *first, *t, *n;
+    struct verify_delta v = {
+        .d.done = verify_delta_done,
+    };
+    LIST_HEAD(pack);
+    uint64_t size, done, len, limit;
+    bool err;
+
+    init_completion(&v.done);
+    v.d.tasks = &pack;
+
+    for(;;) {
+        // 校验日志的一条记录不超过一页
+        limit = READ_ONCE(dev->plog.enabled) ? PAGE_SIZE : dev->geo.chunk_size;
+        size = 0;
+
+        spin_lock_irq(&dev->verify_lock);
+        first = list_first_entry_or_null(&dev->verify_list, struct verify_task, list);
+        if(!first) {
+            spin_unlock_irq(&dev->verify_lock);
+            return;
+        }
+        t = first;
+        list_for_each_entry_safe_from(t, n, &dev->verify_list, list) {
+            if(size && (t->num_sector != first->num_sector + (size >> KERNEL_SECTOR_SHIFT) || t->offset != first->offset + size || size + t->size > limit)) {
+                break;
+            }
+            size += t->size;
+            list_move_tail(&t->list, &pack);
+        }
+        spin_unlock_irq(&dev->verify_lock);
+
+        VP_DEBUG("size=%llu, offset=%llu, num_sector=%llu\n", size, first->offset, first->num_sector);
+
+        // 等待主机在该 chunk 上的更新结束后再读改写校验
+        praid_hybrid_wait(dev, first->num_sector);
+
+        // 单个更新超过 limit 时分多次提交
+        err = false;
+        for(done = 0; done < size; done += len) {
+            len = min(size - done, limit);
+            v.d.sector = first->num_sector + (done >> KERNEL_SECTOR_SHIFT);
+            v.d.offset = first->offset + done;
+            v.d.size = len;
+            reinit_completion(&v.done);
+            engine->delta(dev, &v.d);
+            wait_for_completion_io(&v.done);
+            err |= v.err != 0;
+            atomic64_inc(&dev->verify_cmds);
+        }
+
+        verify_pack_finish(&pack, err, dev);
+        cond_resched();
     }
+}
 
-    param->dev->bar->io_property.offset = param->offset;
-    param->dev->bar->io_property.size = param->size;
-    param->dev->bar->io_property.sector_sta = param->num_sector;
+/*
+ * 设备的校验更新：把差值暂存到旧数据和新数据槽位的对应位置后交给设备，中断中调用 d->done
+ */
+static void pciev_engine_delta(struct praid_dev *dev, struct praid_engine_delta *d) {
+    struct verify_task *t;
+    sector_t log_sector;
+    u64 log_seq;
 
-    param->dev->bar->io_property.io_num ++;
+    down(&dev->sem);
 
-    if(param->page_new) {
-        __free_page(param->page_new);
+    // 槽位可能被其他操作覆盖，每次重新暂存
+    list_for_each_entry(t, d->tasks, list) {
+        verify_task_stage(t, dev, d->offset, d->size);
     }
-    if(param->page_old) {
-        __free_page(param->page_old);
+
+    // 开启校验日志时差值追加到日志中，环满时原地更新
+    if(praid_plog_reserve(dev, d->sector, d->size, &log_sector, &log_seq)) {
+        dev->bar->io_property.opcode = PCIEV_OP_DELTA_LOG;
+        dev->bar->io_property.log_sector = log_sector;
+        dev->bar->io_property.log_seq = log_seq;
+    } else {
+        dev->bar->io_property.opcode = PCIEV_OP_DELTA;
     }
+    dev->bar->io_property.offset = d->offset;
+    dev->bar->io_property.size = d->size;
+    dev->bar->io_property.sector_sta = d->sector;
+    dev->delta = d;
+    wmb();
+    dev->bar->io_property.io_num ++;
 }
 
-static bool add_verify_task(struct page *page_new, struct page *page_old, sector_t num_sector, uint64_t offset, uint64_t size, struct praid_dev *dev) {
-    struct verify_work* work = kmalloc(sizeof(struct verify_work), GFP_KERNEL);
+/*
+ * 槽位 [0, nr_src) 的 [offset, offset + len) 已就绪，由设备计算异或写入槽位 nr_src。
+ * 调用者持有 sem，在可睡眠的上下文中调用
+ */
+int pcievdrv_submit_xor_slots(struct praid_dev *dev, unsigned int nr_src, unsigned int offset, unsigned int len) {
+    reinit_completion(&dev->cmd_done);
+    dev->cmd_sync = true;
+
+    dev->bar->io_property.opcode = PCIEV_OP_XOR;
+    dev->bar->io_property.nr_src = nr_src;
+    dev->bar->io_property.offset = offset;
+    dev->bar->io_property.size = len;
+    wmb();
+    dev->bar->io_property.io_num ++;
+
+    wait_for_completion_io(&dev->cmd_done);
+    dev->cmd_sync = false;
+
+    if(dev->bar->io_property.status) {
+        VP_ERROR("xor failed.\n");
+        return -EIO;
+    }
 
-    if(!work) {
-        VP_ERROR("Alloc work struct failed.\n");
-        return false;
+    return 0;
+}
+
+/*
+ * 由设备计算 nr_src 组数据的异或，每组 nr_pages 个页，数据位于页内 [0, len)，计算时放在各槽位的
+ * offset 处。结果写入第 nr_src 组页中。需要在可睡眠的上下文中调用
+ */
+int pcievdrv_submit_xor(struct praid_dev *dev, struct page **pages, unsigned int nr_src, unsigned int nr_pages, unsigned int offset, unsigned int len) {
+    unsigned int i;
+    int ret;
+
+    if(nr_src + 1 > PCIEV_BAR_SLOTS(dev->disk_cnt) || offset + len > dev->geo.chunk_size) {
+        return -EINVAL;
     }
 
-    work->param.page_new = alloc_page(GFP_KERNEL);
-    if(!work->param.page_new) {
-        VP_ERROR("Alloc new page failed.\n");
-        goto out_work;
+    down(&dev->sem);
+
+    for(i = 0; i < nr_src; i ++) {
+        copy_pages_to_buffer(pages + i * nr_pages, PTR_BAR_TO_SLOT(dev->chunk_addr, i, dev->geo.chunk_size) + offset, len);
     }
 
-    work->param.page_old = alloc_page(GFP_KERNEL);
-    if(!work->param.page_old) {
-        VP_ERROR("Alloc old page failed.\n");
-        goto out_page;
+    ret = pcievdrv_submit_xor_slots(dev, nr_src, offset, len);
+    if(!ret) {
+        copy_buffer_to_pages(PTR_BAR_TO_SLOT(dev->chunk_addr, nr_src, dev->geo.chunk_size) + offset, pages + nr_src * nr_pages, len);
     }
 
-    copy_page_to_page(work->param.page_new, page_new);
-    copy_page_to_page(work->param.page_old, page_old);
+    up(&dev->sem);
 
-    work->param.num_sector = num_sector;
-    work->param.offset = offset;
-    work->param.size = size;
-    work->param.dev = dev;
-    INIT_WORK(&work->work, do_verify_work);
-    
-    if (!queue_work(dev->workqueue, &work->work)) {
-        VP_ERROR("Add work failed.\n");
-        goto out_page;
+    return ret;
+}
+
+/*
+ * 由设备把 nr_src 个 size 字节的差值合并到校验盘 sector 处的校验中，需要在可睡眠的上下文中调用
+ */
+int pcievdrv_submit_fold(struct praid_dev *dev, void **srcs, unsigned int nr_src, sector_t sector, unsigned int size) {
+    unsigned int i;
+    int ret = 0;
+
+    if(!nr_src || nr_src + 1 > PCIEV_BAR_SLOTS(dev->disk_cnt) || size > PAGE_SIZE) {
+        return -EINVAL;
     }
 
-    return true;
+    down(&dev->sem);
 
-out_page:
-    if(work->param.page_new) {
-        __free_page(work->param.page_new);
+    for(i = 0; i < nr_src; i ++) {
+        memcpy(PTR_BAR_TO_SLOT(dev->chunk_addr, i, dev->geo.chunk_size), srcs[i], size);
     }
-    if(work->param.page_old) {
-        __free_page(work->param.page_old);
+
+    reinit_completion(&dev->cmd_done);
+    dev->cmd_sync = true;
+
+    dev->bar->io_property.opcode = PCIEV_OP_FOLD;
+    dev->bar->io_property.nr_src = nr_src;
+    dev->bar->io_property.offset = 0;
+    dev->bar->io_property.size = size;
+    dev->bar->io_property.sector_sta = sector;
+    wmb();
+    dev->bar->io_property.io_num ++;
+
+    wait_for_completion_io(&dev->cmd_done);
+    dev->cmd_sync = false;
+
+    if(dev->bar->io_property.status) {
+        VP_ERROR("fold failed.\n");
+        ret = -EIO;
     }
-out_work:
-    kfree(work);
-out_err:
-    return false;
+
+    up(&dev->sem);
+
+    return ret;
 }
 
-static void pciev_read_bio_endio(struct bio* bio_old) {
-    struct bio* bio_new = bio_old->bi_private;
-    struct bio_vec bvec_old, bvec_new;
-	struct bvec_iter iter_old, iter_new;
-    sector_t pos_sector = bio_new->bi_iter.bi_sector;
-    
-    if(bio_old->bi_vcnt != bio_new->bi_vcnt) {
-        VP_ERROR("BIO format dose not match.\n");
-        return;
+const struct praid_engine_ops pcievdrv_engine = {
+    .name = "pciev",
+    .delta = pciev_engine_delta,
+    .stripe = pcievdrv_submit_xor,
+    .reconstruct = pcievdrv_submit_xor,
+};
+
+/*
+ * 扩容后按 disk_cnt 个数据盘重新映射 chunk 计算区域。调用者持有 sem，设备空闲
+ */
+int pcievdrv_remap_chunks(struct praid_dev *dev, unsigned int disk_cnt) {
+    void *addr = memremap(dev->mem_sta + BAR_CHUNK_OFFSET, PCIEV_BAR_SLOTS(disk_cnt) * dev->geo.chunk_size, MEMREMAP_WB);
+
+    if(!addr) {
+        VP_ERROR("storage memremap err.\n");
+        return -ENOMEM;
+    }
+
+    memunmap(dev->chunk_addr);
+    dev->chunk_addr = addr;
+
+    return 0;
+}
+
+/*
+ * 为写入的 bio 分配校验更新并拷贝新数据，缓冲区只包含 bio 的扇区范围。
+ * 一页以内的写入从 kmalloc 的 slab 分配，不占用整页
+ */
+static struct verify_task *verify_task_alloc(struct bio *bio, bool zero, struct praid_dev *dev) {
+    unsigned int size = bio->bi_iter.bi_size, noio;
+    struct verify_task *t;
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    uint8_t *dst, *src;
+
+    t = kmalloc_node(sizeof(*t), GFP_NOIO, dev->config.node);
+    if(!t) {
+        VP_ERROR("Alloc verify task failed.\n");
+        return NULL;
+    }
+
+    // 大的写入可能退回到 vmalloc，kvmalloc 只接受 GFP_KERNEL，用作用域限制为 noio
+    noio = memalloc_noio_save();
+    t->buf = kvmalloc_node(zero ? size : 2 * size, GFP_KERNEL, dev->config.node);
+    memalloc_noio_restore(noio);
+    if(!t->buf) {
+        VP_ERROR("Alloc verify buffer failed.\n");
+        kfree(t);
+        return NULL;
+    }
+
+    t->bio = bio;
+    t->zero = zero;
+    t->num_sector = bio->bi_iter.bi_sector;
+    t->offset = SECTOR_TO_BYTE(bio->bi_iter.bi_sector & dev->geo.chunk_mask);
+    t->size = size;
+
+    dst = verify_task_new(t);
+    praid_bio_for_each_data(bvec, bio, iter) {
+        src = bvec_kmap_local(&bvec);
+        memcpy(dst, src, bvec.bv_len);
+        kunmap_local(src);
+        dst += bvec.bv_len;
+    }
+
+    return t;
+}
+
+/*
+ * 主机的校验更新，在提交写入的 cpu 上和数据写入并行进行。写入的 bio 多计了一次完成，
+ * 更新结束后结束一次
+ */
+static void verify_host_work(struct work_struct *work) {
+    struct verify_task *t = container_of(work, struct verify_task, work);
+    struct praid_dev *dev = container_of(t->bio, struct praid_bio, bio)->member->dev;
+    struct bio *parent = t->bio->bi_private;
+    struct praid_engine_delta d = {
+        .sector = t->num_sector,
+        .offset = t->offset,
+        .size = t->size,
+    };
+    LIST_HEAD(tasks);
+    int ret;
+
+    list_add(&t->list, &tasks);
+    d.tasks = &tasks;
+    ret = praid_engine_host_delta(dev, &d);
+
+    praid_hybrid_host_end(dev, t->num_sector, ktime_get_ns() - t->queue_ns);
+    praid_stripe_end_update(dev, t->num_sector);
+    if(ret) {
+        VP_ERROR("host parity update failed, sector=%llu, ret=%d\n", (u64)t->num_sector, ret);
+        atomic64_inc(&dev->verify_errors);
+        if(!parent->bi_status) {
+            parent->bi_status = BLK_STS_IOERR;
+        }
+    }
+    if(t->ack) {
+        atomic64_inc(&dev->verify_acks);
+    }
+
+    bio_endio(t->bio);
+    verify_task_free(t);
+}
+
+/*
+ * 任务排队前调用，决定由主机还是设备计算。校验同步模式下写入的 bio 多计一次完成，数据写完和
+ * 校验更新完成都结束一次，两者并行进行，都完成后 bio 才结束。主机计算的更新总是这样等待
+ */
+static void verify_task_arm(struct verify_task *t, struct praid_dev *dev) {
+    t->queue_ns = ktime_get_ns();
+    t->ack = READ_ONCE(dev->parity_sync);
+    t->host = praid_hybrid_start(dev, t->num_sector);
+    praid_stripe_start_update(dev, t->num_sector);
+    if(t->ack || t->host) {
+        bio_inc_remaining(t->bio);
+    }
+    if(t->host) {
+        INIT_WORK(&t->work, verify_host_work);
+    }
+}
+
+// 把一批任务挂到 verify_list 上等待打包提交
+static void verify_tasks_queue(struct list_head *batch, unsigned int nr, struct praid_dev *dev) {
+    spin_lock_irq(&dev->verify_lock);
+    list_splice_tail_init(batch, &dev->verify_list);
+    spin_unlock_irq(&dev->verify_lock);
+
+    atomic64_add(nr, &dev->verify_updates);
+    queue_work_node(dev->config.node, dev->workqueue, &dev->verify_work);
+}
+
+/*
+ * 旧数据已就绪的一组任务，first 为 llist 的链，按完成的顺序排列。成功的任务一次挂到 verify_list 上，
+ * 之后在同一个 plug 中下发写入；写入要在校验更新排队之后下发，flush 才能等到其校验更新
+ */
+static void verify_tasks_complete(struct llist_node *first, struct praid_dev *dev) {
+    struct verify_task *t, *n;
+    struct bio_list bios = BIO_EMPTY_LIST;
+    struct blk_plug plug;
+    struct bio *bio;
+    LIST_HEAD(batch);
+    LIST_HEAD(host);
+    unsigned int nr = 0;
+
+    llist_for_each_entry_safe(t, n, first, lnode) {
+        if(t->status) {
+            VP_ERROR("read old data failed.\n");
+            t->bio->bi_status = t->status;
+            bio_endio(t->bio);
+            verify_task_free(t);
+            continue;
+        }
+        verify_task_arm(t, dev);
+        bio_list_add(&bios, t->bio);
+        if(t->host) {
+            list_add_tail(&t->list, &host);
+        } else {
+            list_add_tail(&t->list, &batch);
+            nr ++;
+        }
+    }
+
+    if(nr) {
+        verify_tasks_queue(&batch, nr, dev);
+    }
+
+    blk_start_plug(&plug);
+    while((bio = bio_list_pop(&bios))) {
+        praid_member_dispatch(bio);
     }
+    blk_finish_plug(&plug);
 
-    for(iter_old = bio_new->bi_iter, iter_new = bio_new->bi_iter;
-	    iter_old.bi_size && iter_new.bi_size &&
-	    ((bvec_old = bio_iter_iovec(bio_old, iter_old)), 1) &&
-        ((bvec_new = bio_iter_iovec(bio_new, iter_new)), 1);
-	    bio_advance_iter_single(bio_old, &iter_old, bvec_old.bv_len),
-    bio_advance_iter_single(bio_new, &iter_new, bvec_new.bv_len)) {
-        BUG_ON(bvec_old.bv_len != bvec_new.bv_len);
-        BUG_ON(bvec_old.bv_offset != bvec_new.bv_offset);
-        VP_DEBUG("iter\n");
-        add_verify_task(bvec_new.bv_page, bvec_old.bv_page, pos_sector, bvec_new.bv_offset, bvec_new.bv_len, praid_dev);
-        pos_sector += (bvec_new.bv_len >> KERNEL_SECTOR_SHIFT);
+    // 由主机计算的更新在写入下发后开始，每个一个 work，阻塞时由工作队列在本 cpu 上另起线程
+    list_for_each_entry_safe(t, n, &host, list) {
+        list_del(&t->list);
+        queue_work(dev->verify_done_wq, &t->work);
     }
+}
+
+// 每个 cpu 上成批处理读旧数据的完成
+static void verify_done_work(struct work_struct *work) {
+    struct praid_verify_pcpu *pc = container_of(work, struct praid_verify_pcpu, work);
+    struct llist_node *first = llist_del_all(&pc->list);
+
+    if(first) {
+        verify_tasks_complete(llist_reverse_order(first), pc->dev);
+    }
+}
+
+/*
+ * 读旧数据完成，通常在软中断或中断上下文中。只记录结果并挂到当前 cpu 的链表上，
+ * 链表由空变为非空时唤醒该 cpu 上的 verify_done_work
+ */
+static void pciev_read_bio_endio(struct bio* bio_old) {
+    struct verify_task *t = bio_old->bi_private;
+    struct praid_dev *dev = container_of(t->bio, struct praid_bio, bio)->member->dev;
+    struct praid_verify_pcpu *pc;
+
+    t->status = bio_old->bi_status;
+    bio_put(bio_old);
+
+    pc = get_cpu_ptr(dev->verify_pcpu);
+    if(llist_add(&t->lnode, &pc->list)) {
+        queue_work_on(smp_processor_id(), dev->verify_done_wq, &pc->work);
+    }
+    put_cpu_ptr(dev->verify_pcpu);
+}
+
+// 经 io 调度从成员盘读出旧数据
+static void pciev_read_bio_ioq_endio(struct bio *bio_old) {
+    praid_ioq_done(container_of(((struct verify_task *)bio_old->bi_private)->bio, struct praid_bio, bio)->member);
+    pciev_read_bio_endio(bio_old);
+}
+
+// pcievdrv_submit_verify 构造的 bio 读入的旧数据，和写入的 bio 的数据一一对应
+void *pcievdrv_verify_old_data(struct bio *bio_old) {
+    return ((struct verify_task *)bio_old->bi_private)->buf;
+}
+
+/*
+ * 旧数据已从旧数据缓存拷贝到 pcievdrv_submit_verify 构造的 bio 中，不读成员盘，
+ * 直接提交校验更新任务和写入
+ */
+void pcievdrv_submit_verify_old(struct bio *bio_old) {
+    struct verify_task *t = bio_old->bi_private;
 
-    bio_for_each_segment(bvec_old, bio_old, iter_old)
-		__free_page(bvec_old.bv_page);
     bio_put(bio_old);
+    t->status = BLK_STS_OK;
+    t->lnode.next = NULL;
+    verify_tasks_complete(&t->lnode, container_of(t->bio, struct praid_bio, bio)->member->dev);
+}
 
-    VP_DEBUG("read bio done.\n");
+/*
+ * 写入范围的旧数据为零时直接提交校验更新任务，不读旧数据，之后由调用者提交 bio。
+ * 失败时 bio 以错误结束，返回 false
+ */
+bool pcievdrv_submit_verify_zero(struct bio *bio, struct praid_dev *dev) {
+    struct verify_task *t = verify_task_alloc(bio, true, dev);
+    LIST_HEAD(batch);
+
+    if(!t) {
+        bio->bi_status = BLK_STS_RESOURCE;
+        bio_endio(bio);
+        return false;
+    }
 
-    submit_bio(bio_new);
+    verify_task_arm(t, dev);
+    if(t->host) {
+        queue_work(dev->verify_done_wq, &t->work);
+        return true;
+    }
+    list_add_tail(&t->list, &batch);
+    verify_tasks_queue(&batch, 1, dev);
+    return true;
 }
 
+/*
+ * 为写入的 bio 构造读取旧数据的 bio，只读 bio 的扇区范围，旧数据读完后才提交原 bio。
+ * 失败时原 bio 以错误结束，返回 ERR_PTR
+ */
 struct bio* pcievdrv_submit_verify(struct bio *bio, unsigned int devi, struct praid_dev *dev) {
-    struct bio_vec bvec;
-	struct bvec_iter iter;
-    bool ret;
-    sector_t pos_sector = bio->bi_iter.bi_sector;
+    struct verify_task *t;
     struct bio* n_bio;
-    struct page* page;
 
-    n_bio = bio_alloc(GFP_KERNEL, bio->bi_vcnt);
+    t = verify_task_alloc(bio, false, dev);
+    if(!t) {
+        goto out_err;
+    }
+
+    n_bio = bio_alloc(GFP_NOIO, praid_bio_buffer_segs(t->buf, t->size));
+    if(!n_bio) {
+        VP_ERROR("alloc bio failed.\n");
+        goto out_task;
+    }
     bio_set_dev(n_bio, bio->bi_bdev);
     n_bio->bi_iter.bi_sector = bio->bi_iter.bi_sector;
+    n_bio->bi_ioprio = bio->bi_ioprio;
 
-    VP_DEBUG("outter, devi=%u\n", devi);
-    bio_for_each_segment(bvec, bio, iter) {
-        BUG_ON(bvec.bv_len > PAGE_SIZE);
-        
-        VP_DEBUG("inner, devi=%u\n", devi);
-        page = alloc_page(GFP_KERNEL);
-
-        if(!page) {
-            VP_ERROR("alloc page failed.\n");
-            goto out_bio;
-        }
-
-        if(!bio_add_page(n_bio, page, bvec.bv_len, bvec.bv_offset)) {
-            VP_ERROR("add page failed.\n");
-            goto out_page;
-        }
+    VP_DEBUG("devi=%u, size=%llu\n", devi, t->size);
+    if(!praid_bio_add_buffer(n_bio, t->buf, t->size)) {
+        VP_ERROR("add page failed.\n");
+        goto out_bio;
     }
 
-    n_bio->bi_private = bio;
-    n_bio->bi_end_io = pciev_read_bio_endio;
+    n_bio->bi_private = t;
+    n_bio->bi_end_io = pciev_read_bio_ioq_endio;
 
     bio_set_op_attrs(n_bio, REQ_OP_READ, 0);
 
     return n_bio;
-out_page:
-    if(page) {
-        __free_page(page);
-    }
+
 out_bio:
-    bio_put(bio);
+    bio_put(n_bio);
+out_task:
+    verify_task_free(t);
 out_err:
-    return ERR_PTR(-EIO);
+    bio->bi_status = BLK_STS_RESOURCE;
+    bio_endio(bio);
+    return ERR_PTR(-ENOMEM);
+}
+
+static int verify_done_init(struct praid_dev *dev) {
+    struct praid_verify_pcpu *pc;
+    int cpu;
+
+    dev->verify_done_wq = alloc_workqueue("verify_done_wq%d", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0, dev->id);
+    if(!dev->verify_done_wq) {
+        return -ENOMEM;
+    }
+
+    dev->verify_pcpu = alloc_percpu(struct praid_verify_pcpu);
+    if(!dev->verify_pcpu) {
+        destroy_workqueue(dev->verify_done_wq);
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        pc = per_cpu_ptr(dev->verify_pcpu, cpu);
+        init_llist_head(&pc->list);
+        INIT_WORK(&pc->work, verify_done_work);
+        pc->dev = dev;
+    }
+
+    return 0;
+}
+
+static void verify_done_exit(struct praid_dev *dev) {
+    destroy_workqueue(dev->verify_done_wq);
+    free_percpu(dev->verify_pcpu);
 }
 
 static irqreturn_t pcievdrv_interrupt(int irq, void *dev_id) {
     struct praid_dev *praid_dev = (struct praid_dev *)dev_id;
+    struct praid_engine_delta *d;
+    int err;
+
+    // 中断线由所有阵列的设备共享
+    if(!praid_dev->bar->isr) {
+        return IRQ_NONE;
+    }
+    praid_dev->bar->isr = 0;
+
     VP_DEBUG("");
-    up(&praid_dev->sem);
+    if(praid_dev->cmd_sync) {
+        complete(&praid_dev->cmd_done);
+    } else {
+        // 异步的操作只有校验更新，先释放 sem 再通知引擎的调用者
+        err = praid_dev->bar->io_property.status ? -EIO : 0;
+        d = praid_dev->delta;
+        praid_dev->delta = NULL;
+        up(&praid_dev->sem);
+        d->done(d, err);
+    }
 
     return IRQ_HANDLED;
 }
 
+// 等待设备 probe 的阵列，按设备所在的总线号匹配
+static LIST_HEAD(pcievdrv_arrays);
+static DEFINE_SPINLOCK(pcievdrv_arrays_lock);
+
+void pcievdrv_attach(struct praid_dev *praid_dev) {
+    spin_lock(&pcievdrv_arrays_lock);
+    list_add_tail(&praid_dev->drv_list, &pcievdrv_arrays);
+    spin_unlock(&pcievdrv_arrays_lock);
+}
+
+void pcievdrv_detach(struct praid_dev *praid_dev) {
+    spin_lock(&pcievdrv_arrays_lock);
+    list_del(&praid_dev->drv_list);
+    spin_unlock(&pcievdrv_arrays_lock);
+}
+
+static struct praid_dev *pcievdrv_find_array(struct pci_dev *dev) {
+    struct praid_dev *praid_dev, *found = NULL;
+
+    spin_lock(&pcievdrv_arrays_lock);
+    list_for_each_entry(praid_dev, &pcievdrv_arrays, drv_list) {
+        if(praid_dev->pci_bus_nr == dev->bus->number) {
+            found = praid_dev;
+            break;
+        }
+    }
+    spin_unlock(&pcievdrv_arrays_lock);
+
+    return found;
+}
+
 static int pcievdrv_probe(struct pci_dev *dev, const struct pci_device_id *id) {
     int ret = 0;
     resource_size_t chunk_sta;
     size_t chunk_range;
+    struct praid_dev *praid_dev;
 
     VP_INFO("probing function\n");
 
+    praid_dev = pcievdrv_find_array(dev);
+    if(!praid_dev) {
+        VP_ERROR("no array for bus %#x.\n", dev->bus->number);
+        ret = -ENODEV;
+        goto out_final;
+    }
+
     if(pci_enable_device(dev)) {
         VP_ERROR("cannot enable device.\n");
         ret = -EIO;
@@ -210,7 +706,7 @@ static int pcievdrv_probe(struct pci_dev *dev, const struct pci_device_id *id) {
     if(praid_dev->irq < 0) {
         VP_ERROR("invalid irq %d\n", praid_dev->irq);
         ret = -EINVAL;
-        goto out_final;
+        goto out_disable;
     }
 
     praid_dev->mem_sta = pci_resource_start(dev, 0);
@@ -221,7 +717,7 @@ static int pcievdrv_probe(struct pci_dev *dev, const struct pci_device_id *id) {
     if(ret) {
         VP_ERROR("PCI request regions err\n");
         ret = -EINVAL;
-        goto out_final;
+        goto out_disable;
     }
 
     /* 将mem资源映射到虚拟地址 */
@@ -236,23 +732,31 @@ static int pcievdrv_probe(struct pci_dev *dev, const struct pci_device_id *id) {
     VP_INFO("bar memremap in: 0x%p\n", praid_dev->bar);
 
     chunk_sta = praid_dev->mem_sta + BAR_CHUNK_OFFSET;
-    chunk_range = 3 * CHUNK_SIZE;
+    chunk_range = PCIEV_BAR_SLOTS(praid_dev->disk_cnt) * praid_dev->geo.chunk_size;
 
     sema_init(&praid_dev->sem, 1);
-    praid_dev->workqueue = create_workqueue("verfy_task_work_queue");
+    init_completion(&praid_dev->cmd_done);
+    INIT_WORK(&praid_dev->verify_work, do_verify_work);
+    INIT_LIST_HEAD(&praid_dev->verify_list);
+    spin_lock_init(&praid_dev->verify_lock);
+    praid_hybrid_init(praid_dev);
+    praid_dev->workqueue = alloc_workqueue("verify_task_wq%d", WQ_UNBOUND | WQ_MEM_RECLAIM, 1, praid_dev->id);
+    if(!praid_dev->workqueue) {
+        ret = -ENOMEM;
+        goto out_memunmap_bar;
+    }
 
-    // if(praid_dev->range < chunk_range + BAR_CHUNK_OFFSET) {
-    //     VP_ERROR("request size larger than provided.\n");
-    //     ret = -ENOMEM;
-    //     goto out_regions;
-    // }
+    ret = verify_done_init(praid_dev);
+    if(ret) {
+        goto out_workqueue;
+    }
 
     praid_dev->chunk_addr = memremap(chunk_sta, chunk_range, MEMREMAP_WB);
 
     if(!praid_dev->chunk_addr) {
         VP_ERROR("storage memremap err.\n");
         ret = -ENOMEM;
-        goto out_memunmap_bar;
+        goto out_verify_done;
     }
 
     /* 申请中断IRQ并设定中断服务子函数 */
@@ -263,29 +767,60 @@ static int pcievdrv_probe(struct pci_dev *dev, const struct pci_device_id *id) {
     }
 
     pci_set_drvdata(dev, praid_dev);
+    praid_dev->pdev = dev;
+
+    ret = pcievdrv_dma_register(praid_dev);
+    if(ret) {
+        goto out_irq;
+    }
+
+    ret = pcievdrv_user_register(praid_dev);
+    if(ret) {
+        goto out_dma;
+    }
+
     VP_INFO("Probe succeeds.PCIE memory addr start at %llX, mypci->bar is 0x%p,interrupt No. %d.\n", praid_dev->mem_sta, praid_dev->bar, praid_dev->irq);
     pcievdrv_get_configs(dev);
 
     return 0;
 
+out_dma:
+    pcievdrv_dma_unregister(praid_dev);
+out_irq:
+    praid_dev->pdev = NULL;
+    pci_set_drvdata(dev, NULL);
+    free_irq(praid_dev->irq, praid_dev);
 out_memunmap_sto:
     memunmap(praid_dev->chunk_addr);
+out_verify_done:
+    verify_done_exit(praid_dev);
+out_workqueue:
+    destroy_workqueue(praid_dev->workqueue);
 out_memunmap_bar:
     memunmap(praid_dev->bar);
-    destroy_workqueue(praid_dev->workqueue);
+    praid_dev->bar = NULL;
 out_regions:
     pci_release_regions(dev);
+out_disable:
+    pci_disable_device(dev);
 out_final:
     return ret;
 }
 
 static void pcievdrv_remove(struct pci_dev *dev) {
     struct praid_dev *praid_dev = pci_get_drvdata(dev);
+
+    // 等待中的校验任务依赖中断释放信号量，先清空任务再释放中断。完成处理会向 workqueue 提交任务，先清空
+    pcievdrv_user_unregister(praid_dev);
+    pcievdrv_dma_unregister(praid_dev);
+    verify_done_exit(praid_dev);
+    flush_workqueue(praid_dev->workqueue);
+    destroy_workqueue(praid_dev->workqueue);
     free_irq(praid_dev->irq, praid_dev);
     memunmap(praid_dev->chunk_addr);
     memunmap(praid_dev->bar);
-    flush_workqueue(praid_dev->workqueue);
-    destroy_workqueue(praid_dev->workqueue);
+    praid_dev->bar = NULL;
+    praid_dev->pdev = NULL;
     pci_release_regions(dev);
     pci_disable_device(dev);
     VP_INFO("driver removed.\n");
@@ -4,6 +4,8 @@
 #include <linux/pci.h>
 #include <linux/kernel.h>
 #include <linux/workqueue.h>
+#include <linux/highmem.h>
+#include <linux/llist.h>
 
 #define PCIEVIRT_DRV_NAME "PRAID_PCIEDRV"
 
@@ -11,45 +13,71 @@
 #define VP_DEBUG(string, args...) printk(KERN_DEBUG "%s %s: " string, PCIEVIRT_DRV_NAME, __func__, ##args)
 #define VP_ERROR(string, args...) printk(KERN_ERR "%s: " string, PCIEVIRT_DRV_NAME, ##args)
 
-struct verify_work_param {
-    struct page *page_new, *page_old;
-    sector_t num_sector;
-    uint64_t offset;
+/*
+ * 一次校验更新，在写入的 bio 提交前分配。旧数据和新数据依次暂存在 buf 中，各 size 字节，
+ * 只包含写入的扇区范围。提交后挂到 dev->verify_list 上，由 dev->verify_work 打包提交给设备
+ */
+struct verify_task {
+    struct list_head list;
+    struct llist_node lnode; // 读旧数据完成后挂到 cpu 的 praid_verify_pcpu 上
+    blk_status_t status; // 读旧数据的结果
+    bool ack; // 校验同步模式，bio 等待校验更新完成
+    bool host; // 由主机计算，见 hybrid.c。bio 同样等待主机的更新完成
+    struct work_struct work; // 主机的读改写
+    u64 queue_ns; // 排队的时间
+    struct bio *bio; // 等待旧数据的写入 bio
+    void *buf;
+    bool zero; // 旧数据为零，buf 中只有新数据
+    sector_t num_sector; // 校验盘扇区
+    uint64_t offset; // 在 chunk 中的偏移
     uint64_t size;
-    struct praid_dev *dev;
 };
 
-// work_struct 和 workqueue 函数的参数
-struct verify_work {
-    struct work_struct work;
-    struct verify_work_param param;
-};
+static inline uint8_t *verify_task_new(struct verify_task *t) {
+    return (uint8_t*)t->buf + (t->zero ? 0 : t->size);
+}
 
-static inline bool copy_page_to_buffer(struct page *page, char* buffer, size_t offset, size_t size) {
-    char *data;
+// t 和 chunk 内 [off, off + len) 重叠的部分 [*sta, *end)，不重叠时返回 false
+static inline bool verify_task_overlap(struct verify_task *t, uint64_t off, uint64_t len, uint64_t *sta, uint64_t *end) {
+    *sta = max(t->offset, off);
+    *end = min(t->offset + t->size, off + len);
+    return *sta < *end;
+}
 
-    if(!(data = kmap(page))) {
-        return false;
-    }
+struct praid_dev;
 
-    memcpy(buffer + offset, data + offset, size);
+void pcievdrv_attach(struct praid_dev *praid_dev);
+void pcievdrv_detach(struct praid_dev *praid_dev);
+// 将一组页的前 len 字节依次拷贝到连续的缓冲区中
+static inline void copy_pages_to_buffer(struct page **pages, void *buffer, size_t len) {
+    size_t done, size;
+    void *data;
 
-    kunmap(page);
-    return true;
+    for(done = 0; done < len; done += size, pages ++) {
+        size = min_t(size_t, PAGE_SIZE, len - done);
+        data = kmap_local_page(*pages);
+        memcpy((uint8_t*)buffer + done, data, size);
+        kunmap_local(data);
+    }
 }
 
-static inline void copy_page_to_page(struct page *to, struct page *from) {
-    void *to_data, *from_data;
+static inline void copy_buffer_to_pages(void *buffer, struct page **pages, size_t len) {
+    size_t done, size;
+    void *data;
 
-    to_data = kmap(to);
-    from_data = kmap(from);
-
-    copy_page(to_data, from_data);
-
-    kunmap(from);
-    kunmap(to);
+    for(done = 0; done < len; done += size, pages ++) {
+        size = min_t(size_t, PAGE_SIZE, len - done);
+        data = kmap_local_page(*pages);
+        memcpy(data, (uint8_t*)buffer + done, size);
+        kunmap_local(data);
+    }
 }
 
+int pcievdrv_submit_xor_slots(struct praid_dev *dev, unsigned int nr_src, unsigned int offset, unsigned int len);
+int pcievdrv_submit_xor(struct praid_dev *dev, struct page **pages, unsigned int nr_src, unsigned int nr_pages, unsigned int offset, unsigned int len);
+int pcievdrv_submit_fold(struct praid_dev *dev, void **srcs, unsigned int nr_src, sector_t sector, unsigned int size);
+int pcievdrv_remap_chunks(struct praid_dev *dev, unsigned int disk_cnt);
+
 int pcievdrv_init(void);
 void pcievdrv_exit(void);
 
@@ -0,0 +1,497 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "praid.h"
+#include "pciev.h"
+#include "pciedrv.h"
+#include "pcieuser.h"
+
+/*
+ * 用户态异或接口。每个阵列注册字符设备 /dev/praid_xor<id>，应用 mmap 提交环、完成环和缓冲区后
+ * 不需要每个作业一次系统调用：内核的 work 取出提交环中的作业，在设备上计算后把结果写入完成环，
+ * 每批完成后通知 eventfd 并唤醒 poll。提交环空后 work 继续轮询 sq_idle_us，之后置
+ * PRAID_USER_SQ_NEED_WAKEUP 并退出，应用再提交时用 PRAID_USER_ENTER 唤醒。
+ *
+ * 作业和阵列自身的校验计算一样持有 sem，每次计算至多一个 chunk，两者在设备上交替进行。
+ * 作业的条目先拷贝到内核中再检查，应用改写提交环和缓冲区只影响自己的结果
+ */
+
+#define PRAID_USER_BATCH 64 // 一批最多处理的作业数，每批之后通知一次
+
+struct praid_user_ctx {
+    struct pcievdrv_user *user;
+    struct mutex lock;          // PRAID_USER_SETUP 和 mmap
+    struct praid_user_ring *ring; // 设置完成后非空
+    size_t ring_size;
+    struct praid_user_sqe *sqes;
+    struct praid_user_cqe *cqes;
+    u32 sq_entries, cq_entries;
+    u32 sq_head, cq_tail;       // 内核维护的位置，不读回应用可写的副本
+    void *buf;
+    size_t buf_size;
+    unsigned int max_src;
+    unsigned int idle_us;
+    struct eventfd_ctx *eventfd;
+    struct work_struct work;
+    wait_queue_head_t wait;
+    bool stop;                  // 文件关闭
+    int err;                    // 环不可用的原因，之后 PRAID_USER_ENTER 返回该错误
+};
+
+static bool praid_user_range_ok(struct praid_user_ctx *ctx, u64 off, u64 len) {
+    return off <= ctx->buf_size && len <= ctx->buf_size - off;
+}
+
+static int praid_user_check(struct praid_user_ctx *ctx, struct praid_user_sqe *sqe) {
+    unsigned int i;
+
+    if(sqe->opcode > PRAID_USER_OP_XOR_VAL || !sqe->nr_src || sqe->nr_src > ctx->max_src ||
+       !sqe->len || !IS_ALIGNED(sqe->len, sizeof(u64))) {
+        return -EINVAL;
+    }
+    if(sqe->opcode == PRAID_USER_OP_XOR && !praid_user_range_ok(ctx, sqe->dst, sqe->len)) {
+        return -EFAULT;
+    }
+    for(i = 0; i < sqe->nr_src; i ++) {
+        if(!praid_user_range_ok(ctx, sqe->src[i], sqe->len)) {
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+// 由设备计算一个作业，超过一个 chunk 时分多次计算，每次持有 sem
+static int praid_user_run(struct praid_user_ctx *ctx, struct praid_dev *dev, struct praid_user_sqe *sqe) {
+    uint8_t *buf = ctx->buf;
+    unsigned int i, chunk_size;
+    u64 off, len;
+    int ret = 0, res = 0;
+
+    for(off = 0; off < sqe->len && !ret; off += len) {
+        down(&dev->sem);
+        chunk_size = dev->geo.chunk_size;
+        len = min_t(u64, sqe->len - off, chunk_size);
+
+        for(i = 0; i < sqe->nr_src; i ++) {
+            memcpy(PTR_BAR_TO_SLOT(dev->chunk_addr, i, chunk_size), buf + sqe->src[i] + off, len);
+        }
+
+        ret = pcievdrv_submit_xor_slots(dev, sqe->nr_src, 0, len);
+        if(!ret) {
+            if(sqe->opcode == PRAID_USER_OP_XOR_VAL) {
+                if(memchr_inv(PTR_BAR_TO_SLOT(dev->chunk_addr, sqe->nr_src, chunk_size), 0, len)) {
+                    res = 1;
+                }
+            } else {
+                memcpy(buf + sqe->dst + off, PTR_BAR_TO_SLOT(dev->chunk_addr, sqe->nr_src, chunk_size), len);
+            }
+        }
+
+        up(&dev->sem);
+    }
+
+    return ret ? ret : res;
+}
+
+static bool praid_user_cq_full(struct praid_user_ctx *ctx) {
+    return ctx->cq_tail - smp_load_acquire(&ctx->ring->cq_head) >= ctx->cq_entries;
+}
+
+static bool praid_user_sq_empty(struct praid_user_ctx *ctx) {
+    return smp_load_acquire(&ctx->ring->sq_tail) == ctx->sq_head;
+}
+
+/*
+ * 处理提交环中的一批作业，完成环满时停止。返回完成的作业数
+ */
+static unsigned int praid_user_drain(struct praid_user_ctx *ctx) {
+    struct pcievdrv_user *user = ctx->user;
+    struct praid_user_ring *ring = ctx->ring;
+    struct praid_user_cqe *cqe;
+    struct praid_user_sqe sqe;
+    struct praid_dev *dev;
+    unsigned int n;
+    u32 tail = smp_load_acquire(&ring->sq_tail);
+    int res;
+
+    // 尾部超前整个环时应用的环已损坏，不再处理
+    if(tail - ctx->sq_head > ctx->sq_entries) {
+        WRITE_ONCE(ctx->err, -EINVAL);
+        return 0;
+    }
+
+    for(n = 0; n < PRAID_USER_BATCH && ctx->sq_head != tail && !praid_user_cq_full(ctx); n ++) {
+        memcpy(&sqe, &ctx->sqes[ctx->sq_head & (ctx->sq_entries - 1)], sizeof(sqe));
+        ctx->sq_head ++;
+        smp_store_release(&ring->sq_head, ctx->sq_head);
+
+        // 阵列移除时 unregister 等待正在运行的 work，取到的 dev 在作业期间有效
+        spin_lock(&user->lock);
+        dev = user->dev;
+        spin_unlock(&user->lock);
+
+        res = praid_user_check(ctx, &sqe);
+        if(!res) {
+            res = dev ? praid_user_run(ctx, dev, &sqe) : -ENODEV;
+        }
+        if(res < 0) {
+            atomic64_inc(&user->errors);
+        }
+        atomic64_inc(&user->jobs);
+
+        cqe = &ctx->cqes[ctx->cq_tail & (ctx->cq_entries - 1)];
+        cqe->user_data = sqe.user_data;
+        cqe->res = res;
+        cqe->flags = 0;
+        ctx->cq_tail ++;
+        smp_store_release(&ring->cq_tail, ctx->cq_tail);
+    }
+
+    return n;
+}
+
+static void praid_user_work(struct work_struct *work) {
+    struct praid_user_ctx *ctx = container_of(work, struct praid_user_ctx, work);
+    struct praid_user_ring *ring = ctx->ring;
+    u64 idle_end = 0;
+
+    // 轮询期间应用提交后不需要 PRAID_USER_ENTER，先清除标志再读 sq_tail，和设置时的顺序对应
+    WRITE_ONCE(ring->sq_flags, READ_ONCE(ring->sq_flags) & ~PRAID_USER_SQ_NEED_WAKEUP);
+    smp_mb();
+
+    for(;;) {
+        if(praid_user_drain(ctx)) {
+            if(ctx->eventfd) {
+                eventfd_signal(ctx->eventfd, 1);
+            }
+            wake_up_interruptible(&ctx->wait);
+            idle_end = 0;
+        }
+
+        // 之后的提交由 PRAID_USER_ENTER 返回错误
+        if(READ_ONCE(ctx->stop) || READ_ONCE(ctx->err) || !READ_ONCE(ctx->user->dev)) {
+            WRITE_ONCE(ring->sq_flags, READ_ONCE(ring->sq_flags) | PRAID_USER_SQ_NEED_WAKEUP);
+            break;
+        }
+        if(!praid_user_sq_empty(ctx) && !praid_user_cq_full(ctx)) {
+            continue;
+        }
+
+        // 提交环空闲时继续轮询一段时间，完成环满时等应用取走后再唤醒
+        if(ctx->idle_us && !praid_user_cq_full(ctx)) {
+            if(!idle_end) {
+                idle_end = ktime_get_ns() + (u64)ctx->idle_us * NSEC_PER_USEC;
+            }
+            if(ktime_get_ns() < idle_end) {
+                cond_resched();
+                continue;
+            }
+        }
+
+        WRITE_ONCE(ring->sq_flags, READ_ONCE(ring->sq_flags) | PRAID_USER_SQ_NEED_WAKEUP);
+        smp_mb();
+        if(praid_user_sq_empty(ctx) || praid_user_cq_full(ctx)) {
+            break;
+        }
+        WRITE_ONCE(ring->sq_flags, READ_ONCE(ring->sq_flags) & ~PRAID_USER_SQ_NEED_WAKEUP);
+    }
+}
+
+static long praid_user_setup(struct praid_user_ctx *ctx, struct praid_user_setup __user *arg) {
+    struct praid_user_setup p;
+    struct praid_user_ring *ring;
+    struct praid_dev *dev;
+    size_t sq_off, cq_off, ring_size;
+    long ret;
+
+    if(copy_from_user(&p, arg, sizeof(p))) {
+        return -EFAULT;
+    }
+
+    if(!is_power_of_2(p.sq_entries) || p.sq_entries > PRAID_USER_ENTRIES_MAX ||
+       !is_power_of_2(p.cq_entries) || p.cq_entries < p.sq_entries || p.cq_entries > 2 * PRAID_USER_ENTRIES_MAX ||
+       !p.buf_size || !PAGE_ALIGNED(p.buf_size) || p.buf_size > PRAID_USER_BUF_MAX || p.sq_idle_us > PRAID_USER_IDLE_MAX) {
+        return -EINVAL;
+    }
+
+    sq_off = ALIGN(sizeof(*ring), 64);
+    cq_off = sq_off + (size_t)p.sq_entries * sizeof(struct praid_user_sqe);
+    ring_size = PAGE_ALIGN(cq_off + (size_t)p.cq_entries * sizeof(struct praid_user_cqe));
+
+    mutex_lock(&ctx->lock);
+    if(ctx->ring) {
+        ret = -EBUSY;
+        goto out_unlock;
+    }
+
+    spin_lock(&ctx->user->lock);
+    dev = ctx->user->dev;
+    if(dev) {
+        ctx->max_src = min_t(unsigned int, PRAID_USER_MAX_SRC, PCIEV_BAR_SLOTS(dev->disk_cnt) - 1);
+    }
+    spin_unlock(&ctx->user->lock);
+    if(!dev) {
+        ret = -ENODEV;
+        goto out_unlock;
+    }
+
+    if(p.eventfd >= 0) {
+        ctx->eventfd = eventfd_ctx_fdget(p.eventfd);
+        if(IS_ERR(ctx->eventfd)) {
+            ret = PTR_ERR(ctx->eventfd);
+            ctx->eventfd = NULL;
+            goto out_unlock;
+        }
+    }
+
+    ring = vmalloc_user(ring_size);
+    ctx->buf = vmalloc_user(p.buf_size);
+    if(!ring || !ctx->buf) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    ring->sq_mask = p.sq_entries - 1;
+    ring->cq_mask = p.cq_entries - 1;
+    ring->sq_flags = PRAID_USER_SQ_NEED_WAKEUP;
+    ctx->sqes = (void *)((uint8_t *)ring + sq_off);
+    ctx->cqes = (void *)((uint8_t *)ring + cq_off);
+    ctx->sq_entries = p.sq_entries;
+    ctx->cq_entries = p.cq_entries;
+    ctx->ring_size = ring_size;
+    ctx->buf_size = p.buf_size;
+    ctx->idle_us = p.sq_idle_us;
+
+    p.ring_size = ring_size;
+    p.sq_off = sq_off;
+    p.cq_off = cq_off;
+    p.max_src = ctx->max_src;
+    p.resv = 0;
+    if(copy_to_user(arg, &p, sizeof(p))) {
+        ret = -EFAULT;
+        goto out_free;
+    }
+
+    // 其余字段在 ring 可见前写好，PRAID_USER_ENTER 和 poll 不持有 lock
+    smp_store_release(&ctx->ring, ring);
+    mutex_unlock(&ctx->lock);
+
+    return 0;
+
+out_free:
+    vfree(ring);
+    vfree(ctx->buf);
+    ctx->buf = NULL;
+    if(ctx->eventfd) {
+        eventfd_ctx_put(ctx->eventfd);
+        ctx->eventfd = NULL;
+    }
+out_unlock:
+    mutex_unlock(&ctx->lock);
+    return ret;
+}
+
+static long praid_user_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct praid_user_ctx *ctx = file->private_data;
+    int err;
+
+    switch(cmd) {
+    case PRAID_USER_SETUP:
+        return praid_user_setup(ctx, (struct praid_user_setup __user *)arg);
+    case PRAID_USER_ENTER:
+        if(!smp_load_acquire(&ctx->ring)) {
+            return -EINVAL;
+        }
+        err = READ_ONCE(ctx->err);
+        if(err) {
+            return err;
+        }
+        if(!READ_ONCE(ctx->user->dev)) {
+            return -ENODEV;
+        }
+        queue_work(ctx->user->wq, &ctx->work);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static __poll_t praid_user_poll(struct file *file, poll_table *wait) {
+    struct praid_user_ctx *ctx = file->private_data;
+    struct praid_user_ring *ring = smp_load_acquire(&ctx->ring);
+    __poll_t mask = 0;
+
+    if(!ring) {
+        return EPOLLERR;
+    }
+
+    poll_wait(file, &ctx->wait, wait);
+    if(READ_ONCE(ring->cq_head) != READ_ONCE(ctx->cq_tail)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if(READ_ONCE(ctx->err) || !READ_ONCE(ctx->user->dev)) {
+        mask |= EPOLLERR;
+    }
+
+    return mask;
+}
+
+// PRAID_USER_OFF_RING 处映射环，PRAID_USER_OFF_BUF 处映射缓冲区
+static int praid_user_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct praid_user_ctx *ctx = file->private_data;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    u64 off = (u64)vma->vm_pgoff << PAGE_SHIFT;
+    void *addr = NULL;
+    size_t len = 0;
+    int ret;
+
+    mutex_lock(&ctx->lock);
+    if(ctx->ring && off == PRAID_USER_OFF_RING) {
+        addr = ctx->ring;
+        len = ctx->ring_size;
+    } else if(ctx->ring && off == PRAID_USER_OFF_BUF) {
+        addr = ctx->buf;
+        len = ctx->buf_size;
+    }
+
+    if(!addr || size > len) {
+        ret = -EINVAL;
+    } else {
+        ret = remap_vmalloc_range(vma, addr, 0);
+    }
+    mutex_unlock(&ctx->lock);
+
+    return ret;
+}
+
+static void pcievdrv_user_free(struct kref *ref) {
+    struct pcievdrv_user *user = container_of(ref, struct pcievdrv_user, ref);
+
+    destroy_workqueue(user->wq);
+    kfree(user);
+}
+
+static int praid_user_open(struct inode *inode, struct file *file) {
+    struct pcievdrv_user *user = container_of(file->private_data, struct pcievdrv_user, misc);
+    struct praid_user_ctx *ctx;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if(!ctx) {
+        return -ENOMEM;
+    }
+
+    ctx->user = user;
+    mutex_init(&ctx->lock);
+    INIT_WORK(&ctx->work, praid_user_work);
+    init_waitqueue_head(&ctx->wait);
+
+    // misc_deregister 之后不会再打开，这里的 user 仍然注册着
+    kref_get(&user->ref);
+    atomic_inc(&user->files);
+    file->private_data = ctx;
+
+    return nonseekable_open(inode, file);
+}
+
+// 映射存在时文件不会释放，这里可以释放环和缓冲区
+static int praid_user_release(struct inode *inode, struct file *file) {
+    struct praid_user_ctx *ctx = file->private_data;
+    struct pcievdrv_user *user = ctx->user;
+
+    WRITE_ONCE(ctx->stop, true);
+    flush_work(&ctx->work);
+
+    if(ctx->eventfd) {
+        eventfd_ctx_put(ctx->eventfd);
+    }
+    vfree(ctx->ring);
+    vfree(ctx->buf);
+    kfree(ctx);
+
+    atomic_dec(&user->files);
+    kref_put(&user->ref, pcievdrv_user_free);
+
+    return 0;
+}
+
+static const struct file_operations praid_user_fops = {
+    .owner = THIS_MODULE,
+    .open = praid_user_open,
+    .release = praid_user_release,
+    .unlocked_ioctl = praid_user_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .poll = praid_user_poll,
+    .mmap = praid_user_mmap,
+    .llseek = no_llseek,
+};
+
+// 在 probe 中、中断申请之后调用
+int pcievdrv_user_register(struct praid_dev *dev) {
+    struct pcievdrv_user *user;
+    int ret;
+
+    user = kzalloc_node(sizeof(*user), GFP_KERNEL, dev->config.node);
+    if(!user) {
+        return -ENOMEM;
+    }
+
+    snprintf(user->name, sizeof(user->name), "praid_xor%d", dev->id);
+    kref_init(&user->ref);
+    spin_lock_init(&user->lock);
+    user->dev = dev;
+    user->wq = alloc_workqueue("%s", WQ_UNBOUND, 0, user->name);
+    if(!user->wq) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    user->misc.minor = MISC_DYNAMIC_MINOR;
+    user->misc.name = user->name;
+    user->misc.fops = &praid_user_fops;
+    user->misc.parent = &dev->pdev->dev;
+    user->misc.mode = 0600;
+    ret = misc_register(&user->misc);
+    if(ret) {
+        VP_ERROR("register %s failed, ret=%d\n", user->name, ret);
+        goto out_wq;
+    }
+
+    dev->user = user;
+
+    return 0;
+
+out_wq:
+    destroy_workqueue(user->wq);
+out_free:
+    kfree(user);
+    return ret;
+}
+
+/*
+ * 在 remove 中、释放中断之前调用。已打开的文件仍然可用，之后的作业以 -ENODEV 结束，
+ * 等待正在使用设备的 work 结束后返回
+ */
+void pcievdrv_user_unregister(struct praid_dev *dev) {
+    struct pcievdrv_user *user = dev->user;
+
+    if(!user) {
+        return;
+    }
+
+    misc_deregister(&user->misc);
+
+    spin_lock(&user->lock);
+    user->dev = NULL;
+    spin_unlock(&user->lock);
+    flush_workqueue(user->wq);
+
+    dev->user = NULL;
+    kref_put(&user->ref, pcievdrv_user_free);
+}
@@ -0,0 +1,93 @@
+#ifndef __PCIEVUSER_H__
+#define __PCIEVUSER_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * 用户态异或接口，字符设备 /dev/praid_xor<id>，见 pcieuser.c。本文件也由应用直接包含。
+ *
+ * 应用打开设备后用 PRAID_USER_SETUP 创建环和缓冲区，再 mmap 两块区域：
+ * PRAID_USER_OFF_RING 处为环的头部、提交环和完成环，PRAID_USER_OFF_BUF 处为缓冲区，作业的数据
+ * 都以缓冲区内的偏移给出。提交时填好 sq_tail & sq_mask 处的条目后以 release 语义增加 sq_tail，
+ * 之后读 sq_flags，带 PRAID_USER_SQ_NEED_WAKEUP 时调用 PRAID_USER_ENTER。完成环同理，
+ * 应用处理完 cq_head 处的条目后增加 cq_head。完成可以轮询 cq_tail，也可以 poll 文件或等待 eventfd
+ */
+
+#define PRAID_USER_OFF_RING 0ULL
+#define PRAID_USER_OFF_BUF  0x10000000ULL
+
+#define PRAID_USER_MAX_SRC 16
+#define PRAID_USER_ENTRIES_MAX 4096
+#define PRAID_USER_BUF_MAX (256ULL << 20)
+#define PRAID_USER_IDLE_MAX 10000 // us
+
+enum {
+    PRAID_USER_OP_XOR = 0,      // src 的异或写入 dst，dst 可以和某个 src 相同
+    PRAID_USER_OP_XOR_VAL = 1,  // 检查 src 的异或是否为零，不为零时 res 为 1
+};
+
+#define PRAID_USER_SQ_NEED_WAKEUP (1U << 0) // 内核已停止轮询提交环，需要 PRAID_USER_ENTER
+
+struct praid_user_sqe {
+    __u64 user_data;    // 原样返回到完成条目中
+    __u32 opcode;
+    __u32 nr_src;       // 1 到 PRAID_USER_SETUP 返回的 max_src
+    __u64 len;          // 8 字节的倍数
+    __u64 dst;
+    __u64 src[PRAID_USER_MAX_SRC];
+};
+
+struct praid_user_cqe {
+    __u64 user_data;
+    __s32 res;          // 0 或 -errno，PRAID_USER_OP_XOR_VAL 的结果不为零时为 1
+    __u32 flags;
+};
+
+// 环的头部，位于环区域的开始处。提交环和完成环的条目分别位于 sq_off、cq_off 处
+struct praid_user_ring {
+    __u32 sq_head, sq_tail, sq_mask, sq_flags;
+    __u32 cq_head, cq_tail, cq_mask, cq_overflow;
+};
+
+struct praid_user_setup {
+    // in
+    __u32 sq_entries;   // 2 的幂，不超过 PRAID_USER_ENTRIES_MAX
+    __u32 cq_entries;   // 2 的幂，不少于 sq_entries
+    __u64 buf_size;     // 页大小的倍数，不超过 PRAID_USER_BUF_MAX
+    __s32 eventfd;      // 每批完成后通知的 eventfd，-1 为不使用
+    __u32 sq_idle_us;   // 提交环空闲后内核继续轮询的时间，不超过 PRAID_USER_IDLE_MAX
+    // out
+    __u64 ring_size;    // 环区域的字节数
+    __u64 sq_off, cq_off;
+    __u32 max_src;
+    __u32 resv;
+};
+
+#define PRAID_USER_SETUP _IOWR('P', 1, struct praid_user_setup)
+#define PRAID_USER_ENTER _IO('P', 2)
+
+#ifdef __KERNEL__
+#include <linux/miscdevice.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+
+struct praid_dev;
+
+// 每个阵列一个字符设备，打开的文件各有一组环
+struct pcievdrv_user {
+    struct miscdevice misc;
+    char name[16];
+    struct kref ref;        // 注册和每个打开的文件各持有一个
+    spinlock_t lock;
+    struct praid_dev *dev;  // 阵列移除后为 NULL，作业以 -ENODEV 结束
+    struct workqueue_struct *wq; // 各文件处理提交环的 work
+    atomic_t files;
+    atomic64_t jobs, errors;
+};
+
+int pcievdrv_user_register(struct praid_dev *dev);
+void pcievdrv_user_unregister(struct praid_dev *dev);
+#endif
+
+#endif
@@ -7,23 +7,57 @@
 #define PCIEV_SUBSYSTEM_ID 0x370d
 #define PCIEV_SUBSYSTEM_VENDOR_ID PCIEV_VENDOR_ID
 
+// 设备支持的操作，由驱动写入 io_property.opcode
+enum pciev_opcode {
+    PCIEV_OP_DELTA = 0, // 校验盘 sector_sta 处的校验数据 [offset, offset + size) 异或上旧数据和新数据槽位
+    PCIEV_OP_XOR = 1,   // 槽位 [0, nr_src) 的 [offset, offset + size) 异或后写入槽位 nr_src
+    PCIEV_OP_DELTA_LOG = 2, // 旧数据和新数据槽位的差值不写入校验，作为一条记录顺序写入校验盘 log_sector 处
+    PCIEV_OP_FOLD = 3,  // 校验盘 sector_sta 处的校验数据 [offset, offset + size) 异或上槽位 [0, nr_src)
+};
+
+#define PCIEV_PLOG_MAGIC 0x50524c47 // "PRLG"
+
+// 记录头部和差值都按 4KiB 对齐，日志在 SSD 上按页顺序写入
+#define PCIEV_PLOG_ALIGN_SECTORS 8
+
+// PCIEV_OP_DELTA_LOG 写入的记录头部，占 PCIEV_PLOG_ALIGN_SECTORS 个扇区，之后是 size 字节的差值
+struct pciev_plog_rec {
+    __le32 magic;
+    __le32 size;
+    __le64 seq;     // log_seq
+    __le64 sector;  // 差值对应的校验盘扇区
+};
+
 /* pcie 设备的bar资源，保留了物理地址前 1MB 的空间 */
 struct __packed pciev_bar {
     // read only config
     uint32_t dev_cnt;
+    uint32_t chunk_size;
 
     struct __packed {
         volatile uint64_t offset, size;
         volatile uint64_t sector_sta;
+        volatile uint64_t log_sector, log_seq; // PCIEV_OP_DELTA_LOG 的记录位置和序号
+        volatile uint32_t opcode, nr_src;
+        volatile uint32_t status; // 上一个操作的结果，0 为成功
         volatile uint32_t io_num, io_done;
         // 未进行的 io 操作区间为 (io_done, io_num]
     } io_property;
 
+    volatile uint32_t isr; // 设备发出中断前置 1，驱动在中断处理中清零
+
 };
 
-#define PTR_BAR_TO_CHUNK_O(addr) ((uint8_t*)(addr))
-#define PTR_BAR_TO_CHUNK_N(addr) ((uint8_t*)(addr) + CHUNK_SIZE)
-#define PTR_BAR_TO_CHUNK_V(addr) ((uint8_t*)(addr) + CHUNK_SIZE * 2)
+/*
+ * chunk 计算区域按成员数量分为 PCIEV_BAR_SLOTS(dev_cnt) 个 chunk 大小的槽位，每个成员盘
+ * (包括校验盘) 一个，至少三个。单个 chunk 的校验更新使用前三个槽位，分别存放旧数据、新数据和校验数据。
+ * chunk_size 由 bar 中的 chunk_size 给出
+ */
+#define PCIEV_BAR_SLOTS(dev_cnt) max_t(uint32_t, 3, (dev_cnt) + 1)
+#define PTR_BAR_TO_SLOT(addr, i, chunk_size) ((uint8_t*)(addr) + (size_t)(chunk_size) * (i))
+#define PTR_BAR_TO_CHUNK_O(addr, chunk_size) ((uint8_t*)(addr))
+#define PTR_BAR_TO_CHUNK_N(addr, chunk_size) ((uint8_t*)(addr) + (chunk_size))
+#define PTR_BAR_TO_CHUNK_V(addr, chunk_size) ((uint8_t*)(addr) + (chunk_size) * 2)
 
 #define U64_DATA(ptr, offset) (*(uint64_t*)((uint8_t*)(ptr) + (offset)))
 
@@ -0,0 +1,454 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/timekeeping.h>
+#include <linux/vmalloc.h>
+
+#include "praid.h"
+#include "pciev.h"
+#include "pciedrv.h"
+#include "block.h"
+#include "meta.h"
+#include "degraded.h"
+#include "rebuild.h"
+#include "plog.h"
+
+/*
+ * 校验日志。RAID4 的校验集中在一个盘上并原地更新，随机小写入在校验盘上变成随机的读改写。
+ * 开启后校验更新任务改用 PCIEV_OP_DELTA_LOG，设备把旧数据和新数据的差值作为记录顺序追加到校验盘上的环中；
+ * 环使用超过一半时后台按批读出记录，按校验盘扇区排序，同一位置的差值合并为一次 PCIEV_OP_FOLD 写入校验。
+ * 差值的异或满足交换律，环满时校验更新任务直接原地更新，和未合并的记录互不影响。
+ *
+ * 合并后写入头部中的环尾，合并和头部之间崩溃时记录会被再次合并，所以崩溃后不重放记录，
+ * 而是由数据盘重新计算环中记录涉及的 chunk 的校验，再清空日志。
+ *
+ * 降级后校验盘上的数据会被直接读写，降级路径和重建开始前先合并所有记录，降级期间不再追加记录。
+ */
+
+struct praid_plog_desc {
+    u64 pos; // 记录头部在环中的逻辑位置
+    u64 seq;
+    sector_t sector; // 差值对应的校验盘扇区
+    unsigned int size;
+    unsigned int off; // 合并时差值在 buf 中的偏移
+};
+
+// 记录占用的扇区数，头部和差值各自补齐到 4KiB
+static sector_t praid_plog_need(unsigned int size) {
+    return PCIEV_PLOG_ALIGN_SECTORS + round_up(size >> KERNEL_SECTOR_SHIFT, PCIEV_PLOG_ALIGN_SECTORS);
+}
+
+static sector_t praid_plog_ring_offset(struct praid_dev *dev) {
+    return praid_meta_plog_offset(dev) + PRAID_META_PAGE_SECTORS;
+}
+
+/*
+ * 为校验更新任务分配一条记录，在持有 dev->sem 时调用，返回 false 时原地更新校验。
+ * 分配到的记录由随后的 PCIEV_OP_DELTA_LOG 写入
+ */
+bool praid_plog_reserve(struct praid_dev *dev, sector_t sector, unsigned int size, sector_t *log_sector, u64 *seq) {
+    struct praid_plog *p = &dev->plog;
+    struct praid_plog_desc *d;
+    sector_t need = praid_plog_need(size);
+    u64 pos, off, used;
+
+    if(!p->enabled || praid_degraded(dev)) {
+        return false;
+    }
+
+    spin_lock(&p->lock);
+    pos = p->head;
+    off = pos & (p->size - 1);
+    // 记录不跨过环尾，放不下时从下一圈的环首开始
+    if(off + need > p->size) {
+        pos += p->size - off;
+    }
+    if(pos + need - p->tail > p->size) {
+        spin_unlock(&p->lock);
+        queue_work(p->wq, &p->fold_work);
+        return false;
+    }
+
+    d = &p->descs[p->seq & (p->nr_descs - 1)];
+    d->pos = pos;
+    d->seq = p->seq;
+    d->sector = sector;
+    d->size = size;
+    p->pending[praid_stripe_bucket(dev, sector)] ++;
+
+    *log_sector = p->start + (pos & (p->size - 1));
+    *seq = p->seq ++;
+    p->head = pos + need;
+    used = p->head - p->tail;
+    spin_unlock(&p->lock);
+
+    if(used > p->size / 2) {
+        queue_work(p->wq, &p->fold_work);
+    }
+
+    return true;
+}
+
+static int praid_plog_write_sb(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+    struct praid_member *parity = praid_parity_member(dev);
+    struct praid_plog_sb *sb = page_address(p->sb_page);
+
+    if(praid_member_faulty(parity)) {
+        return 0;
+    }
+
+    clear_page(sb);
+    sb->magic = cpu_to_le32(PRAID_PLOG_MAGIC);
+    sb->disk_cnt = cpu_to_le32(dev->disk_cnt);
+    sb->chunk_size = cpu_to_le32(dev->geo.chunk_size);
+    sb->size = cpu_to_le64(dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+    sb->ring_size = cpu_to_le64(p->size);
+    spin_lock(&p->lock);
+    sb->tail = cpu_to_le64(p->tail);
+    sb->tail_seq = cpu_to_le64(p->tail_seq);
+    spin_unlock(&p->lock);
+
+    // 环尾之前的记录已合并到校验中，合并的写入落盘之后环尾才能落盘
+    return praid_meta_io(dev, READ_ONCE(parity->bdev), praid_meta_plog_offset(dev), p->sb_page, REQ_OP_WRITE | REQ_PREFLUSH);
+}
+
+// 从校验盘顺序读出 len 字节的记录到 buf
+static int praid_plog_read(struct praid_dev *dev, sector_t sector, void *buf, unsigned int len) {
+    struct block_device *bdev = READ_ONCE(praid_parity_member(dev)->bdev);
+    struct bio *bio;
+    unsigned int done = 0, size;
+    int ret = 0;
+
+    while(!ret && done < len) {
+        bio = bio_alloc(GFP_NOIO, BIO_MAX_VECS);
+        bio_set_dev(bio, bdev);
+        bio->bi_iter.bi_sector = sector + (done >> KERNEL_SECTOR_SHIFT);
+        bio->bi_opf = REQ_OP_READ | REQ_SYNC;
+
+        do {
+            size = min_t(unsigned int, PAGE_SIZE, len - done);
+            if(!bio_add_page(bio, vmalloc_to_page(buf + done), size, 0)) {
+                break;
+            }
+            done += size;
+        } while(done < len);
+
+        ret = submit_bio_wait(bio);
+        bio_put(bio);
+    }
+
+    return ret;
+}
+
+static int praid_plog_desc_cmp(const void *a, const void *b) {
+    const struct praid_plog_desc *x = a, *y = b;
+
+    if(x->sector != y->sector) {
+        return x->sector < y->sector ? -1 : 1;
+    }
+    return (int)x->size - (int)y->size;
+}
+
+// 合并序号小于 end_seq 的记录中环里连续的一批，返回合并的记录数，调用者持有 fold_lock
+static unsigned int praid_plog_fold_batch(struct praid_dev *dev, u64 end_seq) {
+    struct praid_plog *p = &dev->plog;
+    struct praid_member *parity = praid_parity_member(dev);
+    struct praid_plog_desc *d;
+    unsigned int n = 0, i, j, nr_max = PCIEV_BAR_SLOTS(dev->disk_cnt) - 1;
+    u64 seq, first = 0, next = 0;
+    int ret;
+
+    spin_lock(&p->lock);
+    for(seq = p->tail_seq; seq < end_seq && n < PRAID_PLOG_BATCH; seq ++) {
+        d = &p->descs[seq & (p->nr_descs - 1)];
+        if(!n) {
+            first = d->pos;
+        } else if(d->pos != next) {
+            break;
+        }
+        if(SECTOR_TO_BYTE(d->pos + praid_plog_need(d->size) - first) > PRAID_PLOG_FOLD_BUF) {
+            break;
+        }
+
+        p->batch[n] = *d;
+        p->batch[n].off = SECTOR_TO_BYTE(d->pos + PCIEV_PLOG_ALIGN_SECTORS - first);
+        next = d->pos + praid_plog_need(d->size);
+        n ++;
+    }
+    spin_unlock(&p->lock);
+
+    if(!n) {
+        return 0;
+    }
+
+    // 校验盘失效后校验由重建重新计算，记录直接丢弃
+    if(!praid_member_faulty(parity)) {
+        ret = praid_plog_read(dev, p->start + (first & (p->size - 1)), p->buf, SECTOR_TO_BYTE(next - first));
+
+        if(!ret) {
+            sort(p->batch, n, sizeof(*p->batch), praid_plog_desc_cmp, NULL);
+            for(i = 0; !ret && i < n; i = j) {
+                for(j = i; j < n && j - i < nr_max && p->batch[j].sector == p->batch[i].sector && p->batch[j].size == p->batch[i].size; j ++) {
+                    p->srcs[j - i] = p->buf + p->batch[j].off;
+                }
+                ret = pcievdrv_submit_fold(dev, p->srcs, j - i, p->batch[i].sector, p->batch[i].size);
+            }
+        }
+
+        if(ret) {
+            PRAID_ERROR("%s%d: fold parity log failed, error %d.\n", VPCIEDISK_NAME, dev->id, ret);
+            praid_member_set_faulty(parity);
+        }
+    }
+
+    spin_lock(&p->lock);
+    p->tail = next;
+    p->tail_seq += n;
+    for(i = 0; i < n; i ++) {
+        p->pending[praid_stripe_bucket(dev, p->batch[i].sector)] --;
+    }
+    spin_unlock(&p->lock);
+    atomic64_add(n, &p->folded);
+
+    ret = praid_plog_write_sb(dev);
+    if(ret) {
+        PRAID_ERROR("%s%d: write parity log header failed, error %d.\n", VPCIEDISK_NAME, dev->id, ret);
+    }
+
+    return n;
+}
+
+// 合并当前所有已写入的记录，调用者持有 fold_lock
+static void praid_plog_fold(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+    u64 end_seq;
+
+    // 拿到 sem 时之前分配的记录都已由设备写入
+    down(&dev->sem);
+    spin_lock(&p->lock);
+    end_seq = p->seq;
+    spin_unlock(&p->lock);
+    up(&dev->sem);
+
+    while(praid_plog_fold_batch(dev, end_seq));
+}
+
+static void praid_plog_fold_work(struct work_struct *work) {
+    struct praid_dev *dev = container_of(work, struct praid_dev, plog.fold_work);
+
+    mutex_lock(&dev->plog.fold_lock);
+    praid_plog_fold(dev);
+    mutex_unlock(&dev->plog.fold_lock);
+}
+
+// sector 所在条带的桶中是否有未合并的记录
+bool praid_plog_pending(struct praid_dev *dev, sector_t sector) {
+    struct praid_plog *p = &dev->plog;
+    bool pending;
+
+    if(!p->enabled) {
+        return false;
+    }
+
+    spin_lock(&p->lock);
+    pending = p->pending[praid_stripe_bucket(dev, sector)];
+    spin_unlock(&p->lock);
+
+    return pending;
+}
+
+// 直接读写校验盘之前调用，合并所有记录
+void praid_plog_drain(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+
+    if(!p->enabled || READ_ONCE(p->tail_seq) == READ_ONCE(p->seq)) {
+        return;
+    }
+
+    mutex_lock(&p->fold_lock);
+    praid_plog_fold(dev);
+    mutex_unlock(&p->fold_lock);
+}
+
+static bool praid_plog_rec_valid(struct praid_dev *dev, struct pciev_plog_rec *rec, u64 seq) {
+    sector_t size = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    unsigned int len = le32_to_cpu(rec->size);
+
+    return le32_to_cpu(rec->magic) == PCIEV_PLOG_MAGIC && le64_to_cpu(rec->seq) == seq &&
+           len && len <= PAGE_SIZE && !(len & (KERNEL_SECTOR_SIZE - 1)) &&
+           le64_to_cpu(rec->sector) + (len >> KERNEL_SECTOR_SHIFT) <= size;
+}
+
+// 重新计算环中未合并的记录涉及的 chunk 的校验，此时块设备还没有创建
+static void praid_plog_recover(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+    struct praid_member *parity = praid_parity_member(dev);
+    struct page *page;
+    struct pciev_plog_rec *rec;
+    u64 pos = p->tail, seq = p->tail_seq;
+    sector_t sta, last = (sector_t)-1;
+    unsigned int nr = 0;
+    int ret;
+
+    if(praid_degraded(dev)) {
+        PRAID_ERROR("%s%d: array degraded, parity log can not be resynced.\n", VPCIEDISK_NAME, dev->id);
+        return;
+    }
+
+    page = alloc_page(GFP_KERNEL);
+    if(!page) {
+        return;
+    }
+    rec = page_address(page);
+
+    while(pos - p->tail < p->size) {
+        if(praid_meta_io(dev, parity->bdev, praid_plog_ring_offset(dev) + (pos & (p->size - 1)), page, REQ_OP_READ)) {
+            break;
+        }
+
+        if(!praid_plog_rec_valid(dev, rec, seq)) {
+            // 可能是放不下的记录被移到了下一圈的环首
+            if(pos & (p->size - 1)) {
+                pos += p->size - (pos & (p->size - 1));
+                continue;
+            }
+            break;
+        }
+
+        sta = le64_to_cpu(rec->sector) & ~dev->geo.chunk_mask;
+        if(sta != last) {
+            ret = praid_rebuild_sync(dev, parity, sta, sta + dev->geo.chunk_sectors);
+            if(ret) {
+                PRAID_ERROR("%s%d: resync chunk at sector %llu failed, error %d.\n", VPCIEDISK_NAME, dev->id, (u64)sta, ret);
+            }
+            last = sta;
+            nr ++;
+        }
+
+        pos += praid_plog_need(le32_to_cpu(rec->size));
+        seq ++;
+    }
+
+    if(nr) {
+        PRAID_INFO("%s%d: unclean shutdown, resynced %u chunks from parity log.\n", VPCIEDISK_NAME, dev->id, nr);
+    }
+
+    __free_page(page);
+}
+
+// 读取上次的头部，几何参数一致时返回 true
+static bool praid_plog_load(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+    struct praid_plog_sb *sb = page_address(p->sb_page);
+
+    if(praid_meta_io(dev, praid_parity_member(dev)->bdev, praid_meta_plog_offset(dev), p->sb_page, REQ_OP_READ)) {
+        return false;
+    }
+
+    if(le32_to_cpu(sb->magic) != PRAID_PLOG_MAGIC ||
+       le32_to_cpu(sb->disk_cnt) != dev->disk_cnt ||
+       le32_to_cpu(sb->chunk_size) != dev->geo.chunk_size ||
+       le64_to_cpu(sb->size) != dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT ||
+       le64_to_cpu(sb->ring_size) != p->size) {
+        return false;
+    }
+
+    p->tail = le64_to_cpu(sb->tail);
+    p->tail_seq = le64_to_cpu(sb->tail_seq);
+
+    return true;
+}
+
+static void praid_plog_free(struct praid_plog *p) {
+    if(p->wq) {
+        destroy_workqueue(p->wq);
+    }
+    if(p->sb_page) {
+        __free_page(p->sb_page);
+    }
+    vfree(p->buf);
+    kvfree(p->descs);
+    kvfree(p->batch);
+    kfree(p->srcs);
+}
+
+/*
+ * 在 praid_zeromap_init 之后、praid_journal_init 之前调用。校验盘上没有空间或者校验盘失效时不使用
+ */
+int praid_plog_init(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+    struct praid_member *parity = praid_parity_member(dev);
+    int node = dev->config.node;
+    sector_t ring;
+    int ret = -ENOMEM;
+
+    if(!dev->config.plog_size) {
+        return 0;
+    }
+
+    spin_lock_init(&p->lock);
+    mutex_init(&p->fold_lock);
+    INIT_WORK(&p->fold_work, praid_plog_fold_work);
+
+    ring = rounddown_pow_of_two(dev->config.plog_size >> KERNEL_SECTOR_SHIFT);
+    if(praid_member_faulty(parity) ||
+       !praid_meta_fits(dev, parity->bdev, praid_meta_plog_offset(dev), ring + 2 * PRAID_META_PAGE_SECTORS)) {
+        PRAID_INFO("%s%d: no space for parity log on parity member, disabled.\n", VPCIEDISK_NAME, dev->id);
+        return 0;
+    }
+
+    p->size = ring;
+    p->start = (dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT) + praid_plog_ring_offset(dev);
+    p->nr_descs = ring / 2; // 每个记录至少两个扇区
+
+    p->descs = kvcalloc(p->nr_descs, sizeof(*p->descs), GFP_KERNEL);
+    p->batch = kvcalloc(PRAID_PLOG_BATCH, sizeof(*p->batch), GFP_KERNEL);
+    p->srcs = kcalloc_node(PCIEV_BAR_SLOTS(dev->disk_cnt), sizeof(*p->srcs), GFP_KERNEL, node);
+    p->buf = vmalloc_node(PRAID_PLOG_FOLD_BUF, node);
+    p->sb_page = alloc_pages_node(node, GFP_KERNEL, 0);
+    p->wq = alloc_workqueue("praid%d_plog", WQ_UNBOUND | WQ_MEM_RECLAIM, 1, dev->id);
+    if(!p->descs || !p->batch || !p->srcs || !p->buf || !p->sb_page || !p->wq) {
+        goto out_free;
+    }
+
+    if(praid_plog_load(dev)) {
+        praid_plog_recover(dev);
+    }
+
+    // 序号从一个随机的位置开始，旧的记录不会被当作有效记录
+    p->head = p->tail = 0;
+    p->seq = p->tail_seq = ktime_get_real_ns();
+    ret = praid_plog_write_sb(dev);
+    if(ret) {
+        PRAID_ERROR("%s%d: write parity log header failed, error %d.\n", VPCIEDISK_NAME, dev->id, ret);
+        goto out_free;
+    }
+
+    p->enabled = true;
+    PRAID_INFO("%s%d: parity log %llu MiB.\n", VPCIEDISK_NAME, dev->id, BYTE_TO_MB((u64)SECTOR_TO_BYTE(ring)));
+
+    return 0;
+
+out_free:
+    praid_plog_free(p);
+    memset(p, 0, sizeof(*p));
+    return ret;
+}
+
+// 块设备删除、写日志写回之后调用，合并所有记录
+void praid_plog_exit(struct praid_dev *dev) {
+    struct praid_plog *p = &dev->plog;
+
+    if(!p->enabled) {
+        return;
+    }
+
+    flush_workqueue(dev->workqueue);
+    cancel_work_sync(&p->fold_work);
+    praid_plog_drain(dev);
+
+    p->enabled = false;
+    praid_plog_free(p);
+}
@@ -0,0 +1,30 @@
+#ifndef __PRAID_PLOG_H__
+#define __PRAID_PLOG_H__
+
+#include "praid.h"
+
+#define PRAID_PLOG_MAGIC 0x5052504c // "PRPL"
+#define PRAID_PLOG_MIN_SIZE MB(1)
+#define PRAID_PLOG_FOLD_BUF MB(4)   // 一次合并读出的记录字节数上限
+#define PRAID_PLOG_BATCH 1024       // 一次合并的记录数上限
+
+// 校验日志头部，位置见 meta.h，记录环紧随其后
+struct praid_plog_sb {
+    __le32 magic;
+    __le32 disk_cnt;
+    __le32 chunk_size;
+    __le32 reserved;
+    __le64 size;        // 成员盘数据区扇区数
+    __le64 ring_size;   // 环的扇区数
+    __le64 tail;        // 第一个未合并的记录在环中的逻辑位置
+    __le64 tail_seq;    // 该记录的序号
+};
+
+bool praid_plog_reserve(struct praid_dev *dev, sector_t sector, unsigned int size, sector_t *log_sector, u64 *seq);
+bool praid_plog_pending(struct praid_dev *dev, sector_t sector);
+void praid_plog_drain(struct praid_dev *dev);
+
+int praid_plog_init(struct praid_dev *dev);
+void praid_plog_exit(struct praid_dev *dev);
+
+#endif
@@ -3,6 +3,28 @@
 
 #include <linux/blkdev.h>
 #include <linux/semaphore.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/bio.h>
+#include <linux/mempool.h>
+#include <linux/llist.h>
+
+#include "geometry.h"
+
+struct pciev_dev;
+struct pci_dev;
+struct task_struct;
+struct praid_xor_req;
+struct praid_journal_sb;
+struct praid_journal_entry;
+struct praid_plog_desc;
+struct praid_engine_ops;
+struct praid_engine_delta;
+struct pcievdrv_dma;
+struct pcievdrv_user;
 
 #define PRAID_NAME "praid"
 #define PRAID_ERROR(string, args...) printk(KERN_ERR "%s: " string, PRAID_NAME, ##args)
@@ -12,11 +34,10 @@
 #define HARDSECT_SIZE 512
 #define KERNEL_SECTOR_SHIFT 9
 
-#define CHUNK_SHIFT 12
-#define CHUNK_SIZE (1 << CHUNK_SHIFT)
-
-#define SECTORS_IN_CHUNK 8
-#define SECTORS_IN_CHUNK_SHIFT 3
+// chunk 大小由模块参数 chunk_size 指定，取值为 2 的幂
+#define PRAID_CHUNK_SIZE_MIN KB(4)
+#define PRAID_CHUNK_SIZE_MAX MB(1)
+#define PRAID_CHUNK_SIZE_DEFAULT KB(4)
 
 #define KB(k) ((k) << 10)
 #define MB(m) ((m) << 20)
@@ -28,36 +49,491 @@
 
 #define BAR_CHUNK_OFFSET MB(1)
 
+#define PRAID_MAX_DISKS 128 // 数据盘数量上限，不含校验盘
+#define PRAID_MAX_ARRAYS 16 // 阵列数量上限，每个阵列占用一条虚拟 pci 总线
+
 struct praid_config {
+    unsigned long memmap_start; // 该阵列的虚拟设备使用的保留内存区间
+    unsigned long memmap_size;
+    unsigned int cpu; // 虚拟设备 dispatcher 所在的 cpu
+    int node; // cpu 所在的 NUMA 节点，阵列的内存和任务都放在该节点上
+
     unsigned int nr_nvme_disks;
     uint64_t size_nvme_disk;
+    unsigned int chunk_size;
+    bool journal; // 写入先记录到保留内存中的日志
+    bool fresh; // 新建的阵列，清零成员盘并将所有区域标记为未写过
+    uint64_t plog_size; // 校验盘上校验日志的字节数，0 为不使用
+    uint64_t cache_size; // 保留内存中写回缓存的字节数，0 为不使用
+    uint64_t pcache_size; // 旧数据缓存的字节数，0 为不使用
+    bool readahead; // 阵列级的顺序预读
+    const struct praid_engine_ops *engine; // 校验计算引擎，见 engine.c
+    bool dmaengine; // 把虚拟设备注册为 dmaengine 的异或通道
     unsigned int nvme_major;
     unsigned int nvme_minor_verify;
-    unsigned int nvme_minor[32];
+    unsigned int *nvme_minor; // nr_nvme_disks 个数据盘的次设备号
+};
+
+/*
+ * 成员盘的状态和统计，每个成员独占 cache line，避免不同成员的计数器之间的伪共享。
+ * members[0, disk_cnt) 为数据盘，members[disk_cnt] 为校验盘。
+ */
+enum {
+    PRAID_MEMBER_FAULTY = 0, // 成员盘出错或被标记为失效，不再向其发送 io
+    PRAID_MEMBER_REBUILDING, // 失效盘已被替换，[0, recovery_offset) 已重建，可以直接读写
+};
+
+// 成员盘 io 调度的队列，见 iosched.c
+enum {
+    PRAID_IOQ_READ = 0, // 前台读，以及 RT 优先级的 io
+    PRAID_IOQ_WRITE,    // 前台写和读改写的旧数据读
+    PRAID_IOQ_BG,       // 重建、扩容、缓存和日志的写回，以及 IDLE 优先级的 io
+    PRAID_IOQ_NR,
+};
+
+struct praid_member {
+    struct block_device *bdev;
+    struct praid_dev *dev;
+    unsigned int minor;
+    unsigned int index;
+    unsigned long flags; // PRAID_MEMBER_*
+    sector_t recovery_offset; // 重建进度，盘内扇区
+
+    atomic_t inflight;
+    atomic64_t ios[2];      // READ / WRITE
+    atomic64_t sectors[2];
+    atomic64_t ticks_ns[2]; // 完成的 io 的累计时延
+    atomic64_t errors;
+    u64 read_lat_ns;        // 读时延的滑动平均
+
+    spinlock_t ioq_lock;
+    struct bio_list ioq[PRAID_IOQ_NR]; // 等待下发的 bio
+    unsigned int ioq_inflight; // 经调度下发未完成的 bio
+    unsigned int ioq_credit[PRAID_IOQ_NR]; // 本轮剩余的配额
+    struct work_struct ioq_work;
+} ____cacheline_aligned_in_smp;
+
+// 每个 cpu 上读完旧数据、等待处理的校验更新任务，见 pciedrv.c
+struct praid_verify_pcpu {
+    struct llist_head list;
+    struct work_struct work;
+    struct praid_dev *dev;
+};
+
+// 成员盘 bio 的前置数据，通过 bioset 的 front_pad 分配
+struct praid_bio {
+    struct praid_member *member;
+    u64 start_ns;
+    unsigned int sectors;
+    struct bvec_iter iter; // 提交时的 iter，成员盘出错后用于重建
+    bool degraded; // 已交给降级路径处理
+    int bucket; // 写入时计入的重建屏障桶，-1 为无
+    bool bitmap; // 写入时计入了写意图位图
+    bool zeromap; // 已经过零区域表的检查
+    bool zero; // 写入前该范围全为零，更新校验时不读旧数据
+    bool full; // 整条带写入的一部分，校验由调用者直接写入，不更新校验
+    int reshape; // 计入的扩容屏障 epoch，-1 为无
+    bool background; // 缓存或日志的写回，按后台 io 调度
+    bool ioq; // 经 io 调度下发，完成时释放
+    int hedge; // 计入的条带写入桶，-1 为无
+    int stripe; // 读改写计入的条带桶，-1 为无
+    struct work_struct work; // 降级读写的任务
+    struct bio bio; // must be last
+};
+
+/*
+ * 重建引擎的状态。重建按盘内扇区的窗口顺序进行，窗口同时是写入屏障的粒度：
+ * 前台写按窗口号计入 nr_pending 的桶中，重建某个窗口前设置 barrier 并等待该桶中的写全部完成，
+ * 重建期间落在该窗口中的写入等待
+ */
+#define PRAID_REBUILD_BUCKETS 64
+
+struct praid_rebuild {
+    struct mutex lock; // 串行化替换操作
+    struct task_struct *thread;
+    struct praid_member *member; // 正在重建的成员盘
+    bool running;
+
+    unsigned int window_chunks; // 每个窗口的 chunk 数，为 2 的幂
+    unsigned int window_shift; // log2(窗口扇区数)
+    struct praid_xor_req **reqs; // window_chunks 个，窗口中每个 chunk 一个异或请求
+
+    unsigned long barrier; // 正在重建的窗口号 + 1，0 为无
+    atomic_t nr_pending[PRAID_REBUILD_BUCKETS];
+    wait_queue_head_t wait;
+
+    unsigned int speed_min, speed_max; // KB/s，同 md 的 sync_speed_min/max
+    unsigned long mark_jiffies; // 速度统计的起点
+    sector_t mark_offset;
+    u64 last_fg_ios; // 上次检查时前台 io 的总数
+    unsigned long ckpt_jiffies; // 上次写检查点的时间
+};
+
+/*
+ * 写意图位图，每一位对应成员盘上的一个区域(所有成员盘相同位置的条带)。
+ * 区域中有写入时该位先落盘，写入结束并且校验更新完成后由 daemon 延迟清除
+ */
+struct praid_bitmap {
+    bool enabled;
+    unsigned int region_shift; // log2(区域扇区数)
+    unsigned long nr_regions;
+    unsigned int nr_pages;
+
+    spinlock_t lock;
+    struct page **pages; // 内存中的位图，落盘的内容
+    unsigned long *disk_bits; // 已经落盘的位
+    unsigned long *clear_bits; // 上一轮 daemon 中已空闲的区域，下一轮仍空闲则清除
+    unsigned long *dirty_pages; // 需要写回的位图页
+    unsigned int *counters; // 区域中未完成的写
+    struct bio_list deferred; // 等待位图落盘的写
+
+    struct mutex io_lock; // 串行化位图的写回
+    struct page *bounce; // 写回时位图页的快照，由 io_lock 保护
+    struct workqueue_struct *wq;
+    struct work_struct flush_work;
+    struct delayed_work daemon_work;
+};
+
+/*
+ * 零区域表。每个数据盘按区域记录一个水位(区域内的扇区偏移)，水位之后的数据从未写过，盘上为零。
+ * 内存中的水位是精确的；落盘的水位不低于内存中的，区域第一次写入时先落盘为整个区域
+ */
+struct praid_zeromap {
+    bool enabled;
+    unsigned int region_shift; // log2(区域扇区数)
+    unsigned long nr_regions; // 每个数据盘的区域数
+    unsigned int nr_pages;
+
+    spinlock_t lock;
+    u32 *zero_off; // disk_cnt * nr_regions 个，内存中的水位
+    u32 *disk_off; // 已经落盘的水位
+    struct page **pages; // 落盘的内容
+    unsigned long *dirty_pages;
+    struct bio_list deferred; // 等待水位落盘的写
+
+    struct mutex io_lock; // 串行化写回
+    struct page *bounce; // 写回时的快照，由 io_lock 保护
+    struct workqueue_struct *wq;
+    struct work_struct flush_work;
+};
+
+#define PRAID_STRIPE_BUCKETS 256 // 按条带计数的桶数
+
+/*
+ * 校验日志。校验更新时设备把差值作为记录顺序追加到校验盘上的环中，不再原地读改写校验；
+ * 后台按批读出记录，按校验盘扇区排序后合并到校验中。位置是单调增加的逻辑扇区数，对环大小取模得到环中偏移
+ */
+struct praid_plog {
+    bool enabled;
+    sector_t start; // 环在校验盘上的起始扇区
+    sector_t size; // 环的扇区数，为 2 的幂
+
+    spinlock_t lock; // 保护 head、tail、seq 和 descs
+    u64 head, tail;
+    u64 seq; // 下一个记录的序号
+    u64 tail_seq;
+    struct praid_plog_desc *descs; // 未合并的记录，按序号取模存放
+    unsigned long nr_descs; // descs 的容量，为 2 的幂
+    atomic64_t folded; // 已合并的记录数
+    unsigned int pending[PRAID_STRIPE_BUCKETS]; // 各条带桶中未合并的记录数
+
+    struct mutex fold_lock; // 串行化合并
+    struct page *sb_page;
+    void *buf; // 合并时读出的记录，由 fold_lock 保护
+    struct praid_plog_desc *batch;
+    void **srcs;
+    struct workqueue_struct *wq;
+    struct work_struct fold_work;
+};
+
+/*
+ * 保留内存中的写日志。写入的新数据追加到环中后即完成，之后按批写回成员盘；
+ * 写回完成并且校验更新结束后环尾前移。位置是单调增加的逻辑字节数，对环大小取模得到环中偏移
+ */
+struct praid_journal {
+    bool enabled;
+    void *addr; // 映射的日志区域
+    struct praid_journal_sb *sb;
+    void *ring;
+    u64 ring_size;
+
+    struct mutex append_lock; // 串行化追加，记录按序号连续落盘
+    spinlock_t lock; // 保护 entries、hash 和 tail
+    u64 head, tail;
+    u64 seq; // 下一个记录的序号
+    u64 tail_seq;
+    struct list_head entries; // 未写回的记录，按序号排列
+    unsigned int nr_entries;
+    struct hlist_head *hash; // 按 (成员盘, chunk) 索引未写回的记录，读取时检查
+    mempool_t *entry_pool;
+    wait_queue_head_t wait; // 等待空间或记录写回
+
+    struct workqueue_struct *wq;
+    struct delayed_work wb_work;
+    struct praid_journal_entry **batch; // 写回中的记录
+    int wb_err; // 上一批写回的错误，成功后清零
+    bool stopping; // 退出中，写回失败时不再重试
+    struct bio_set bio_set; // 写回的 bio，和 praid_dev.bio_set 一样带 praid_bio 前置数据
+};
+
+/*
+ * 在线扩容的状态，见 reshape.c。新布局的条带 [0, pos) 已搬移，对应的阵列扇区 [0, pos_sector) 按 dev->geo 映射，
+ * 其余按扩容前的 old_geo 映射。搬移中的阵列扇区 [lo, hi) 阻塞所有 io，io 按 epoch 计数，
+ * 切换 epoch 后等待旧 epoch 的 io 全部完成
+ */
+struct praid_reshape {
+    bool active;
+    struct task_struct *thread;
+    struct praid_geo old_geo;
+    u64 pos; // 已搬移的新条带数
+    u64 end; // 需要搬移的新条带数
+    sector_t pos_sector;
+    bool backup; // 校验盘上的备份区中保存了第 pos 个新条带的数据
+    bool ckpt_stale; // 扩容开始时的检查点没有写入，搬移条带前重写
+    unsigned int max_stripes; // 一个窗口最多的条带数
+
+    sector_t lo, hi; // 搬移中的阵列扇区，hi 为 0 时没有
+    unsigned int epoch;
+    atomic_t nr_pending[2];
+    wait_queue_head_t wait;
+
+    unsigned long mark_jiffies; // 速度统计的起点，限速同重建
+    u64 mark_pos;
+};
+
+/*
+ * 成员盘 io 调度的参数，见 iosched.c
+ */
+struct praid_iosched {
+    unsigned int depth; // 每个成员盘同时下发的 io 上限，0 为不限
+    unsigned int weights[PRAID_IOQ_NR]; // 各队列的轮询权重
+    struct workqueue_struct *wq;
+    atomic64_t waits[PRAID_IOQ_NR]; // 需要排队的 io 数
+};
+
+#define PRAID_HEDGE_BUCKETS 256 // 条带写入计数的桶数，另有一个桶计入跨越多个条带的写入
+
+/*
+ * 对冲读，见 hedge.c
+ */
+struct praid_hedge {
+    unsigned int timeout_us;    // 成员盘读取超过该时间后由校验重建，0 为关闭
+    unsigned int depth;         // 成员盘未完成的 io 超过其余成员盘的该倍数时直接重建，0 为关闭
+    atomic_t writes[PRAID_HEDGE_BUCKETS + 1]; // 正在写入的成员盘 bio 数
+    atomic_t gen[PRAID_HEDGE_BUCKETS + 1];    // 写入开始的次数，重建期间变化时放弃结果
+
+    atomic64_t busy;        // 因队列过深直接重建的读
+    atomic64_t timeouts;    // 超时后开始重建的读
+    atomic64_t wins;        // 重建先于成员盘完成的读
+    atomic64_t aborts;      // 条带上有写入或读取出错而放弃的重建
+};
+
+#define PRAID_HYBRID_BUCKETS 256 // 按校验盘 chunk 计数的桶数
+
+/*
+ * 主机和设备混合计算校验更新，见 hybrid.c
+ */
+struct praid_hybrid {
+    unsigned int depth;     // 交给设备还未完成的更新不少于该值时改由主机计算，0 为不看队列深度
+    unsigned int lat_us;    // 设备的时延超过该值时改由主机计算，0 为不看时延
+    spinlock_t lock;
+    unsigned int queued;    // 交给设备还未完成的更新
+    u64 lat_ns;             // 设备上的更新从排队到完成的时延的滑动平均
+    unsigned int dev_pending[PRAID_HYBRID_BUCKETS]; // 桶中交给设备还未完成的更新
+    unsigned int host_active[PRAID_HYBRID_BUCKETS]; // 桶中主机正在进行的更新
+    wait_queue_head_t wait; // 等待桶中主机的更新结束
+
+    atomic64_t host, device; // 由主机和设备完成的更新
+    atomic64_t host_ns;     // 主机更新的累计时延
+};
+
+#define PRAID_RA_STREAMS 8 // 记录的顺序读流数
+#define PRAID_RA_WINDOWS 8 // 预读窗口数
+
+enum {
+    PRAID_RA_EMPTY = 0,
+    PRAID_RA_LOADING,   // 成员盘读取中
+    PRAID_RA_VALID,
+};
+
+// 预读窗口，覆盖阵列扇区 [sector, end)
+struct praid_ra_window {
+    struct praid_dev *dev;
+    sector_t sector;    // 按 PRAID_RA_WINDOW 对齐
+    sector_t end;       // 不超过阵列容量
+    int state;          // PRAID_RA_*
+    bool stale;         // 读取中遇到写入，读完后丢弃
+    bool failed;
+    unsigned int readers; // 正在拷贝数据的 bio 数，不为零时不能装入其他位置
+    u64 used;           // 最近一次使用的时钟，淘汰最久未用的窗口
+    struct bio_list waiters; // 等待窗口读完的 bio
+    struct work_struct work;
+    struct page **pages;
+};
+
+struct praid_ra_stream {
+    sector_t next;      // 顺序读的下一个扇区
+    unsigned int seq;   // 连续的顺序读次数
+    u64 used;
+};
+
+/*
+ * 阵列级的顺序预读，见 readahead.c
+ */
+struct praid_ra {
+    bool enabled;
+    spinlock_t lock;
+    unsigned int nr_busy; // 非空的窗口数，为零时写入不需要加锁检查
+    u64 clock;
+    struct praid_ra_stream streams[PRAID_RA_STREAMS];
+    struct praid_ra_window windows[PRAID_RA_WINDOWS];
+    struct workqueue_struct *wq;
+
+    atomic64_t prefetches; // 预读的窗口数
+    atomic64_t hits;    // 从窗口直接返回的读 bio 数
+    atomic64_t waits;   // 其中等待窗口读完的 bio 数
+};
+
+/*
+ * flush 和 FUA 的合并，见 flush.c。等待刷新的 bio 在下一轮刷新后一起结束
+ */
+struct praid_flush {
+    spinlock_t lock;
+    struct bio_list pending;
+    struct workqueue_struct *wq;
+    struct work_struct work;
+    struct bio_set bio_set; // FUA 写入去掉 FUA 后的克隆
+    atomic64_t requests; // flush 和 FUA 请求数
+    atomic64_t flushes; // 实际刷新所有成员盘的轮数
+};
+
+struct praid_pcache_entry;
+
+/*
+ * 旧数据缓存，见 pcache.c。按 (成员盘, 页) 缓存最近写入数据盘的数据，读改写时代替读旧数据
+ */
+struct praid_pcache {
+    bool enabled;
+    unsigned long nr_entries;
+    struct praid_pcache_entry *entries;
+    struct hlist_head *hash;
+    unsigned int hash_bits;
+    struct list_head lru; // 最近使用的在表头
+    spinlock_t lock;
+    atomic64_t hits, misses; // 需要旧数据的写入命中、未命中的次数
+};
+
+struct praid_cache_line;
+
+/*
+ * 写回缓存的状态，见 cache.c。缓存按条带组织，每行缓存一个条带所有数据盘的 chunk，
+ * 行在 free、clean(LRU 顺序)和 dirty 三个链表之一中
+ */
+struct praid_cache {
+    bool enabled;
+    void *addr; // 映射的缓存区域
+    unsigned long nr_lines;
+    unsigned int line_sectors; // 一行(条带的数据部分)的扇区数
+    struct praid_cache_line *lines;
+    unsigned long *bits; // 所有行的 valid 和 dirty 位图
+
+    spinlock_t lock; // 保护行的状态、链表和 hash
+    struct hlist_head *hash; // 按条带号索引已使用的行
+    unsigned int hash_bits;
+    struct list_head free, clean, dirty;
+    unsigned long nr_dirty;
+    bool urgent; // 有读写在等待刷写，不限速刷写所有脏行
+    struct bio_list flushes; // 等待所有脏行刷写的 flush/FUA bio
+    wait_queue_head_t wait; // 等待空闲的行或行的刷写结束
+
+    unsigned int dirty_high, dirty_low; // 脏行占比的高低水位(%)
+    unsigned int destage_rate; // 后台刷写的速度上限(KB/s)，0 为不限速
+
+    struct task_struct *thread;
+    wait_queue_head_t destage_wait;
+    struct praid_cache_line **batch; // 刷写中的行，按条带号排序
+    u64 cursor; // 上次刷写到的条带号
+    unsigned long *snap; // 刷写中的行开始刷写时的 dirty 位图
+    unsigned int batch_lines; // 一批最多刷写的行数
+    struct page **buf; // 刷写的缓冲区
+    unsigned int nr_buf_pages;
+    struct bio_set bio_set; // 刷写的 bio，和 praid_dev.bio_set 一样带 praid_bio 前置数据
+
+    atomic64_t read_hits, full_stripes, partial_stripes;
+};
+
+/*
+ * 条带上未完成的读改写，降级读写期间锁定条带所在的桶，见 degraded.c
+ */
+struct praid_stripe {
+    atomic_t pending[PRAID_STRIPE_BUCKETS]; // 桶中未完成的读改写，写入和校验更新各计一次
+    atomic_t locked[PRAID_STRIPE_BUCKETS];  // 桶中进行中的降级读写
+    spinlock_t lock;                        // 保护 deferred
+    struct bio_list deferred;               // 桶被锁定时挂起的写入
+    wait_queue_head_t wait;
 };
 
 struct praid_dev {
+    int id; // praiddisk<id>
+    struct list_head list;
     struct praid_config config;
 
     // disk property
     uint64_t size;
     unsigned int disk_cnt;
-    struct block_device *bdev[32]; // 下级的数据盘
-    struct block_device *bdev_verify; // 校验盘
+    struct praid_geo geo;
+    struct praid_member *members; // disk_cnt 个数据盘和一个校验盘，按 PRAID_MAX_DISKS 分配
+    struct bio_set bio_set; // 拆分后发往成员盘的 bio
+
+    // degraded mode
+    atomic_t nr_faulty; // 失效的成员盘数量，超过 1 时阵列失效
+    struct workqueue_struct *recovery_wq; // 降级读写的任务
+    atomic64_t degraded_reads, degraded_writes;
+    struct praid_stripe stripe;
+    struct praid_rebuild rebuild;
+    struct praid_bitmap bitmap;
+    struct praid_zeromap zeromap;
+    struct praid_plog plog;
+    struct praid_journal journal;
+    struct praid_cache cache;
+    struct praid_pcache pcache;
+    struct praid_reshape reshape;
+    struct praid_flush flush;
+    struct praid_iosched iosched;
+    struct praid_ra ra;
+    struct praid_hedge hedge;
+    struct praid_hybrid hybrid;
 
     // block device
     // spinlock_t blk_lock; // unused
     struct request_queue *queue;
     struct gendisk *gd;
-    struct semaphore sem;
+    struct semaphore sem; // 设备同一时间只处理一个操作，中断中释放
+    bool cmd_sync; // 当前操作需要读回结果，中断中完成 cmd_done 而不释放 sem
+    struct completion cmd_done;
     struct workqueue_struct *workqueue;
+    struct work_struct verify_work; // 在 workqueue 上打包提交 verify_list 中的校验更新
+    struct list_head verify_list;
+    spinlock_t verify_lock;
+    atomic64_t verify_updates, verify_cmds; // 校验更新和实际交给引擎的更新数
+    bool parity_sync; // 写入在校验更新完成后才结束
+    struct praid_engine_delta *delta; // 设备上进行中的校验更新，中断中完成
+    atomic64_t verify_finished, verify_lat_ns, verify_acks, verify_errors;
+    struct workqueue_struct *verify_done_wq; // 绑定 cpu，成批处理读旧数据的完成
+    struct praid_verify_pcpu __percpu *verify_pcpu;
     // wait_queue_head_t verify_wait_queue; // 用于等待上一个校验任务结束的等待队列
 
     // pcie device
+    struct pciev_dev *vdev; // 该阵列的虚拟加速设备
+    int pci_bus_nr; // 虚拟设备所在的 pci 总线号，驱动 probe 时以此找到阵列
+    struct list_head drv_list; // pcievdrv 中等待 probe 的阵列
+    struct pci_dev *pdev;
+    struct pcievdrv_dma *dma; // 注册为 dmaengine 的异或通道，见 pciedma.c
+    struct pcievdrv_user *user; // 用户态异或接口的字符设备，见 pcieuser.c
     resource_size_t mem_sta;
     size_t range;
     struct pciev_bar __iomem *bar; // struct pciev_bar 存放的地址
-    void __iomem *chunk_addr; // 三个chunk计算区域的的起始地址
+    void __iomem *chunk_addr; // chunk 计算区域的起始地址，共 PCIEV_BAR_SLOTS(disk_cnt) 个 chunk
     int irq;
 };
 
@@ -66,6 +542,36 @@ enum {
     STATUS_WRITE = 1,   // device is receving task
 };
 
-extern struct praid_dev* praid_dev;
+static inline struct praid_member *praid_parity_member(struct praid_dev *dev) {
+    return &dev->members[dev->disk_cnt];
+}
+
+static inline bool praid_member_faulty(struct praid_member *member) {
+    return test_bit(PRAID_MEMBER_FAULTY, &member->flags);
+}
+
+// [sector, sector + nr_sectors) 在成员盘上的数据是否有效
+static inline bool praid_member_in_sync(struct praid_member *member, sector_t sector, unsigned int nr_sectors) {
+    if(likely(!praid_member_faulty(member))) {
+        return true;
+    }
+
+    return test_bit(PRAID_MEMBER_REBUILDING, &member->flags) &&
+           sector + nr_sectors <= smp_load_acquire(&member->recovery_offset);
+}
+
+static inline bool praid_degraded(struct praid_dev *dev) {
+    return atomic_read(&dev->nr_faulty) > 0;
+}
+
+// RAID4 最多容忍一个成员盘失效
+static inline bool praid_failed(struct praid_dev *dev) {
+    return atomic_read(&dev->nr_faulty) > 1;
+}
+
+// 成员盘扇区所在条带的计数桶，见 degraded.c 的条带锁
+static inline unsigned int praid_stripe_bucket(struct praid_dev *dev, sector_t sector) {
+    return (sector >> dev->geo.chunk_sectors_shift) % PRAID_STRIPE_BUCKETS;
+}
 
 #endif
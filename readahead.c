@@ -0,0 +1,423 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "readahead.h"
+
+/*
+ * 阵列级的顺序预读。上层的预读按单盘的大小下发，拆分成 chunk 之后每个成员盘上同时只有很少的 io，
+ * 单个顺序读流的带宽远低于所有数据盘的总和。
+ *
+ * 记录最近的 PRAID_RA_STREAMS 个读流，连续 PRAID_RA_TRIGGER 次顺序读之后，预读读流之后的
+ * PRAID_RA_AHEAD 个按 PRAID_RA_WINDOW 对齐的窗口。窗口内的 chunk 按成员盘分组下发，同一成员盘上的
+ * chunk 在盘内连续，由块层合并为大的请求，所有数据盘并行读取。读取的 bio 落在已读完的窗口中时直接
+ * 拷贝返回，落在读取中的窗口时等待窗口读完。
+ *
+ * 写入在提交时和成员盘写完时都使覆盖的窗口失效，读取中的窗口读完后丢弃，窗口中不会留下写入之前的数据。
+ * 开启日志或写回缓存时成员盘上的数据不是最新的，不预读；扩容中不发起新的预读。
+ * 关闭 readahead 时不分配窗口
+ */
+
+static unsigned int praid_ra_window_pages(void) {
+    return PRAID_RA_WINDOW >> PAGE_SHIFT;
+}
+
+// 调用者持有 ra->lock
+static void praid_ra_set_state(struct praid_ra *ra, struct praid_ra_window *w, int state) {
+    if(w->state == PRAID_RA_EMPTY && state != PRAID_RA_EMPTY) {
+        WRITE_ONCE(ra->nr_busy, ra->nr_busy + 1);
+    } else if(w->state != PRAID_RA_EMPTY && state == PRAID_RA_EMPTY) {
+        WRITE_ONCE(ra->nr_busy, ra->nr_busy - 1);
+    }
+    w->state = state;
+}
+
+// 找到覆盖 sector 的非空窗口，调用者持有 ra->lock
+static struct praid_ra_window *praid_ra_find(struct praid_ra *ra, sector_t sector) {
+    sector_t start = round_down(sector, PRAID_RA_WINDOW_SECTORS);
+    unsigned int i;
+
+    for(i = 0; i < PRAID_RA_WINDOWS; i ++) {
+        if(ra->windows[i].state != PRAID_RA_EMPTY && ra->windows[i].sector == start) {
+            return &ra->windows[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * 选出装入新位置的窗口：空闲的窗口，或者不在 [lo, hi) 中、最久未用的已读完窗口。
+ * 调用者持有 ra->lock
+ */
+static struct praid_ra_window *praid_ra_select(struct praid_ra *ra, sector_t lo, sector_t hi) {
+    struct praid_ra_window *w, *lru = NULL;
+    unsigned int i;
+
+    for(i = 0; i < PRAID_RA_WINDOWS; i ++) {
+        w = &ra->windows[i];
+        if(w->readers) {
+            continue;
+        }
+        if(w->state == PRAID_RA_EMPTY) {
+            return w;
+        }
+        if(w->state == PRAID_RA_VALID && (w->sector < lo || w->sector >= hi) && (!lru || w->used < lru->used)) {
+            lru = w;
+        }
+    }
+
+    return lru;
+}
+
+// 更新 [sector, end) 所属的读流，没有时替换最久未用的读流。调用者持有 ra->lock
+static struct praid_ra_stream *praid_ra_stream(struct praid_ra *ra, sector_t sector, sector_t end) {
+    struct praid_ra_stream *s, *lru = &ra->streams[0];
+    unsigned int i;
+
+    for(i = 0; i < PRAID_RA_STREAMS; i ++) {
+        s = &ra->streams[i];
+        if(s->next == sector) {
+            s->seq ++;
+            goto out;
+        }
+        if(s->used < lru->used) {
+            lru = s;
+        }
+    }
+
+    s = lru;
+    s->seq = 0;
+
+out:
+    s->next = end;
+    s->used = ++ ra->clock;
+    return s;
+}
+
+// 从窗口拷贝 bio 的数据，ws 为覆盖 bio 的一个或两个相邻窗口
+static void praid_ra_copy(struct praid_ra_window **ws, struct bio *bio) {
+    unsigned int nr_pages = praid_ra_window_pages(), idx;
+    size_t done = (bio->bi_iter.bi_sector - ws[0]->sector) << KERNEL_SECTOR_SHIFT, bv_done, pos, size;
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    uint8_t *data, *buf;
+
+    praid_bio_for_each_data(bvec, bio, iter) {
+        data = bvec_kmap_local(&bvec);
+        for(bv_done = 0; bv_done < bvec.bv_len; bv_done += size, done += size) {
+            pos = offset_in_page(done);
+            size = min_t(size_t, bvec.bv_len - bv_done, PAGE_SIZE - pos);
+            idx = done >> PAGE_SHIFT;
+            buf = kmap_local_page(ws[idx >= nr_pages]->pages[idx >= nr_pages ? idx - nr_pages : idx]);
+            memcpy(data + bv_done, buf + pos, size);
+            kunmap_local(buf);
+        }
+        kunmap_local(data);
+    }
+}
+
+static void praid_ra_endio(struct bio *parent) {
+    struct praid_ra_window *w = parent->bi_private;
+
+    w->failed = parent->bi_status != BLK_STS_OK;
+    bio_put(parent);
+
+    queue_work(w->dev->ra.wq, &w->work);
+}
+
+// 窗口读完，返回等待的 bio；失效或出错时等待的 bio 重新按普通读下发
+static void praid_ra_work(struct work_struct *work) {
+    struct praid_ra_window *w = container_of(work, struct praid_ra_window, work);
+    struct praid_ra *ra = &w->dev->ra;
+    struct praid_ra_window *ws[2] = { w, NULL };
+    struct bio_list list;
+    struct bio *bio;
+    bool valid;
+
+    spin_lock_irq(&ra->lock);
+    valid = !w->failed && !w->stale;
+    praid_ra_set_state(ra, w, valid ? PRAID_RA_VALID : PRAID_RA_EMPTY);
+    bio_list_init(&list);
+    bio_list_merge(&list, &w->waiters);
+    bio_list_init(&w->waiters);
+    if(valid) {
+        w->readers ++;
+    }
+    spin_unlock_irq(&ra->lock);
+
+    while((bio = bio_list_pop(&list))) {
+        if(valid) {
+            praid_ra_copy(ws, bio);
+            bio_endio(bio);
+        } else {
+            submit_bio_noacct(bio);
+        }
+    }
+
+    if(valid) {
+        spin_lock_irq(&ra->lock);
+        w->readers --;
+        spin_unlock_irq(&ra->lock);
+    }
+}
+
+// 按成员盘分组下发窗口内的 chunk，同一成员盘的 bio 在盘内连续，在 plug 中合并
+static void praid_ra_load(struct praid_dev *dev, struct praid_ra_window *w) {
+    struct praid_geo *geo = &dev->geo;
+    unsigned int n = geo->data_disks, d0, devi, i;
+    u64 c0 = praid_geo_chunk(geo, w->sector), c1 = praid_geo_chunk(geo, w->end - 1), c;
+    sector_t sta, end, off;
+    struct bio *parent, *bio;
+    struct blk_plug plug;
+
+    parent = bio_alloc(GFP_NOIO, 0);
+    parent->bi_private = w;
+    parent->bi_end_io = praid_ra_endio;
+
+    praid_geo_split_chunk(geo, c0, &d0);
+
+    blk_start_plug(&plug);
+    for(i = 0; i < n; i ++) {
+        for(c = c0 + (i >= d0 ? i - d0 : i + n - d0); c <= c1; c += n) {
+            sta = max_t(sector_t, (sector_t)c << geo->chunk_sectors_shift, w->sector);
+            end = min_t(sector_t, (sector_t)(c + 1) << geo->chunk_sectors_shift, w->end);
+
+            bio = bio_alloc_bioset(GFP_NOIO, (end - sta) >> (PAGE_SHIFT - KERNEL_SECTOR_SHIFT), &dev->bio_set);
+            bio->bi_iter.bi_sector = praid_geo_map(geo, sta, &devi);
+            bio->bi_opf = REQ_OP_READ;
+            // chunk 不小于一页，窗口按页对齐
+            for(off = (sta - w->sector) << KERNEL_SECTOR_SHIFT; off < (end - w->sector) << KERNEL_SECTOR_SHIFT; off += PAGE_SIZE) {
+                bio_add_page(bio, w->pages[off >> PAGE_SHIFT], PAGE_SIZE, 0);
+            }
+
+            praid_member_bio_init(bio, parent, &dev->members[i]);
+            praid_member_submit(bio);
+        }
+    }
+    blk_finish_plug(&plug);
+
+    atomic64_inc(&dev->ra.prefetches);
+
+    bio_endio(parent);
+}
+
+// 预读 sector 所在的窗口和之后的窗口，共 PRAID_RA_AHEAD 个，已经在窗口中的跳过
+static void praid_ra_prefetch(struct praid_dev *dev, sector_t sector) {
+    struct praid_ra *ra = &dev->ra;
+    sector_t lo = round_down(sector, PRAID_RA_WINDOW_SECTORS), hi = lo + PRAID_RA_AHEAD * PRAID_RA_WINDOW_SECTORS;
+    sector_t capacity = get_capacity(dev->gd), start;
+    struct praid_ra_window *w;
+
+    for(start = lo; start < hi && start < capacity; start += PRAID_RA_WINDOW_SECTORS) {
+        spin_lock_irq(&ra->lock);
+        if(praid_ra_find(ra, start)) {
+            spin_unlock_irq(&ra->lock);
+            continue;
+        }
+
+        w = praid_ra_select(ra, lo, hi);
+        if(!w) {
+            spin_unlock_irq(&ra->lock);
+            break;
+        }
+        w->sector = start;
+        w->end = min(start + PRAID_RA_WINDOW_SECTORS, capacity);
+        w->stale = false;
+        w->failed = false;
+        w->used = ++ ra->clock;
+        praid_ra_set_state(ra, w, PRAID_RA_LOADING);
+        spin_unlock_irq(&ra->lock);
+
+        praid_ra_load(dev, w);
+    }
+}
+
+/*
+ * 提交路径中调用，记录读流并按需预读。读取的 bio 全部落在已读完的窗口中时拷贝数据并结束 bio，
+ * 落在一个读取中的窗口时接管 bio，这两种情况返回 true
+ */
+bool praid_ra_read(struct praid_dev *dev, struct bio *bio) {
+    struct praid_ra *ra = &dev->ra;
+    sector_t sector = bio->bi_iter.bi_sector, end = bio_end_sector(bio);
+    struct praid_ra_window *ws[2] = { NULL, NULL }, *w;
+    bool prefetch, wait = false, hit = false;
+    unsigned int i;
+
+    if(!READ_ONCE(ra->enabled) || !bio_sectors(bio)) {
+        return false;
+    }
+
+    spin_lock_irq(&ra->lock);
+    prefetch = praid_ra_stream(ra, sector, end)->seq >= PRAID_RA_TRIGGER && !READ_ONCE(dev->reshape.active);
+
+    w = praid_ra_find(ra, sector);
+    if(w && w->state == PRAID_RA_LOADING && end <= w->end) {
+        bio_list_add(&w->waiters, bio);
+        wait = true;
+    } else if(w && w->state == PRAID_RA_VALID) {
+        ws[0] = w;
+        // bio 最多跨越两个窗口
+        if(end > w->end && w->end == w->sector + PRAID_RA_WINDOW_SECTORS) {
+            w = praid_ra_find(ra, w->end);
+            ws[1] = w && w->state == PRAID_RA_VALID ? w : NULL;
+        }
+        hit = end <= (ws[1] ? ws[1] : ws[0])->end;
+        for(i = 0; hit && i < 2 && ws[i]; i ++) {
+            ws[i]->readers ++;
+            ws[i]->used = ++ ra->clock;
+        }
+    }
+    spin_unlock_irq(&ra->lock);
+
+    if(prefetch) {
+        praid_ra_prefetch(dev, end);
+    }
+
+    if(wait) {
+        atomic64_inc(&ra->hits);
+        atomic64_inc(&ra->waits);
+        return true;
+    }
+    if(!hit) {
+        return false;
+    }
+
+    praid_ra_copy(ws, bio);
+
+    spin_lock_irq(&ra->lock);
+    for(i = 0; i < 2 && ws[i]; i ++) {
+        ws[i]->readers --;
+    }
+    spin_unlock_irq(&ra->lock);
+
+    atomic64_inc(&ra->hits);
+    bio_endio(bio);
+    return true;
+}
+
+// 阵列扇区 [sector, end) 被写入，覆盖的窗口失效，也在完成回调中调用
+void praid_ra_invalidate(struct praid_dev *dev, sector_t sector, sector_t end) {
+    struct praid_ra *ra = &dev->ra;
+    struct praid_ra_window *w;
+    unsigned long flags;
+    unsigned int i;
+
+    if(!READ_ONCE(ra->nr_busy)) {
+        return;
+    }
+
+    spin_lock_irqsave(&ra->lock, flags);
+    for(i = 0; i < PRAID_RA_WINDOWS; i ++) {
+        w = &ra->windows[i];
+        if(w->state == PRAID_RA_EMPTY || w->sector >= end || w->end <= sector) {
+            continue;
+        }
+        if(w->state == PRAID_RA_LOADING) {
+            w->stale = true;
+        } else {
+            praid_ra_set_state(ra, w, PRAID_RA_EMPTY);
+        }
+    }
+    spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+/*
+ * 数据盘的写入完成时调用。提交时已经使窗口失效，但之后开始的预读可能在写入落盘之前读到旧数据，
+ * 写完时再失效一次
+ */
+void praid_ra_end_write(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    struct praid_dev *dev = pbio->member->dev;
+    sector_t sector;
+
+    if(!READ_ONCE(dev->ra.nr_busy) || pbio->member->index >= dev->disk_cnt) {
+        return;
+    }
+
+    // 扩容中成员盘扇区对应的阵列扇区取决于搬移的位置，全部失效
+    if(unlikely(READ_ONCE(dev->reshape.active))) {
+        praid_ra_invalidate(dev, 0, (sector_t)-1);
+        return;
+    }
+
+    sector = praid_geo_unmap(&dev->geo, pbio->iter.bi_sector, pbio->member->index);
+    praid_ra_invalidate(dev, sector, sector + pbio->sectors);
+}
+
+int praid_ra_init(struct praid_dev *dev) {
+    struct praid_ra *ra = &dev->ra;
+    struct praid_ra_window *w;
+    unsigned int i, j;
+
+    spin_lock_init(&ra->lock);
+    for(i = 0; i < PRAID_RA_STREAMS; i ++) {
+        ra->streams[i].next = (sector_t)-1;
+    }
+
+    // 日志和写回缓存中的数据比成员盘上的新
+    if(!dev->config.readahead || dev->journal.enabled || dev->cache.enabled) {
+        return 0;
+    }
+
+    ra->wq = alloc_workqueue("praid%d_ra", WQ_MEM_RECLAIM, 0, dev->id);
+    if(!ra->wq) {
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < PRAID_RA_WINDOWS; i ++) {
+        w = &ra->windows[i];
+        w->dev = dev;
+        bio_list_init(&w->waiters);
+        INIT_WORK(&w->work, praid_ra_work);
+
+        w->pages = kcalloc_node(praid_ra_window_pages(), sizeof(struct page *), GFP_KERNEL, dev->config.node);
+        if(!w->pages) {
+            goto out_free;
+        }
+        for(j = 0; j < praid_ra_window_pages(); j ++) {
+            w->pages[j] = alloc_pages_node(dev->config.node, GFP_KERNEL, 0);
+            if(!w->pages[j]) {
+                goto out_free;
+            }
+        }
+    }
+
+    ra->enabled = true;
+
+    return 0;
+
+out_free:
+    praid_ra_exit(dev);
+    return -ENOMEM;
+}
+
+// 块设备删除之后调用
+void praid_ra_exit(struct praid_dev *dev) {
+    struct praid_ra *ra = &dev->ra;
+    unsigned int i, j;
+
+    if(!ra->wq) {
+        return;
+    }
+
+    destroy_workqueue(ra->wq);
+    ra->wq = NULL;
+    ra->enabled = false;
+
+    for(i = 0; i < PRAID_RA_WINDOWS; i ++) {
+        if(!ra->windows[i].pages) {
+            continue;
+        }
+        for(j = 0; j < praid_ra_window_pages(); j ++) {
+            if(ra->windows[i].pages[j]) {
+                __free_page(ra->windows[i].pages[j]);
+            }
+        }
+        kfree(ra->windows[i].pages);
+        ra->windows[i].pages = NULL;
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef __PRAID_READAHEAD_H__
+#define __PRAID_READAHEAD_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_RA_WINDOW MB(1)      // 预读窗口的字节数，2 的幂
+#define PRAID_RA_WINDOW_SECTORS ((sector_t)PRAID_RA_WINDOW >> KERNEL_SECTOR_SHIFT)
+#define PRAID_RA_AHEAD 4            // 读流之后预读的窗口数
+#define PRAID_RA_TRIGGER 2          // 连续的顺序读达到该次数后开始预读
+
+bool praid_ra_read(struct praid_dev *dev, struct bio *bio);
+void praid_ra_invalidate(struct praid_dev *dev, sector_t sector, sector_t end);
+void praid_ra_end_write(struct bio *bio);
+
+int praid_ra_init(struct praid_dev *dev);
+void praid_ra_exit(struct praid_dev *dev);
+
+#endif
@@ -0,0 +1,543 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "degraded.h"
+#include "rebuild.h"
+#include "meta.h"
+#include "plog.h"
+#include "reshape.h"
+
+/*
+ * 重建引擎：失效的成员盘被替换后，后台线程按窗口顺序遍历盘内扇区，并行读出其余所有成员盘
+ * 窗口内的数据，由设备对每个 chunk 做整条带异或得到缺失的数据，再写入替换盘。
+ *
+ * 速度控制同 md：低于 speed_min 时不限速，高于 speed_max 或有前台 io 时让出。
+ * 进度定期写入替换盘数据区之后的检查点，中断后重新替换或重新创建阵列时从检查点继续。
+ */
+
+#define PRAID_REBUILD_MARK_STEP (3 * HZ)   // 速度统计的时间窗口
+#define PRAID_REBUILD_SLEEP_MS 100
+#define PRAID_REBUILD_CKPT_INTERVAL (5 * HZ)
+
+#define PRAID_MEMBER_MODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/*
+ * 写入屏障。一个写 bio 在拆分前先按其覆盖的窗口范围计数，拆分出的每个成员盘 bio 再各自计数，
+ * 范围的计数在拆分完成后释放。submit_bio 中提交的 bio 要等返回后才真正下发，
+ * 如果拆分中途等待屏障，已计数但未下发的 bio 会使重建线程永远等不到计数归零。
+ * 桶按窗口号取模，跨越 PRAID_REBUILD_BUCKETS 个以上窗口的 bio 计入所有桶。
+ * 屏障阻止所有计入屏障所在桶的范围，而不只是屏障窗口本身，否则映射到同一个桶的其他窗口上
+ * 持续的写入会使桶的计数一直不归零，重建线程永远等不到
+ */
+static unsigned long praid_rebuild_range_len(unsigned long w0, unsigned long w1) {
+    return min_t(unsigned long, w1 - w0 + 1, PRAID_REBUILD_BUCKETS);
+}
+
+static bool praid_rebuild_blocked(struct praid_rebuild *b, unsigned long w0, unsigned long w1) {
+    unsigned long barrier = READ_ONCE(b->barrier);
+
+    return barrier && (barrier - 1 - w0) % PRAID_REBUILD_BUCKETS < praid_rebuild_range_len(w0, w1);
+}
+
+static void praid_rebuild_put_bucket(struct praid_rebuild *b, unsigned int bucket) {
+    if(atomic_dec_and_test(&b->nr_pending[bucket]) && READ_ONCE(b->barrier)) {
+        wake_up(&b->wait);
+    }
+}
+
+void praid_rebuild_hold_range(struct praid_dev *dev, sector_t sector, sector_t end_sector, unsigned long *w0, unsigned long *w1) {
+    struct praid_rebuild *b = &dev->rebuild;
+    const struct praid_geo *g0 = praid_reshape_geo(dev, sector), *g1 = praid_reshape_geo(dev, end_sector - 1);
+    unsigned int devi, shift = b->window_shift - dev->geo.chunk_sectors_shift;
+    unsigned long i, n;
+
+    // 扩容中跨越 pos 的范围两端按各自的几何参数映射，新布局的条带号总是不大于旧布局的
+    *w0 = praid_geo_split_chunk(g0, praid_geo_chunk(g0, sector), &devi) >> shift;
+    *w1 = praid_geo_split_chunk(g1, praid_geo_chunk(g1, end_sector - 1), &devi) >> shift;
+    n = praid_rebuild_range_len(*w0, *w1);
+
+    for(;;) {
+        for(i = 0; i < n; i ++) {
+            atomic_inc(&b->nr_pending[(*w0 + i) % PRAID_REBUILD_BUCKETS]);
+        }
+        smp_mb__after_atomic();
+
+        if(likely(!praid_rebuild_blocked(b, *w0, *w1))) {
+            return;
+        }
+
+        praid_rebuild_release_range(dev, *w0, *w1);
+        wait_event(b->wait, !praid_rebuild_blocked(b, *w0, *w1));
+    }
+}
+
+void praid_rebuild_release_range(struct praid_dev *dev, unsigned long w0, unsigned long w1) {
+    unsigned long i, n = praid_rebuild_range_len(w0, w1);
+
+    for(i = 0; i < n; i ++) {
+        praid_rebuild_put_bucket(&dev->rebuild, (w0 + i) % PRAID_REBUILD_BUCKETS);
+    }
+}
+
+// 成员盘的写 bio 计数，调用者持有覆盖该 bio 的范围
+void praid_rebuild_start_write(struct praid_dev *dev, struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    pbio->bucket = (bio->bi_iter.bi_sector >> dev->rebuild.window_shift) % PRAID_REBUILD_BUCKETS;
+    atomic_inc(&dev->rebuild.nr_pending[pbio->bucket]);
+}
+
+void praid_rebuild_end_write(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    if(pbio->bucket < 0) {
+        return;
+    }
+    praid_rebuild_put_bucket(&pbio->member->dev->rebuild, pbio->bucket);
+    pbio->bucket = -1;
+}
+
+// 阻止新的写进入窗口 w 所在的桶，等待桶中已有的写和对应的校验更新完成
+static void praid_rebuild_raise_barrier(struct praid_dev *dev, unsigned long w) {
+    struct praid_rebuild *b = &dev->rebuild;
+
+    WRITE_ONCE(b->barrier, w + 1);
+    smp_mb();
+    wait_event(b->wait, !atomic_read(&b->nr_pending[w % PRAID_REBUILD_BUCKETS]));
+
+    flush_workqueue(dev->workqueue);
+    // 最后一个校验更新在设备完成后才释放 sem
+    down(&dev->sem);
+    up(&dev->sem);
+}
+
+static void praid_rebuild_lower_barrier(struct praid_dev *dev) {
+    WRITE_ONCE(dev->rebuild.barrier, 0);
+    wake_up_all(&dev->rebuild.wait);
+}
+
+// 写入检查点，valid 为假时清除检查点
+static int praid_rebuild_ckpt_write(struct praid_dev *dev, struct praid_member *member, bool valid) {
+    struct praid_rebuild_ckpt *ckpt;
+    struct page *page;
+    int ret;
+
+    page = alloc_page(GFP_NOIO | __GFP_ZERO);
+    if(!page) {
+        return -ENOMEM;
+    }
+
+    if(valid) {
+        ckpt = page_address(page);
+        ckpt->magic = cpu_to_le32(PRAID_REBUILD_CKPT_MAGIC);
+        ckpt->index = cpu_to_le32(member->index);
+        ckpt->disk_cnt = cpu_to_le32(dev->disk_cnt);
+        ckpt->chunk_size = cpu_to_le32(dev->geo.chunk_size);
+        ckpt->size = cpu_to_le64(dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+        ckpt->offset = cpu_to_le64(member->recovery_offset);
+    }
+
+    ret = praid_meta_io(dev, member->bdev, PRAID_META_CKPT_OFFSET, page, REQ_OP_WRITE);
+    __free_page(page);
+
+    return ret;
+}
+
+// 读取检查点，和阵列的几何参数一致时返回 true
+static bool praid_rebuild_ckpt_read(struct praid_dev *dev, struct praid_member *member, sector_t *offset) {
+    struct praid_rebuild_ckpt *ckpt;
+    struct page *page;
+    bool valid = false;
+
+    page = alloc_page(GFP_KERNEL);
+    if(!page) {
+        return false;
+    }
+
+    if(!praid_meta_io(dev, member->bdev, PRAID_META_CKPT_OFFSET, page, REQ_OP_READ)) {
+        ckpt = page_address(page);
+        valid = le32_to_cpu(ckpt->magic) == PRAID_REBUILD_CKPT_MAGIC &&
+                le32_to_cpu(ckpt->index) == member->index &&
+                le32_to_cpu(ckpt->disk_cnt) == dev->disk_cnt &&
+                le32_to_cpu(ckpt->chunk_size) == dev->geo.chunk_size &&
+                le64_to_cpu(ckpt->size) == dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT &&
+                le64_to_cpu(ckpt->offset) < le64_to_cpu(ckpt->size);
+        if(valid) {
+            *offset = round_down(le64_to_cpu(ckpt->offset), (sector_t)1 << dev->rebuild.window_shift);
+        }
+    }
+    __free_page(page);
+
+    return valid;
+}
+
+// 前台是否有 io，rebuild 和扩容自己的 io 不计入成员盘的统计
+bool praid_rebuild_fg_busy(struct praid_dev *dev) {
+    struct praid_member *member;
+    bool busy = false;
+    u64 ios = 0;
+    unsigned int i;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        member = &dev->members[i];
+        if(atomic_read(&member->inflight)) {
+            busy = true;
+        }
+        ios += atomic64_read(&member->ios[READ]) + atomic64_read(&member->ios[WRITE]);
+    }
+
+    if(ios != dev->rebuild.last_fg_ios) {
+        busy = true;
+    }
+    dev->rebuild.last_fg_ios = ios;
+
+    return busy;
+}
+
+static bool praid_rebuild_should_stop(struct praid_member *member) {
+    return kthread_should_stop() || !test_bit(PRAID_MEMBER_REBUILDING, &member->flags);
+}
+
+static void praid_rebuild_throttle(struct praid_dev *dev, struct praid_member *member) {
+    struct praid_rebuild *b = &dev->rebuild;
+    unsigned long speed;
+
+    while(!praid_rebuild_should_stop(member)) {
+        if(time_after(jiffies, b->mark_jiffies + PRAID_REBUILD_MARK_STEP)) {
+            b->mark_jiffies = jiffies;
+            b->mark_offset = member->recovery_offset;
+        }
+
+        speed = div_u64((member->recovery_offset - b->mark_offset) >> 1, (jiffies - b->mark_jiffies) / HZ + 1);
+        if(speed <= READ_ONCE(b->speed_min)) {
+            return;
+        }
+        if(speed <= READ_ONCE(b->speed_max) && !praid_rebuild_fg_busy(dev)) {
+            return;
+        }
+
+        schedule_timeout_interruptible(msecs_to_jiffies(PRAID_REBUILD_SLEEP_MS));
+    }
+}
+
+// 重建替换盘上从 offset 开始的 nr_chunks 个 chunk
+static int praid_rebuild_window(struct praid_dev *dev, struct praid_member *member, sector_t offset, unsigned int nr_chunks) {
+    struct praid_xor_req **reqs = dev->rebuild.reqs;
+    struct blk_plug plug;
+    unsigned int i, j, idx, nr = 0;
+    int ret = 0, err;
+
+    blk_start_plug(&plug);
+    for(nr = 0; nr < nr_chunks; nr ++) {
+        reqs[nr] = praid_xor_req_alloc(dev, offset + ((sector_t)nr << dev->geo.chunk_sectors_shift), dev->geo.chunk_size, dev->disk_cnt);
+        if(!reqs[nr]) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        for(j = 0, idx = 0; j <= dev->disk_cnt; j ++) {
+            if(j != member->index) {
+                praid_xor_req_submit(reqs[nr], idx ++, &dev->members[j], REQ_OP_READ);
+            }
+        }
+    }
+    blk_finish_plug(&plug);
+
+    for(i = 0; i < nr; i ++) {
+        err = praid_xor_req_wait(reqs[i]);
+        ret = ret ? ret : err;
+    }
+
+    for(i = 0; i < nr && !ret; i ++) {
+        ret = praid_xor_req_compute(reqs[i]);
+    }
+
+    if(!ret) {
+        blk_start_plug(&plug);
+        for(i = 0; i < nr; i ++) {
+            praid_xor_req_submit(reqs[i], reqs[i]->nr_src, member, REQ_OP_WRITE);
+        }
+        blk_finish_plug(&plug);
+
+        for(i = 0; i < nr; i ++) {
+            err = praid_xor_req_wait(reqs[i]);
+            ret = ret ? ret : err;
+        }
+    }
+
+    for(i = 0; i < nr; i ++) {
+        praid_xor_req_free(reqs[i]);
+    }
+
+    return ret;
+}
+
+/*
+ * 由其余成员盘重新计算 target 上 [sector, end) 的数据，用于崩溃后的校验同步。
+ * 不设置写入屏障，调用时不能有前台写
+ */
+int praid_rebuild_sync(struct praid_dev *dev, struct praid_member *target, sector_t sector, sector_t end) {
+    sector_t nr_sectors;
+    int ret;
+
+    for(; sector < end; sector += nr_sectors) {
+        nr_sectors = min_t(sector_t, (sector_t)1 << dev->rebuild.window_shift, end - sector);
+        ret = praid_rebuild_window(dev, target, sector, nr_sectors >> dev->geo.chunk_sectors_shift);
+        if(ret) {
+            return ret;
+        }
+        cond_resched();
+    }
+
+    return 0;
+}
+
+static void praid_rebuild_finish(struct praid_dev *dev, struct praid_member *member) {
+    praid_rebuild_ckpt_write(dev, member, false);
+
+    clear_bit(PRAID_MEMBER_FAULTY, &member->flags);
+    clear_bit(PRAID_MEMBER_REBUILDING, &member->flags);
+    atomic_dec(&dev->nr_faulty);
+
+    PRAID_INFO("%s%d: member %u rebuild complete.\n", VPCIEDISK_NAME, dev->id, member->index);
+}
+
+static int praid_rebuild_thread(void *data) {
+    struct praid_dev *dev = data;
+    struct praid_rebuild *b = &dev->rebuild;
+    struct praid_member *member = b->member;
+    sector_t end = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    sector_t offset, nr_sectors;
+    int ret = 0;
+
+    PRAID_INFO("%s%d: rebuilding member %u from sector %llu.\n", VPCIEDISK_NAME, dev->id, member->index, (u64)member->recovery_offset);
+
+    // 重建读写校验盘，未合并的校验日志先写入校验
+    praid_plog_drain(dev);
+
+    b->mark_jiffies = b->ckpt_jiffies = jiffies;
+    b->mark_offset = member->recovery_offset;
+
+    while(member->recovery_offset < end) {
+        praid_rebuild_throttle(dev, member);
+        if(praid_rebuild_should_stop(member)) {
+            break;
+        }
+
+        offset = member->recovery_offset;
+        nr_sectors = min_t(sector_t, (sector_t)1 << b->window_shift, end - offset);
+
+        praid_rebuild_raise_barrier(dev, offset >> b->window_shift);
+        ret = praid_rebuild_window(dev, member, offset, nr_sectors >> dev->geo.chunk_sectors_shift);
+        if(!ret) {
+            smp_store_release(&member->recovery_offset, offset + nr_sectors);
+        }
+        praid_rebuild_lower_barrier(dev);
+
+        if(ret) {
+            PRAID_ERROR("%s%d: rebuild member %u failed at sector %llu, error %d.\n", VPCIEDISK_NAME, dev->id, member->index, (u64)offset, ret);
+            clear_bit(PRAID_MEMBER_REBUILDING, &member->flags);
+            break;
+        }
+
+        if(time_after(jiffies, b->ckpt_jiffies + PRAID_REBUILD_CKPT_INTERVAL)) {
+            praid_rebuild_ckpt_write(dev, member, true);
+            b->ckpt_jiffies = jiffies;
+        }
+
+        cond_resched();
+    }
+
+    if(member->recovery_offset >= end) {
+        praid_rebuild_finish(dev, member);
+    } else {
+        praid_rebuild_ckpt_write(dev, member, true);
+        PRAID_INFO("%s%d: member %u rebuild stopped at sector %llu.\n", VPCIEDISK_NAME, dev->id, member->index, (u64)member->recovery_offset);
+    }
+
+    WRITE_ONCE(b->running, false);
+
+    // 等待 kthread_stop
+    while(!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if(kthread_should_stop()) {
+            break;
+        }
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return ret;
+}
+
+static int praid_rebuild_start(struct praid_dev *dev) {
+    struct praid_rebuild *b = &dev->rebuild;
+    int ret;
+
+    b->running = true;
+    b->thread = kthread_create_on_node(praid_rebuild_thread, dev, dev->config.node, "praid%d_rebuild", dev->id);
+    if(IS_ERR(b->thread)) {
+        ret = PTR_ERR(b->thread);
+        b->thread = NULL;
+        b->running = false;
+        clear_bit(PRAID_MEMBER_REBUILDING, &b->member->flags);
+        return ret;
+    }
+    wake_up_process(b->thread);
+
+    return 0;
+}
+
+static void praid_rebuild_stop(struct praid_dev *dev) {
+    if(dev->rebuild.thread) {
+        kthread_stop(dev->rebuild.thread);
+        dev->rebuild.thread = NULL;
+    }
+}
+
+/*
+ * 用次设备号为 minor 的盘替换失效的成员盘 idx 并开始重建。
+ * 替换盘上有该成员的检查点时从检查点继续
+ */
+int praid_rebuild_replace(struct praid_dev *dev, unsigned int idx, unsigned int minor) {
+    struct praid_rebuild *b = &dev->rebuild;
+    struct praid_member *member;
+    struct block_device *bdev, *old;
+    sector_t offset = 0;
+    int i, ret;
+
+    if(idx > dev->disk_cnt) {
+        return -EINVAL;
+    }
+    member = &dev->members[idx];
+
+    mutex_lock(&b->lock);
+
+    if(!praid_member_faulty(member)) {
+        PRAID_ERROR("%s%d: member %u is not faulty.\n", VPCIEDISK_NAME, dev->id, idx);
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+    if(READ_ONCE(b->running)) {
+        ret = -EBUSY;
+        goto out_unlock;
+    }
+    if(praid_failed(dev)) {
+        ret = -EIO;
+        goto out_unlock;
+    }
+    praid_rebuild_stop(dev);
+
+    bdev = blkdev_get_by_dev(MKDEV(dev->config.nvme_major, minor), PRAID_MEMBER_MODE, dev);
+    if(IS_ERR(bdev)) {
+        ret = PTR_ERR(bdev);
+        goto out_unlock;
+    }
+
+    if(bdev_nr_sectors(bdev) < dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT) {
+        PRAID_ERROR("%s%d: replacement disk too small.\n", VPCIEDISK_NAME, dev->id);
+        ret = -ENOSPC;
+        goto out_put;
+    }
+
+    // 等待失效前发往旧盘的 io 结束
+    for(i = 0; atomic_read(&member->inflight) && i < 500; i ++) {
+        msleep(10);
+    }
+    if(atomic_read(&member->inflight)) {
+        ret = -EBUSY;
+        goto out_put;
+    }
+
+    old = member->bdev;
+    WRITE_ONCE(member->bdev, bdev);
+    member->minor = minor;
+    blkdev_put(old, PRAID_MEMBER_MODE);
+
+    if(praid_rebuild_ckpt_read(dev, member, &offset)) {
+        PRAID_INFO("%s%d: resume rebuild of member %u from checkpoint.\n", VPCIEDISK_NAME, dev->id, idx);
+    }
+    member->recovery_offset = offset;
+    smp_mb__before_atomic();
+    set_bit(PRAID_MEMBER_REBUILDING, &member->flags);
+
+    b->member = member;
+    ret = praid_rebuild_start(dev);
+    goto out_unlock;
+
+out_put:
+    blkdev_put(bdev, PRAID_MEMBER_MODE);
+out_unlock:
+    mutex_unlock(&b->lock);
+    return ret;
+}
+
+/*
+ * 在块设备创建之前调用。成员盘上有未完成的检查点时，该盘的重建在 praid_rebuild_run 中继续
+ */
+int praid_rebuild_init(struct praid_dev *dev) {
+    struct praid_rebuild *b = &dev->rebuild;
+    struct praid_member *member;
+    unsigned int i, chunks;
+    sector_t offset;
+
+    mutex_init(&b->lock);
+    init_waitqueue_head(&b->wait);
+    b->speed_min = PRAID_REBUILD_SPEED_MIN;
+    b->speed_max = PRAID_REBUILD_SPEED_MAX;
+
+    chunks = min_t(unsigned int, PRAID_REBUILD_WINDOW >> dev->geo.chunk_shift,
+                   PRAID_REBUILD_BUF / (dev->geo.chunk_size * (dev->disk_cnt + 1)));
+    b->window_chunks = rounddown_pow_of_two(max(chunks, 1u));
+    b->window_shift = dev->geo.chunk_sectors_shift + ilog2(b->window_chunks);
+
+    b->reqs = kcalloc_node(b->window_chunks, sizeof(*b->reqs), GFP_KERNEL, dev->config.node);
+    if(!b->reqs) {
+        return -ENOMEM;
+    }
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        member = &dev->members[i];
+        if(!praid_rebuild_ckpt_read(dev, member, &offset)) {
+            continue;
+        }
+        if(b->member) {
+            PRAID_ERROR("%s%d: member %u also has a rebuild checkpoint, ignored.\n", VPCIEDISK_NAME, dev->id, i);
+            continue;
+        }
+
+        PRAID_INFO("%s%d: member %u was rebuilding, resume from sector %llu.\n", VPCIEDISK_NAME, dev->id, i, (u64)offset);
+        member->recovery_offset = offset;
+        set_bit(PRAID_MEMBER_FAULTY, &member->flags);
+        set_bit(PRAID_MEMBER_REBUILDING, &member->flags);
+        atomic_inc(&dev->nr_faulty);
+        b->member = member;
+    }
+
+    return 0;
+}
+
+// 在块设备创建之后调用，继续未完成的重建
+void praid_rebuild_run(struct praid_dev *dev) {
+    struct praid_rebuild *b = &dev->rebuild;
+
+    mutex_lock(&b->lock);
+    if(b->member && test_bit(PRAID_MEMBER_REBUILDING, &b->member->flags) && praid_rebuild_start(dev)) {
+        PRAID_ERROR("%s%d: start rebuild thread failed.\n", VPCIEDISK_NAME, dev->id);
+    }
+    mutex_unlock(&b->lock);
+}
+
+void praid_rebuild_exit(struct praid_dev *dev) {
+    mutex_lock(&dev->rebuild.lock);
+    praid_rebuild_stop(dev);
+    mutex_unlock(&dev->rebuild.lock);
+
+    kfree(dev->rebuild.reqs);
+}
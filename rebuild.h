@@ -0,0 +1,37 @@
+#ifndef __PRAID_REBUILD_H__
+#define __PRAID_REBUILD_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_REBUILD_SPEED_MIN 1000    // KB/s
+#define PRAID_REBUILD_SPEED_MAX 200000  // KB/s
+#define PRAID_REBUILD_WINDOW MB(1)      // 每个成员盘上一个窗口的最大字节数
+#define PRAID_REBUILD_BUF MB(16)        // 一个窗口所有成员盘的缓冲区上限
+
+#define PRAID_REBUILD_CKPT_MAGIC 0x50524244 // "PRBD"
+
+// 重建检查点，位置见 meta.h
+struct praid_rebuild_ckpt {
+    __le32 magic;
+    __le32 index;
+    __le32 disk_cnt;
+    __le32 chunk_size;
+    __le64 size;    // 成员盘数据区扇区数
+    __le64 offset;  // 已重建的扇区数
+};
+
+void praid_rebuild_hold_range(struct praid_dev *dev, sector_t sector, sector_t end_sector, unsigned long *w0, unsigned long *w1);
+void praid_rebuild_release_range(struct praid_dev *dev, unsigned long w0, unsigned long w1);
+void praid_rebuild_start_write(struct praid_dev *dev, struct bio *bio);
+void praid_rebuild_end_write(struct bio *bio);
+
+bool praid_rebuild_fg_busy(struct praid_dev *dev);
+int praid_rebuild_sync(struct praid_dev *dev, struct praid_member *target, sector_t sector, sector_t end);
+int praid_rebuild_replace(struct praid_dev *dev, unsigned int idx, unsigned int minor);
+int praid_rebuild_init(struct praid_dev *dev);
+void praid_rebuild_run(struct praid_dev *dev);
+void praid_rebuild_exit(struct praid_dev *dev);
+
+#endif
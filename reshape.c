@@ -0,0 +1,689 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "device.h"
+#include "pciev.h"
+#include "pciedrv.h"
+#include "degraded.h"
+#include "rebuild.h"
+#include "reshape.h"
+#include "meta.h"
+#include "bitmap.h"
+#include "zeromap.h"
+#include "pcache.h"
+#include "discard.h"
+#include "iosched.h"
+
+/*
+ * 在线扩容。grow 加入一个数据盘后，后台线程按新布局的条带顺序把 N 个数据盘上的数据重新分布到 N + 1 个数据盘上，
+ * 每个窗口的条带由设备整条带异或重新计算校验，数据和校验直接写入。
+ *
+ * 新数据盘先清零，旧布局的校验对 N + 1 个数据盘仍然成立：降级读写、重建和写意图位图都按成员盘扇区工作，
+ * 不区分新旧布局。已搬移的部分按新布局映射，其余按旧布局映射，正在搬移的窗口阻塞落在其中的 io。
+ *
+ * 新条带的窗口 [a, b) 覆盖旧布局的条带 [a, b)，其中的数据在搬移到第 b * N / (N + 1) 个新条带后已经全部搬走。
+ * a >= N 时窗口不超过 a / N 个条带，覆盖的都是已搬走并记入检查点的数据；开始的 N 个条带总会覆盖还没搬走的数据，
+ * 逐条带先写入校验盘上的备份区。每个窗口写完后刷新成员盘再写检查点，崩溃后从检查点继续，备份有效时从备份重写该条带。
+ * 限速和重建共用 sync_speed_min/max，有成员盘失效时暂停，重建完成后继续。
+ */
+
+#define PRAID_RESHAPE_MARK_STEP (3 * HZ)    // 速度统计的时间窗口
+#define PRAID_RESHAPE_SLEEP_MS 100
+#define PRAID_RESHAPE_RETRY_MS 1000
+
+#define PRAID_MEMBER_MODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/*
+ * 扩容屏障。io 在拆分前读取当前的 epoch 并计数，拆分出的成员盘 bio 计入同一 epoch，完成时释放。
+ * 搬移窗口前设置阻塞范围并切换 epoch，等待旧 epoch 的 io 全部完成；之后进入的 io 都能看到阻塞范围
+ */
+static bool praid_reshape_blocked(struct praid_reshape *r, sector_t sector, sector_t end_sector) {
+    sector_t hi = READ_ONCE(r->hi);
+
+    return hi && sector < hi && end_sector > READ_ONCE(r->lo);
+}
+
+static void praid_reshape_put(struct praid_reshape *r, unsigned int epoch) {
+    if(atomic_dec_and_test(&r->nr_pending[epoch]) && READ_ONCE(r->hi)) {
+        wake_up(&r->wait);
+    }
+}
+
+// 提交路径上拆分 bio 之前调用，返回计入的 epoch，没有扩容时返回 -1
+int praid_reshape_hold(struct praid_dev *dev, struct bio *bio) {
+    struct praid_reshape *r = &dev->reshape;
+    sector_t sector = bio->bi_iter.bi_sector, end_sector = bio_end_sector(bio);
+    unsigned int epoch;
+
+    if(likely(!READ_ONCE(r->active)) || !bio_sectors(bio)) {
+        return -1;
+    }
+
+    for(;;) {
+        epoch = READ_ONCE(r->epoch);
+        atomic_inc(&r->nr_pending[epoch]);
+        smp_mb__after_atomic();
+
+        if(likely(!praid_reshape_blocked(r, sector, end_sector))) {
+            return epoch;
+        }
+
+        praid_reshape_put(r, epoch);
+        wait_event(r->wait, !praid_reshape_blocked(r, sector, end_sector));
+    }
+}
+
+void praid_reshape_release(struct praid_dev *dev, int epoch) {
+    if(epoch >= 0) {
+        praid_reshape_put(&dev->reshape, epoch);
+    }
+}
+
+// 成员盘 bio 计入拆分前取得的 epoch
+void praid_reshape_start_io(struct praid_dev *dev, struct bio *bio, int epoch) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    pbio->reshape = epoch;
+    if(epoch >= 0) {
+        atomic_inc(&dev->reshape.nr_pending[epoch]);
+    }
+}
+
+void praid_reshape_end_io(struct bio *bio) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+
+    if(pbio->reshape < 0) {
+        return;
+    }
+    praid_reshape_put(&pbio->member->dev->reshape, pbio->reshape);
+    pbio->reshape = -1;
+}
+
+// 阻止 io 进入新条带 [a, b) 对应的阵列扇区，等待已有的 io 和校验更新完成
+static void praid_reshape_raise_gate(struct praid_dev *dev, u64 a, u64 b) {
+    struct praid_reshape *r = &dev->reshape;
+    unsigned int epoch = r->epoch, shift = dev->geo.chunk_sectors_shift;
+
+    WRITE_ONCE(r->lo, (sector_t)(a * dev->disk_cnt) << shift);
+    WRITE_ONCE(r->hi, (sector_t)(b * dev->disk_cnt) << shift);
+    smp_wmb();
+    WRITE_ONCE(r->epoch, !epoch);
+    smp_mb();
+    wait_event(r->wait, !atomic_read(&r->nr_pending[epoch]));
+
+    flush_workqueue(dev->workqueue);
+    down(&dev->sem);
+    up(&dev->sem);
+}
+
+static void praid_reshape_lower_gate(struct praid_dev *dev) {
+    WRITE_ONCE(dev->reshape.hi, 0);
+    wake_up_all(&dev->reshape.wait);
+}
+
+// 检查点在校验盘上的偏移，零区域表的大小按 disk_cnt 个数据盘计算
+static sector_t praid_reshape_meta_offset(struct praid_dev *dev, unsigned int disk_cnt) {
+    return praid_meta_zeromap_offset(dev) + (sector_t)(praid_zeromap_nr_pages(dev, disk_cnt) + 1) * PRAID_META_PAGE_SECTORS;
+}
+
+// 扩容前的容量对应的 chunk 数
+static u64 praid_reshape_nr_chunks(struct praid_dev *dev) {
+    return (u64)dev->reshape.old_geo.data_disks * ((dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT) >> dev->geo.chunk_sectors_shift);
+}
+
+static unsigned int praid_reshape_max_stripes(struct praid_dev *dev) {
+    return max_t(unsigned int, 1, PRAID_RESHAPE_BUF / (dev->geo.chunk_size * (dev->disk_cnt + 1)));
+}
+
+// 写入检查点，valid 为假时清除检查点
+static int praid_reshape_ckpt_write(struct praid_dev *dev, bool valid, u64 pos, bool backup) {
+    struct praid_reshape_ckpt *ckpt;
+    struct page *page;
+    int ret;
+
+    page = alloc_page(GFP_NOIO | __GFP_ZERO);
+    if(!page) {
+        return -ENOMEM;
+    }
+
+    if(valid) {
+        ckpt = page_address(page);
+        ckpt->magic = cpu_to_le32(PRAID_RESHAPE_CKPT_MAGIC);
+        ckpt->disk_cnt = cpu_to_le32(dev->disk_cnt);
+        ckpt->chunk_size = cpu_to_le32(dev->geo.chunk_size);
+        ckpt->backup = cpu_to_le32(backup);
+        ckpt->size = cpu_to_le64(dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+        ckpt->pos = cpu_to_le64(pos);
+    }
+
+    ret = praid_meta_io(dev, praid_parity_member(dev)->bdev, praid_reshape_meta_offset(dev, dev->disk_cnt), page, REQ_OP_WRITE);
+    __free_page(page);
+
+    return ret;
+}
+
+// 读取检查点，和阵列的几何参数一致时返回 true
+static bool praid_reshape_ckpt_read(struct praid_dev *dev, u64 *pos, bool *backup) {
+    struct praid_reshape_ckpt *ckpt;
+    struct page *page;
+    bool valid = false;
+
+    page = alloc_page(GFP_KERNEL);
+    if(!page) {
+        return false;
+    }
+
+    if(!praid_meta_io(dev, praid_parity_member(dev)->bdev, praid_reshape_meta_offset(dev, dev->disk_cnt), page, REQ_OP_READ)) {
+        ckpt = page_address(page);
+        valid = le32_to_cpu(ckpt->magic) == PRAID_RESHAPE_CKPT_MAGIC &&
+                le32_to_cpu(ckpt->disk_cnt) == dev->disk_cnt &&
+                le32_to_cpu(ckpt->chunk_size) == dev->geo.chunk_size &&
+                le64_to_cpu(ckpt->size) == dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+        if(valid) {
+            *pos = le64_to_cpu(ckpt->pos);
+            *backup = le32_to_cpu(ckpt->backup);
+        }
+    }
+    __free_page(page);
+
+    return valid;
+}
+
+// 异步读出第 s 个新条带各数据盘的 chunk 到 req 的前 disk_cnt 组中，超出扩容前容量的 chunk 为零
+static void praid_reshape_read_stripe(struct praid_dev *dev, struct praid_xor_req *req, u64 s) {
+    struct praid_reshape *r = &dev->reshape;
+    u64 nr_chunks = praid_reshape_nr_chunks(dev), chunk, stripe;
+    unsigned int j, k, devi;
+
+    for(j = 0; j < dev->disk_cnt; j ++) {
+        chunk = s * dev->disk_cnt + j;
+        if(chunk >= nr_chunks) {
+            for(k = 0; k < req->nr_pages; k ++) {
+                clear_highpage(praid_xor_req_group(req, j)[k]);
+            }
+            continue;
+        }
+
+        stripe = praid_geo_split_chunk(&r->old_geo, chunk, &devi);
+        praid_xor_req_submit_at(req, j, &dev->members[devi], praid_geo_stripe_to_sector(&r->old_geo, stripe), REQ_OP_READ);
+    }
+}
+
+// 异步读写校验盘上的备份区，备份区保存一个新条带所有数据盘的 chunk
+static void praid_reshape_backup_io(struct praid_dev *dev, struct praid_xor_req *req, unsigned int op) {
+    sector_t sector = (dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT) + praid_reshape_meta_offset(dev, dev->disk_cnt) + PRAID_META_PAGE_SECTORS;
+    unsigned int j;
+
+    for(j = 0; j < dev->disk_cnt; j ++) {
+        praid_xor_req_submit_at(req, j, praid_parity_member(dev), sector + ((sector_t)j << dev->geo.chunk_sectors_shift), op);
+    }
+}
+
+static int praid_reshape_flush(struct praid_dev *dev) {
+    unsigned int i;
+    int ret;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        ret = blkdev_issue_flush(dev->members[i].bdev);
+        if(ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * 搬移新条带 [a, b)，调用者已阻止 io 进入对应的阵列扇区。a 小于扩容前的数据盘数时窗口只有一个条带，
+ * 写入前先写备份和检查点。成功后 pos 前移到 b
+ */
+static int praid_reshape_window(struct praid_dev *dev, u64 a, u64 b) {
+    struct praid_reshape *r = &dev->reshape;
+    struct praid_xor_req **reqs;
+    struct blk_plug plug;
+    unsigned int nr = b - a, i, j;
+    bool backup = a < r->old_geo.data_disks;
+    int ret = 0, err;
+
+    // 没有检查点时中断后按扩容前的布局加载，已搬移的条带会丢失
+    if(r->ckpt_stale) {
+        ret = praid_reshape_ckpt_write(dev, true, a, r->backup);
+        if(ret) {
+            return ret;
+        }
+        r->ckpt_stale = false;
+    }
+
+    reqs = kcalloc(nr, sizeof(*reqs), GFP_NOIO);
+    if(!reqs) {
+        return -ENOMEM;
+    }
+
+    blk_start_plug(&plug);
+    for(i = 0; i < nr; i ++) {
+        reqs[i] = praid_xor_req_alloc(dev, praid_geo_stripe_to_sector(&dev->geo, a + i), dev->geo.chunk_size, dev->disk_cnt);
+        if(!reqs[i]) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        // 上次在写入中途中断，旧布局的数据可能已被覆盖，备份中的数据是完整的
+        if(r->backup) {
+            praid_reshape_backup_io(dev, reqs[i], REQ_OP_READ);
+        } else {
+            praid_reshape_read_stripe(dev, reqs[i], a + i);
+        }
+    }
+    blk_finish_plug(&plug);
+    nr = i;
+
+    for(i = 0; i < nr; i ++) {
+        err = praid_xor_req_wait(reqs[i]);
+        ret = ret ? ret : err;
+    }
+
+    if(!ret && backup && !r->backup) {
+        praid_reshape_backup_io(dev, reqs[0], REQ_OP_WRITE);
+        ret = praid_xor_req_wait(reqs[0]);
+        if(!ret) {
+            ret = blkdev_issue_flush(praid_parity_member(dev)->bdev);
+        }
+        if(!ret) {
+            ret = praid_reshape_ckpt_write(dev, true, a, true);
+        }
+        // 检查点落盘之前不能覆盖旧布局，重试时重新写入备份
+        if(!ret) {
+            r->backup = true;
+        }
+    }
+
+    for(i = 0; i < nr && !ret; i ++) {
+        ret = praid_xor_req_compute(reqs[i]);
+    }
+
+    // 第 disk_cnt 组为异或结果，正好对应校验盘
+    if(!ret) {
+        blk_start_plug(&plug);
+        for(i = 0; i < nr; i ++) {
+            for(j = 0; j <= dev->disk_cnt; j ++) {
+                praid_xor_req_submit(reqs[i], j, &dev->members[j], REQ_OP_WRITE);
+            }
+        }
+        blk_finish_plug(&plug);
+
+        for(i = 0; i < nr; i ++) {
+            err = praid_xor_req_wait(reqs[i]);
+            ret = ret ? ret : err;
+        }
+    }
+
+    // 新位置落盘后才能记录进度，之后的窗口会覆盖这些数据的旧位置
+    if(!ret) {
+        ret = praid_reshape_flush(dev);
+    }
+    if(!ret) {
+        ret = praid_reshape_ckpt_write(dev, true, b, false);
+    }
+
+    if(!ret) {
+        for(j = 0; j < dev->disk_cnt; j ++) {
+            praid_pcache_invalidate_range(dev, j, praid_geo_stripe_to_sector(&dev->geo, a), (sector_t)(b - a) << dev->geo.chunk_sectors_shift);
+        }
+        r->pos = b;
+        r->backup = false;
+        WRITE_ONCE(r->pos_sector, (sector_t)(b * dev->disk_cnt) << dev->geo.chunk_sectors_shift);
+    }
+
+    for(i = 0; i < nr; i ++) {
+        praid_xor_req_free(reqs[i]);
+    }
+    kfree(reqs);
+
+    return ret;
+}
+
+// 速度按每个成员盘上写入的扇区数计算，同重建
+static void praid_reshape_throttle(struct praid_dev *dev) {
+    struct praid_reshape *r = &dev->reshape;
+    struct praid_rebuild *b = &dev->rebuild;
+    unsigned long speed;
+
+    while(!kthread_should_stop()) {
+        if(time_after(jiffies, r->mark_jiffies + PRAID_RESHAPE_MARK_STEP)) {
+            r->mark_jiffies = jiffies;
+            r->mark_pos = r->pos;
+        }
+
+        speed = div_u64(((r->pos - r->mark_pos) << dev->geo.chunk_sectors_shift) >> 1, (jiffies - r->mark_jiffies) / HZ + 1);
+        if(speed <= READ_ONCE(b->speed_min)) {
+            return;
+        }
+        if(speed <= READ_ONCE(b->speed_max) && !praid_rebuild_fg_busy(dev)) {
+            return;
+        }
+
+        schedule_timeout_interruptible(msecs_to_jiffies(PRAID_RESHAPE_SLEEP_MS));
+    }
+}
+
+static void praid_reshape_finish(struct praid_dev *dev) {
+    WRITE_ONCE(dev->reshape.active, false);
+
+    dev->size = dev->config.size_nvme_disk * (uint64_t)dev->disk_cnt;
+    blk_queue_io_opt(dev->queue, dev->geo.chunk_size * dev->disk_cnt);
+    praid_discard_limits(dev);
+    set_capacity_and_notify(dev->gd, dev->size >> KERNEL_SECTOR_SHIFT);
+    praid_reshape_ckpt_write(dev, false, 0, false);
+
+    PRAID_INFO("%s%d: reshape complete, %u data disks, %llu MiB.\n", VPCIEDISK_NAME, dev->id, dev->disk_cnt, BYTE_TO_MB(dev->size));
+}
+
+static int praid_reshape_thread(void *data) {
+    struct praid_dev *dev = data;
+    struct praid_reshape *r = &dev->reshape;
+    unsigned int old_disks = r->old_geo.data_disks;
+    bool raised = false;
+    u64 a, b;
+    int ret;
+
+    PRAID_INFO("%s%d: reshaping to %u data disks from stripe %llu of %llu.\n", VPCIEDISK_NAME, dev->id, dev->disk_cnt, r->pos, r->end);
+
+    r->mark_jiffies = jiffies;
+    r->mark_pos = r->pos;
+
+    while(r->pos < r->end && !kthread_should_stop()) {
+        // 有成员盘失效时暂停，重建完成后继续。窗口中途失败时保持阻塞，重建完成后重做该窗口
+        if(praid_degraded(dev)) {
+            schedule_timeout_interruptible(msecs_to_jiffies(PRAID_RESHAPE_SLEEP_MS));
+            continue;
+        }
+
+        a = r->pos;
+        b = a + 1;
+        if(a >= old_disks && !r->backup) {
+            b = a + min_t(u64, div_u64(a, old_disks), r->max_stripes);
+        }
+        b = min(b, r->end);
+
+        if(!raised) {
+            praid_reshape_throttle(dev);
+            if(kthread_should_stop()) {
+                break;
+            }
+            praid_reshape_raise_gate(dev, a, b);
+            raised = true;
+        }
+
+        ret = praid_reshape_window(dev, a, b);
+        if(ret) {
+            PRAID_ERROR("%s%d: reshape stripes [%llu, %llu) failed, error %d.\n", VPCIEDISK_NAME, dev->id, a, b, ret);
+            schedule_timeout_interruptible(msecs_to_jiffies(PRAID_RESHAPE_RETRY_MS));
+            continue;
+        }
+
+        praid_reshape_lower_gate(dev);
+        raised = false;
+
+        cond_resched();
+    }
+
+    if(raised) {
+        praid_reshape_lower_gate(dev);
+    }
+
+    if(r->pos >= r->end) {
+        praid_reshape_finish(dev);
+    } else {
+        PRAID_INFO("%s%d: reshape stopped at stripe %llu.\n", VPCIEDISK_NAME, dev->id, r->pos);
+    }
+
+    // 等待 kthread_stop
+    while(!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if(kthread_should_stop()) {
+            break;
+        }
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+static int praid_reshape_start(struct praid_dev *dev) {
+    struct praid_reshape *r = &dev->reshape;
+    int ret;
+
+    r->thread = kthread_create_on_node(praid_reshape_thread, dev, dev->config.node, "praid%d_reshape", dev->id);
+    if(IS_ERR(r->thread)) {
+        ret = PTR_ERR(r->thread);
+        r->thread = NULL;
+        return ret;
+    }
+    wake_up_process(r->thread);
+
+    return 0;
+}
+
+static void praid_reshape_stop(struct praid_dev *dev) {
+    if(dev->reshape.thread) {
+        kthread_stop(dev->reshape.thread);
+        dev->reshape.thread = NULL;
+    }
+}
+
+// 等待所有成员盘的 io 和校验更新结束，调用者已冻结队列
+static void praid_reshape_quiesce(struct praid_dev *dev) {
+    unsigned int i;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        while(atomic_read(&dev->members[i].inflight)) {
+            msleep(10);
+        }
+    }
+
+    flush_workqueue(dev->workqueue);
+}
+
+/*
+ * 加入次设备号为 minor 的盘作为新的数据盘并开始扩容。日志、写回缓存和校验日志
+ * 使用按成员数量划分的空间，开启时不能扩容；降级或重建中也不能扩容
+ */
+int praid_reshape_grow(struct praid_dev *dev, unsigned int minor) {
+    struct praid_reshape *r = &dev->reshape;
+    struct praid_member *parity = praid_parity_member(dev), *member;
+    unsigned int n = dev->disk_cnt, i, *minors;
+    sector_t size = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    struct block_device *bdev;
+    int ret;
+
+    mutex_lock(&dev->rebuild.lock);
+
+    if(READ_ONCE(r->active) || praid_degraded(dev) || READ_ONCE(dev->rebuild.running)) {
+        ret = -EBUSY;
+        goto out_unlock;
+    }
+    if(dev->journal.enabled || dev->cache.enabled || dev->plog.enabled) {
+        PRAID_ERROR("%s%d: can not grow with [journal], [cache_size] or [plog_size].\n", VPCIEDISK_NAME, dev->id);
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+    if(n + 1 > PRAID_MAX_DISKS) {
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+    for(i = 0; i <= n; i ++) {
+        if(dev->members[i].minor == minor) {
+            ret = -EINVAL;
+            goto out_unlock;
+        }
+    }
+    if((unsigned long)PCIEV_BAR_SLOTS(n + 1) * dev->geo.chunk_size + BAR_CHUNK_OFFSET > dev->config.memmap_size) {
+        PRAID_ERROR("%s%d: reserved memory too small for %u data disks.\n", VPCIEDISK_NAME, dev->id, n + 1);
+        ret = -ENOSPC;
+        goto out_unlock;
+    }
+    if(!praid_meta_fits(dev, parity->bdev, praid_reshape_meta_offset(dev, n + 1), PRAID_META_PAGE_SECTORS + ((sector_t)(n + 1) << dev->geo.chunk_sectors_shift))) {
+        PRAID_ERROR("%s%d: no space for reshape checkpoint on parity member.\n", VPCIEDISK_NAME, dev->id);
+        ret = -ENOSPC;
+        goto out_unlock;
+    }
+
+    // 上次扩容的线程已结束，等待 kthread_stop
+    praid_reshape_stop(dev);
+
+    minors = krealloc(dev->config.nvme_minor, (n + 1) * sizeof(*minors), GFP_KERNEL);
+    if(!minors) {
+        ret = -ENOMEM;
+        goto out_unlock;
+    }
+    dev->config.nvme_minor = minors;
+
+    bdev = blkdev_get_by_dev(MKDEV(dev->config.nvme_major, minor), PRAID_MEMBER_MODE, dev);
+    if(IS_ERR(bdev)) {
+        ret = PTR_ERR(bdev);
+        goto out_unlock;
+    }
+    if(bdev_nr_sectors(bdev) < size) {
+        PRAID_ERROR("%s%d: new disk too small.\n", VPCIEDISK_NAME, dev->id);
+        ret = -ENOSPC;
+        goto out_put;
+    }
+
+    // 新数据盘清零后旧布局的校验对所有成员盘仍然成立
+    ret = blkdev_issue_zeroout(bdev, 0, size, GFP_KERNEL, 0);
+    if(ret) {
+        goto out_put;
+    }
+
+    blk_mq_freeze_queue(dev->queue);
+    praid_reshape_quiesce(dev);
+
+    down(&dev->sem);
+    ret = pcievdrv_remap_chunks(dev, n + 1);
+    if(ret) {
+        up(&dev->sem);
+        blk_mq_unfreeze_queue(dev->queue);
+        goto out_put;
+    }
+    PCIEV_set_disk_cnt(dev->vdev, n + 1);
+
+    // 校验盘移到 members[n + 1]，数组按 PRAID_MAX_DISKS 分配。调度队列中的锁和 work 不能拷贝，重新初始化
+    flush_work(&parity->ioq_work);
+    memcpy(&dev->members[n + 1], parity, sizeof(*parity));
+    dev->members[n + 1].index = n + 1;
+    praid_iosched_member_init(&dev->members[n + 1]);
+    member = &dev->members[n];
+    memset(member, 0, sizeof(*member));
+    praid_iosched_member_init(member);
+    member->dev = dev;
+    member->index = n;
+    member->minor = minor;
+    member->bdev = bdev;
+    dev->config.nvme_minor[n] = minor;
+    dev->config.nr_nvme_disks = n + 1;
+    dev->rebuild.member = NULL;
+
+    r->old_geo = dev->geo;
+    praid_geo_init(&dev->geo, dev->geo.chunk_size, n + 1);
+    WRITE_ONCE(dev->disk_cnt, n + 1);
+    r->end = DIV_ROUND_UP_ULL(praid_reshape_nr_chunks(dev), n + 1);
+    r->pos = 0;
+    r->pos_sector = 0;
+    r->backup = false;
+    r->ckpt_stale = false;
+    r->max_stripes = praid_reshape_max_stripes(dev);
+    WRITE_ONCE(r->active, true);
+    up(&dev->sem);
+
+    // 位图和零区域表的头部记录了数据盘数
+    if(praid_bitmap_regrow(dev)) {
+        PRAID_ERROR("%s%d: write bitmap failed.\n", VPCIEDISK_NAME, dev->id);
+    }
+    if(praid_zeromap_regrow(dev)) {
+        PRAID_ERROR("%s%d: rebuild zero map failed, disabled.\n", VPCIEDISK_NAME, dev->id);
+    }
+    ret = praid_reshape_ckpt_write(dev, true, 0, false);
+    if(ret) {
+        PRAID_ERROR("%s%d: write reshape checkpoint failed, error %d, retry before moving stripes.\n", VPCIEDISK_NAME, dev->id, ret);
+        r->ckpt_stale = true;
+    }
+
+    blk_mq_unfreeze_queue(dev->queue);
+
+    PRAID_INFO("%s%d: member %u (minor %u) added, parity moved to member %u.\n", VPCIEDISK_NAME, dev->id, n, minor, n + 1);
+
+    ret = praid_reshape_start(dev);
+    goto out_unlock;
+
+out_put:
+    blkdev_put(bdev, PRAID_MEMBER_MODE);
+out_unlock:
+    mutex_unlock(&dev->rebuild.lock);
+    return ret;
+}
+
+/*
+ * 在零区域表初始化之后、块设备创建之前调用。校验盘上有扩容检查点时，数据盘按扩容后的数量指定，
+ * 块设备以扩容前的容量创建，扩容在 praid_reshape_run 中继续
+ */
+int praid_reshape_init(struct praid_dev *dev) {
+    struct praid_reshape *r = &dev->reshape;
+    bool backup;
+    u64 pos;
+
+    init_waitqueue_head(&r->wait);
+
+    if(dev->disk_cnt < 2 || !praid_reshape_ckpt_read(dev, &pos, &backup)) {
+        return 0;
+    }
+
+    // fresh 已清零所有成员盘
+    if(dev->config.fresh) {
+        praid_reshape_ckpt_write(dev, false, 0, false);
+        return 0;
+    }
+
+    if(dev->config.journal || dev->config.cache_size || dev->config.plog_size) {
+        PRAID_ERROR("%s%d: reshape in progress, [journal], [cache_size] and [plog_size] can not be used.\n", VPCIEDISK_NAME, dev->id);
+        return -EINVAL;
+    }
+
+    praid_geo_init(&r->old_geo, dev->geo.chunk_size, dev->disk_cnt - 1);
+    r->end = DIV_ROUND_UP_ULL(praid_reshape_nr_chunks(dev), dev->disk_cnt);
+    if(pos > r->end) {
+        PRAID_ERROR("%s%d: invalid reshape checkpoint, ignored.\n", VPCIEDISK_NAME, dev->id);
+        return 0;
+    }
+
+    r->pos = pos;
+    r->pos_sector = (sector_t)(pos * dev->disk_cnt) << dev->geo.chunk_sectors_shift;
+    r->backup = backup;
+    r->max_stripes = praid_reshape_max_stripes(dev);
+    r->active = true;
+
+    PRAID_INFO("%s%d: was reshaping from %u data disks, resume from stripe %llu%s.\n", VPCIEDISK_NAME, dev->id,
+               dev->disk_cnt - 1, pos, backup ? " with backup" : "");
+
+    return 0;
+}
+
+// 在块设备创建之后调用，继续未完成的扩容
+void praid_reshape_run(struct praid_dev *dev) {
+    if(dev->reshape.active && praid_reshape_start(dev)) {
+        PRAID_ERROR("%s%d: start reshape thread failed.\n", VPCIEDISK_NAME, dev->id);
+    }
+}
+
+// 在块设备删除之前调用，阻塞中的 io 在线程退出时放行
+void praid_reshape_exit(struct praid_dev *dev) {
+    mutex_lock(&dev->rebuild.lock);
+    praid_reshape_stop(dev);
+    mutex_unlock(&dev->rebuild.lock);
+}
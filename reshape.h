@@ -0,0 +1,41 @@
+#ifndef __PRAID_RESHAPE_H__
+#define __PRAID_RESHAPE_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_RESHAPE_BUF MB(16)        // 一个窗口所有成员盘的缓冲区上限
+#define PRAID_RESHAPE_CKPT_MAGIC 0x50525348 // "PRSH"
+
+// 扩容检查点，保存在校验盘上校验日志的位置(扩容期间不使用校验日志)，第 pos 个新条带的备份紧随其后
+struct praid_reshape_ckpt {
+    __le32 magic;
+    __le32 disk_cnt;    // 扩容后的数据盘数
+    __le32 chunk_size;
+    __le32 backup;      // 备份区中有第 pos 个新条带的数据
+    __le64 size;        // 成员盘数据区扇区数
+    __le64 pos;         // 已搬移的新条带数
+};
+
+// 阵列扇区所在位置使用的几何参数，chunk 大小扩容前后相同
+static inline const struct praid_geo *praid_reshape_geo(struct praid_dev *dev, sector_t sector) {
+    struct praid_reshape *r = &dev->reshape;
+
+    if(likely(!READ_ONCE(r->active)) || sector < READ_ONCE(r->pos_sector)) {
+        return &dev->geo;
+    }
+    return &r->old_geo;
+}
+
+int praid_reshape_hold(struct praid_dev *dev, struct bio *bio);
+void praid_reshape_release(struct praid_dev *dev, int epoch);
+void praid_reshape_start_io(struct praid_dev *dev, struct bio *bio, int epoch);
+void praid_reshape_end_io(struct bio *bio);
+
+int praid_reshape_grow(struct praid_dev *dev, unsigned int minor);
+int praid_reshape_init(struct praid_dev *dev);
+void praid_reshape_run(struct praid_dev *dev);
+void praid_reshape_exit(struct praid_dev *dev);
+
+#endif
@@ -0,0 +1,667 @@
+#include <linux/sysfs.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+
+#include "praid.h"
+#include "block.h"
+#include "degraded.h"
+#include "rebuild.h"
+#include "reshape.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "zeromap.h"
+#include "plog.h"
+#include "cache.h"
+#include "pcache.h"
+#include "flush.h"
+#include "iosched.h"
+#include "readahead.h"
+#include "hedge.h"
+#include "hybrid.h"
+#include "engine.h"
+#include "pciedma.h"
+#include "pcieuser.h"
+
+/*
+ * 阵列的 sysfs 属性，位于 /sys/block/praiddisk<N>/praid/
+ */
+
+static struct praid_dev *dev_to_praid(struct device *d) {
+    return dev_to_disk(d)->private_data;
+}
+
+static ssize_t chunk_size_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", dev_to_praid(d)->geo.chunk_size);
+}
+static DEVICE_ATTR_RO(chunk_size);
+
+static ssize_t disk_cnt_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", dev_to_praid(d)->disk_cnt);
+}
+static DEVICE_ATTR_RO(disk_cnt);
+
+// 失效的成员盘数量和降级读写的次数
+static ssize_t degraded_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+
+    return sysfs_emit(buf, "%d %lld %lld\n", atomic_read(&dev->nr_faulty),
+                      atomic64_read(&dev->degraded_reads), atomic64_read(&dev->degraded_writes));
+}
+static DEVICE_ATTR_RO(degraded);
+
+// 写入成员盘编号，将其标记为失效，编号 disk_cnt 为校验盘
+static ssize_t fail_member_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    struct praid_dev *dev = dev_to_praid(d);
+    unsigned int idx;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &idx);
+    if (ret) {
+        return ret;
+    }
+    if (idx > dev->disk_cnt) {
+        return -EINVAL;
+    }
+
+    praid_member_set_faulty(&dev->members[idx]);
+
+    return count;
+}
+static DEVICE_ATTR_WO(fail_member);
+
+// 写入 "<成员盘编号> <替换盘次设备号>"，替换失效的成员盘并开始重建
+static ssize_t replace_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int idx, minor;
+    int ret;
+
+    if (sscanf(buf, "%u %u", &idx, &minor) != 2) {
+        return -EINVAL;
+    }
+
+    ret = praid_rebuild_replace(dev_to_praid(d), idx, minor);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(replace);
+
+// 重建进度：成员盘编号、已重建扇区数、总扇区数，没有重建时为 idle
+static ssize_t rebuild_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_member *member = dev->rebuild.member;
+
+    if (!member || !test_bit(PRAID_MEMBER_REBUILDING, &member->flags)) {
+        return sysfs_emit(buf, "idle\n");
+    }
+
+    return sysfs_emit(buf, "%u %llu %llu\n", member->index, (u64)READ_ONCE(member->recovery_offset),
+                      dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+}
+static DEVICE_ATTR_RO(rebuild);
+
+// 写入新盘的次设备号，加入为数据盘并开始扩容
+static ssize_t grow_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int minor;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &minor);
+    if (ret) {
+        return ret;
+    }
+
+    ret = praid_reshape_grow(dev_to_praid(d), minor);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(grow);
+
+// 扩容进度：扩容前的数据盘数、已搬移的新条带数、新条带总数，没有扩容时为 idle
+static ssize_t reshape_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_reshape *r = &dev->reshape;
+
+    if (!READ_ONCE(r->active)) {
+        return sysfs_emit(buf, "idle\n");
+    }
+
+    return sysfs_emit(buf, "%u %llu %llu\n", r->old_geo.data_disks, READ_ONCE(r->pos), r->end);
+}
+static DEVICE_ATTR_RO(reshape);
+
+static ssize_t sync_speed_min_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->rebuild.speed_min));
+}
+
+static ssize_t sync_speed_min_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int speed;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &speed);
+    if (ret) {
+        return ret;
+    }
+    WRITE_ONCE(dev_to_praid(d)->rebuild.speed_min, speed);
+
+    return count;
+}
+static DEVICE_ATTR_RW(sync_speed_min);
+
+static ssize_t sync_speed_max_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->rebuild.speed_max));
+}
+
+static ssize_t sync_speed_max_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int speed;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &speed);
+    if (ret) {
+        return ret;
+    }
+    WRITE_ONCE(dev_to_praid(d)->rebuild.speed_max, speed);
+
+    return count;
+}
+static DEVICE_ATTR_RW(sync_speed_max);
+
+// 写意图位图：区域总数、置位的区域数、每个区域的字节数
+static ssize_t bitmap_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+
+    if (!dev->bitmap.enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    return sysfs_emit(buf, "%lu %lu %llu\n", dev->bitmap.nr_regions, praid_bitmap_dirty_regions(dev),
+                      (u64)SECTOR_TO_BYTE((sector_t)1 << dev->bitmap.region_shift));
+}
+static DEVICE_ATTR_RO(bitmap);
+
+// 零区域表：区域总数(所有数据盘)、从未写过的区域数、每个区域的字节数
+static ssize_t zeromap_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+
+    if (!dev->zeromap.enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    return sysfs_emit(buf, "%lu %lu %llu\n", dev->disk_cnt * dev->zeromap.nr_regions, praid_zeromap_clean_regions(dev),
+                      (u64)SECTOR_TO_BYTE((sector_t)1 << dev->zeromap.region_shift));
+}
+static DEVICE_ATTR_RO(zeromap);
+
+// 校验日志：未合并的记录数、已使用的字节数、环的字节数、已合并的记录数
+static ssize_t plog_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_plog *p = &dev->plog;
+    u64 records, used;
+
+    if (!p->enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    spin_lock(&p->lock);
+    records = p->seq - p->tail_seq;
+    used = p->head - p->tail;
+    spin_unlock(&p->lock);
+
+    return sysfs_emit(buf, "%llu %llu %llu %lld\n", records, (u64)SECTOR_TO_BYTE(used), (u64)SECTOR_TO_BYTE(p->size),
+                      atomic64_read(&p->folded));
+}
+static DEVICE_ATTR_RO(plog);
+
+// 写日志：未写回的记录数、已使用的字节数、环的字节数
+static ssize_t journal_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_journal *j = &dev->journal;
+
+    if (!j->enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    return sysfs_emit(buf, "%u %llu %llu\n", READ_ONCE(j->nr_entries),
+                      READ_ONCE(j->head) - READ_ONCE(j->tail), j->ring_size);
+}
+static DEVICE_ATTR_RO(journal);
+
+// 写回缓存：行(条带)数、脏行数、读命中次数、整条带刷写次数、部分刷写次数
+static ssize_t cache_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_cache *c = &dev->cache;
+
+    if (!c->enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    return sysfs_emit(buf, "%lu %lu %lld %lld %lld\n", c->nr_lines, praid_cache_dirty_lines(dev),
+                      atomic64_read(&c->read_hits), atomic64_read(&c->full_stripes), atomic64_read(&c->partial_stripes));
+}
+static DEVICE_ATTR_RO(cache);
+
+// 旧数据缓存：页数、命中次数、未命中次数、命中率(%)
+static ssize_t pcache_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_pcache *p = &dev->pcache;
+    u64 hits, misses;
+
+    if (!p->enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    hits = atomic64_read(&p->hits);
+    misses = atomic64_read(&p->misses);
+
+    return sysfs_emit(buf, "%lu %llu %llu %llu\n", p->nr_entries, hits, misses,
+                      hits + misses ? div64_u64(hits * 100, hits + misses) : 0);
+}
+static DEVICE_ATTR_RO(pcache);
+
+static ssize_t cache_dirty_high_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->cache.dirty_high));
+}
+
+static ssize_t cache_dirty_high_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    struct praid_dev *dev = dev_to_praid(d);
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > 100 || val < READ_ONCE(dev->cache.dirty_low)) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev->cache.dirty_high, val);
+    if (dev->cache.enabled) {
+        praid_cache_kick(dev);
+    }
+
+    return count;
+}
+static DEVICE_ATTR_RW(cache_dirty_high);
+
+static ssize_t cache_dirty_low_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->cache.dirty_low));
+}
+
+static ssize_t cache_dirty_low_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    struct praid_dev *dev = dev_to_praid(d);
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > READ_ONCE(dev->cache.dirty_high)) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev->cache.dirty_low, val);
+
+    return count;
+}
+static DEVICE_ATTR_RW(cache_dirty_low);
+
+static ssize_t cache_destage_rate_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->cache.destage_rate));
+}
+
+static ssize_t cache_destage_rate_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int rate;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &rate);
+    if (ret) {
+        return ret;
+    }
+    WRITE_ONCE(dev_to_praid(d)->cache.destage_rate, rate);
+
+    return count;
+}
+static DEVICE_ATTR_RW(cache_destage_rate);
+
+#define PRAID_MEMBERS_LINE_MAX 256 // members 中一行的最大长度
+
+/*
+ * 第一行为以 # 开头的表头，之后每行一个成员盘，最后一行为校验盘。输出限制在一页内，
+ * 放不下时最后一行为 "# <n> more"，n 为没有输出的成员盘数
+ */
+static ssize_t members_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    struct praid_member *member;
+    char line[PRAID_MEMBERS_LINE_MAX];
+    unsigned int i, n = dev->disk_cnt + 1;
+    ssize_t len = 0;
+    int size;
+
+    len += sysfs_emit_at(buf, len, "# idx role state minor inflight rd_ios rd_sectors rd_ticks_ms wr_ios wr_sectors wr_ticks_ms errors rd_lat_us\n");
+    for (i = 0; i < n; i++) {
+        member = &dev->members[i];
+        size = scnprintf(line, sizeof(line), "%u %s %s %u %d %lld %lld %lld %lld %lld %lld %lld %llu\n",
+                         i, i < dev->disk_cnt ? "data" : "parity",
+                         !praid_member_faulty(member) ? "ok" :
+                         test_bit(PRAID_MEMBER_REBUILDING, &member->flags) ? "rebuilding" : "faulty", member->minor,
+                         atomic_read(&member->inflight),
+                         atomic64_read(&member->ios[READ]),
+                         atomic64_read(&member->sectors[READ]),
+                         atomic64_read(&member->ticks_ns[READ]) / NSEC_PER_MSEC,
+                         atomic64_read(&member->ios[WRITE]),
+                         atomic64_read(&member->sectors[WRITE]),
+                         atomic64_read(&member->ticks_ns[WRITE]) / NSEC_PER_MSEC,
+                         atomic64_read(&member->errors),
+                         READ_ONCE(member->read_lat_ns) / NSEC_PER_USEC);
+        // 不是最后一个成员盘时给截断的标记留出位置
+        if (len + size + (i + 1 < n ? 16 : 0) > PAGE_SIZE) {
+            break;
+        }
+        len += sysfs_emit_at(buf, len, "%s", line);
+    }
+    if (i < n) {
+        len += sysfs_emit_at(buf, len, "# %u more\n", n - i);
+    }
+
+    return len;
+}
+static DEVICE_ATTR_RO(members);
+
+// flush 和 FUA 的请求数、实际刷新所有成员盘的轮数
+static ssize_t flush_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+
+    return sysfs_emit(buf, "%lld %lld\n", atomic64_read(&dev->flush.requests), atomic64_read(&dev->flush.flushes));
+}
+static DEVICE_ATTR_RO(flush);
+
+// 每个成员盘同时下发的 io 上限，0 为不限制
+static ssize_t ioq_depth_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->iosched.depth));
+}
+
+static ssize_t ioq_depth_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    struct praid_dev *dev = dev_to_praid(d);
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > PRAID_IOQ_DEPTH_MAX) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev->iosched.depth, val);
+    praid_ioq_kick(dev);
+
+    return count;
+}
+static DEVICE_ATTR_RW(ioq_depth);
+
+// 前台读、前台写、后台队列的轮询权重，格式为 "读 写 后台"
+static ssize_t ioq_weights_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_iosched *s = &dev_to_praid(d)->iosched;
+
+    return sysfs_emit(buf, "%u %u %u\n", READ_ONCE(s->weights[PRAID_IOQ_READ]),
+                      READ_ONCE(s->weights[PRAID_IOQ_WRITE]), READ_ONCE(s->weights[PRAID_IOQ_BG]));
+}
+
+static ssize_t ioq_weights_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    struct praid_dev *dev = dev_to_praid(d);
+    unsigned int w[PRAID_IOQ_NR], c;
+
+    if (sscanf(buf, "%u %u %u", &w[PRAID_IOQ_READ], &w[PRAID_IOQ_WRITE], &w[PRAID_IOQ_BG]) != PRAID_IOQ_NR) {
+        return -EINVAL;
+    }
+    for (c = 0; c < PRAID_IOQ_NR; c ++) {
+        if (!w[c] || w[c] > PRAID_IOQ_WEIGHT_MAX) {
+            return -EINVAL;
+        }
+    }
+    for (c = 0; c < PRAID_IOQ_NR; c ++) {
+        WRITE_ONCE(dev->iosched.weights[c], w[c]);
+    }
+    praid_ioq_kick(dev);
+
+    return count;
+}
+static DEVICE_ATTR_RW(ioq_weights);
+
+// 前台读、前台写、后台队列因成员盘下发已满而排队的 io 数
+static ssize_t ioq_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_iosched *s = &dev_to_praid(d)->iosched;
+
+    return sysfs_emit(buf, "%lld %lld %lld\n", atomic64_read(&s->waits[PRAID_IOQ_READ]),
+                      atomic64_read(&s->waits[PRAID_IOQ_WRITE]), atomic64_read(&s->waits[PRAID_IOQ_BG]));
+}
+static DEVICE_ATTR_RO(ioq);
+
+// 顺序预读：预读的窗口数、从窗口返回的读 bio 数、其中等待窗口读完的数量
+static ssize_t readahead_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_ra *ra = &dev_to_praid(d)->ra;
+
+    if (!ra->enabled) {
+        return sysfs_emit(buf, "disabled\n");
+    }
+
+    return sysfs_emit(buf, "%lld %lld %lld\n", atomic64_read(&ra->prefetches),
+                      atomic64_read(&ra->hits), atomic64_read(&ra->waits));
+}
+static DEVICE_ATTR_RO(readahead);
+
+// 成员盘的读超过该时间(us)未完成时同时由校验重建，0 为关闭
+static ssize_t hedge_us_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->hedge.timeout_us));
+}
+
+static ssize_t hedge_us_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > PRAID_HEDGE_TIMEOUT_MAX) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev_to_praid(d)->hedge.timeout_us, val);
+
+    return count;
+}
+static DEVICE_ATTR_RW(hedge_us);
+
+// 成员盘未完成的 io 超过其余成员盘的该倍数时读直接由校验重建，0 为关闭
+static ssize_t hedge_depth_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->hedge.depth));
+}
+
+static ssize_t hedge_depth_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > PRAID_HEDGE_DEPTH_MAX) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev_to_praid(d)->hedge.depth, val);
+
+    return count;
+}
+static DEVICE_ATTR_RW(hedge_depth);
+
+// 对冲读：因队列过深直接重建的读、超时后开始重建的读、重建先完成的读、放弃的重建
+static ssize_t hedge_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_hedge *h = &dev_to_praid(d)->hedge;
+
+    return sysfs_emit(buf, "%lld %lld %lld %lld\n", atomic64_read(&h->busy), atomic64_read(&h->timeouts),
+                      atomic64_read(&h->wins), atomic64_read(&h->aborts));
+}
+static DEVICE_ATTR_RO(hedge);
+
+// 校验更新的数量、打包后下发给设备的操作数、已完成数、从排队到完成的平均时延、同步模式等待的写入数和失败数
+static ssize_t verify_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_dev *dev = dev_to_praid(d);
+    s64 finished = atomic64_read(&dev->verify_finished);
+
+    return sysfs_emit(buf, "%lld %lld %lld %lld %lld %lld\n", atomic64_read(&dev->verify_updates), atomic64_read(&dev->verify_cmds),
+                      finished, finished ? div64_s64(atomic64_read(&dev->verify_lat_ns), finished) / NSEC_PER_USEC : 0,
+                      atomic64_read(&dev->verify_acks), atomic64_read(&dev->verify_errors));
+}
+static DEVICE_ATTR_RO(verify);
+
+// 校验同步模式，写入在数据写完并且校验更新完成后才结束
+static ssize_t parity_sync_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", READ_ONCE(dev_to_praid(d)->parity_sync));
+}
+
+static ssize_t parity_sync_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    bool val;
+    int ret;
+
+    ret = kstrtobool(buf, &val);
+    if (ret) {
+        return ret;
+    }
+    WRITE_ONCE(dev_to_praid(d)->parity_sync, val);
+    return count;
+}
+static DEVICE_ATTR_RW(parity_sync);
+
+// 交给设备还未完成的校验更新不少于该值时改由主机计算，0 为不看队列深度
+static ssize_t hybrid_depth_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->hybrid.depth));
+}
+
+static ssize_t hybrid_depth_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > PRAID_HYBRID_DEPTH_MAX) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev_to_praid(d)->hybrid.depth, val);
+
+    return count;
+}
+static DEVICE_ATTR_RW(hybrid_depth);
+
+// 设备上的校验更新时延超过该值时改由主机计算，0 为不看时延
+static ssize_t hybrid_lat_us_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_praid(d)->hybrid.lat_us));
+}
+
+static ssize_t hybrid_lat_us_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret) {
+        return ret;
+    }
+    if (val > PRAID_HYBRID_LAT_MAX) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev_to_praid(d)->hybrid.lat_us, val);
+
+    return count;
+}
+static DEVICE_ATTR_RW(hybrid_lat_us);
+
+// 混合计算：主机完成的更新、设备完成的更新、主机更新的平均时延、设备时延的滑动平均、交给设备还未完成的更新
+static ssize_t hybrid_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct praid_hybrid *h = &dev_to_praid(d)->hybrid;
+    s64 host = atomic64_read(&h->host);
+
+    return sysfs_emit(buf, "%lld %lld %lld %llu %u\n", host, atomic64_read(&h->device),
+                      host ? div64_s64(atomic64_read(&h->host_ns), host) / NSEC_PER_USEC : 0,
+                      READ_ONCE(h->lat_ns) / NSEC_PER_USEC, READ_ONCE(h->queued));
+}
+static DEVICE_ATTR_RO(hybrid);
+
+// 校验计算引擎，加载时选择
+static ssize_t engine_show(struct device *d, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%s\n", dev_to_praid(d)->config.engine->name);
+}
+static DEVICE_ATTR_RO(engine);
+
+// dmaengine 通道：通道名、完成的异或、完成的校验检查、出错的描述符，未注册时为 none
+static ssize_t dmaengine_show(struct device *d, struct device_attribute *attr, char *buf) {
+#ifdef CONFIG_DMA_ENGINE
+    struct pcievdrv_dma *dma = dev_to_praid(d)->dma;
+
+    if (dma) {
+        return sysfs_emit(buf, "%s %lld %lld %lld\n", dma_chan_name(&dma->chan), atomic64_read(&dma->xors),
+                          atomic64_read(&dma->vals), atomic64_read(&dma->errors));
+    }
+#endif
+    return sysfs_emit(buf, "none\n");
+}
+static DEVICE_ATTR_RO(dmaengine);
+
+// 用户态异或接口：字符设备名、打开的文件数、完成的作业、出错的作业
+static ssize_t user_xor_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct pcievdrv_user *user = dev_to_praid(d)->user;
+
+    if (!user) {
+        return sysfs_emit(buf, "none\n");
+    }
+    return sysfs_emit(buf, "%s %d %lld %lld\n", user->name, atomic_read(&user->files),
+                      atomic64_read(&user->jobs), atomic64_read(&user->errors));
+}
+static DEVICE_ATTR_RO(user_xor);
+
+static struct attribute *praid_attrs[] = {
+    &dev_attr_chunk_size.attr,
+    &dev_attr_disk_cnt.attr,
+    &dev_attr_members.attr,
+    &dev_attr_degraded.attr,
+    &dev_attr_fail_member.attr,
+    &dev_attr_replace.attr,
+    &dev_attr_rebuild.attr,
+    &dev_attr_grow.attr,
+    &dev_attr_reshape.attr,
+    &dev_attr_sync_speed_min.attr,
+    &dev_attr_sync_speed_max.attr,
+    &dev_attr_bitmap.attr,
+    &dev_attr_zeromap.attr,
+    &dev_attr_plog.attr,
+    &dev_attr_journal.attr,
+    &dev_attr_cache.attr,
+    &dev_attr_cache_dirty_high.attr,
+    &dev_attr_cache_dirty_low.attr,
+    &dev_attr_cache_destage_rate.attr,
+    &dev_attr_pcache.attr,
+    &dev_attr_flush.attr,
+    &dev_attr_ioq_depth.attr,
+    &dev_attr_ioq_weights.attr,
+    &dev_attr_ioq.attr,
+    &dev_attr_readahead.attr,
+    &dev_attr_hedge_us.attr,
+    &dev_attr_hedge_depth.attr,
+    &dev_attr_hedge.attr,
+    &dev_attr_verify.attr,
+    &dev_attr_parity_sync.attr,
+    &dev_attr_hybrid_depth.attr,
+    &dev_attr_hybrid_lat_us.attr,
+    &dev_attr_hybrid.attr,
+    &dev_attr_engine.attr,
+    &dev_attr_dmaengine.attr,
+    &dev_attr_user_xor.attr,
+    NULL,
+};
+
+static const struct attribute_group praid_attr_group = {
+    .name = PRAID_NAME,
+    .attrs = praid_attrs,
+};
+
+const struct attribute_group *praid_attr_groups[] = {
+    &praid_attr_group,
+    NULL,
+};
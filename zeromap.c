@@ -0,0 +1,492 @@
+#include <linux/bio.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+
+#include "praid.h"
+#include "block.h"
+#include "meta.h"
+#include "zeromap.h"
+
+/*
+ * 零区域表。新建阵列时成员盘被清零，之后每个数据盘的每个区域记录一个水位，水位之后的数据从未写过。
+ * 读取落在水位之后时直接返回零；写入的起点不低于水位时旧数据为零，更新校验时不再读旧数据。
+ * 顺序填充新阵列时每次写入都从水位开始，读改写的读全部省去。
+ *
+ * 写入把水位推过已落盘的值时，先把该区域落盘的水位设为整个区域，写回后再下发写入，和写意图位图一样
+ * 按批写回。崩溃后这些区域按已写过处理，仍然正确；正常删除阵列时写回精确的水位。
+ */
+
+#define PRAID_ZEROMAP_PER_PAGE (PAGE_SIZE / sizeof(__le32))
+
+static __le32 *praid_zeromap_entry(struct praid_zeromap *zm, unsigned long idx) {
+    return (__le32 *)page_address(zm->pages[idx / PRAID_ZEROMAP_PER_PAGE]) + idx % PRAID_ZEROMAP_PER_PAGE;
+}
+
+static sector_t praid_zeromap_page_offset(struct praid_dev *dev, unsigned int p) {
+    return praid_meta_zeromap_offset(dev) + (sector_t)(p + 1) * PRAID_META_PAGE_SECTORS;
+}
+
+static unsigned long praid_zeromap_nr_entries(struct praid_dev *dev) {
+    return (unsigned long)dev->disk_cnt * dev->zeromap.nr_regions;
+}
+
+// disk_cnt 个数据盘的水位占用的页数
+unsigned int praid_zeromap_nr_pages(struct praid_dev *dev, unsigned int disk_cnt) {
+    return DIV_ROUND_UP((unsigned long)disk_cnt * dev->zeromap.nr_regions, PRAID_ZEROMAP_PER_PAGE);
+}
+
+// 调用者持有 lock
+static void praid_zeromap_set(struct praid_zeromap *zm, unsigned long idx, u32 off) {
+    *praid_zeromap_entry(zm, idx) = cpu_to_le32(off);
+    __set_bit(idx / PRAID_ZEROMAP_PER_PAGE, zm->dirty_pages);
+}
+
+// 写回所有脏的页，调用者持有 io_lock。写失败的页保持为脏，落盘的水位不推进
+static void praid_zeromap_write_dirty(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct praid_member *parity = praid_parity_member(dev);
+    __le32 *entries = page_address(zm->bounce);
+    unsigned long base, i, n;
+    unsigned int p, next = 0;
+    int ret;
+
+    for(;;) {
+        spin_lock_irq(&zm->lock);
+        p = find_next_bit(zm->dirty_pages, zm->nr_pages, next);
+        if(p >= zm->nr_pages) {
+            spin_unlock_irq(&zm->lock);
+            break;
+        }
+        __clear_bit(p, zm->dirty_pages);
+        memcpy(entries, page_address(zm->pages[p]), PAGE_SIZE);
+        spin_unlock_irq(&zm->lock);
+        next = p + 1;
+
+        if(!praid_member_faulty(parity)) {
+            ret = praid_meta_io(dev, READ_ONCE(parity->bdev), praid_zeromap_page_offset(dev, p), zm->bounce, REQ_OP_WRITE);
+            if(ret) {
+                PRAID_ERROR("%s%d: write zero map page %u failed, error %d.\n", VPCIEDISK_NAME, dev->id, p, ret);
+                spin_lock_irq(&zm->lock);
+                __set_bit(p, zm->dirty_pages);
+                spin_unlock_irq(&zm->lock);
+                continue;
+            }
+        }
+
+        base = (unsigned long)p * PRAID_ZEROMAP_PER_PAGE;
+        n = min_t(unsigned long, PRAID_ZEROMAP_PER_PAGE, praid_zeromap_nr_entries(dev) - base);
+        spin_lock_irq(&zm->lock);
+        for(i = 0; i < n; i ++) {
+            zm->disk_off[base + i] = le32_to_cpu(entries[i]);
+        }
+        spin_unlock_irq(&zm->lock);
+    }
+}
+
+// bio 所在区域的表项，end 为 bio 在区域内的结束位置
+static unsigned long praid_zeromap_index(struct praid_zeromap *zm, struct bio *bio, u32 *end) {
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    sector_t mask = ((sector_t)1 << zm->region_shift) - 1;
+
+    *end = (bio->bi_iter.bi_sector & mask) + bio_sectors(bio);
+    return (unsigned long)pbio->member->index * zm->nr_regions + (bio->bi_iter.bi_sector >> zm->region_shift);
+}
+
+// 挂起的 bio 的水位是否已经落盘
+static bool praid_zeromap_written(struct praid_dev *dev, struct bio *bio) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    unsigned long idx;
+    bool written;
+    u32 end;
+
+    idx = praid_zeromap_index(zm, bio, &end);
+    spin_lock_irq(&zm->lock);
+    written = zm->disk_off[idx] >= end;
+    spin_unlock_irq(&zm->lock);
+
+    return written;
+}
+
+static void praid_zeromap_flush_work(struct work_struct *work) {
+    struct praid_dev *dev = container_of(work, struct praid_dev, zeromap.flush_work);
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct bio_list list;
+    struct bio *bio;
+
+    mutex_lock(&zm->io_lock);
+    spin_lock_irq(&zm->lock);
+    bio_list_init(&list);
+    bio_list_merge(&list, &zm->deferred);
+    bio_list_init(&zm->deferred);
+    spin_unlock_irq(&zm->lock);
+
+    praid_zeromap_write_dirty(dev);
+    mutex_unlock(&zm->io_lock);
+
+    /*
+     * 水位仍未落盘的 bio 以错误结束，否则崩溃后读到的是零而不是写入的数据。
+     * 错误来自校验盘，不进入降级路径
+     */
+    while((bio = bio_list_pop(&list))) {
+        if(!praid_zeromap_written(dev, bio)) {
+            container_of(bio, struct praid_bio, bio)->degraded = true;
+            bio_io_error(bio);
+            continue;
+        }
+        praid_member_submit(bio);
+    }
+}
+
+/*
+ * 数据盘的写 bio 下发前调用，推进水位并记录旧数据是否为零。水位已落盘时返回 true，由调用者继续下发；
+ * 否则 bio 被挂起，水位落盘后由 praid_member_submit 重新下发
+ */
+bool praid_zeromap_start_write(struct praid_dev *dev, struct bio *bio) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    unsigned long idx;
+    u32 sta, end;
+
+    if(!zm->enabled || pbio->zeromap || !bio_sectors(bio) || pbio->member->index >= dev->disk_cnt) {
+        return true;
+    }
+
+    idx = praid_zeromap_index(zm, bio, &end);
+    sta = end - bio_sectors(bio);
+
+    spin_lock_irq(&zm->lock);
+    pbio->zeromap = true;
+    pbio->zero = sta >= zm->zero_off[idx];
+    zm->zero_off[idx] = max(zm->zero_off[idx], end);
+    if(likely(zm->disk_off[idx] >= end)) {
+        spin_unlock_irq(&zm->lock);
+        return true;
+    }
+
+    praid_zeromap_set(zm, idx, 1U << zm->region_shift);
+    bio_list_add(&zm->deferred, bio);
+    spin_unlock_irq(&zm->lock);
+
+    queue_work(zm->wq, &zm->flush_work);
+
+    return false;
+}
+
+// 读取的 bio 落在水位之后时填零并结束，返回 true
+bool praid_zeromap_read(struct praid_dev *dev, struct bio *bio) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct praid_bio *pbio = container_of(bio, struct praid_bio, bio);
+    unsigned long idx;
+
+    if(!zm->enabled || pbio->member->index >= dev->disk_cnt) {
+        return false;
+    }
+
+    idx = (unsigned long)pbio->member->index * zm->nr_regions + (bio->bi_iter.bi_sector >> zm->region_shift);
+    if((bio->bi_iter.bi_sector & (((sector_t)1 << zm->region_shift) - 1)) < READ_ONCE(zm->zero_off[idx])) {
+        return false;
+    }
+
+    zero_fill_bio(bio);
+    bio_endio(bio);
+    return true;
+}
+
+// 数据盘 member 上 [sector, sector + nr_sectors) 已整条带清零，范围覆盖到水位时把水位降到范围的起点
+void praid_zeromap_discard(struct praid_dev *dev, unsigned int member, sector_t sector, sector_t nr_sectors) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    sector_t end = sector + nr_sectors, mask = ((sector_t)1 << zm->region_shift) - 1, next;
+    unsigned long idx;
+    u32 sta, off;
+
+    if(!zm->enabled) {
+        return;
+    }
+
+    // 落盘的水位不低于内存中的即可，不需要写回
+    spin_lock_irq(&zm->lock);
+    for(; sector < end; sector = next) {
+        next = min(end, (sector | mask) + 1);
+        idx = (unsigned long)member * zm->nr_regions + (sector >> zm->region_shift);
+        sta = sector & mask;
+        off = ((next - 1) & mask) + 1;
+        if(sta < zm->zero_off[idx] && off >= zm->zero_off[idx]) {
+            zm->zero_off[idx] = sta;
+        }
+    }
+    spin_unlock_irq(&zm->lock);
+}
+
+// 从未写过的区域数
+unsigned long praid_zeromap_clean_regions(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    unsigned long idx, nr = 0;
+
+    for(idx = 0; idx < praid_zeromap_nr_entries(dev); idx ++) {
+        if(!READ_ONCE(zm->zero_off[idx])) {
+            nr ++;
+        }
+    }
+
+    return nr;
+}
+
+static void praid_zeromap_free(struct praid_zeromap *zm) {
+    unsigned int p;
+
+    if(zm->wq) {
+        destroy_workqueue(zm->wq);
+    }
+    if(zm->pages) {
+        for(p = 0; p < zm->nr_pages; p ++) {
+            if(zm->pages[p]) {
+                __free_page(zm->pages[p]);
+            }
+        }
+    }
+    if(zm->bounce) {
+        __free_page(zm->bounce);
+    }
+    kfree(zm->pages);
+    bitmap_free(zm->dirty_pages);
+    kvfree(zm->zero_off);
+    kvfree(zm->disk_off);
+}
+
+static int praid_zeromap_alloc(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    int node = dev->config.node;
+    unsigned long nr = praid_zeromap_nr_entries(dev);
+    unsigned int p;
+
+    zm->pages = kcalloc_node(zm->nr_pages, sizeof(*zm->pages), GFP_KERNEL, node);
+    zm->dirty_pages = bitmap_zalloc(zm->nr_pages, GFP_KERNEL);
+    zm->zero_off = kvcalloc(nr, sizeof(*zm->zero_off), GFP_KERNEL);
+    zm->disk_off = kvcalloc(nr, sizeof(*zm->disk_off), GFP_KERNEL);
+    zm->bounce = alloc_pages_node(node, GFP_KERNEL, 0);
+    zm->wq = alloc_workqueue("praid%d_zeromap", WQ_UNBOUND | WQ_MEM_RECLAIM, 0, dev->id);
+    if(!zm->pages || !zm->dirty_pages || !zm->zero_off || !zm->disk_off || !zm->bounce || !zm->wq) {
+        return -ENOMEM;
+    }
+
+    for(p = 0; p < zm->nr_pages; p ++) {
+        zm->pages[p] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+        if(!zm->pages[p]) {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+// 读取上次的零区域表，几何参数一致时返回 true
+static bool praid_zeromap_load(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct block_device *bdev = praid_parity_member(dev)->bdev;
+    struct praid_zeromap_sb *sb = page_address(zm->bounce);
+    u32 region_sectors = 1U << zm->region_shift;
+    unsigned long idx;
+    unsigned int p;
+
+    if(praid_meta_io(dev, bdev, praid_meta_zeromap_offset(dev), zm->bounce, REQ_OP_READ)) {
+        return false;
+    }
+
+    if(le32_to_cpu(sb->magic) != PRAID_ZEROMAP_MAGIC ||
+       le32_to_cpu(sb->disk_cnt) != dev->disk_cnt ||
+       le32_to_cpu(sb->chunk_size) != dev->geo.chunk_size ||
+       le32_to_cpu(sb->region_shift) != zm->region_shift ||
+       le64_to_cpu(sb->size) != dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT ||
+       le64_to_cpu(sb->nr_regions) != zm->nr_regions) {
+        return false;
+    }
+
+    for(p = 0; p < zm->nr_pages; p ++) {
+        if(praid_meta_io(dev, bdev, praid_zeromap_page_offset(dev, p), zm->pages[p], REQ_OP_READ)) {
+            return false;
+        }
+    }
+
+    for(idx = 0; idx < praid_zeromap_nr_entries(dev); idx ++) {
+        zm->zero_off[idx] = min(le32_to_cpu(*praid_zeromap_entry(zm, idx)), region_sectors);
+        zm->disk_off[idx] = zm->zero_off[idx];
+    }
+
+    return true;
+}
+
+// 写入头部和水位，clean 时所有区域为未写过，否则为已写过
+static int praid_zeromap_format(struct praid_dev *dev, bool clean) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct praid_zeromap_sb *sb = page_address(zm->bounce);
+    u32 off = clean ? 0 : 1U << zm->region_shift;
+    unsigned long idx;
+
+    spin_lock_irq(&zm->lock);
+    for(idx = 0; idx < praid_zeromap_nr_entries(dev); idx ++) {
+        zm->zero_off[idx] = off;
+        praid_zeromap_set(zm, idx, off);
+    }
+    spin_unlock_irq(&zm->lock);
+    praid_zeromap_write_dirty(dev);
+
+    clear_page(sb);
+    sb->magic = cpu_to_le32(PRAID_ZEROMAP_MAGIC);
+    sb->disk_cnt = cpu_to_le32(dev->disk_cnt);
+    sb->chunk_size = cpu_to_le32(dev->geo.chunk_size);
+    sb->region_shift = cpu_to_le32(zm->region_shift);
+    sb->size = cpu_to_le64(dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT);
+    sb->nr_regions = cpu_to_le64(zm->nr_regions);
+
+    return praid_meta_io(dev, praid_parity_member(dev)->bdev, praid_meta_zeromap_offset(dev), zm->bounce, REQ_OP_WRITE);
+}
+
+// 清零所有成员盘(包括校验盘)的数据区，全部成功时返回 true
+static bool praid_zeromap_zero_members(struct praid_dev *dev) {
+    sector_t size = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    unsigned int i;
+    int ret;
+
+    for(i = 0; i <= dev->disk_cnt; i ++) {
+        if(praid_member_faulty(&dev->members[i])) {
+            return false;
+        }
+
+        ret = blkdev_issue_zeroout(dev->members[i].bdev, 0, size, GFP_KERNEL, 0);
+        if(ret) {
+            PRAID_ERROR("%s%d: zero member %u failed, error %d.\n", VPCIEDISK_NAME, dev->id, i, ret);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * 在 praid_bitmap_init 之后、块设备创建之前调用。创建时指定 fresh 则清零成员盘并将所有区域标记为未写过；
+ * 否则读取上次的零区域表，没有时所有区域按已写过处理。校验盘上没有空间或者校验盘失效时不使用
+ */
+int praid_zeromap_init(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct praid_member *parity = praid_parity_member(dev);
+    sector_t size = dev->config.size_nvme_disk >> KERNEL_SECTOR_SHIFT;
+    bool clean;
+    int ret = 0;
+
+    spin_lock_init(&zm->lock);
+    mutex_init(&zm->io_lock);
+    bio_list_init(&zm->deferred);
+    INIT_WORK(&zm->flush_work, praid_zeromap_flush_work);
+
+    zm->region_shift = ilog2(PRAID_ZEROMAP_REGION >> KERNEL_SECTOR_SHIFT);
+    zm->nr_regions = DIV_ROUND_UP_SECTOR_T(size, (sector_t)1 << zm->region_shift);
+    zm->nr_pages = praid_zeromap_nr_pages(dev, dev->disk_cnt);
+
+    if(praid_member_faulty(parity) ||
+       !praid_meta_fits(dev, parity->bdev, praid_meta_zeromap_offset(dev), (sector_t)(zm->nr_pages + 1) * PRAID_META_PAGE_SECTORS)) {
+        PRAID_INFO("%s%d: no space for zero map on parity member, disabled.\n", VPCIEDISK_NAME, dev->id);
+        return 0;
+    }
+
+    ret = praid_zeromap_alloc(dev);
+    if(ret) {
+        goto out_free;
+    }
+
+    mutex_lock(&zm->io_lock);
+    if(dev->config.fresh) {
+        clean = praid_zeromap_zero_members(dev);
+        if(!clean) {
+            PRAID_ERROR("%s%d: members not zeroed, all regions treated as written.\n", VPCIEDISK_NAME, dev->id);
+        }
+        ret = praid_zeromap_format(dev, clean);
+    } else if(!praid_zeromap_load(dev)) {
+        ret = praid_zeromap_format(dev, false);
+    }
+    mutex_unlock(&zm->io_lock);
+    if(ret) {
+        PRAID_ERROR("%s%d: write zero map failed, error %d.\n", VPCIEDISK_NAME, dev->id, ret);
+        goto out_free;
+    }
+
+    zm->enabled = true;
+
+    return 0;
+
+out_free:
+    praid_zeromap_free(zm);
+    memset(zm, 0, sizeof(*zm));
+    return ret;
+}
+
+/*
+ * 扩容时在数据盘数量更新之后调用，此时没有正在进行的 io。数据被重新分布，按新的数据盘数重建零区域表，
+ * 所有区域按已写过处理
+ */
+int praid_zeromap_regrow(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    struct praid_member *parity = praid_parity_member(dev);
+    bool enabled = zm->enabled;
+    int ret;
+
+    if(enabled) {
+        zm->enabled = false;
+        praid_zeromap_free(zm);
+    }
+    zm->pages = NULL;
+    zm->dirty_pages = NULL;
+    zm->zero_off = zm->disk_off = NULL;
+    zm->bounce = NULL;
+    zm->wq = NULL;
+    zm->nr_pages = praid_zeromap_nr_pages(dev, dev->disk_cnt);
+
+    if(!enabled) {
+        return 0;
+    }
+    if(!praid_meta_fits(dev, parity->bdev, praid_meta_zeromap_offset(dev), (sector_t)(zm->nr_pages + 1) * PRAID_META_PAGE_SECTORS)) {
+        PRAID_INFO("%s%d: no space for zero map on parity member, disabled.\n", VPCIEDISK_NAME, dev->id);
+        return 0;
+    }
+
+    ret = praid_zeromap_alloc(dev);
+    if(!ret) {
+        mutex_lock(&zm->io_lock);
+        ret = praid_zeromap_format(dev, false);
+        mutex_unlock(&zm->io_lock);
+    }
+    if(ret) {
+        praid_zeromap_free(zm);
+        return ret;
+    }
+
+    zm->enabled = true;
+
+    return 0;
+}
+
+// 块设备删除之后调用，写回精确的水位
+void praid_zeromap_exit(struct praid_dev *dev) {
+    struct praid_zeromap *zm = &dev->zeromap;
+    unsigned long idx;
+
+    if(!zm->enabled) {
+        return;
+    }
+
+    flush_work(&zm->flush_work);
+
+    mutex_lock(&zm->io_lock);
+    spin_lock_irq(&zm->lock);
+    for(idx = 0; idx < praid_zeromap_nr_entries(dev); idx ++) {
+        if(zm->disk_off[idx] != zm->zero_off[idx]) {
+            praid_zeromap_set(zm, idx, zm->zero_off[idx]);
+        }
+    }
+    spin_unlock_irq(&zm->lock);
+    praid_zeromap_write_dirty(dev);
+    mutex_unlock(&zm->io_lock);
+
+    zm->enabled = false;
+    praid_zeromap_free(zm);
+}
@@ -0,0 +1,31 @@
+#ifndef __PRAID_ZEROMAP_H__
+#define __PRAID_ZEROMAP_H__
+
+#include <linux/bio.h>
+
+#include "praid.h"
+
+#define PRAID_ZEROMAP_MAGIC 0x50525a4d // "PRZM"
+#define PRAID_ZEROMAP_REGION MB(16) // 每个水位对应的数据盘区域的字节数
+
+// 零区域表头部，位置见 meta.h，之后是 disk_cnt * nr_regions 个 __le32 的水位
+struct praid_zeromap_sb {
+    __le32 magic;
+    __le32 disk_cnt;
+    __le32 chunk_size;
+    __le32 region_shift;
+    __le64 size;        // 成员盘数据区扇区数
+    __le64 nr_regions;
+};
+
+bool praid_zeromap_start_write(struct praid_dev *dev, struct bio *bio);
+bool praid_zeromap_read(struct praid_dev *dev, struct bio *bio);
+void praid_zeromap_discard(struct praid_dev *dev, unsigned int member, sector_t sector, sector_t nr_sectors);
+unsigned long praid_zeromap_clean_regions(struct praid_dev *dev);
+unsigned int praid_zeromap_nr_pages(struct praid_dev *dev, unsigned int disk_cnt);
+int praid_zeromap_regrow(struct praid_dev *dev);
+
+int praid_zeromap_init(struct praid_dev *dev);
+void praid_zeromap_exit(struct praid_dev *dev);
+
+#endif